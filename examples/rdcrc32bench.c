@@ -0,0 +1,86 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Typical include path would be <librd/rd..h>, but this program
+ * is builtin from within the librd source tree and thus differs. */
+#include "rd.h"       /* librd base */
+#include "rdtime.h"
+#include "rdcrc32.h"
+
+static const char *impl_names[] = { "auto", "table", "slice8", "hw" };
+
+int main (int argc, char **argv) {
+	size_t size = 1024 * 1024;
+	int rounds = 16;
+	char *buf;
+	rd_crc32_impl_t impl;
+	volatile rd_crc32_t c RD_UNUSED;
+	int i;
+
+	if (argc > 1)
+		size = strtoull(argv[1], NULL, 0);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+
+	if (!size || rounds < 1) {
+		fprintf(stderr, "Usage: %s [<bufsize> [<rounds>]]\n", argv[0]);
+		exit(1);
+	}
+
+	buf = malloc(size);
+	memset(buf, 0xa5, size);
+
+	for (impl = RD_CRC32_IMPL_TABLE ; impl <= RD_CRC32_IMPL_HW ; impl++) {
+		rd_ts_t t32, t32c;
+
+		if (rd_crc32_impl_set(impl) == -1) {
+			printf("%s: not supported by this CPU\n",
+			       impl_names[impl]);
+			continue;
+		}
+
+		t32 = rd_clock();
+		for (i = 0 ; i < rounds ; i++)
+			c = rd_crc32(buf, size);
+		t32 = rd_clock() - t32;
+
+		t32c = rd_clock();
+		for (i = 0 ; i < rounds ; i++)
+			c = rd_crc32c(buf, size);
+		t32c = rd_clock() - t32c;
+
+		printf("%s: crc32 %.0f MB/s, crc32c %.0f MB/s\n",
+		       impl_names[impl],
+		       (double)rounds * size / (double)(t32 ? t32 : 1),
+		       (double)rounds * size / (double)(t32c ? t32c : 1));
+	}
+
+	free(buf);
+	return 0;
+}
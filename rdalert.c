@@ -54,8 +54,8 @@ void rd_alert0 (const char *file, const char *func, int line,
 	va_list ap;
 	struct rd_alert_cb *rac;
 
-	rdbg("%%%i: %s ALERT at %s:%i:%s: %s",
-	     level, rd_alert_names[type], file, line, func, reason);
+	rdbg_fac(RD_LOG_FAC_ALERT, "%%%i: %s ALERT at %s:%i:%s: %s",
+		 level, rd_alert_names[type], file, line, func, reason);
 
 	rd_mutex_lock(&rd_alert_lock);
 	va_start(ap, reason);
@@ -30,11 +30,293 @@
 #include "rdavg.h"
 #include "rdtime.h"
 
+#include <math.h>
+
 /**
  * NOTE: THIS IS WORK IN PROGRESS
  **/
 
 
+
+int rd_hdr_init (rd_hdr_t *hdr, uint64_t max_value, int sigfigs) {
+	uint64_t largest, untrackable;
+	int buckets, i;
+
+	if (sigfigs < 1 || sigfigs > 5 || max_value < 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	/* Sub-buckets needed to tell apart values differing in the
+	 * last significant digit: 2 * 10^sigfigs, rounded up to pow2. */
+	for (largest = 2, i = 0 ; i < sigfigs ; i++)
+		largest *= 10;
+	while ((1llu << hdr->rh_sub_bits) < largest)
+		hdr->rh_sub_bits++;
+
+	/* Power-of-two ranges needed to cover max_value */
+	untrackable = 1llu << hdr->rh_sub_bits;
+	buckets = 1;
+	while (untrackable <= max_value && untrackable < (1llu << 63)) {
+		untrackable <<= 1;
+		buckets++;
+	}
+	if (untrackable <= max_value)
+		buckets++;
+
+	hdr->rh_sigfigs       = sigfigs;
+	hdr->rh_max_trackable = max_value;
+	hdr->rh_counts_len    = (buckets + 1) << (hdr->rh_sub_bits - 1);
+	hdr->rh_counts = calloc(hdr->rh_counts_len, sizeof(*hdr->rh_counts));
+	hdr->rh_min = RD_AVG_NO_VALUE;
+
+	return 0;
+}
+
+void rd_hdr_destroy (rd_hdr_t *hdr) {
+	free(hdr->rh_counts);
+	hdr->rh_counts = NULL;
+}
+
+void rd_hdr_reset (rd_hdr_t *hdr) {
+	memset(hdr->rh_counts, 0,
+	       hdr->rh_counts_len * sizeof(*hdr->rh_counts));
+	hdr->rh_total    = 0;
+	hdr->rh_sum      = 0;
+	hdr->rh_min      = RD_AVG_NO_VALUE;
+	hdr->rh_max      = 0;
+	hdr->rh_overflow = 0;
+}
+
+int rd_hdr_merge (rd_hdr_t *dst, const rd_hdr_t *src) {
+	int i;
+
+	if (dst->rh_counts_len != src->rh_counts_len ||
+	    dst->rh_sub_bits != src->rh_sub_bits ||
+	    dst->rh_max_trackable != src->rh_max_trackable) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0 ; i < src->rh_counts_len ; i++)
+		dst->rh_counts[i] += src->rh_counts[i];
+
+	dst->rh_total    += src->rh_total;
+	dst->rh_sum      += src->rh_sum;
+	dst->rh_overflow += src->rh_overflow;
+	if (src->rh_min < dst->rh_min)
+		dst->rh_min = src->rh_min;
+	if (src->rh_max > dst->rh_max)
+		dst->rh_max = src->rh_max;
+
+	return 0;
+}
+
+
+/**
+ * Returns the highest value that maps to counts index 'idx'.
+ */
+static uint64_t rd_hdr_highest_value (const rd_hdr_t *hdr, int idx) {
+	const int half_bits = hdr->rh_sub_bits - 1;
+	int bucket = (idx >> half_bits) - 1;
+	uint64_t sub = (idx & ((1 << half_bits) - 1)) + (1 << half_bits);
+
+	if (bucket < 0) {
+		sub -= 1 << half_bits;
+		bucket = 0;
+	}
+
+	return (sub << bucket) + (1llu << bucket) - 1;
+}
+
+uint64_t rd_hdr_percentile (const rd_hdr_t *hdr, double pct) {
+	uint64_t target, cnt = 0;
+	int i;
+
+	if (hdr->rh_total == 0)
+		return 0;
+
+	pct = RD_INT_CAP(pct, 0.0, 100.0);
+	target = (uint64_t)((pct / 100.0) * (double)hdr->rh_total + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0 ; i < hdr->rh_counts_len ; i++) {
+		if ((cnt += hdr->rh_counts[i]) >= target) {
+			uint64_t v = rd_hdr_highest_value(hdr, i);
+			return RD_MIN(v, hdr->rh_max);
+		}
+	}
+
+	return hdr->rh_max;
+}
+
+double rd_hdr_mean (const rd_hdr_t *hdr) {
+	if (hdr->rh_total == 0)
+		return 0.0;
+	return (double)hdr->rh_sum / (double)hdr->rh_total;
+}
+
+
+
+
+void rd_ewma_init (rd_ewma_t *re, int tick_ms,
+		   const int *windows_s, int cnt) {
+	static const int defwindows[] = { 60, 300, 900 };
+	int i;
+
+	if (!windows_s) {
+		windows_s = defwindows;
+		cnt = RD_ARRAYSIZE(defwindows);
+	}
+
+	assert(cnt > 0 && cnt <= RD_EWMA_WINDOWS_MAX && tick_ms > 0);
+
+	memset(re, 0, sizeof(*re));
+	re->re_tick = (rd_ts_t)tick_ms * 1000;
+	re->re_last = rd_clock_coarse();
+	re->re_windows = cnt;
+
+	for (i = 0 ; i < cnt ; i++)
+		re->re_alpha[i] = 1.0 - exp(-((double)tick_ms / 1000.0) /
+					    (double)windows_s[i]);
+}
+
+void rd_ewma_tick (rd_ewma_t *re, rd_ts_t now) {
+	rd_ts_t ticks;
+	double instant;
+	int i;
+
+	if (now - re->re_last < re->re_tick)
+		return;
+
+	ticks = (now - re->re_last) / re->re_tick;
+	re->re_last += ticks * re->re_tick;
+
+	/* The first tick takes the values, the remaining ticks
+	 * were idle: decay them all at once. */
+	instant = (double)re->re_uncounted /
+		((double)re->re_tick / 1000000.0);
+	re->re_uncounted = 0;
+
+	for (i = 0 ; i < re->re_windows ; i++) {
+		if (re->re_seeded)
+			re->re_rate[i] += re->re_alpha[i] *
+				(instant - re->re_rate[i]);
+		else
+			re->re_rate[i] = instant;
+
+		if (ticks > 1)
+			re->re_rate[i] *= pow(1.0 - re->re_alpha[i],
+					      (double)(ticks - 1));
+	}
+
+	re->re_seeded = 1;
+}
+
+double rd_ewma_rate0 (rd_ewma_t *re, int window, rd_ts_t now) {
+	assert(window >= 0 && window < re->re_windows);
+	rd_ewma_tick(re, now);
+	return re->re_rate[window];
+}
+
+
+
+int rd_swrate_init (rd_swrate_t *rsw, int window_ms, int buckets) {
+	int i;
+
+	if (buckets < 1 || window_ms < buckets) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rsw->rsw_cnt = buckets;
+	rsw->rsw_width = ((rd_ts_t)window_ms * 1000) / buckets;
+	rsw->rsw_sum = calloc(buckets, sizeof(*rsw->rsw_sum));
+	rsw->rsw_slot = malloc(buckets * sizeof(*rsw->rsw_slot));
+	for (i = 0 ; i < buckets ; i++)
+		rsw->rsw_slot[i] = -1;
+
+	return 0;
+}
+
+void rd_swrate_destroy (rd_swrate_t *rsw) {
+	free(rsw->rsw_sum);
+	free(rsw->rsw_slot);
+}
+
+void rd_swrate_put0 (rd_swrate_t *rsw, uint64_t val, rd_ts_t now) {
+	int64_t slot = now / rsw->rsw_width;
+	int i = slot % rsw->rsw_cnt;
+
+	/* Recycle the sub-bucket if it is from a previous lap. */
+	if (rsw->rsw_slot[i] != slot) {
+		rsw->rsw_slot[i] = slot;
+		rsw->rsw_sum[i] = 0;
+	}
+
+	rsw->rsw_sum[i] += val;
+}
+
+uint64_t rd_swrate_sum0 (const rd_swrate_t *rsw, rd_ts_t now) {
+	int64_t slot = now / rsw->rsw_width;
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0 ; i < rsw->rsw_cnt ; i++)
+		if (rsw->rsw_slot[i] > slot - rsw->rsw_cnt &&
+		    rsw->rsw_slot[i] <= slot)
+			sum += rsw->rsw_sum[i];
+
+	return sum;
+}
+
+double rd_swrate_rate0 (const rd_swrate_t *rsw, rd_ts_t now) {
+	/* Full older sub-buckets and the elapsed part of the current. */
+	rd_ts_t span = (rsw->rsw_cnt - 1) * rsw->rsw_width +
+		(now % rsw->rsw_width);
+
+	if (span == 0)
+		return 0.0;
+
+	return ((double)rd_swrate_sum0(rsw, now) * 1000000.0) / (double)span;
+}
+
+
+
+/**
+ * Per-thread shard of a concurrent rd_avg_t.
+ * The counters are only written by the owning thread and only grow,
+ * readers sum all shards and subtract the sums seen at the last roll.
+ */
+typedef struct rd_avg_shard_s {
+	TAILQ_ENTRY(rd_avg_shard_s) ras_link;
+	pthread_t  ras_thread;
+	uint64_t   ras_gen;          /* Period generation of high/low */
+	uint64_t   ras_high;
+	uint64_t   ras_low;
+	uint64_t   ras_counters[0];  /* Type-specific, see below */
+} rd_avg_shard_t;
+
+/* RD_AVG_HDR counter layout: total, sum, overflow, counts.. */
+#define RD_AVG_HDR_TOTAL     0
+#define RD_AVG_HDR_SUM       1
+#define RD_AVG_HDR_OVERFLOW  2
+#define RD_AVG_HDR_COUNTS    3
+
+/* Thread-local direct-mapped shard lookup cache, keyed by ra_id. */
+#define RD_AVG_TLS_SLOTS 16
+static __thread struct {
+	uint64_t        id;
+	rd_avg_shard_t *ras;
+} rd_avg_tls[RD_AVG_TLS_SLOTS];
+
+static uint64_t rd_avg_next_id;
+
+
+
 rd_avg_t *rd_avg_new (rd_avg_type_t type, int periods, int duration) {
 	rd_avg_t *ra;
 
@@ -43,6 +325,7 @@ rd_avg_t *rd_avg_new (rd_avg_type_t type, int periods, int duration) {
 	ra->ra_type     = type;
 	ra->ra_periods  = periods;
 	ra->ra_duration = duration;
+	rd_mutex_init(&ra->ra_lock);
 	return ra;
 }
 
@@ -65,6 +348,300 @@ rd_avg_t *rd_avg_new_rate (int periods, int duration, int interval) {
 	return ra;
 }
 
+
+rd_avg_t *rd_avg_new_hist (int periods, int duration, int buckets,
+			   int (*val2bucket) (rd_avg_t *ra,
+					      uint64_t val, int buckets)) {
+	rd_avg_t *ra;
+	int i;
+
+	if (periods < 1 || periods > 10000 || buckets < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ra = rd_avg_new(RD_AVG_HIST, periods, duration);
+
+	ra->ra_u.hist.buckets = buckets;
+	ra->ra_u.hist.val2bucket = val2bucket;
+
+	ra->ra_period = calloc(periods, sizeof(*ra->ra_period));
+	for (i = 0 ; i < periods ; i++)
+		ra->ra_period[i].u.hist.bucket =
+			calloc(buckets, sizeof(*ra->ra_period[i].u.hist.bucket));
+
+	return ra;
+}
+
+
+rd_avg_t *rd_avg_new_hdr (int periods, int duration,
+			  uint64_t max_value, int sigfigs) {
+	rd_avg_t *ra;
+	rd_hdr_t hdr;
+	int i;
+
+	if (periods < 1 || periods > 10000 ||
+	    rd_hdr_init(&hdr, max_value, sigfigs) == -1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	rd_hdr_destroy(&hdr);
+
+	ra = rd_avg_new(RD_AVG_HDR, periods, duration);
+
+	ra->ra_u.hdr.conf = hdr;
+
+	ra->ra_period = calloc(periods, sizeof(*ra->ra_period));
+	for (i = 0 ; i < periods ; i++)
+		rd_hdr_init(&ra->ra_period[i].u.hdr, max_value, sigfigs);
+
+	return ra;
+}
+
+
+void rd_avg_destroy (rd_avg_t *ra) {
+	int i;
+
+	for (i = 0 ; i < ra->ra_periods ; i++) {
+		switch (ra->ra_type)
+		{
+		case RD_AVG_HIST:
+			free(ra->ra_period[i].u.hist.bucket);
+			break;
+		case RD_AVG_HDR:
+			rd_hdr_destroy(&ra->ra_period[i].u.hdr);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (ra->ra_flags & RD_AVG_F_CONCURRENT) {
+		rd_avg_shard_t *ras;
+
+		while ((ras = TAILQ_FIRST(&ra->ra_shards))) {
+			TAILQ_REMOVE(&ra->ra_shards, ras, ras_link);
+			free(ras);
+		}
+		free(ra->ra_snap);
+		free(ra->ra_sum);
+	}
+
+	rd_mutex_destroy(&ra->ra_lock);
+
+	free(ra->ra_period);
+	free(ra);
+}
+
+
+void rd_avg_concurrent (rd_avg_t *ra) {
+	switch (ra->ra_type)
+	{
+	case RD_AVG_RATE:
+		ra->ra_ncounters = 1;
+		break;
+	case RD_AVG_HIST:
+		ra->ra_ncounters = ra->ra_u.hist.buckets;
+		break;
+	case RD_AVG_HDR:
+		ra->ra_ncounters = RD_AVG_HDR_COUNTS +
+			ra->ra_u.hdr.conf.rh_counts_len;
+		break;
+	}
+
+	ra->ra_flags |= RD_AVG_F_CONCURRENT;
+	ra->ra_id = rd_atomic_add(&rd_avg_next_id, 1);
+	ra->ra_snap = calloc(ra->ra_ncounters, sizeof(*ra->ra_snap));
+	ra->ra_sum = calloc(ra->ra_ncounters, sizeof(*ra->ra_sum));
+	TAILQ_INIT(&ra->ra_shards);
+}
+
+
+int rd_avg_parent_set (rd_avg_t *ra, rd_avg_t *parent) {
+	if (ra->ra_type != parent->ra_type ||
+	    (parent->ra_flags & RD_AVG_F_CONCURRENT) ||
+	    (ra->ra_type == RD_AVG_HIST &&
+	     ra->ra_u.hist.buckets != parent->ra_u.hist.buckets) ||
+	    (ra->ra_type == RD_AVG_HDR &&
+	     (ra->ra_u.hdr.conf.rh_counts_len !=
+	      parent->ra_u.hdr.conf.rh_counts_len ||
+	      ra->ra_u.hdr.conf.rh_max_trackable !=
+	      parent->ra_u.hdr.conf.rh_max_trackable))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	parent->ra_flags |= RD_AVG_F_PARENT;
+	ra->ra_parent = parent;
+
+	return 0;
+}
+
+
+/**
+ * Returns the calling thread's shard, creating it if necessary.
+ */
+static rd_avg_shard_t *rd_avg_shard_get (rd_avg_t *ra) {
+	const int slot = ra->ra_id % RD_AVG_TLS_SLOTS;
+	pthread_t thr;
+	rd_avg_shard_t *ras;
+
+	if (likely(rd_avg_tls[slot].id == ra->ra_id))
+		return rd_avg_tls[slot].ras;
+
+	thr = pthread_self();
+
+	rd_mutex_lock(&ra->ra_lock);
+	TAILQ_FOREACH(ras, &ra->ra_shards, ras_link)
+		if (pthread_equal(ras->ras_thread, thr))
+			break;
+
+	if (!ras) {
+		size_t size = sizeof(*ras) +
+			ra->ra_ncounters * sizeof(*ras->ras_counters);
+		/* Cache-line aligned to avoid false sharing. */
+		if (posix_memalign((void **)&ras, 64, size))
+			abort();
+		memset(ras, 0, size);
+		ras->ras_thread = thr;
+		ras->ras_low = RD_AVG_NO_VALUE;
+		TAILQ_INSERT_TAIL(&ra->ra_shards, ras, ras_link);
+	}
+	rd_mutex_unlock(&ra->ra_lock);
+
+	rd_avg_tls[slot].id = ra->ra_id;
+	rd_avg_tls[slot].ras = ras;
+
+	return ras;
+}
+
+
+/**
+ * Single-writer increment: only the owning thread writes the counter.
+ */
+#define RD_AVG_SHARD_ADD(PTR,VAL) \
+	__atomic_store_n(PTR, *(PTR) + (VAL), __ATOMIC_RELAXED)
+
+static void rd_avg_put_shard (rd_avg_t *ra, rd_avg_shard_t *ras,
+			      uint64_t val) {
+	uint64_t gen = __atomic_load_n(&ra->ra_gen, __ATOMIC_RELAXED);
+
+	/* New period: restart high/low */
+	if (ras->ras_gen != gen) {
+		__atomic_store_n(&ras->ras_high, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&ras->ras_low, RD_AVG_NO_VALUE,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&ras->ras_gen, gen, __ATOMIC_RELAXED);
+	}
+
+	if (val > ras->ras_high)
+		__atomic_store_n(&ras->ras_high, val, __ATOMIC_RELAXED);
+	if (val < ras->ras_low)
+		__atomic_store_n(&ras->ras_low, val, __ATOMIC_RELAXED);
+
+	switch (ra->ra_type)
+	{
+	case RD_AVG_RATE:
+		RD_AVG_SHARD_ADD(&ras->ras_counters[0], val);
+		break;
+
+	case RD_AVG_HIST:
+	{
+		int b = ra->ra_u.hist.val2bucket(ra, val,
+						 ra->ra_u.hist.buckets);
+		if (likely(b != -1))
+			RD_AVG_SHARD_ADD(&ras->ras_counters[b], 1);
+		break;
+	}
+
+	case RD_AVG_HDR:
+	{
+		const rd_hdr_t *conf = &ra->ra_u.hdr.conf;
+
+		if (unlikely(val > conf->rh_max_trackable)) {
+			RD_AVG_SHARD_ADD(&ras->ras_counters[RD_AVG_HDR_OVERFLOW],
+					 1);
+			val = conf->rh_max_trackable;
+		}
+
+		RD_AVG_SHARD_ADD(&ras->ras_counters[RD_AVG_HDR_COUNTS +
+						    rd_hdr_index(conf, val)],
+				 1);
+		RD_AVG_SHARD_ADD(&ras->ras_counters[RD_AVG_HDR_TOTAL], 1);
+		RD_AVG_SHARD_ADD(&ras->ras_counters[RD_AVG_HDR_SUM], val);
+		break;
+	}
+	}
+}
+
+
+/**
+ * Sums all shards into period 'p' (the current period).
+ * If 'commit' is set the sums are remembered as the start of the
+ * next period.
+ *
+ * NOTE: ra_lock must be held.
+ */
+static void rd_avg_shards_collect (rd_avg_t *ra, rd_avg_period_t *p,
+				   int commit) {
+	uint64_t *sum = ra->ra_sum;
+	uint64_t high = 0, low = RD_AVG_NO_VALUE;
+	rd_avg_shard_t *ras;
+	int i;
+
+	memset(sum, 0, ra->ra_ncounters * sizeof(*sum));
+
+	TAILQ_FOREACH(ras, &ra->ra_shards, ras_link) {
+		for (i = 0 ; i < ra->ra_ncounters ; i++)
+			sum[i] += __atomic_load_n(&ras->ras_counters[i],
+						  __ATOMIC_RELAXED);
+
+		if (__atomic_load_n(&ras->ras_gen, __ATOMIC_RELAXED) ==
+		    ra->ra_gen) {
+			uint64_t v;
+			if ((v = __atomic_load_n(&ras->ras_high,
+						 __ATOMIC_RELAXED)) > high)
+				high = v;
+			if ((v = __atomic_load_n(&ras->ras_low,
+						 __ATOMIC_RELAXED)) < low)
+				low = v;
+		}
+	}
+
+	/* Period delta */
+	for (i = 0 ; i < ra->ra_ncounters ; i++) {
+		uint64_t v = sum[i];
+		sum[i] -= ra->ra_snap[i];
+		if (commit)
+			ra->ra_snap[i] = v;
+	}
+
+	p->res.high = high;
+	p->res.low = low;
+
+	switch (ra->ra_type)
+	{
+	case RD_AVG_RATE:
+		p->u.rate.cnt = sum[0];
+		break;
+
+	case RD_AVG_HIST:
+		memcpy(p->u.hist.bucket, sum,
+		       ra->ra_u.hist.buckets * sizeof(*sum));
+		break;
+
+	case RD_AVG_HDR:
+		p->u.hdr.rh_total = sum[RD_AVG_HDR_TOTAL];
+		p->u.hdr.rh_sum = sum[RD_AVG_HDR_SUM];
+		p->u.hdr.rh_overflow = sum[RD_AVG_HDR_OVERFLOW];
+		p->u.hdr.rh_min = low;
+		p->u.hdr.rh_max = high;
+		memcpy(p->u.hdr.rh_counts, &sum[RD_AVG_HDR_COUNTS],
+		       p->u.hdr.rh_counts_len * sizeof(*sum));
+		break;
+	}
+}
+
 static const rd_avg_res_t *rd_avg_calc (rd_avg_t *ra, rd_avg_period_t *p) {
 	rd_avg_res_t *res = &p->res;
 
@@ -86,15 +663,21 @@ static const rd_avg_res_t *rd_avg_calc (rd_avg_t *ra, rd_avg_period_t *p) {
 	case RD_AVG_HIST:
 		/* No average for histograms, return 0. */
 		goto no_data;
+
+	case RD_AVG_HDR:
+		res->dbl = rd_hdr_mean(&p->u.hdr);
+		res->sum = p->u.hdr.rh_total;
+		break;
 	}
 
 	return res;
 }
 
 
-rd_avg_res_t rd_avg (rd_avg_t *ra, int period) {
-	rd_avg_period_t *p;
-
+/**
+ * Returns the period for index 'period' or RD_AVG_CURR/PREV.
+ */
+static rd_avg_period_t *rd_avg_period_get (rd_avg_t *ra, int period) {
 	if (period == -1)
 		period = ra->ra_curri;
 	else if (period == -2) {
@@ -104,25 +687,111 @@ rd_avg_res_t rd_avg (rd_avg_t *ra, int period) {
 			period = (ra->ra_curri - 1) % ra->ra_periods;
 	}
 	
-	p = &ra->ra_period[period];
+	return &ra->ra_period[period];
+}
+
+/**
+ * Returns the period for 'period', with the shards summed into it
+ * if it is the current period of a concurrent average.
+ * If concurrent, ra_lock is held on return.
+ */
+static rd_avg_period_t *rd_avg_period_lock (rd_avg_t *ra, int period) {
+	rd_avg_period_t *p;
+
+	if (!(ra->ra_flags & (RD_AVG_F_CONCURRENT|RD_AVG_F_PARENT)))
+		return rd_avg_period_get(ra, period);
+
+	rd_mutex_lock(&ra->ra_lock);
+	p = rd_avg_period_get(ra, period);
+	if (p == ra->ra_curr && (ra->ra_flags & RD_AVG_F_CONCURRENT))
+		rd_avg_shards_collect(ra, p, 0);
+
+	return p;
+}
+
+static void rd_avg_period_unlock (rd_avg_t *ra) {
+	if (ra->ra_flags & (RD_AVG_F_CONCURRENT|RD_AVG_F_PARENT))
+		rd_mutex_unlock(&ra->ra_lock);
+}
+
+rd_avg_res_t rd_avg (rd_avg_t *ra, int period) {
+	rd_avg_period_t *p = rd_avg_period_lock(ra, period);
+	rd_avg_res_t res;
 
 	if (p == ra->ra_curr)
 		p->duration = (p->last ? : rd_clock()) - ra->ra_start;
 
-	return *(rd_avg_calc(ra, p));
+	res = *(rd_avg_calc(ra, p));
+
+	rd_avg_period_unlock(ra);
+
+	return res;
+}
+
+
+uint64_t rd_avg_percentile (rd_avg_t *ra, int period, double pct) {
+	uint64_t v;
+
+	assert(ra->ra_type == RD_AVG_HDR);
+
+	v = rd_hdr_percentile(&rd_avg_period_lock(ra, period)->u.hdr, pct);
+	rd_avg_period_unlock(ra);
+
+	return v;
+}
+
+int rd_avg_hdr_copy (rd_avg_t *ra, int period, rd_hdr_t *dst) {
+	const rd_hdr_t *src;
+	int r;
+
+	assert(ra->ra_type == RD_AVG_HDR);
+
+	src = &rd_avg_period_lock(ra, period)->u.hdr;
+	if ((r = rd_hdr_init(dst, src->rh_max_trackable,
+			     src->rh_sigfigs)) != -1)
+		r = rd_hdr_merge(dst, src);
+	rd_avg_period_unlock(ra);
+
+	return r;
 }
 
 
 static void rd_avg_period_next (rd_avg_t *ra, rd_ts_t now) {
+	rd_avg_period_t *p;
 
 	ra->ra_curri = (ra->ra_curri + 1) % ra->ra_periods;
-	ra->ra_curr = &ra->ra_period[ra->ra_curri];
+	ra->ra_curr = p = &ra->ra_period[ra->ra_curri];
 
 	ra->ra_start = now;
-	ra->ra_end = ra->ra_start + ra->ra_duration;
+	/* Read without locking by concurrent writers. */
+	__atomic_store_n(&ra->ra_end, ra->ra_start + ra->ra_duration,
+			 __ATOMIC_RELAXED);
+
+	/* Keep the preallocated histogram buckets. */
+	switch (ra->ra_type)
+	{
+	case RD_AVG_HIST:
+	{
+		uint64_t *bucket = p->u.hist.bucket;
+		memset(p, 0, sizeof(*p));
+		memset(bucket, 0, ra->ra_u.hist.buckets * sizeof(*bucket));
+		p->u.hist.bucket = bucket;
+		break;
+	}
+	case RD_AVG_HDR:
+	{
+		rd_hdr_t hdr = p->u.hdr;
+		memset(p, 0, sizeof(*p));
+		p->u.hdr = hdr;
+		rd_hdr_reset(&p->u.hdr);
+		break;
+	}
+	default:
+		memset(p, 0, sizeof(*p));
+		break;
+	}
 
-	memset(ra->ra_curr, 0, sizeof(*ra->ra_curr));
-	ra->ra_curr->res.low = RD_AVG_NO_VALUE;
+	p->res.low = RD_AVG_NO_VALUE;
 	
 }
 
@@ -132,6 +801,47 @@ void rd_avg_start (rd_avg_t *ra) {
 
 
 
+static void rd_avg_roll (rd_avg_t *ra, rd_ts_t now);
+
+/**
+ * Adds the child period 'cp' to the current period of 'parent'.
+ */
+static void rd_avg_parent_merge (rd_avg_t *parent,
+				 const rd_avg_period_t *cp, rd_ts_t now) {
+	rd_avg_period_t *p;
+	int i;
+
+	rd_mutex_lock(&parent->ra_lock);
+
+	if (parent->ra_end <= now)
+		rd_avg_roll(parent, now);
+
+	p = parent->ra_curr;
+	p->last = now;
+
+	if (cp->res.high > p->res.high)
+		p->res.high = cp->res.high;
+	if (cp->res.low < p->res.low)
+		p->res.low = cp->res.low;
+
+	switch (parent->ra_type)
+	{
+	case RD_AVG_RATE:
+		p->u.rate.cnt += cp->u.rate.cnt;
+		break;
+	case RD_AVG_HIST:
+		for (i = 0 ; i < parent->ra_u.hist.buckets ; i++)
+			p->u.hist.bucket[i] += cp->u.hist.bucket[i];
+		break;
+	case RD_AVG_HDR:
+		rd_hdr_merge(&p->u.hdr, &cp->u.hdr);
+		break;
+	}
+
+	rd_mutex_unlock(&parent->ra_lock);
+}
+
+
 /**
  * Roll-over, stop and perform average calculations on the current period.
  * Set up a new current period.
@@ -139,6 +849,9 @@ void rd_avg_start (rd_avg_t *ra) {
 static void rd_avg_roll (rd_avg_t *ra, rd_ts_t now) {
 	int missed;
 
+	if (ra->ra_flags & RD_AVG_F_CONCURRENT)
+		rd_avg_shards_collect(ra, ra->ra_curr, 1);
+
 	/* Calculate the average */
 	ra->ra_curr->closed = now;
 	ra->ra_curr->duration = (ra->ra_curr->last ? : now) - ra->ra_start;
@@ -152,8 +865,15 @@ static void rd_avg_roll (rd_avg_t *ra, rd_ts_t now) {
 	if (ra->ra_roll_cb)
 		ra->ra_roll_cb(ra, ra->ra_curri, ra->ra_opaque);
 
+	if (ra->ra_parent)
+		rd_avg_parent_merge(ra->ra_parent, ra->ra_curr, now);
+
 	/* Set up new current period */
 	rd_avg_period_next(ra, now);
+
+	if (ra->ra_flags & RD_AVG_F_CONCURRENT)
+		__atomic_store_n(&ra->ra_gen, ra->ra_gen + 1,
+				 __ATOMIC_RELAXED);
 }
 
 static inline void rd_avg_put_rate (rd_avg_t *ra, uint64_t val, rd_ts_t now) {
@@ -170,8 +890,35 @@ static inline void rd_avg_put_hist (rd_avg_t *ra, uint64_t val, rd_ts_t now) {
 	ra->ra_curr->u.hist.bucket[b]++;
 }
 
+static inline void rd_avg_put_hdr (rd_avg_t *ra, uint64_t val, rd_ts_t now) {
+	rd_hdr_record(&ra->ra_curr->u.hdr, val);
+}
+
+/**
+ * Concurrent rd_avg_put(): one coarse clock read and the thread's
+ * own shard, the lock is only taken by the thread rolling the period.
+ */
+static void rd_avg_put_concurrent (rd_avg_t *ra, uint64_t val) {
+	rd_ts_t now = rd_clock_coarse();
+
+	if (unlikely(__atomic_load_n(&ra->ra_end, __ATOMIC_RELAXED) <= now)) {
+		rd_mutex_lock(&ra->ra_lock);
+		/* Another thread may have rolled it already. */
+		if (ra->ra_end <= now)
+			rd_avg_roll(ra, now);
+		rd_mutex_unlock(&ra->ra_lock);
+	}
+
+	rd_avg_put_shard(ra, rd_avg_shard_get(ra), val);
+}
+
 void rd_avg_put (rd_avg_t *ra, uint64_t val) {
-	rd_ts_t now = rd_clock();
+	rd_ts_t now;
+
+	if (ra->ra_flags & RD_AVG_F_CONCURRENT)
+		return rd_avg_put_concurrent(ra, val);
+
+	now = rd_clock();
 
 	/* Check if current period has ended */
 	if (ra->ra_end <= now)
@@ -190,5 +937,7 @@ void rd_avg_put (rd_avg_t *ra, uint64_t val) {
 		return rd_avg_put_rate(ra, val, now);
 	case RD_AVG_HIST:
 		return rd_avg_put_hist(ra, val, now);
+	case RD_AVG_HDR:
+		return rd_avg_put_hdr(ra, val, now);
 	}
 }
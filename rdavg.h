@@ -33,12 +33,14 @@
  * NOTE: THIS IS WORK IN PROGRESS
  **/
 
+#include "rd.h"
 #include "rdsysqueue.h"
+#include "rdthread.h"
 
 typedef enum {
 	RD_AVG_RATE,  /* x/time-interval rate */
 	RD_AVG_HIST,  /* fixed-bucket histogram */
-
+	RD_AVG_HDR,   /* log-linear (HDR) histogram */
 } rd_avg_type_t;
 
 #define RD_AVG_NO_VALUE 0xffffffffffffffff
@@ -59,6 +61,210 @@ typedef struct rd_avg_hist_s {
 	uint64_t *bucket;
 } rd_avg_hist_t;
 
+
+/**
+ * HDR (High Dynamic Range) histogram.
+ *
+ * Log-linear buckets: values are grouped in power-of-two ranges, each
+ * range being split in linear sub-buckets, which keeps the relative
+ * error of every recorded value within the configured number of
+ * significant decimal digits over the full 1..max_value range with a
+ * fixed amount of memory.
+ * Recording is O(1) with no branches on the value range.
+ *
+ * Usage:
+ *   rd_hdr_init(&hdr, 60*1000000, 3);    // 1us..60s, 3 digits precision
+ *   rd_hdr_record(&hdr, latency_us);
+ *   p99 = rd_hdr_percentile(&hdr, 99.0);
+ */
+typedef struct rd_hdr_s {
+	uint64_t *rh_counts;
+	int       rh_counts_len;
+	int       rh_sub_bits;        /* log2(sub-buckets per bucket) */
+	int       rh_sigfigs;         /* config: significant digits */
+	uint64_t  rh_max_trackable;   /* config: max value */
+
+	uint64_t  rh_total;           /* Number of recorded values */
+	uint64_t  rh_sum;             /* Sum of recorded values */
+	uint64_t  rh_min;
+	uint64_t  rh_max;
+	uint64_t  rh_overflow;        /* Values capped to max_trackable */
+} rd_hdr_t;
+
+
+/**
+ * Initializes histogram 'hdr' for values 0..'max_value' with 'sigfigs'
+ * (1..5) significant decimal digits of precision.
+ * Returns 0 on success or -1 on invalid arguments (errno EINVAL).
+ */
+int  rd_hdr_init (rd_hdr_t *hdr, uint64_t max_value, int sigfigs);
+
+/**
+ * Frees the histogram's buckets.
+ */
+void rd_hdr_destroy (rd_hdr_t *hdr);
+
+/**
+ * Clears all recorded values.
+ */
+void rd_hdr_reset (rd_hdr_t *hdr);
+
+/**
+ * Adds the values recorded in 'src' to 'dst'.
+ * Both histograms must have been initialized with the same parameters.
+ * Returns 0 on success or -1 (errno EINVAL) on configuration mismatch.
+ */
+int  rd_hdr_merge (rd_hdr_t *dst, const rd_hdr_t *src);
+
+/**
+ * Returns the value at percentile 'pct' (0..100), i.e., the highest
+ * value equivalent (within precision) to the value below which 'pct'
+ * percent of the recorded values fall. Returns 0 if no values were recorded.
+ */
+uint64_t rd_hdr_percentile (const rd_hdr_t *hdr, double pct);
+
+/**
+ * Returns the mean of recorded values.
+ */
+double rd_hdr_mean (const rd_hdr_t *hdr);
+
+
+static inline int rd_hdr_index (const rd_hdr_t *hdr, uint64_t val) RD_UNUSED;
+static inline int rd_hdr_index (const rd_hdr_t *hdr, uint64_t val) {
+	const int half_bits = hdr->rh_sub_bits - 1;
+	/* Power-of-two range of 'val', the first range covers
+	 * all sub-buckets with a resolution of 1. */
+	int bucket = (64 - __builtin_clzll(val |
+					   ((1llu << hdr->rh_sub_bits) - 1))) -
+		hdr->rh_sub_bits;
+	int sub = (int)(val >> bucket);
+
+	return ((bucket + 1) << half_bits) + (sub - (1 << half_bits));
+}
+
+/**
+ * Records value 'val'. Values above the configured max are
+ * capped and counted in rh_overflow.
+ */
+static inline void rd_hdr_record (rd_hdr_t *hdr, uint64_t val) RD_UNUSED;
+static inline void rd_hdr_record (rd_hdr_t *hdr, uint64_t val) {
+	if (unlikely(val > hdr->rh_max_trackable)) {
+		hdr->rh_overflow++;
+		val = hdr->rh_max_trackable;
+	}
+
+	hdr->rh_counts[rd_hdr_index(hdr, val)]++;
+	hdr->rh_total++;
+	hdr->rh_sum += val;
+	if (val < hdr->rh_min)
+		hdr->rh_min = val;
+	if (val > hdr->rh_max)
+		hdr->rh_max = val;
+}
+
+
+
+/**
+ * Exponentially weighted moving average rates, like the Unix load
+ * average: every tick the rate of the values added during the tick is
+ * folded into each window's rate with weight 1-exp(-tick/window).
+ * Gives smooth per-second rates with O(1) state and update cost.
+ *
+ * Usage:
+ *   rd_ewma_init(&re, 5000, NULL, 0);    // 5s ticks, 1/5/15 minutes
+ *   rd_ewma_update(&re, bytes);
+ *   rate_1m = rd_ewma_rate(&re, 0);
+ *
+ * NOTE: not thread-safe.
+ */
+#define RD_EWMA_WINDOWS_MAX 4
+
+typedef struct rd_ewma_s {
+	uint64_t re_uncounted;                  /* Sum since last tick */
+	rd_ts_t  re_tick;                       /* config: tick interval */
+	rd_ts_t  re_last;                       /* Last tick time */
+	int      re_windows;
+	int      re_seeded;                     /* First tick done */
+	double   re_alpha[RD_EWMA_WINDOWS_MAX];
+	double   re_rate[RD_EWMA_WINDOWS_MAX];  /* Per-second rates */
+} rd_ewma_t;
+
+/**
+ * Initializes 'ewma' with a tick interval of 'tick_ms' and the 'cnt'
+ * window lengths (in seconds) in 'windows_s', or 1, 5 and 15 minutes
+ * if 'windows_s' is NULL.
+ */
+void rd_ewma_init (rd_ewma_t *re, int tick_ms,
+		   const int *windows_s, int cnt);
+
+/**
+ * Catches up on ticks that are due at time 'now'.
+ */
+void rd_ewma_tick (rd_ewma_t *re, rd_ts_t now);
+
+static inline void rd_ewma_update0 (rd_ewma_t *re, uint64_t val,
+				    rd_ts_t now) RD_UNUSED;
+static inline void rd_ewma_update0 (rd_ewma_t *re, uint64_t val,
+				    rd_ts_t now) {
+	if (unlikely(now - re->re_last >= re->re_tick))
+		rd_ewma_tick(re, now);
+	re->re_uncounted += val;
+}
+
+/**
+ * Adds 'val' (e.g., 1 for event rates or a byte count).
+ */
+#define rd_ewma_update(re,val)  rd_ewma_update0(re, val, rd_clock_coarse())
+
+/**
+ * Returns the per-second rate of window 'window' (index in the
+ * windows given to rd_ewma_init()).
+ */
+double rd_ewma_rate0 (rd_ewma_t *re, int window, rd_ts_t now);
+#define rd_ewma_rate(re,window)  rd_ewma_rate0(re, window, rd_clock_coarse())
+
+
+
+/**
+ * Sliding-window rate.
+ * The window is split in sub-buckets of equal width in a ring,
+ * the oldest sub-bucket is recycled as time passes, so the rate
+ * follows the last window without the steps of fixed periods.
+ *
+ * NOTE: not thread-safe.
+ */
+typedef struct rd_swrate_s {
+	rd_ts_t   rsw_width;   /* Sub-bucket width */
+	int       rsw_cnt;     /* Number of sub-buckets */
+	uint64_t *rsw_sum;     /* Per sub-bucket sums */
+	int64_t  *rsw_slot;    /* Per sub-bucket absolute slot number */
+} rd_swrate_t;
+
+/**
+ * Initializes 'rsw' with a window of 'window_ms' split in 'buckets'
+ * sub-buckets. Returns 0 on success or -1 on invalid arguments.
+ */
+int  rd_swrate_init (rd_swrate_t *rsw, int window_ms, int buckets);
+void rd_swrate_destroy (rd_swrate_t *rsw);
+
+void rd_swrate_put0 (rd_swrate_t *rsw, uint64_t val, rd_ts_t now);
+#define rd_swrate_put(rsw,val)  rd_swrate_put0(rsw, val, rd_clock_coarse())
+
+/**
+ * Returns the sum of values within the window.
+ */
+uint64_t rd_swrate_sum0 (const rd_swrate_t *rsw, rd_ts_t now);
+#define rd_swrate_sum(rsw)  rd_swrate_sum0(rsw, rd_clock_coarse())
+
+/**
+ * Returns the per-second rate over the window (or over the elapsed
+ * part of the window's current sub-bucket and the full older ones).
+ */
+double rd_swrate_rate0 (const rd_swrate_t *rsw, rd_ts_t now);
+#define rd_swrate_rate(rsw)  rd_swrate_rate0(rsw, rd_clock_coarse())
+
+
+
 typedef struct rd_avg_period_s {
 	rd_ts_t last;       /* last data point */
 	rd_ts_t duration;
@@ -67,6 +273,7 @@ typedef struct rd_avg_period_s {
 	union {
 		rd_avg_rate_t rate;
 		rd_avg_hist_t hist;
+		rd_hdr_t      hdr;
 	} u;
 	rd_avg_res_t res;
 } rd_avg_period_t;
@@ -95,10 +302,28 @@ typedef struct rd_avg_s {
 			int (*val2bucket) (struct rd_avg_s *ra,
 					   uint64_t val, int buckets);
 		} hist;
+		struct {
+			rd_hdr_t conf;  /* Configuration only, no counts */
+		} hdr;
 	} ra_u;
 
 	struct rd_avg_s  *ra_parent;
 
+	int                 ra_flags;
+#define RD_AVG_F_CONCURRENT  0x1  /* Per-thread shards, see below. */
+#define RD_AVG_F_PARENT      0x2  /* Aggregates children, see below. */
+
+	rd_mutex_t          ra_lock;      /* Protects shard list, rolls
+					   * and children merges. */
+
+	/* RD_AVG_F_CONCURRENT state */
+	uint64_t            ra_id;        /* Unique id for shard lookups */
+	uint64_t            ra_gen;       /* Period generation */
+	TAILQ_HEAD(, rd_avg_shard_s) ra_shards;
+	int                 ra_ncounters; /* Counters per shard */
+	uint64_t           *ra_snap;      /* Counter sums at last roll */
+	uint64_t           *ra_sum;       /* Scratch for counter sums */
+
 	void (*ra_roll_cb) (struct rd_avg_s *ra, int period, void *opaque);
 	void *ra_opaque;
 } rd_avg_t;
@@ -122,6 +347,74 @@ typedef struct rd_avg_s {
 #define RD_AVG_PREV  -2  /* previous period */
 
 rd_avg_t *rd_avg_new_rate (int periods, int duration, int interval);
+
+/**
+ * Creates a fixed-bucket histogram average: 'val2bucket' maps a value
+ * to a bucket index in the range 0..'buckets'-1, or -1 to ignore it.
+ */
+rd_avg_t *rd_avg_new_hist (int periods, int duration, int buckets,
+			   int (*val2bucket) (rd_avg_t *ra,
+					      uint64_t val, int buckets));
+
+/**
+ * Creates an HDR histogram average, each period has its own
+ * rd_hdr_t histogram, see rd_hdr_init() for 'max_value' and 'sigfigs'.
+ * The result's 'dbl' is the mean and 'sum' is the number of values.
+ */
+rd_avg_t *rd_avg_new_hdr (int periods, int duration,
+			  uint64_t max_value, int sigfigs);
+
+void rd_avg_destroy (rd_avg_t *ra);
+
+
+/**
+ * Enables concurrent mode: rd_avg_put() may then be called from any
+ * number of threads without locking.
+ *
+ * Each thread records into its own cache-line aligned shard with
+ * plain (single-writer) stores and reads a coarse clock
+ * (rd_clock_coarse()) to detect period roll-over.
+ * The shards are summed into the period when it is rolled or when it
+ * is queried with rd_avg(), rd_avg_percentile() or rd_avg_hdr_copy().
+ * Data points recorded concurrently with a roll-over may be accounted
+ * to either period.
+ *
+ * Must be called before rd_avg_start().
+ */
+void rd_avg_concurrent (rd_avg_t *ra);
+
+
+/**
+ * Makes 'parent' aggregate 'ra': whenever a period of 'ra' is rolled
+ * its values (counts, histogram buckets, high and low) are added to
+ * the current period of 'parent', thus a parent with a longer period
+ * duration aggregates a number of children over its period.
+ * Children may be concurrent and roll in different threads.
+ *
+ * 'parent' must be of the same type and configuration as 'ra',
+ * started with rd_avg_start(), and should not be written to directly,
+ * nor be concurrent itself.
+ * Returns 0 on success or -1 (errno EINVAL) on mismatch.
+ */
+int rd_avg_parent_set (rd_avg_t *ra, rd_avg_t *parent);
+
 rd_avg_res_t rd_avg (rd_avg_t *ra, int period);
+
+/**
+ * Returns the value at percentile 'pct' for 'period' of an
+ * RD_AVG_HDR average, e.g.: rd_avg_percentile(ra, RD_AVG_PREV, 99.9)
+ */
+uint64_t rd_avg_percentile (rd_avg_t *ra, int period, double pct);
+
+/**
+ * Initializes 'dst' as a copy of the HDR histogram of 'period' of an
+ * RD_AVG_HDR average, taken atomically with respect to concurrent
+ * puts and roll-overs, e.g. to read several consistent statistics or
+ * to rd_hdr_merge() it into an aggregate.
+ * The caller must rd_hdr_destroy() 'dst'.
+ * Returns 0 on success or -1 on failure.
+ */
+int rd_avg_hdr_copy (rd_avg_t *ra, int period, rd_hdr_t *dst);
+
 void rd_avg_start (rd_avg_t *ra);
 void rd_avg_put (rd_avg_t *ra, uint64_t val);
@@ -28,6 +28,8 @@
 
 #include "rdavl.h"
 
+#include <stddef.h>
+
 /*
  * AVL tree.
  * Inspired by Ian Piumarta's tree.h implementation.
@@ -44,6 +46,21 @@
 
 static rd_avl_node_t *rd_avl_balance_node (rd_avl_node_t *ran);
 
+
+static inline void rd_avl_height_update (rd_avl_node_t *ran) {
+	int h;
+
+	ran->ran_height = 0;
+
+	if ((h = RD_AVL_NODE_HEIGHT(ran->ran_p[RD_AVL_LEFT])) > ran->ran_height)
+		ran->ran_height = h;
+
+	if ((h = RD_AVL_NODE_HEIGHT(ran->ran_p[RD_AVL_RIGHT])) >ran->ran_height)
+		ran->ran_height = h;
+
+	ran->ran_height++;
+}
+
 static rd_avl_node_t *rd_avl_rotate (rd_avl_node_t *ran, rd_avl_dir_t dir) {
 	rd_avl_node_t *n;
 	static const rd_avl_dir_t odirmap[] = { /* opposite direction map */
@@ -63,7 +80,6 @@ static rd_avl_node_t *rd_avl_rotate (rd_avl_node_t *ran, rd_avl_dir_t dir) {
 
 static rd_avl_node_t *rd_avl_balance_node (rd_avl_node_t *ran) {
 	const int d = RD_AVL_NODE_DELTA(ran);
-	int h;
 
 	if (d < -RD_DELTA_MAX) {
 		if (RD_AVL_NODE_DELTA(ran->ran_p[RD_AVL_RIGHT]) > 0)
@@ -81,135 +97,658 @@ static rd_avl_node_t *rd_avl_balance_node (rd_avl_node_t *ran) {
 		return rd_avl_rotate(ran, RD_AVL_RIGHT);
 	}
 
-	ran->ran_height = 0;
+	rd_avl_height_update(ran);
 
-	if ((h = RD_AVL_NODE_HEIGHT(ran->ran_p[RD_AVL_LEFT])) > ran->ran_height)
-		ran->ran_height = h;
+	return ran;
+}
 
-	if ((h = RD_AVL_NODE_HEIGHT(ran->ran_p[RD_AVL_RIGHT])) >ran->ran_height)
-		ran->ran_height = h;
+/**
+ * Rebalances the nodes referenced by the links in 'path' (root first),
+ * bottom up.
+ * Stops early when a subtree's height is unchanged since its
+ * ancestors are then unaffected.
+ */
+static void rd_avl_rebalance_path (rd_avl_node_t ***path, int depth) {
 
-	ran->ran_height++;
+	while (depth > 0) {
+		rd_avl_node_t **linkp = path[--depth];
+		int height = (*linkp)->ran_height;
 
-	return ran;
+		*linkp = rd_avl_balance_node(*linkp);
+		if ((*linkp)->ran_height == height)
+			break;
+	}
 }
 
+
 rd_avl_node_t *rd_avl_insert_node (rd_avl_t *ravl,
 				   rd_avl_node_t *parent,
 				   rd_avl_node_t *ran,
 				   rd_avl_node_t **existing) {
-	rd_avl_dir_t dir;
+	rd_avl_node_t **path[RD_AVL_HEIGHT_MAX];
+	rd_avl_node_t *root = parent;
+	rd_avl_node_t **linkp = &root;
+	int depth = 0;
 	int r;
 
-	if (!parent)
-		return ran;
+	while (*linkp) {
+		if ((r = ravl->ravl_cmp(ran->ran_elm, (*linkp)->ran_elm)) == 0) {
+			/* Replace existing node with new one. */
+			ran->ran_p[RD_AVL_LEFT] = (*linkp)->ran_p[RD_AVL_LEFT];
+			ran->ran_p[RD_AVL_RIGHT] =
+				(*linkp)->ran_p[RD_AVL_RIGHT];
+			ran->ran_height = (*linkp)->ran_height;
+			*existing = *linkp;
+			*linkp = ran;
+			return root;
+		}
+
+		assert(depth < RD_AVL_HEIGHT_MAX);
+		path[depth++] = linkp;
+		linkp = &(*linkp)->ran_p[r < 0 ? RD_AVL_LEFT : RD_AVL_RIGHT];
+	}
 
-	if ((r = ravl->ravl_cmp(ran->ran_elm, parent->ran_elm)) == 0) {
-		/* Replace existing node with new one. */
-		ran->ran_p[RD_AVL_LEFT] = parent->ran_p[RD_AVL_LEFT];
-		ran->ran_p[RD_AVL_RIGHT] = parent->ran_p[RD_AVL_RIGHT];
-		ran->ran_height = parent->ran_height;
-		*existing = parent;
-		return ran;
+	ran->ran_height = 1;
+	*linkp = ran;
+
+	rd_avl_rebalance_path(path, depth);
+
+	return root;
+}
+
+
+rd_avl_node_t *rd_avl_remove_elm0 (rd_avl_t *ravl, rd_avl_node_t *parent,
+				   const void *elm) {
+	rd_avl_node_t **path[RD_AVL_HEIGHT_MAX];
+	rd_avl_node_t *root = parent;
+	rd_avl_node_t **linkp = &root;
+	rd_avl_node_t *ran;
+	int depth = 0;
+	int r;
+
+	while (*linkp && (r = ravl->ravl_cmp(elm, (*linkp)->ran_elm))) {
+		path[depth++] = linkp;
+		linkp = &(*linkp)->ran_p[r < 0 ? RD_AVL_LEFT : RD_AVL_RIGHT];
 	}
 
-	if (r < 0)
-		dir = RD_AVL_LEFT;
-	else
-		dir = RD_AVL_RIGHT;
+	if (!(ran = *linkp))
+		return root;
+
+	if (!ran->ran_p[RD_AVL_LEFT])
+		*linkp = ran->ran_p[RD_AVL_RIGHT];
+	else if (!ran->ran_p[RD_AVL_RIGHT])
+		*linkp = ran->ran_p[RD_AVL_LEFT];
+	else {
+		/* Replace the node with its in-order successor:
+		 * the leftmost node of its right subtree. */
+		int idx = depth;
+		rd_avl_node_t **succp = &ran->ran_p[RD_AVL_RIGHT];
+		rd_avl_node_t *succ;
+
+		path[depth++] = linkp;
+		while ((*succp)->ran_p[RD_AVL_LEFT]) {
+			path[depth++] = succp;
+			succp = &(*succp)->ran_p[RD_AVL_LEFT];
+		}
+
+		succ = *succp;
+		*succp = succ->ran_p[RD_AVL_RIGHT];
+
+		succ->ran_p[RD_AVL_LEFT]  = ran->ran_p[RD_AVL_LEFT];
+		succ->ran_p[RD_AVL_RIGHT] = ran->ran_p[RD_AVL_RIGHT];
+		succ->ran_height = ran->ran_height;
+		*linkp = succ;
+
+		/* The path continued through the removed node's
+		 * right link which now belongs to the successor. */
+		if (idx + 1 < depth)
+			path[idx + 1] = &succ->ran_p[RD_AVL_RIGHT];
+	}
 
-	parent->ran_p[dir] = rd_avl_insert_node(ravl, parent->ran_p[dir],
-						ran, existing);
-	return rd_avl_balance_node(parent);
+	ran->ran_p[RD_AVL_LEFT] = ran->ran_p[RD_AVL_RIGHT] = NULL;
+
+	rd_avl_rebalance_path(path, depth);
+
+	return root;
 }
 
 
-static rd_avl_node_t *rd_avl_move (rd_avl_node_t *dst, rd_avl_node_t *src,
-				   rd_avl_dir_t dir) {
 
-	if (!dst)
-		return src;
+rd_avl_node_t *rd_avl_find_node (const rd_avl_t *ravl,
+				 const rd_avl_node_t *begin,
+				 const void *elm) {
+	int r;
 
-	dst->ran_p[dir] = rd_avl_move(dst->ran_p[dir], src, dir);
+	while (begin && (r = ravl->ravl_cmp(elm, begin->ran_elm)))
+		begin = begin->ran_p[r < 0 ? RD_AVL_LEFT : RD_AVL_RIGHT];
 
-	return rd_avl_balance_node(dst);
+	return (rd_avl_node_t *)begin;
 }
 
-static rd_avl_node_t *rd_avl_remove_node0 (rd_avl_node_t *ran) {
-	rd_avl_node_t *tmp;
 
-	tmp = rd_avl_move(ran->ran_p[RD_AVL_LEFT],
-			  ran->ran_p[RD_AVL_RIGHT],
-			  RD_AVL_RIGHT);
-	
-	ran->ran_p[RD_AVL_LEFT] = ran->ran_p[RD_AVL_RIGHT] = NULL;
-	return tmp;
+/**
+ * Post-order traversal: children are visited before their parent
+ * so the callback may free the element.
+ * If 'node_free' is set each node is passed to it after it is visited.
+ */
+static void rd_avl_postorder (rd_avl_node_t *ran,
+			      rd_avl_foreach_cb cb, void *opaque,
+			      void (*node_free) (void *)) {
+	rd_avl_node_t *stack[RD_AVL_HEIGHT_MAX];
+	rd_avl_node_t *last = NULL;
+	int depth = 0;
+
+	while (ran || depth > 0) {
+		void *elm;
+
+		if (ran) {
+			stack[depth++] = ran;
+			ran = ran->ran_p[RD_AVL_LEFT];
+			continue;
+		}
+
+		ran = stack[depth-1];
+		if (ran->ran_p[RD_AVL_RIGHT] &&
+		    ran->ran_p[RD_AVL_RIGHT] != last) {
+			/* Right subtree not yet visited. */
+			ran = ran->ran_p[RD_AVL_RIGHT];
+			continue;
+		}
+
+		depth--;
+		/* Only the address of 'last' is used from here on. */
+		last = ran;
+		elm = RD_AVL_ELM_GET_NL(ran);
+		if (node_free)
+			node_free(ran);
+		if (cb)
+			cb(elm, opaque);
+		ran = NULL;
+	}
 }
 
+void rd_avl_foreach_node (rd_avl_node_t *ran,
+			  rd_avl_foreach_cb cb, void *opaque) {
+	rd_avl_postorder(ran, cb, opaque, NULL);
+}
 
-rd_avl_node_t *rd_avl_remove_elm0 (rd_avl_t *ravl, rd_avl_node_t *parent,
-				   const void *elm) {
-	rd_avl_dir_t dir;
-	int r;
 
-	if (!parent)
+/**
+ * Pushes 'ran' and its chain of children in the iterator's start
+ * direction.
+ */
+static void rd_avl_iter_push (rd_avl_iter_t *rai, rd_avl_node_t *ran) {
+	while (ran) {
+		rai->rai_stack[rai->rai_depth++] = ran;
+		ran = ran->ran_p[rai->rai_dir];
+	}
+}
+
+void rd_avl_iter_init (rd_avl_iter_t *rai, rd_avl_t *ravl,
+		       rd_avl_dir_t dir) {
+	rai->rai_dir   = dir;
+	rai->rai_depth = 0;
+	rd_avl_iter_push(rai, rd_avl_root(ravl));
+}
+
+
+void rd_avl_iter_seek (rd_avl_iter_t *rai, rd_avl_t *ravl,
+		       const void *elm, int upper) {
+	rd_avl_node_t *ran = rd_avl_root(ravl);
+
+	rai->rai_dir   = RD_AVL_LEFT;
+	rai->rai_depth = 0;
+
+	/* Only nodes in the result range are pushed: exactly those
+	 * the in-order walk would still return from this position. */
+	while (ran) {
+		int r = ravl->ravl_cmp(elm, ran->ran_elm);
+
+		if (r < 0 || (r == 0 && !upper)) {
+			rai->rai_stack[rai->rai_depth++] = ran;
+			ran = ran->ran_p[RD_AVL_LEFT];
+		} else
+			ran = ran->ran_p[RD_AVL_RIGHT];
+	}
+}
+
+
+void *rd_avl_iter_next (rd_avl_iter_t *rai) {
+	rd_avl_node_t *ran;
+
+	if (rai->rai_depth == 0)
 		return NULL;
 
+	ran = rai->rai_stack[--rai->rai_depth];
+	rd_avl_iter_push(rai, ran->ran_p[!rai->rai_dir]);
+
+	return ran->ran_elm;
+}
+
+
+void *rd_avl_edge (rd_avl_t *ravl, rd_avl_dir_t dir, int dolock) {
+	const rd_avl_node_t *ran;
+	void *ret = NULL;
 
-	if ((r = ravl->ravl_cmp(elm, parent->ran_elm)) == 0)
-		return rd_avl_remove_node0(parent);
-	else if  (r < 0)
-		dir = RD_AVL_LEFT;
-	else /* > 0 */
-		dir = RD_AVL_RIGHT;
+	if (dolock)
+		rd_avl_rdlock(ravl);
 
-	parent->ran_p[dir] =
-		rd_avl_remove_elm0(ravl, parent->ran_p[dir], elm);
+	if ((ran = rd_avl_root(ravl))) {
+		while (ran->ran_p[dir])
+			ran = ran->ran_p[dir];
+		ret = ran->ran_elm;
+	}
+
+	if (dolock)
+		rd_avl_rdunlock(ravl);
 
-	return rd_avl_balance_node(parent);
+	return ret;
 }
 
 
+void *rd_avl_bound (rd_avl_t *ravl, const void *elm, int upper, int dolock) {
+	const rd_avl_node_t *ran;
+	void *ret = NULL;
 
-rd_avl_node_t *rd_avl_find_node (const rd_avl_t *ravl,
-				 const rd_avl_node_t *begin,
-				 const void *elm) {
+	if (dolock)
+		rd_avl_rdlock(ravl);
+
+	ran = rd_avl_root(ravl);
+	while (ran) {
+		int r = ravl->ravl_cmp(elm, ran->ran_elm);
+
+		if (r < 0 || (r == 0 && !upper)) {
+			/* Candidate, look for a smaller one. */
+			ret = ran->ran_elm;
+			ran = ran->ran_p[RD_AVL_LEFT];
+		} else
+			ran = ran->ran_p[RD_AVL_RIGHT];
+	}
+
+	if (dolock)
+		rd_avl_rdunlock(ravl);
+
+	return ret;
+}
+
+
+int rd_avl_range (rd_avl_t *ravl, const void *lo, const void *hi,
+		  rd_avl_foreach_cb cb, void *opaque, int dolock) {
+	rd_avl_iter_t rai;
+	void *elm;
+	int cnt = 0;
+
+	if (dolock)
+		rd_avl_rdlock(ravl);
+
+	if (lo)
+		rd_avl_iter_seek(&rai, ravl, lo, 0);
+	else
+		rd_avl_iter_init(&rai, ravl, RD_AVL_LEFT);
+
+	while ((elm = rd_avl_iter_next(&rai))) {
+		if (hi && ravl->ravl_cmp(elm, hi) > 0)
+			break;
+		cb(elm, opaque);
+		cnt++;
+	}
+
+	if (dolock)
+		rd_avl_rdunlock(ravl);
+
+	return cnt;
+}
+
+
+
+/**
+ * RCU mode: copy-on-write updates.
+ * NOTE: the write lock must be held.
+ */
+
+/**
+ * RCU trees allocate their own nodes, with room for the link used
+ * to retire them without allocating.
+ */
+typedef struct rd_avl_rcu_node_s {
+	rd_avl_node_t    rarn_node;    /* Must be first */
+	rd_epoch_entry_t rarn_ee;      /* Retire link, also links the
+					* update's new or replaced nodes
+					* until it is published. */
+	int              rarn_new;     /* Not yet published: private to
+					* the writer. */
+} rd_avl_rcu_node_t;
+
+#define RD_AVL_RCU_NODE(ran)  ((rd_avl_rcu_node_t *)(ran))
+
+/**
+ * A single copy-on-write update.
+ */
+typedef struct rd_avl_rcu_upd_s {
+	rd_epoch_entry_t *raru_new;       /* Nodes allocated */
+	rd_epoch_entry_t *raru_replaced;  /* Published nodes replaced */
+} rd_avl_rcu_upd_t;
+
+static void rd_avl_rcu_link (rd_epoch_entry_t **head, rd_avl_node_t *ran) {
+	RD_AVL_RCU_NODE(ran)->rarn_ee.ree_next = *head;
+	*head = &RD_AVL_RCU_NODE(ran)->rarn_ee;
+}
+
+#define RD_AVL_RCU_EE2NODE(ree)							((rd_avl_rcu_node_t *)((char *)(ree) -							       offsetof(rd_avl_rcu_node_t, rarn_ee)))
+
+/**
+ * Allocates a node, private to update 'upd' if not NULL.
+ */
+static rd_avl_node_t *rd_avl_rcu_node_new (rd_avl_rcu_upd_t *upd) {
+	rd_avl_rcu_node_t *rarn = malloc(sizeof(*rarn));
+
+	if (!rarn)
+		abort();
+
+	rarn->rarn_new = !!upd;
+	if (upd)
+		rd_avl_rcu_link(&upd->raru_new, &rarn->rarn_node);
+
+	return &rarn->rarn_node;
+}
+
+static void rd_avl_rcu_node_free (rd_epoch_entry_t *ree) {
+	free(RD_AVL_RCU_EE2NODE(ree));
+}
+
+static void rd_avl_rcu_retire (rd_avl_node_t *ran) {
+	rd_epoch_retire_entry(&RD_AVL_RCU_NODE(ran)->rarn_ee,
+			      rd_avl_rcu_node_free);
+}
+
+
+/**
+ * Returns a private copy of 'ran', which is 'ran' itself if already
+ * private. A published original is retired when the update is
+ * published.
+ */
+static rd_avl_node_t *rd_avl_rcu_copy (rd_avl_rcu_upd_t *upd,
+				       rd_avl_node_t *ran) {
+	rd_avl_node_t *n;
+
+	if (RD_AVL_RCU_NODE(ran)->rarn_new)
+		return ran;
+
+	n = rd_avl_rcu_node_new(upd);
+	*n = *ran;
+	rd_avl_rcu_link(&upd->raru_replaced, ran);
+
+	return n;
+}
+
+static rd_avl_node_t *rd_avl_rcu_balance (rd_avl_rcu_upd_t *upd,
+					  rd_avl_node_t *ran);
+
+/**
+ * Same as rd_avl_rotate() for a private node 'ran',
+ * its child that is rotated up is copied first unless private.
+ */
+static rd_avl_node_t *rd_avl_rcu_rotate (rd_avl_rcu_upd_t *upd,
+					 rd_avl_node_t *ran,
+					 rd_avl_dir_t dir) {
+	const int odir = !dir;
+	rd_avl_node_t *n;
+
+	n = rd_avl_rcu_copy(upd, ran->ran_p[odir]);
+	ran->ran_p[odir] = n->ran_p[dir];
+	n->ran_p[dir] = rd_avl_rcu_balance(upd, ran);
+
+	return rd_avl_rcu_balance(upd, n);
+}
+
+static rd_avl_node_t *rd_avl_rcu_balance (rd_avl_rcu_upd_t *upd,
+					  rd_avl_node_t *ran) {
+	const int d = RD_AVL_NODE_DELTA(ran);
+
+	if (d < -RD_DELTA_MAX) {
+		if (RD_AVL_NODE_DELTA(ran->ran_p[RD_AVL_RIGHT]) > 0)
+			ran->ran_p[RD_AVL_RIGHT] = rd_avl_rcu_rotate(
+				upd,
+				rd_avl_rcu_copy(upd, ran->ran_p[RD_AVL_RIGHT]),
+				RD_AVL_RIGHT);
+		return rd_avl_rcu_rotate(upd, ran, RD_AVL_LEFT);
+
+	} else if (d > RD_DELTA_MAX) {
+		if (RD_AVL_NODE_DELTA(ran->ran_p[RD_AVL_LEFT]) < 0)
+			ran->ran_p[RD_AVL_LEFT] = rd_avl_rcu_rotate(
+				upd,
+				rd_avl_rcu_copy(upd, ran->ran_p[RD_AVL_LEFT]),
+				RD_AVL_LEFT);
+		return rd_avl_rcu_rotate(upd, ran, RD_AVL_RIGHT);
+	}
+
+	rd_avl_height_update(ran);
+
+	return ran;
+}
+
+
+/**
+ * Copies the path 'path' (root first) bottom up, linking in the
+ * new subtree 'child' at the bottom, and publishes the new root.
+ * The replaced nodes are retired only once they are unreachable
+ * from the published root.
+ */
+static void rd_avl_rcu_publish (rd_avl_t *ravl, rd_avl_rcu_upd_t *upd,
+				rd_avl_node_t **path,
+				const rd_avl_dir_t *dirs, int depth,
+				rd_avl_node_t *child) {
+	rd_epoch_entry_t *ree, *next;
+
+	while (depth-- > 0) {
+		rd_avl_node_t *n = rd_avl_rcu_copy(upd, path[depth]);
+		n->ran_p[dirs[depth]] = child;
+		child = rd_avl_rcu_balance(upd, n);
+	}
+
+	for (ree = upd->raru_new ; ree ; ree = ree->ree_next)
+		RD_AVL_RCU_EE2NODE(ree)->rarn_new = 0;
+
+	__atomic_store_n(&ravl->ravl_root, child, __ATOMIC_RELEASE);
+
+	for (ree = upd->raru_replaced ; ree ; ree = next) {
+		next = ree->ree_next;
+		rd_avl_rcu_retire(&RD_AVL_RCU_EE2NODE(ree)->rarn_node);
+	}
+}
+
+
+void *rd_avl_rcu_insert (rd_avl_t *ravl, void *elm) {
+	rd_avl_node_t *path[RD_AVL_HEIGHT_MAX];
+	rd_avl_dir_t dirs[RD_AVL_HEIGHT_MAX];
+	rd_avl_rcu_upd_t upd = { NULL, NULL };
+	rd_avl_node_t *ran = ravl->ravl_root;
+	rd_avl_node_t *n;
+	void *prev = NULL;
+	int depth = 0;
+	int r;
+
+	while (ran && (r = ravl->ravl_cmp(elm, ran->ran_elm))) {
+		assert(depth < RD_AVL_HEIGHT_MAX);
+		path[depth] = ran;
+		dirs[depth] = r < 0 ? RD_AVL_LEFT : RD_AVL_RIGHT;
+		ran = ran->ran_p[dirs[depth++]];
+	}
+
+	if (ran) {
+		/* Replace existing element */
+		prev = ran->ran_elm;
+		n = rd_avl_rcu_copy(&upd, ran);
+	} else {
+		n = rd_avl_rcu_node_new(&upd);
+		memset(n, 0, sizeof(*n));
+		n->ran_height = 1;
+	}
+	n->ran_elm = elm;
+
+	rd_avl_rcu_publish(ravl, &upd, path, dirs, depth, n);
+
+	return prev;
+}
+
+
+void *rd_avl_rcu_remove (rd_avl_t *ravl, const void *elm) {
+	rd_avl_node_t *path[RD_AVL_HEIGHT_MAX];
+	rd_avl_dir_t dirs[RD_AVL_HEIGHT_MAX];
+	rd_avl_rcu_upd_t upd = { NULL, NULL };
+	rd_avl_node_t *ran = ravl->ravl_root;
+	rd_avl_node_t *child;
+	void *removed;
+	int depth = 0;
 	int r;
 
-	if (!begin)
+	while (ran && (r = ravl->ravl_cmp(elm, ran->ran_elm))) {
+		path[depth] = ran;
+		dirs[depth] = r < 0 ? RD_AVL_LEFT : RD_AVL_RIGHT;
+		ran = ran->ran_p[dirs[depth++]];
+	}
+
+	if (!ran)
 		return NULL;
-	else if (!(r = ravl->ravl_cmp(elm, begin->ran_elm)))
-		return (rd_avl_node_t *)begin;
-	else if (r < 0)
-		return rd_avl_find_node(ravl, begin->ran_p[RD_AVL_LEFT], elm);
-	else /* r > 0 */
-		return rd_avl_find_node(ravl, begin->ran_p[RD_AVL_RIGHT], elm);
+
+	if (!ran->ran_p[RD_AVL_LEFT])
+		child = ran->ran_p[RD_AVL_RIGHT];
+	else if (!ran->ran_p[RD_AVL_RIGHT])
+		child = ran->ran_p[RD_AVL_LEFT];
+	else {
+		/* Replace with a copy of the in-order successor, and
+		 * a copy of the right subtree's left spine without it. */
+		rd_avl_node_t *spath[RD_AVL_HEIGHT_MAX];
+		rd_avl_node_t *succ = ran->ran_p[RD_AVL_RIGHT];
+		rd_avl_node_t *sub;
+		int sdepth = 0;
+
+		while (succ->ran_p[RD_AVL_LEFT]) {
+			spath[sdepth++] = succ;
+			succ = succ->ran_p[RD_AVL_LEFT];
+		}
+
+		sub = succ->ran_p[RD_AVL_RIGHT];
+		while (sdepth-- > 0) {
+			rd_avl_node_t *n = rd_avl_rcu_copy(&upd,
+							   spath[sdepth]);
+			n->ran_p[RD_AVL_LEFT] = sub;
+			sub = rd_avl_rcu_balance(&upd, n);
+		}
+
+		child = rd_avl_rcu_copy(&upd, succ);
+		child->ran_p[RD_AVL_LEFT]  = ran->ran_p[RD_AVL_LEFT];
+		child->ran_p[RD_AVL_RIGHT] = sub;
+		child = rd_avl_rcu_balance(&upd, child);
+	}
+
+	removed = ran->ran_elm;
+	rd_avl_rcu_link(&upd.raru_replaced, ran);
+
+	rd_avl_rcu_publish(ravl, &upd, path, dirs, depth, child);
+
+	return removed;
 }
 
 
-void rd_avl_foreach_node (rd_avl_node_t *ran,
-			  rd_avl_foreach_cb cb, void *opaque) {
-	if (ran->ran_p[RD_AVL_LEFT]) {
-		rd_avl_foreach_node(ran->ran_p[RD_AVL_LEFT], cb, opaque);
+/**
+ * Builds a perfectly balanced tree from the sorted 'elms'
+ * ['lo', 'hi'). Recursion depth is bounded by the tree height.
+ */
+static rd_avl_node_t *rd_avl_build0 (rd_avl_t *ravl, void **elms,
+				     size_t lo, size_t hi,
+				     size_t node_offset) {
+	size_t mid;
+	rd_avl_node_t *ran;
+
+	if (lo == hi)
+		return NULL;
+
+	mid = lo + (hi - lo) / 2;
+
+	if (ravl->ravl_flags & RD_AVL_F_RCU)
+		ran = rd_avl_rcu_node_new(NULL);
+	else
+		ran = (rd_avl_node_t *)((char *)elms[mid] + node_offset);
+
+	ran->ran_elm = elms[mid];
+	ran->ran_p[RD_AVL_LEFT] = rd_avl_build0(ravl, elms, lo, mid,
+						node_offset);
+	ran->ran_p[RD_AVL_RIGHT] = rd_avl_build0(ravl, elms, mid + 1, hi,
+						 node_offset);
+	rd_avl_height_update(ran);
+
+	return ran;
+}
+
+int rd_avl_build (rd_avl_t *ravl, void **elms, size_t cnt,
+		  size_t node_offset) {
+	rd_avl_node_t *root;
+	size_t i;
+
+	for (i = 1 ; i < cnt ; i++) {
+		if (ravl->ravl_cmp(elms[i-1], elms[i]) >= 0) {
+			errno = EINVAL;
+			return -1;
+		}
 	}
 
-	if (ran->ran_p[RD_AVL_RIGHT]) {
-		rd_avl_foreach_node(ran->ran_p[RD_AVL_RIGHT], cb, opaque);
+	rd_avl_wrlock(ravl);
+
+	if (ravl->ravl_root) {
+		rd_avl_unlock(ravl);
+		errno = EEXIST;
+		return -1;
 	}
 
-	cb(RD_AVL_ELM_GET_NL(ran), opaque);
+	root = rd_avl_build0(ravl, elms, 0, cnt, node_offset);
+	__atomic_store_n(&ravl->ravl_root, root, __ATOMIC_RELEASE);
+
+	rd_avl_unlock(ravl);
+
+	return 0;
+}
+
+
+static void rd_avl_rcu_retire_node (void *ran) {
+	rd_avl_rcu_retire(ran);
 }
 
+void rd_avl_clear (rd_avl_t *ravl, rd_avl_foreach_cb cb, void *opaque) {
+	rd_avl_node_t *root;
 
+	rd_avl_wrlock(ravl);
 
-void rd_avl_destroy (rd_avl_t *ravl) {
-	if (ravl->ravl_flags & RD_AVL_F_LOCKS)
+	root = ravl->ravl_root;
+	__atomic_store_n(&ravl->ravl_root, NULL, __ATOMIC_RELEASE);
+
+	/* RCU readers may still be traversing the old nodes. */
+	rd_avl_postorder(root, cb, opaque,
+			 ravl->ravl_flags & RD_AVL_F_RCU ?
+			 rd_avl_rcu_retire_node : NULL);
+
+	rd_avl_unlock(ravl);
+}
+
+
+
+void rd_avl_destroy_cb (rd_avl_t *ravl, rd_avl_foreach_cb cb,
+			void *opaque) {
+	/* Tree-allocated RCU nodes are freed along with the elements. */
+	rd_avl_postorder(ravl->ravl_root, cb, opaque,
+			 ravl->ravl_flags & RD_AVL_F_RCU ? free : NULL);
+
+	if (ravl->ravl_flags & (RD_AVL_F_LOCKS|RD_AVL_F_RCU))
 		rd_rwlock_destroy(&ravl->ravl_rwlock);
 
 	if (ravl->ravl_flags & RD_AVL_F_OWNER)
 		free(ravl);
 }
 
+void rd_avl_destroy (rd_avl_t *ravl) {
+	rd_avl_destroy_cb(ravl, NULL, NULL);
+}
+
 rd_avl_t *rd_avl_init (rd_avl_t *ravl, rd_avl_cmp_t cmp, int flags) {
 
 	if (!ravl) {
@@ -222,7 +761,7 @@ rd_avl_t *rd_avl_init (rd_avl_t *ravl, rd_avl_cmp_t cmp, int flags) {
 	ravl->ravl_flags = flags;
 	ravl->ravl_cmp = cmp;
 
-	if (flags & RD_AVL_F_LOCKS)
+	if (flags & (RD_AVL_F_LOCKS|RD_AVL_F_RCU))
 		rd_rwlock_init(&ravl->ravl_rwlock);
 
 	return ravl;
@@ -35,6 +35,7 @@
 #pragma once
 
 #include "rdthread.h"
+#include "rdepoch.h"
 
 typedef enum {
 	RD_AVL_LEFT,
@@ -58,11 +59,23 @@ typedef struct rd_avl_node_s {
 
 
 
+/**
+ * Max tree height: an AVL tree of this height holds more than 2^40
+ * nodes. Bounds the explicit path stacks used instead of recursion.
+ */
+#define RD_AVL_HEIGHT_MAX  64
+
+
 /**
  * Per-AVL application-provided element comparator.
  */
 typedef int (*rd_avl_cmp_t) (const void *, const void *);
 
+/**
+ * Element callback for foreach, range scans and clearing.
+ */
+typedef void (*rd_avl_foreach_cb)(void *node, void *opaque);
+
 
 /**
  * AVL tree
@@ -73,10 +86,33 @@ typedef struct rd_avl_s {
 	int            ravl_flags;  /* Flags */
 #define RD_AVL_F_LOCKS      0x1     /* Enable thread-safeness */
 #define RD_AVL_F_OWNER      0x2     /* internal: rd_avl_init() allocated ravl */
-	rd_rwlock_t    ravl_rwlock; /* Mutex when .._F_LOCKS is set. */
+#define RD_AVL_F_RCU        0x4     /* Lock-free readers, see below. */
+	rd_rwlock_t    ravl_rwlock; /* Mutex when .._F_LOCKS is set,
+				     * writer mutex when .._F_RCU is set. */
 } rd_avl_t;
 
 
+/**
+ * RCU mode (RD_AVL_F_RCU).
+ *
+ * Readers do not lock: rd_avl_rdlock() enters an epoch read-side section
+ * (see rdepoch.h) which writes nothing but the calling thread's own
+ * record, and the tree is traversed without atomic operations.
+ * Writers serialize on the write lock and never modify a node that is
+ * reachable by readers: every node on the modified path is copied,
+ * the new root is published atomically and the replaced nodes are
+ * retired for epoch-based reclamation.
+ * A reader thus always sees a consistent snapshot of the tree.
+ *
+ * Since nodes are copied they are allocated by the tree itself: the
+ * rd_avl_node_t passed to RD_AVL_INSERT() is not used, and
+ * RD_AVL_ELM_SET_NL() must not be used.
+ * Read sections must be ended with rd_avl_rdunlock().
+ * Writes cost O(log n) node allocations, so this mode is meant for
+ * read-mostly trees.
+ */
+
+
 
 
 /**
@@ -117,7 +153,7 @@ typedef struct rd_avl_s {
  * NOTE: rd_avl_wrlock() must be held.
  */
 #define RD_AVL_FIND_NL(ravl,elm)		\
-	rd_avl_find_node(ravl, (ravl)->ravl_root, elm, 0)
+	rd_avl_find(ravl, elm, 0)
 
 
 /**
@@ -126,7 +162,7 @@ typedef struct rd_avl_s {
  * NOTE: rd_avl_wrlock() must be held.
  */
 #define RD_AVL_FIND_NODE_NL(ravl,elm)		\
-	rd_avl_find(ravl, elm, 0)
+	rd_avl_find_node(ravl, rd_avl_root(ravl), elm)
 
 
 /**
@@ -161,11 +197,109 @@ typedef struct rd_avl_s {
 #define RD_AVL_FOREACH_NL(ran, callback, opaque) \
 	rd_avl_foreach(ravl, callback, opaque, 0)
 
+/**
+ * Builds the tree in O(n) from the 'cnt' element pointers in 'elms',
+ * which must be sorted in ascending order without duplicates, instead
+ * of performing 'cnt' rebalancing inserts.
+ * 'type' and 'field' identify the elements' rd_avl_node_t field.
+ * The tree must be empty.
+ *
+ * Returns 0 on success or -1 on failure with errno set to
+ * EINVAL if 'elms' is not strictly ascending, or
+ * EEXIST if the tree is not empty.
+ */
+#define RD_AVL_BUILD(ravl,elms,cnt,type,field)			\
+	rd_avl_build(ravl, (void **)(elms), cnt, RD_OFFSETOF(type,field))
+
+/**
+ * Removes all elements from the tree in O(n) without rebalancing,
+ * calling 'callback' (if not NULL) for each element in post-order.
+ * The callback may free the element.
+ *
+ * NOTE: For RCU trees readers may still reference the elements,
+ *       the callback should pass them to rd_epoch_retire().
+ */
+#define RD_AVL_CLEAR(ravl,callback,opaque)	\
+	rd_avl_clear(ravl, callback, opaque)
+
+/**
+ * Returns the smallest / largest element, or NULL if the tree is empty.
+ */
+#define RD_AVL_FIRST(ravl)  rd_avl_edge(ravl, RD_AVL_LEFT, 1)
+#define RD_AVL_LAST(ravl)   rd_avl_edge(ravl, RD_AVL_RIGHT, 1)
+
+/**
+ * Returns the first element not less than (LOWER_BOUND) or
+ * greater than (UPPER_BOUND) 'elm', or NULL if there is none.
+ * UPPER_BOUND thus returns the in-order successor of 'elm'.
+ */
+#define RD_AVL_LOWER_BOUND(ravl,elm)  rd_avl_bound(ravl, elm, 0, 1)
+#define RD_AVL_UPPER_BOUND(ravl,elm)  rd_avl_bound(ravl, elm, 1, 1)
+
+/**
+ * Calls 'callback' in order for each element in the inclusive range
+ * ['lo', 'hi'], a NULL 'lo' or 'hi' leaves that end of the range open.
+ * Returns the number of elements visited.
+ *
+ * NOTE: can't insert / delete from the callback.
+ */
+#define RD_AVL_RANGE(ravl,lo,hi,callback,opaque)	\
+	rd_avl_range(ravl, lo, hi, callback, opaque, 1)
+#define RD_AVL_RANGE_NL(ravl,lo,hi,callback,opaque)	\
+	rd_avl_range(ravl, lo, hi, callback, opaque, 0)
+
+
+/**
+ * In-order iterator.
+ *
+ * Usage:
+ *   rd_avl_iter_t it;
+ *
+ *   rd_avl_rdlock(ravl);
+ *   rd_avl_iter_init(&it, ravl, RD_AVL_LEFT);  // RD_AVL_RIGHT: descending
+ *   while ((elm = rd_avl_iter_next(&it)))
+ *      ...
+ *   rd_avl_rdunlock(ravl);
+ *
+ * NOTE: rd_avl_*lock() must be held while iterating and the tree
+ *       must not be modified.
+ */
+typedef struct rd_avl_iter_s {
+	rd_avl_dir_t    rai_dir;     /* RD_AVL_LEFT: ascending */
+	int             rai_depth;
+	rd_avl_node_t  *rai_stack[RD_AVL_HEIGHT_MAX];
+} rd_avl_iter_t;
+
+/**
+ * Positions the iterator before the first element in direction 'dir'.
+ */
+void rd_avl_iter_init (rd_avl_iter_t *rai, rd_avl_t *ravl, rd_avl_dir_t dir);
+
+/**
+ * Positions the (ascending) iterator before the first element not less
+ * than ('upper' = 0) or greater than ('upper' = 1) 'elm'.
+ */
+void rd_avl_iter_seek (rd_avl_iter_t *rai, rd_avl_t *ravl,
+		       const void *elm, int upper);
+
+/**
+ * Returns the next element, or NULL when the iteration is done.
+ */
+void *rd_avl_iter_next (rd_avl_iter_t *rai);
+
+
 /**
  * Destroy previously initialized (by rd_avl_init()) AVL tree.
  */
 void      rd_avl_destroy (rd_avl_t *ravl);
 
+/**
+ * Same as rd_avl_destroy() but first calls 'cb' (if not NULL) for each
+ * element in post-order, e.g., to free them.
+ */
+void      rd_avl_destroy_cb (rd_avl_t *ravl, rd_avl_foreach_cb cb,
+			     void *opaque);
+
 /**
  * Initialize (and optionally allocate if 'ravl' is NULL) AVL tree.
  * 'cmp' is the comparison function that takes two const pointers
@@ -187,22 +321,48 @@ rd_avl_t *rd_avl_init (rd_avl_t *ravl, rd_avl_cmp_t cmp, int flags);
  */
 static void rd_avl_rdlock (rd_avl_t *ravl) RD_UNUSED;
 static void rd_avl_rdlock (rd_avl_t *ravl) {
-	if (ravl->ravl_flags & RD_AVL_F_LOCKS)
+	if (ravl->ravl_flags & RD_AVL_F_RCU)
+		rd_epoch_enter();
+	else if (ravl->ravl_flags & RD_AVL_F_LOCKS)
 		rd_rwlock_rdlock(&ravl->ravl_rwlock);
 }
 
 static void rd_avl_wrlock (rd_avl_t *ravl) RD_UNUSED;
 static void rd_avl_wrlock (rd_avl_t *ravl) {
-	if (ravl->ravl_flags & RD_AVL_F_LOCKS)
+	if (ravl->ravl_flags & (RD_AVL_F_LOCKS|RD_AVL_F_RCU))
 		rd_rwlock_wrlock(&ravl->ravl_rwlock);
 }
 
+/**
+ * Releases the write lock, or the read lock for non-RCU trees.
+ */
 static void rd_avl_unlock (rd_avl_t *ravl) RD_UNUSED;
 static void rd_avl_unlock (rd_avl_t *ravl) {
-	if (ravl->ravl_flags & RD_AVL_F_LOCKS)
+	if (ravl->ravl_flags & (RD_AVL_F_LOCKS|RD_AVL_F_RCU))
 		rd_rwlock_unlock(&ravl->ravl_rwlock);
 }
 
+/**
+ * Releases the read lock taken by rd_avl_rdlock().
+ */
+static void rd_avl_rdunlock (rd_avl_t *ravl) RD_UNUSED;
+static void rd_avl_rdunlock (rd_avl_t *ravl) {
+	if (ravl->ravl_flags & RD_AVL_F_RCU)
+		rd_epoch_exit();
+	else if (ravl->ravl_flags & RD_AVL_F_LOCKS)
+		rd_rwlock_unlock(&ravl->ravl_rwlock);
+}
+
+
+/**
+ * Returns the current root node.
+ * NOTE: rd_avl_*lock() must be held.
+ */
+static inline rd_avl_node_t *rd_avl_root (const rd_avl_t *ravl) RD_UNUSED;
+static inline rd_avl_node_t *rd_avl_root (const rd_avl_t *ravl) {
+	return __atomic_load_n(&ravl->ravl_root, __ATOMIC_ACQUIRE);
+}
+
 
 
 
@@ -215,11 +375,22 @@ rd_avl_node_t *rd_avl_insert_node (rd_avl_t *ravl,
 				   rd_avl_node_t *ran,
 				   rd_avl_node_t **existing);
 
+void *rd_avl_rcu_insert (rd_avl_t *ravl, void *elm);
+void *rd_avl_rcu_remove (rd_avl_t *ravl, const void *elm);
+
 static void *rd_avl_insert (rd_avl_t *ravl, void *elm,
 			    rd_avl_node_t *ran) RD_UNUSED;
 static void *rd_avl_insert (rd_avl_t *ravl, void *elm,
 			    rd_avl_node_t *ran) {
 	rd_avl_node_t *existing = NULL;
+	void *prev;
+
+	if (ravl->ravl_flags & RD_AVL_F_RCU) {
+		rd_avl_wrlock(ravl);
+		prev = rd_avl_rcu_insert(ravl, elm);
+		rd_avl_unlock(ravl);
+		return prev;
+	}
 
 	memset(ran, 0, sizeof(*ran));
 	ran->ran_elm = elm;
@@ -239,7 +410,11 @@ static inline void rd_avl_remove_elm (rd_avl_t *ravl,
 				      const void *elm) RD_UNUSED;
 static inline void rd_avl_remove_elm (rd_avl_t *ravl, const void *elm) {
 	rd_avl_wrlock(ravl);
-	ravl->ravl_root = rd_avl_remove_elm0(ravl, ravl->ravl_root, elm);
+	if (ravl->ravl_flags & RD_AVL_F_RCU)
+		(void)rd_avl_rcu_remove(ravl, elm);
+	else
+		ravl->ravl_root = rd_avl_remove_elm0(ravl, ravl->ravl_root,
+						     elm);
 	rd_avl_unlock(ravl);
 }
 
@@ -259,20 +434,27 @@ static inline void *rd_avl_find (rd_avl_t *ravl, const void *elm,
 	if (dolock)
 		rd_avl_rdlock(ravl);
 
-	ran = rd_avl_find_node(ravl, ravl->ravl_root, elm);
+	ran = rd_avl_find_node(ravl, rd_avl_root(ravl), elm);
 	ret = ran ? ran->ran_elm : NULL;
 
 	if (dolock)
-		rd_avl_unlock(ravl);
+		rd_avl_rdunlock(ravl);
 
 	return ret;
 }
 
-typedef void (*rd_avl_foreach_cb)(void *node, void *opaque);
+void *rd_avl_edge (rd_avl_t *ravl, rd_avl_dir_t dir, int dolock);
+void *rd_avl_bound (rd_avl_t *ravl, const void *elm, int upper, int dolock);
+int   rd_avl_range (rd_avl_t *ravl, const void *lo, const void *hi,
+		    rd_avl_foreach_cb cb, void *opaque, int dolock);
 
 void rd_avl_foreach_node (rd_avl_node_t *ran,
 	rd_avl_foreach_cb cb, void *opaque);
 
+int  rd_avl_build (rd_avl_t *ravl, void **elms, size_t cnt,
+		   size_t node_offset);
+void rd_avl_clear (rd_avl_t *ravl, rd_avl_foreach_cb cb, void *opaque);
+
 static inline void rd_avl_foreach (rd_avl_t *ravl, rd_avl_foreach_cb cb,
 		void *opaque, int dolock) RD_UNUSED;
 static inline void rd_avl_foreach (rd_avl_t *ravl, rd_avl_foreach_cb cb,
@@ -280,8 +462,8 @@ static inline void rd_avl_foreach (rd_avl_t *ravl, rd_avl_foreach_cb cb,
 	if (dolock)
 		rd_avl_rdlock(ravl);
 
-	rd_avl_foreach_node(ravl->ravl_root, cb, opaque);
+	rd_avl_foreach_node(rd_avl_root(ravl), cb, opaque);
 
 	if (dolock)
-		rd_avl_unlock(ravl);
+		rd_avl_rdunlock(ravl);
 }
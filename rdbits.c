@@ -117,3 +117,97 @@ uint64_t rd_bitvec_fxs (const rd_bitvec_t *rbv, rd_bitvec_op_t op) {
 
 	return (uint64_t)bit + (uint64_t)(bucket * (8 * sizeof(*rbv->rbv_b)));
 }
+
+
+
+/**
+ * Count-min sketch
+ */
+
+static const uint64_t rd_cmsketch_seeds[RD_CMSKETCH_DEPTH] = {
+	0xc3a5c85c97cb3127LLU, 0xb492b66fbe98f273LLU,
+	0x9ae16a3b2f90404fLLU, 0xcbf29ce484222325LLU
+};
+
+/**
+ * Returns the counter index for 'hash' in row 'row'.
+ */
+static inline uint32_t rd_cmsketch_index (const rd_cmsketch_t *rcms,
+					  uint32_t hash, int row) {
+	uint64_t h = (hash + rd_cmsketch_seeds[row]) * rd_cmsketch_seeds[row];
+	h += h >> 32;
+	return ((uint32_t)h & (rcms->rcms_width - 1)) +
+		(row * rcms->rcms_width);
+}
+
+#define RD_CMSKETCH_GET(table,i)					\
+	((int)(((table)[(i) >> 4] >> (((i) & 15) * 4)) & 0xf))
+
+
+void rd_cmsketch_init (rd_cmsketch_t *rcms, uint32_t cnt) {
+
+	memset(rcms, 0, sizeof(*rcms));
+
+	/* Two counters per element and row keeps the average counter
+	 * well below saturation at aging time.
+	 * At least one word per row. */
+	rcms->rcms_width = 16;
+	while (rcms->rcms_width < cnt * 2)
+		rcms->rcms_width <<= 1;
+
+	rcms->rcms_sample = RD_MAX(cnt, 1) * 10;
+	rcms->rcms_table = calloc((rcms->rcms_width / 16) * RD_CMSKETCH_DEPTH,
+				  sizeof(*rcms->rcms_table));
+}
+
+void rd_cmsketch_destroy (rd_cmsketch_t *rcms) {
+	free(rcms->rcms_table);
+}
+
+
+/**
+ * Halves all counters.
+ */
+static void rd_cmsketch_age (rd_cmsketch_t *rcms) {
+	uint32_t words = (rcms->rcms_width / 16) * RD_CMSKETCH_DEPTH;
+	uint32_t i;
+
+	for (i = 0 ; i < words ; i++)
+		rcms->rcms_table[i] = (rcms->rcms_table[i] >> 1) &
+			0x7777777777777777LLU;
+
+	rcms->rcms_additions /= 2;
+}
+
+
+void rd_cmsketch_add (rd_cmsketch_t *rcms, uint32_t hash) {
+	int row;
+	int added = 0;
+
+	for (row = 0 ; row < RD_CMSKETCH_DEPTH ; row++) {
+		uint32_t i = rd_cmsketch_index(rcms, hash, row);
+
+		if (RD_CMSKETCH_GET(rcms->rcms_table, i) < 15) {
+			rcms->rcms_table[i >> 4] += 1LLU << ((i & 15) * 4);
+			added = 1;
+		}
+	}
+
+	if (added && ++rcms->rcms_additions >= rcms->rcms_sample)
+		rd_cmsketch_age(rcms);
+}
+
+
+int rd_cmsketch_estimate (const rd_cmsketch_t *rcms, uint32_t hash) {
+	int row;
+	int min = 15;
+
+	for (row = 0 ; row < RD_CMSKETCH_DEPTH ; row++) {
+		int v = RD_CMSKETCH_GET(rcms->rcms_table,
+					rd_cmsketch_index(rcms, hash, row));
+		if (v < min)
+			min = v;
+	}
+
+	return min;
+}
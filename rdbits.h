@@ -77,3 +77,40 @@ int rd_bitvec_op (rd_bitvec_t *rbv, uint64_t i, rd_bitvec_op_t op);
 uint64_t rd_bitvec_fxs (const rd_bitvec_t *rbv, rd_bitvec_op_t op);
 #define rd_bitvec_ffs(rbv)     rd_bitvec_fxs(rbv,RD_BITVEC_OP_FFS)
 #define rd_bitvec_fls(rbv)     rd_bitvec_fxs(rbv,RD_BITVEC_OP_FLS)
+
+
+
+/**
+ * Count-min frequency sketch.
+ *
+ * Estimates how often a hash has been seen using 4 rows of saturating
+ * 4-bit counters (max 15), packed 16 to a 64-bit word.
+ * When the number of additions reaches the sample size (10 times the
+ * number of tracked elements) all counters are halved, so old
+ * popularity ages out.
+ */
+typedef struct rd_cmsketch_s {
+	uint64_t *rcms_table;       /* RD_CMSKETCH_DEPTH rows of counters */
+	uint32_t  rcms_width;       /* Counters per row (power of 2) */
+	uint32_t  rcms_additions;   /* Additions since last aging */
+	uint32_t  rcms_sample;      /* Aging period */
+} rd_cmsketch_t;
+
+#define RD_CMSKETCH_DEPTH  4
+
+/**
+ * Initializes a sketch for tracking the frequencies of about 'cnt'
+ * distinct elements, typically a cache's capacity.
+ */
+void rd_cmsketch_init (rd_cmsketch_t *rcms, uint32_t cnt);
+void rd_cmsketch_destroy (rd_cmsketch_t *rcms);
+
+/**
+ * Records one occurrence of 'hash'.
+ */
+void rd_cmsketch_add (rd_cmsketch_t *rcms, uint32_t hash);
+
+/**
+ * Returns the estimated frequency (0..15) of 'hash'.
+ */
+int rd_cmsketch_estimate (const rd_cmsketch_t *rcms, uint32_t hash);
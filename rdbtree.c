@@ -0,0 +1,584 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdbtree.h"
+
+/*
+ * B-tree (CLRS style: elements live in both inner nodes and leaves).
+ * Insertion splits full nodes and removal refills minimal nodes on the
+ * way down so that both operations are single-pass and iterative.
+ */
+
+
+/**
+ * Search key: integer key or element skeleton depending on tree type.
+ */
+typedef struct rd_btree_key_s {
+	int64_t     ikey;
+	const void *elm;
+} rd_btree_key_t;
+
+
+static rd_btree_node_t *rd_btree_node_new (int leaf, int intkey) {
+	rd_btree_node_t *node;
+	size_t size = sizeof(*node);
+
+	if (intkey)
+		size += RD_BTREE_KEYS_MAX * sizeof(int64_t);
+	if (!leaf)
+		size += (RD_BTREE_KEYS_MAX + 1) * sizeof(rd_btree_node_t *);
+
+	node = malloc(size);
+	node->rbtn_cnt = 0;
+	node->rbtn_leaf = leaf;
+	node->rbtn_intkey = intkey;
+	return node;
+}
+
+
+/**
+ * Compares 'key' to the node's i'th element.
+ */
+static inline int rd_btree_key_cmp (const rd_btree_t *rbt,
+				    const rd_btree_key_t *key,
+				    const rd_btree_node_t *node, int i) {
+	if (rbt->rbt_flags & RD_BTREE_F_INTKEY)
+		return (key->ikey > RD_BTREE_IKEYS(node)[i]) -
+			(key->ikey < RD_BTREE_IKEYS(node)[i]);
+	return rbt->rbt_cmp(key->elm, node->rbtn_elms[i]);
+}
+
+
+/**
+ * Returns the index of the first element not less than ('upper' = 0)
+ * or greater than ('upper' = 1) 'key' in 'node'.
+ * '*foundp' is set if the element at the returned index equals 'key'.
+ */
+static inline int rd_btree_node_search (const rd_btree_t *rbt,
+					const rd_btree_node_t *node,
+					const rd_btree_key_t *key,
+					int upper, int *foundp) {
+	int lo = 0, hi = node->rbtn_cnt;
+
+	*foundp = 0;
+
+	if (rbt->rbt_flags & RD_BTREE_F_INTKEY) {
+		/* Specialized integer search: no calls, no derefs. */
+		const int64_t *ikeys = RD_BTREE_IKEYS(node);
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (ikeys[mid] < key->ikey ||
+			    (upper && ikeys[mid] == key->ikey))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (!upper && lo < node->rbtn_cnt && ikeys[lo] == key->ikey)
+			*foundp = 1;
+		return lo;
+	}
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		int r = rbt->rbt_cmp(key->elm, node->rbtn_elms[mid]);
+		if (r == 0 && !upper) {
+			*foundp = 1;
+			return mid;
+		}
+		if (r >= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/**
+ * Moves 'cnt' elements (and keys) from 'src'[si] to 'dst'[di].
+ */
+static inline void rd_btree_elms_move (rd_btree_node_t *dst, int di,
+				       rd_btree_node_t *src, int si, int cnt) {
+	memmove(&dst->rbtn_elms[di], &src->rbtn_elms[si],
+		cnt * sizeof(*dst->rbtn_elms));
+	if (dst->rbtn_intkey)
+		memmove(&RD_BTREE_IKEYS(dst)[di], &RD_BTREE_IKEYS(src)[si],
+			cnt * sizeof(int64_t));
+}
+
+static inline void rd_btree_child_move (rd_btree_node_t *dst, int di,
+					rd_btree_node_t *src, int si, int cnt) {
+	memmove(&RD_BTREE_CHILD(dst)[di], &RD_BTREE_CHILD(src)[si],
+		cnt * sizeof(*RD_BTREE_CHILD(dst)));
+}
+
+static inline void rd_btree_elm_set (rd_btree_node_t *dst, int di,
+				     const rd_btree_node_t *src, int si) {
+	dst->rbtn_elms[di] = src->rbtn_elms[si];
+	if (dst->rbtn_intkey)
+		RD_BTREE_IKEYS(dst)[di] = RD_BTREE_IKEYS(src)[si];
+}
+
+
+/**
+ * Splits the full child 'i' of 'node' in two, moving the median
+ * element up into 'node' (which must not be full).
+ */
+static void rd_btree_split_child (rd_btree_node_t *node, int i) {
+	rd_btree_node_t *y = RD_BTREE_CHILD(node)[i];
+	rd_btree_node_t *z = rd_btree_node_new(y->rbtn_leaf, y->rbtn_intkey);
+
+	z->rbtn_cnt = RD_BTREE_T - 1;
+	rd_btree_elms_move(z, 0, y, RD_BTREE_T, RD_BTREE_T - 1);
+	if (!y->rbtn_leaf)
+		rd_btree_child_move(z, 0, y, RD_BTREE_T, RD_BTREE_T);
+	y->rbtn_cnt = RD_BTREE_T - 1;
+
+	rd_btree_child_move(node, i + 2, node, i + 1, node->rbtn_cnt - i);
+	RD_BTREE_CHILD(node)[i + 1] = z;
+	rd_btree_elms_move(node, i + 1, node, i, node->rbtn_cnt - i);
+	rd_btree_elm_set(node, i, y, RD_BTREE_T - 1);
+	node->rbtn_cnt++;
+}
+
+
+/**
+ * Merges child 'i+1' and element 'i' of 'node' into child 'i'.
+ * Both children must have the minimum number of elements.
+ */
+static void rd_btree_merge_children (rd_btree_node_t *node, int i) {
+	rd_btree_node_t *y = RD_BTREE_CHILD(node)[i];
+	rd_btree_node_t *z = RD_BTREE_CHILD(node)[i + 1];
+
+	rd_btree_elm_set(y, y->rbtn_cnt, node, i);
+	rd_btree_elms_move(y, y->rbtn_cnt + 1, z, 0, z->rbtn_cnt);
+	if (!y->rbtn_leaf)
+		rd_btree_child_move(y, y->rbtn_cnt + 1, z, 0, z->rbtn_cnt + 1);
+	y->rbtn_cnt += z->rbtn_cnt + 1;
+
+	rd_btree_elms_move(node, i, node, i + 1, node->rbtn_cnt - i - 1);
+	rd_btree_child_move(node, i + 1, node, i + 2, node->rbtn_cnt - i - 1);
+	node->rbtn_cnt--;
+
+	free(z);
+}
+
+
+/**
+ * Makes sure child 'i' of 'node' has more than the minimum number of
+ * elements by borrowing from a sibling or merging with it.
+ * Returns the child to descend into.
+ */
+static rd_btree_node_t *rd_btree_fill_child (rd_btree_node_t *node, int i) {
+	rd_btree_node_t *c = RD_BTREE_CHILD(node)[i];
+	rd_btree_node_t *s;
+
+	if (c->rbtn_cnt >= RD_BTREE_T)
+		return c;
+
+	if (i > 0 && (s = RD_BTREE_CHILD(node)[i - 1])->rbtn_cnt >= RD_BTREE_T) {
+		/* Rotate right from left sibling. */
+		rd_btree_elms_move(c, 1, c, 0, c->rbtn_cnt);
+		rd_btree_elm_set(c, 0, node, i - 1);
+		if (!c->rbtn_leaf) {
+			rd_btree_child_move(c, 1, c, 0, c->rbtn_cnt + 1);
+			RD_BTREE_CHILD(c)[0] = RD_BTREE_CHILD(s)[s->rbtn_cnt];
+		}
+		rd_btree_elm_set(node, i - 1, s, s->rbtn_cnt - 1);
+		s->rbtn_cnt--;
+		c->rbtn_cnt++;
+		return c;
+	}
+
+	if (i < node->rbtn_cnt &&
+	    (s = RD_BTREE_CHILD(node)[i + 1])->rbtn_cnt >= RD_BTREE_T) {
+		/* Rotate left from right sibling. */
+		rd_btree_elm_set(c, c->rbtn_cnt, node, i);
+		if (!c->rbtn_leaf) {
+			RD_BTREE_CHILD(c)[c->rbtn_cnt + 1] = RD_BTREE_CHILD(s)[0];
+			rd_btree_child_move(s, 0, s, 1, s->rbtn_cnt);
+		}
+		rd_btree_elm_set(node, i, s, 0);
+		rd_btree_elms_move(s, 0, s, 1, s->rbtn_cnt - 1);
+		s->rbtn_cnt--;
+		c->rbtn_cnt++;
+		return c;
+	}
+
+	if (i < node->rbtn_cnt) {
+		rd_btree_merge_children(node, i);
+		return c;
+	}
+
+	rd_btree_merge_children(node, i - 1);
+	return RD_BTREE_CHILD(node)[i - 1];
+}
+
+
+static void *rd_btree_insert0 (rd_btree_t *rbt, const rd_btree_key_t *key,
+			       void *elm) {
+	const int intkey = !!(rbt->rbt_flags & RD_BTREE_F_INTKEY);
+	rd_btree_node_t *node;
+	void *old = NULL;
+
+	rd_btree_wrlock(rbt);
+
+	if (!rbt->rbt_root)
+		rbt->rbt_root = rd_btree_node_new(1, intkey);
+	else if (rbt->rbt_root->rbtn_cnt == RD_BTREE_KEYS_MAX) {
+		node = rd_btree_node_new(0, intkey);
+		RD_BTREE_CHILD(node)[0] = rbt->rbt_root;
+		rd_btree_split_child(node, 0);
+		rbt->rbt_root = node;
+	}
+
+	node = rbt->rbt_root;
+	while (1) {
+		int found;
+		int i = rd_btree_node_search(rbt, node, key, 0, &found);
+
+		if (found) {
+			old = node->rbtn_elms[i];
+			node->rbtn_elms[i] = elm;
+			break;
+		}
+
+		if (node->rbtn_leaf) {
+			rd_btree_elms_move(node, i + 1, node, i,
+					   node->rbtn_cnt - i);
+			node->rbtn_elms[i] = elm;
+			if (intkey)
+				RD_BTREE_IKEYS(node)[i] = key->ikey;
+			node->rbtn_cnt++;
+			rbt->rbt_cnt++;
+			break;
+		}
+
+		if (RD_BTREE_CHILD(node)[i]->rbtn_cnt == RD_BTREE_KEYS_MAX) {
+			int r;
+			rd_btree_split_child(node, i);
+			if ((r = rd_btree_key_cmp(rbt, key, node, i)) == 0) {
+				old = node->rbtn_elms[i];
+				node->rbtn_elms[i] = elm;
+				break;
+			} else if (r > 0)
+				i++;
+		}
+
+		node = RD_BTREE_CHILD(node)[i];
+	}
+
+	rd_btree_unlock(rbt);
+
+	return old;
+}
+
+
+static void *rd_btree_remove0 (rd_btree_t *rbt, const rd_btree_key_t *key0) {
+	rd_btree_key_t key = *key0;
+	rd_btree_node_t *node;
+	void *removed = NULL;
+
+	rd_btree_wrlock(rbt);
+
+	node = rbt->rbt_root;
+	while (node) {
+		int found;
+		int i = rd_btree_node_search(rbt, node, &key, 0, &found);
+
+		if (!found) {
+			if (node->rbtn_leaf)
+				break;
+			node = rd_btree_fill_child(node, i);
+			continue;
+		}
+
+		if (!removed)
+			removed = node->rbtn_elms[i];
+
+		if (node->rbtn_leaf) {
+			rd_btree_elms_move(node, i, node, i + 1,
+					   node->rbtn_cnt - i - 1);
+			node->rbtn_cnt--;
+			rbt->rbt_cnt--;
+			break;
+		}
+
+		if (RD_BTREE_CHILD(node)[i]->rbtn_cnt >= RD_BTREE_T) {
+			/* Replace with predecessor, then remove that. */
+			rd_btree_node_t *p = RD_BTREE_CHILD(node)[i];
+			while (!p->rbtn_leaf)
+				p = RD_BTREE_CHILD(p)[p->rbtn_cnt];
+			rd_btree_elm_set(node, i, p, p->rbtn_cnt - 1);
+			key.elm = node->rbtn_elms[i];
+			if (node->rbtn_intkey)
+				key.ikey = RD_BTREE_IKEYS(node)[i];
+			node = RD_BTREE_CHILD(node)[i];
+
+		} else if (RD_BTREE_CHILD(node)[i+1]->rbtn_cnt >= RD_BTREE_T) {
+			/* Replace with successor, then remove that. */
+			rd_btree_node_t *s = RD_BTREE_CHILD(node)[i + 1];
+			while (!s->rbtn_leaf)
+				s = RD_BTREE_CHILD(s)[0];
+			rd_btree_elm_set(node, i, s, 0);
+			key.elm = node->rbtn_elms[i];
+			if (node->rbtn_intkey)
+				key.ikey = RD_BTREE_IKEYS(node)[i];
+			node = RD_BTREE_CHILD(node)[i + 1];
+
+		} else {
+			/* Both children minimal: merge and remove from it. */
+			rd_btree_node_t *c = RD_BTREE_CHILD(node)[i];
+			rd_btree_merge_children(node, i);
+			node = c;
+		}
+	}
+
+	/* Shrink the tree if the root was emptied. */
+	if ((node = rbt->rbt_root) && node->rbtn_cnt == 0) {
+		rbt->rbt_root = node->rbtn_leaf ? NULL : RD_BTREE_CHILD(node)[0];
+		free(node);
+	}
+
+	rd_btree_unlock(rbt);
+
+	return removed;
+}
+
+
+static void *rd_btree_find0 (rd_btree_t *rbt, const rd_btree_key_t *key) {
+	const rd_btree_node_t *node;
+	void *elm = NULL;
+
+	rd_btree_rdlock(rbt);
+
+	node = rbt->rbt_root;
+	while (node) {
+		int found;
+		int i = rd_btree_node_search(rbt, node, key, 0, &found);
+
+		if (found) {
+			elm = node->rbtn_elms[i];
+			break;
+		}
+
+		if (node->rbtn_leaf)
+			break;
+
+		node = RD_BTREE_CHILD(node)[i];
+	}
+
+	rd_btree_unlock(rbt);
+
+	return elm;
+}
+
+
+void *rd_btree_insert (rd_btree_t *rbt, void *elm) {
+	rd_btree_key_t key = { .elm = elm };
+	assert(!(rbt->rbt_flags & RD_BTREE_F_INTKEY));
+	return rd_btree_insert0(rbt, &key, elm);
+}
+
+void *rd_btree_find (rd_btree_t *rbt, const void *elm) {
+	rd_btree_key_t key = { .elm = elm };
+	assert(!(rbt->rbt_flags & RD_BTREE_F_INTKEY));
+	return rd_btree_find0(rbt, &key);
+}
+
+void *rd_btree_remove (rd_btree_t *rbt, const void *elm) {
+	rd_btree_key_t key = { .elm = elm };
+	assert(!(rbt->rbt_flags & RD_BTREE_F_INTKEY));
+	return rd_btree_remove0(rbt, &key);
+}
+
+void *rd_btree_insert_int (rd_btree_t *rbt, int64_t ikey, void *elm) {
+	rd_btree_key_t key = { .ikey = ikey };
+	assert(rbt->rbt_flags & RD_BTREE_F_INTKEY);
+	return rd_btree_insert0(rbt, &key, elm);
+}
+
+void *rd_btree_find_int (rd_btree_t *rbt, int64_t ikey) {
+	rd_btree_key_t key = { .ikey = ikey };
+	assert(rbt->rbt_flags & RD_BTREE_F_INTKEY);
+	return rd_btree_find0(rbt, &key);
+}
+
+void *rd_btree_remove_int (rd_btree_t *rbt, int64_t ikey) {
+	rd_btree_key_t key = { .ikey = ikey };
+	assert(rbt->rbt_flags & RD_BTREE_F_INTKEY);
+	return rd_btree_remove0(rbt, &key);
+}
+
+
+
+/**
+ * Pushes 'node' and its leftmost descendants onto the iterator stack.
+ */
+static void rd_btree_iter_push_left (rd_btree_iter_t *rbti,
+				     const rd_btree_node_t *node) {
+	while (node) {
+		assert(rbti->rbti_depth < RD_BTREE_HEIGHT_MAX);
+		rbti->rbti_stack[rbti->rbti_depth].node = node;
+		rbti->rbti_stack[rbti->rbti_depth].idx = 0;
+		rbti->rbti_depth++;
+		node = node->rbtn_leaf ? NULL : RD_BTREE_CHILD(node)[0];
+	}
+}
+
+void rd_btree_iter_init (rd_btree_iter_t *rbti, rd_btree_t *rbt) {
+	rbti->rbti_depth = 0;
+	rd_btree_iter_push_left(rbti, rbt->rbt_root);
+}
+
+
+static void rd_btree_iter_seek0 (rd_btree_iter_t *rbti, rd_btree_t *rbt,
+				 const rd_btree_key_t *key, int upper) {
+	const rd_btree_node_t *node = rbt->rbt_root;
+
+	rbti->rbti_depth = 0;
+
+	while (node) {
+		int found;
+		int i = rd_btree_node_search(rbt, node, key, upper, &found);
+
+		assert(rbti->rbti_depth < RD_BTREE_HEIGHT_MAX);
+		rbti->rbti_stack[rbti->rbti_depth].node = node;
+		rbti->rbti_stack[rbti->rbti_depth].idx = i;
+		rbti->rbti_depth++;
+
+		if (found || node->rbtn_leaf)
+			break;
+
+		node = RD_BTREE_CHILD(node)[i];
+	}
+}
+
+void rd_btree_iter_seek (rd_btree_iter_t *rbti, rd_btree_t *rbt,
+			 const void *elm, int upper) {
+	rd_btree_key_t key = { .elm = elm };
+	assert(!(rbt->rbt_flags & RD_BTREE_F_INTKEY));
+	rd_btree_iter_seek0(rbti, rbt, &key, upper);
+}
+
+void rd_btree_iter_seek_int (rd_btree_iter_t *rbti, rd_btree_t *rbt,
+			     int64_t ikey, int upper) {
+	rd_btree_key_t key = { .ikey = ikey };
+	assert(rbt->rbt_flags & RD_BTREE_F_INTKEY);
+	rd_btree_iter_seek0(rbti, rbt, &key, upper);
+}
+
+
+void *rd_btree_iter_next (rd_btree_iter_t *rbti, int64_t *keyp) {
+
+	while (rbti->rbti_depth > 0) {
+		const rd_btree_node_t *node =
+			rbti->rbti_stack[rbti->rbti_depth-1].node;
+		int i = rbti->rbti_stack[rbti->rbti_depth-1].idx;
+
+		if (i == node->rbtn_cnt) {
+			rbti->rbti_depth--;
+			continue;
+		}
+
+		rbti->rbti_stack[rbti->rbti_depth-1].idx++;
+
+		/* Elements in the subtree right of 'i' come next. */
+		if (!node->rbtn_leaf)
+			rd_btree_iter_push_left(rbti, RD_BTREE_CHILD(node)[i + 1]);
+
+		if (keyp)
+			*keyp = node->rbtn_intkey ? RD_BTREE_IKEYS(node)[i] : 0;
+		return node->rbtn_elms[i];
+	}
+
+	return NULL;
+}
+
+
+void rd_btree_foreach (rd_btree_t *rbt,
+		       void (*cb) (void *elm, void *opaque), void *opaque) {
+	rd_btree_iter_t rbti;
+	void *elm;
+
+	rd_btree_rdlock(rbt);
+	rd_btree_iter_init(&rbti, rbt);
+	while ((elm = rd_btree_iter_next(&rbti, NULL)))
+		cb(elm, opaque);
+	rd_btree_unlock(rbt);
+}
+
+
+
+void rd_btree_destroy (rd_btree_t *rbt) {
+	rd_btree_node_t *stack[RD_BTREE_HEIGHT_MAX * (RD_BTREE_KEYS_MAX + 1)];
+	int depth = 0;
+
+	/* Free all nodes: each popped inner node pushes its children. */
+	if (rbt->rbt_root)
+		stack[depth++] = rbt->rbt_root;
+
+	while (depth > 0) {
+		rd_btree_node_t *node = stack[--depth];
+		int i;
+
+		if (!node->rbtn_leaf)
+			for (i = 0 ; i <= node->rbtn_cnt ; i++)
+				stack[depth++] = RD_BTREE_CHILD(node)[i];
+
+		free(node);
+	}
+
+	if (rbt->rbt_flags & RD_BTREE_F_LOCKS)
+		rd_rwlock_destroy(&rbt->rbt_rwlock);
+
+	if (rbt->rbt_flags & RD_BTREE_F_OWNER)
+		free(rbt);
+}
+
+rd_btree_t *rd_btree_init (rd_btree_t *rbt, rd_btree_cmp_t cmp, int flags) {
+
+	if (!rbt) {
+		rbt = calloc(1, sizeof(*rbt));
+		flags |= RD_BTREE_F_OWNER;
+	} else {
+		memset(rbt, 0, sizeof(*rbt));
+	}
+
+	assert(cmp || (flags & RD_BTREE_F_INTKEY));
+
+	rbt->rbt_flags = flags;
+	rbt->rbt_cmp = cmp;
+
+	if (flags & RD_BTREE_F_LOCKS)
+		rd_rwlock_init(&rbt->rbt_rwlock);
+
+	return rbt;
+}
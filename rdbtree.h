@@ -0,0 +1,212 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "rdthread.h"
+
+
+/**
+ * B-tree.
+ *
+ * An ordered map with wide nodes: each node holds up to
+ * RD_BTREE_KEYS_MAX elements in contiguous arrays which are binary
+ * searched, giving far fewer cache misses and pointer dereferences per
+ * lookup than the one-element-per-node rd_avl_t for large maps.
+ *
+ * Elements are referenced by pointer (nothing is embedded in them) and
+ * ordered either by an element comparator, like rd_avl_t, or, with
+ * RD_BTREE_F_INTKEY, by an integer key stored in the node itself which
+ * avoids the indirect comparator call and the element dereference.
+ *
+ * Usage:
+ *   rd_btree_init(&rbt, my_cmp, RD_BTREE_F_LOCKS);
+ *   rd_btree_insert(&rbt, elm);
+ *   elm = rd_btree_find(&rbt, &skel);
+ *
+ *   rd_btree_init(&rbt, NULL, RD_BTREE_F_INTKEY);
+ *   rd_btree_insert_int(&rbt, 1234, elm);
+ *   elm = rd_btree_find_int(&rbt, 1234);
+ */
+
+
+#define RD_BTREE_T           16   /* Minimum degree */
+#define RD_BTREE_KEYS_MAX    (2 * RD_BTREE_T - 1)
+#define RD_BTREE_HEIGHT_MAX  16
+
+/**
+ * Nodes are allocated with only the arrays they need: the element
+ * array is followed by the integer keys in RD_BTREE_F_INTKEY trees,
+ * and then by the child pointers in inner nodes.
+ */
+typedef struct rd_btree_node_s {
+	int       rbtn_cnt;                       /* Number of elements */
+	uint16_t  rbtn_leaf;
+	uint16_t  rbtn_intkey;                    /* Has integer keys */
+	void     *rbtn_elms[RD_BTREE_KEYS_MAX];
+} rd_btree_node_t;
+
+#define RD_BTREE_IKEYS(node)						\
+	((int64_t *)&(node)->rbtn_elms[RD_BTREE_KEYS_MAX])
+#define RD_BTREE_CHILD(node)						\
+	((rd_btree_node_t **)(RD_BTREE_IKEYS(node) +			\
+			      ((node)->rbtn_intkey ? RD_BTREE_KEYS_MAX : 0)))
+
+
+typedef int (*rd_btree_cmp_t) (const void *, const void *);
+
+typedef struct rd_btree_s {
+	rd_btree_node_t *rbt_root;
+	rd_btree_cmp_t   rbt_cmp;     /* Element comparator */
+	size_t           rbt_cnt;     /* Number of elements */
+	int              rbt_flags;
+#define RD_BTREE_F_LOCKS   0x1    /* Enable thread-safeness */
+#define RD_BTREE_F_OWNER   0x2    /* internal: rd_btree_init() allocated */
+#define RD_BTREE_F_INTKEY  0x4    /* Integer keys, no comparator */
+	rd_rwlock_t      rbt_rwlock;  /* Lock when .._F_LOCKS is set. */
+} rd_btree_t;
+
+
+/**
+ * Initialize (and optionally allocate if 'rbt' is NULL) a B-tree.
+ * 'cmp' compares two elements, it is not used (may be NULL) with
+ * RD_BTREE_F_INTKEY.
+ */
+rd_btree_t *rd_btree_init (rd_btree_t *rbt, rd_btree_cmp_t cmp, int flags);
+
+/**
+ * Frees the tree's nodes, the elements are not touched.
+ */
+void rd_btree_destroy (rd_btree_t *rbt);
+
+
+/**
+ * 'rbt' locking functions.
+ * All methods lock automatically except for the iterator which
+ * requires the read lock to be held.
+ */
+static void rd_btree_rdlock (rd_btree_t *rbt) RD_UNUSED;
+static void rd_btree_rdlock (rd_btree_t *rbt) {
+	if (rbt->rbt_flags & RD_BTREE_F_LOCKS)
+		rd_rwlock_rdlock(&rbt->rbt_rwlock);
+}
+
+static void rd_btree_wrlock (rd_btree_t *rbt) RD_UNUSED;
+static void rd_btree_wrlock (rd_btree_t *rbt) {
+	if (rbt->rbt_flags & RD_BTREE_F_LOCKS)
+		rd_rwlock_wrlock(&rbt->rbt_rwlock);
+}
+
+static void rd_btree_unlock (rd_btree_t *rbt) RD_UNUSED;
+static void rd_btree_unlock (rd_btree_t *rbt) {
+	if (rbt->rbt_flags & RD_BTREE_F_LOCKS)
+		rd_rwlock_unlock(&rbt->rbt_rwlock);
+}
+
+
+/**
+ * Returns the number of elements in the tree.
+ */
+#define rd_btree_cnt(rbt)  ((rbt)->rbt_cnt)
+
+
+/**
+ * Inserts 'elm'. If an equal element exists it is replaced and
+ * returned, else NULL is returned.
+ * Not for RD_BTREE_F_INTKEY trees, neither are find() and remove().
+ */
+void *rd_btree_insert (rd_btree_t *rbt, void *elm);
+
+/**
+ * Returns the element equal to 'elm', or NULL.
+ */
+void *rd_btree_find (rd_btree_t *rbt, const void *elm);
+
+/**
+ * Removes and returns the element equal to 'elm', or NULL if not found.
+ */
+void *rd_btree_remove (rd_btree_t *rbt, const void *elm);
+
+
+/**
+ * Same as above for RD_BTREE_F_INTKEY trees.
+ */
+void *rd_btree_insert_int (rd_btree_t *rbt, int64_t key, void *elm);
+void *rd_btree_find_int (rd_btree_t *rbt, int64_t key);
+void *rd_btree_remove_int (rd_btree_t *rbt, int64_t key);
+
+
+/**
+ * Calls 'cb' for each element in order.
+ * NOTE: can't insert / delete from the callback.
+ */
+void rd_btree_foreach (rd_btree_t *rbt,
+		       void (*cb) (void *elm, void *opaque), void *opaque);
+
+
+/**
+ * In-order iterator.
+ *
+ * Usage:
+ *   rd_btree_rdlock(rbt);
+ *   rd_btree_iter_init(&it, rbt);
+ *   while ((elm = rd_btree_iter_next(&it, &key)))
+ *      ...
+ *   rd_btree_unlock(rbt);
+ *
+ * NOTE: the read lock must be held while iterating and the tree
+ *       must not be modified.
+ */
+typedef struct rd_btree_iter_s {
+	int  rbti_depth;
+	struct {
+		const rd_btree_node_t *node;
+		int                    idx;
+	} rbti_stack[RD_BTREE_HEIGHT_MAX];
+} rd_btree_iter_t;
+
+/**
+ * Positions the iterator before the first element.
+ */
+void rd_btree_iter_init (rd_btree_iter_t *rbti, rd_btree_t *rbt);
+
+/**
+ * Positions the iterator before the first element not less than
+ * ('upper' = 0) or greater than ('upper' = 1) 'elm' / 'key'.
+ */
+void rd_btree_iter_seek (rd_btree_iter_t *rbti, rd_btree_t *rbt,
+			 const void *elm, int upper);
+void rd_btree_iter_seek_int (rd_btree_iter_t *rbti, rd_btree_t *rbt,
+			     int64_t key, int upper);
+
+/**
+ * Returns the next element, or NULL when the iteration is done.
+ * The integer key is returned in '*keyp' if non-NULL (0 for trees
+ * without RD_BTREE_F_INTKEY).
+ */
+void *rd_btree_iter_next (rd_btree_iter_t *rbti, int64_t *keyp);
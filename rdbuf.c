@@ -30,6 +30,7 @@
 #include "rdbuf.h"
 #include "rdbits.h"
 #include "rdlog.h"
+#include "rdevent.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -234,23 +235,28 @@ rd_buf_t *rd_bufh_prepend (rd_bufh_t *rbh, void *data, uint32_t len,
 
 
 rd_buf_t *rd_bufh_vsprintf (rd_bufh_t *rbh, const char *format, va_list ap) {
-	int totlen;
-	rd_buf_t *rb;
-	va_list ap2;
-
-	va_copy(ap2, ap);
-
-	/* Calculate needed length */
-	totlen = vsnprintf(NULL, 0, format, ap);
-
-	/* Allocate buffer. */
-	rb = rd_bufh_get_buf(rbh, NULL, totlen+1, 0/*FIXME: .._F_SEQ*/);
+	rd_buf_t *tail, *rb;
 
-	/* Format the string to the buffer. */
-	vsnprintf(rb->rb_orig+rb->rb_len, totlen+1, format, ap2);
+	/* Try formatting straight into the tail buffer's free space. */
+	tail = TAILQ_LAST(&rbh->rbh_bufs, rd_buf_tq_head);
+	if (tail && rd_buf_remaining(tail) > 0) {
+		int avail = rd_buf_remaining(tail);
+		va_list ap2;
+		int r;
+
+		va_copy(ap2, ap);
+		r = vsnprintf(tail->rb_orig+tail->rb_len, avail, format, ap2);
+		va_end(ap2);
+
+		if (r >= 0 && r < avail) {
+			/* NOTE: Without trailing null */
+			rd_bufh_update_len(rbh, tail, r);
+			return tail;
+		}
+	}
 
-	/* NOTE: Without trailing null */
-	rd_bufh_update_len(rbh, rb, totlen);
+	rb = rd_buf_vsprintf(format, ap);
+	rd_bufh_buf_insert(rbh, tail, rb);
 
 	return rb;
 }
@@ -270,23 +276,39 @@ rd_buf_t *rd_bufh_sprintf (rd_bufh_t *rbh, const char *format, ...) {
 
 
 rd_buf_t *rd_buf_vsprintf (const char *format, va_list ap) {
-	int totlen;
+	char tmp[256];
+	rd_strbuf_t rsb;
 	rd_buf_t *rb;
-	va_list ap2;
-
-	va_copy(ap2, ap);
 
-	/* Calculate needed length */
-	totlen = vsnprintf(NULL, 0, format, ap);
+	/* Format once: small strings on the stack are copied to a
+	 * single allocation, larger ones are handed off as is. */
+	rd_strbuf_init_static(&rsb, tmp, sizeof(tmp));
+	rd_strbuf_vprintf(&rsb, format, ap);
 
-	/* Allocate buffer. */
-	rb = rd_buf_new(NULL, totlen+1, 0);
+	if (rsb.rsb_flags & RD_STRBUF_F_STATIC) {
+		rb = rd_buf_new(NULL, rsb.rsb_len+1, 0);
+		memcpy(rb->rb_orig, rsb.rsb_buf, rsb.rsb_len+1);
+	} else
+		rb = rd_buf_new(rsb.rsb_buf, rsb.rsb_size, RD_BUF_F_OWNER);
 
-	/* Format the string to the buffer. */
-	vsnprintf(rb->rb_orig+rb->rb_len, totlen+1, format, ap2);
-	
 	/* NOTE: Without trailing null */
-	rb->rb_len = totlen;
+	rb->rb_len = rsb.rsb_len;
+
+	return rb;
+}
+
+
+rd_buf_t *rd_bufh_append_strbuf (rd_bufh_t *rbh, rd_strbuf_t *rsb) {
+	rd_buf_t *rb;
+	size_t len;
+	char *str;
+
+	if (!(str = rd_strbuf_detach(rsb, &len)))
+		return NULL;
+
+	rb = rd_buf_new(str, len+1, RD_BUF_F_OWNER);
+	rb->rb_len = len;
+	rd_bufh_buf_insert(rbh, TAILQ_LAST(&rbh->rbh_bufs, rd_buf_tq_head), rb);
 
 	return rb;
 }
@@ -391,6 +413,174 @@ ssize_t rd_bufh_serialize (const rd_bufh_t *rbh,
 }
 
 
+rd_bufh_writer_f(rd_bufh_write_crc32) {
+	rd_crc32_t *crcp = writer_opaque;
+	*crcp = rd_crc32_update(*crcp, data, len);
+	return len;
+}
+
+rd_bufh_writer_f(rd_bufh_write_crc32c) {
+	rd_crc32_t *crcp = writer_opaque;
+	*crcp = rd_crc32c_update(*crcp, data, len);
+	return len;
+}
+
+rd_bufh_serializer_f(rd_bufh_serialize_binary_crc32) {
+	rd_crc32_t *crcp = serializer_opaque;
+	*crcp = rd_crc32_update(*crcp, (const unsigned char *)rb->rb_orig,
+				rb->rb_len);
+	return writer(rbh, rb->rb_orig, rb->rb_len, writer_opaque);
+}
+
+rd_bufh_serializer_f(rd_bufh_serialize_binary_crc32c) {
+	rd_crc32_t *crcp = serializer_opaque;
+	*crcp = rd_crc32c_update(*crcp, (const unsigned char *)rb->rb_orig,
+				 rb->rb_len);
+	return writer(rbh, rb->rb_orig, rb->rb_len, writer_opaque);
+}
+
+
+
+/**
+ * A range of a buffer chain to checksum, possibly on another thread.
+ */
+struct rd_bufh_crc_job {
+	const rd_buf_t *rb;         /* First segment */
+	uint32_t        of;         /* Offset in first segment */
+	size_t          len;
+	int             castagnoli;
+	rd_crc32_t      crc;        /* Finalized result */
+
+	struct rd_bufh_crc_par {
+		rd_mutex_t lock;
+		rd_cond_t  cond;
+		int        remaining;
+	} *par;
+};
+
+static rd_crc32_t rd_bufh_crc_range (const rd_buf_t *rb, uint32_t of,
+				     size_t len, int castagnoli) {
+	rd_crc32_t crc = rd_crc32_init();
+
+	for ( ; rb && len > 0 ; rb = TAILQ_NEXT(rb, rb_link), of = 0) {
+		const unsigned char *data =
+			(const unsigned char *)rb->rb_orig + of;
+		size_t r = RD_MIN((size_t)(rb->rb_len - of), len);
+
+		if (castagnoli)
+			crc = rd_crc32c_update(crc, data, r);
+		else
+			crc = rd_crc32_update(crc, data, r);
+		len -= r;
+	}
+
+	return rd_crc32_finalize(crc);
+}
+
+static void rd_bufh_crc_job_run (void *arg) {
+	struct rd_bufh_crc_job *job = arg;
+	struct rd_bufh_crc_par *par = job->par;
+
+	job->crc = rd_bufh_crc_range(job->rb, job->of, job->len,
+				     job->castagnoli);
+
+	rd_mutex_lock(&par->lock);
+	if (--par->remaining == 0)
+		rd_cond_signal(&par->cond);
+	rd_mutex_unlock(&par->lock);
+}
+
+
+static rd_crc32_t rd_bufh_crc (const rd_bufh_t *rbh,
+			       rd_thread_t **workers, int worker_cnt,
+			       int castagnoli) {
+	struct rd_bufh_crc_par par;
+	struct rd_bufh_crc_job *jobs;
+	const rd_buf_t *rb;
+	size_t per, left;
+	uint32_t of;
+	rd_crc32_t crc;
+	int cnt, i;
+
+	cnt = 1;
+	if (workers)
+		cnt = RD_MIN(worker_cnt + 1, 64);
+	cnt = RD_MIN(cnt, (int)(rbh->rbh_len / RD_BUFH_CRC_PAR_MIN));
+
+	if (cnt <= 1)
+		return rd_bufh_crc_range(TAILQ_FIRST(&rbh->rbh_bufs), 0,
+					 rbh->rbh_len, castagnoli);
+
+	jobs = alloca(sizeof(*jobs) * cnt);
+	per = (rbh->rbh_len + cnt - 1) / cnt;
+
+	/* Split the chain into 'cnt' ranges of 'per' bytes (the last
+	 * one possibly shorter). */
+	rb = TAILQ_FIRST(&rbh->rbh_bufs);
+	of = 0;
+	left = rbh->rbh_len;
+	for (i = 0 ; i < cnt ; i++) {
+		size_t skip;
+
+		jobs[i].rb = rb;
+		jobs[i].of = of;
+		jobs[i].len = RD_MIN(per, left);
+		jobs[i].castagnoli = castagnoli;
+		jobs[i].par = &par;
+		left -= jobs[i].len;
+
+		for (skip = jobs[i].len ; rb && skip > 0 ; ) {
+			size_t r = RD_MIN((size_t)(rb->rb_len - of), skip);
+			skip -= r;
+			of += r;
+			if (of == rb->rb_len) {
+				rb = TAILQ_NEXT(rb, rb_link);
+				of = 0;
+			}
+		}
+	}
+
+	rd_mutex_init(&par.lock);
+	rd_cond_init(&par.cond, NULL);
+	par.remaining = cnt - 1;
+
+	for (i = 1 ; i < cnt ; i++)
+		rd_thread_event_add(workers[i-1], rd_bufh_crc_job_run,
+				    &jobs[i]);
+
+	jobs[0].crc = rd_bufh_crc_range(jobs[0].rb, jobs[0].of, jobs[0].len,
+					castagnoli);
+
+	rd_mutex_lock(&par.lock);
+	while (par.remaining > 0)
+		rd_cond_wait(&par.cond, &par.lock);
+	rd_mutex_unlock(&par.lock);
+
+	rd_cond_destroy(&par.cond);
+	rd_mutex_destroy(&par.lock);
+
+	crc = jobs[0].crc;
+	for (i = 1 ; i < cnt ; i++) {
+		if (castagnoli)
+			crc = rd_crc32c_combine(crc, jobs[i].crc, jobs[i].len);
+		else
+			crc = rd_crc32_combine(crc, jobs[i].crc, jobs[i].len);
+	}
+
+	return crc;
+}
+
+rd_crc32_t rd_bufh_crc32 (const rd_bufh_t *rbh,
+			  rd_thread_t **workers, int worker_cnt) {
+	return rd_bufh_crc(rbh, workers, worker_cnt, 0);
+}
+
+rd_crc32_t rd_bufh_crc32c (const rd_bufh_t *rbh,
+			   rd_thread_t **workers, int worker_cnt) {
+	return rd_bufh_crc(rbh, workers, worker_cnt, 1);
+}
+
+
 
 void rd_bufh_dump (const char *indent, const rd_bufh_t *rbh) {
 	const rd_buf_t *rb;
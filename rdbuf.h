@@ -32,6 +32,9 @@
 
 #include <stdarg.h>
 #include "rdqueue.h"
+#include "rdstring.h"
+#include "rdthread.h"
+#include "rdcrc32.h"
 
 typedef struct rd_buf_s {
 	TAILQ_ENTRY(rd_buf_s) rb_link;
@@ -103,6 +106,14 @@ void      rd_bufh_move (rd_bufh_t *dst, rd_bufh_t *src);
 rd_buf_t *rd_buf_vsprintf (const char *format, va_list ap);
 rd_buf_t *rd_buf_sprintf  (const char *format, ...);
 
+/**
+ * Appends the string built in 'rsb' as a new buffer without copying it:
+ * the buffer takes over the builder's memory and the builder is reset.
+ * Builders on a static buffer are copied.
+ * NOTE: Without trailing null.
+ */
+rd_buf_t *rd_bufh_append_strbuf (rd_bufh_t *rbh, rd_strbuf_t *rsb);
+
 void rd_bufh_buf_insert (rd_bufh_t *rbh, rd_buf_t *after,
 			 rd_buf_t *rb);
 
@@ -169,4 +180,51 @@ static ssize_t rd_bufh_writeout_fd (const rd_bufh_t *rbh, int fd) {
 				 NULL, &fd);
 }
 
+
+
+/**
+ * Writers that checksum the serialized output instead of writing it.
+ * 'writer_opaque' is a rd_crc32_t * holding the running CRC32/CRC32C
+ * state, which is initialized with rd_crc32_init() and finalized with
+ * rd_crc32_finalize() by the caller.
+ */
+rd_bufh_writer_f(rd_bufh_write_crc32);
+rd_bufh_writer_f(rd_bufh_write_crc32c);
+
+/**
+ * Binary serializers that update the running CRC32/CRC32C in
+ * 'serializer_opaque' (rd_crc32_t *) while passing the data on to the
+ * writer, i.e., the data is checksummed as it is written out:
+ *
+ *   rd_crc32_t crc = rd_crc32_init();
+ *   rd_bufh_serialize(rbh, rd_bufh_serialize_binary_crc32,
+ *                     rd_bufh_write_fd, &crc, &fd);
+ *   crc = rd_crc32_finalize(crc);
+ */
+rd_bufh_serializer_f(rd_bufh_serialize_binary_crc32);
+rd_bufh_serializer_f(rd_bufh_serialize_binary_crc32c);
+
+
+/**
+ * Chains shorter than this per thread are not worth splitting.
+ */
+#define RD_BUFH_CRC_PAR_MIN  (256 * 1024)
+
+/**
+ * Returns the (finalized) CRC32 or CRC32C of the buffer chain's data.
+ *
+ * If 'workers' is non-NULL the chain is split into up to 'worker_cnt'+1
+ * ranges of equal size (at least RD_BUFH_CRC_PAR_MIN bytes each),
+ * regardless of segment boundaries. The ranges are checksummed on the
+ * worker threads, which must be running rd_thread_dispatch(), and on
+ * the calling thread, and the partial CRCs are then combined with
+ * rd_crc32_combine(). The call blocks until all ranges are done, and
+ * the chain must not be modified meanwhile.
+ */
+rd_crc32_t rd_bufh_crc32 (const rd_bufh_t *rbh,
+			  rd_thread_t **workers, int worker_cnt);
+rd_crc32_t rd_bufh_crc32c (const rd_bufh_t *rbh,
+			   rd_thread_t **workers, int worker_cnt);
+
+
 void rd_bufh_dump (const char *indent, const rd_bufh_t *rbh);
@@ -0,0 +1,383 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdcache.h"
+
+#include <stddef.h>
+
+
+static inline rd_cache_shard_t *rd_cache_shard (rd_cache_t *rca,
+						 uint32_t hash) {
+	if (!rca->rca_shard_bits)
+		return &rca->rca_shards[0];
+	return &rca->rca_shards[hash >> (32 - rca->rca_shard_bits)];
+}
+
+
+/**
+ * Locks the shard for modification: serializes against other writers and
+ * makes the index sequence odd so that concurrent lock-free lookups retry.
+ */
+static inline void rd_cache_shard_wrlock (rd_cache_shard_t *rcas) {
+	rd_mutex_lock(&rcas->rcas_lock);
+	__atomic_store_n(&rcas->rcas_seq, rcas->rcas_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void rd_cache_shard_wrunlock (rd_cache_shard_t *rcas) {
+	__atomic_store_n(&rcas->rcas_seq, rcas->rcas_seq + 1, __ATOMIC_RELEASE);
+	rd_mutex_unlock(&rcas->rcas_lock);
+}
+
+
+/**
+ * Returns the slot index of 'key' in the shard, or -1 if not found.
+ * Shard must be locked.
+ */
+static int rd_cache_slot_find (const rd_cache_t *rca,
+			       const rd_cache_shard_t *rcas,
+			       const void *key, uint32_t hash) {
+	unsigned int i = hash & rcas->rcas_slot_mask;
+
+	while (rcas->rcas_slots[i].node) {
+		if (rcas->rcas_slots[i].hash == hash &&
+		    !rca->rca_cmp(rcas->rcas_slots[i].node->rcan_key, key))
+			return (int)i;
+		i = (i + 1) & rcas->rcas_slot_mask;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Lock-free lookup of 'key' in the shard's index.
+ * The probe is bounded since a torn read of the index, which is then
+ * retried, may not contain an empty slot.
+ * Caller must be in an epoch read-side section.
+ */
+static rd_cache_node_t *rd_cache_lookup (const rd_cache_t *rca,
+					 rd_cache_shard_t *rcas,
+					 const void *key, uint32_t hash) {
+	rd_cache_node_t *node;
+	unsigned int seq, i, n;
+
+	do {
+		while ((seq = __atomic_load_n(&rcas->rcas_seq,
+					      __ATOMIC_ACQUIRE)) & 1)
+			;
+
+		node = NULL;
+		i = hash & rcas->rcas_slot_mask;
+		for (n = 0 ; n <= rcas->rcas_slot_mask ; n++) {
+			rd_cache_node_t *s =
+				__atomic_load_n(&rcas->rcas_slots[i].node,
+						__ATOMIC_ACQUIRE);
+			if (!s)
+				break;
+			if (__atomic_load_n(&rcas->rcas_slots[i].hash,
+					    __ATOMIC_RELAXED) == hash &&
+			    !rca->rca_cmp(s->rcan_key, key)) {
+				node = s;
+				break;
+			}
+			i = (i + 1) & rcas->rcas_slot_mask;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&rcas->rcas_seq, __ATOMIC_RELAXED) != seq);
+
+	return node;
+}
+
+
+/**
+ * Removes 'node' from the shard's index and CLOCK ring.
+ * Shard must be locked.
+ */
+static void rd_cache_unlink (rd_cache_shard_t *rcas, rd_cache_node_t *node) {
+	unsigned int mask = rcas->rcas_slot_mask;
+	unsigned int i = node->rcan_hash & mask;
+	unsigned int j;
+
+	while (rcas->rcas_slots[i].node != node)
+		i = (i + 1) & mask;
+
+	/* Backward shift deletion, see rd_lru_cache_slot_delete() */
+	j = i;
+	while (1) {
+		unsigned int home;
+
+		j = (j + 1) & mask;
+		if (!rcas->rcas_slots[j].node)
+			break;
+
+		home = rcas->rcas_slots[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			__atomic_store_n(&rcas->rcas_slots[i].hash,
+					 rcas->rcas_slots[j].hash,
+					 __ATOMIC_RELAXED);
+			__atomic_store_n(&rcas->rcas_slots[i].node,
+					 rcas->rcas_slots[j].node,
+					 __ATOMIC_RELEASE);
+			i = j;
+		}
+	}
+	__atomic_store_n(&rcas->rcas_slots[i].node, NULL, __ATOMIC_RELAXED);
+
+	if (rcas->rcas_hand == node)
+		rcas->rcas_hand = TAILQ_NEXT(node, rcan_link);
+	TAILQ_REMOVE(&rcas->rcas_ring, node, rcan_link);
+	rcas->rcas_cnt--;
+}
+
+
+/**
+ * Advances the CLOCK hand until an unreferenced node is found,
+ * clearing reference bits on the way, and returns it.
+ * Shard must be locked and non-empty.
+ */
+static rd_cache_node_t *rd_cache_clock_victim (rd_cache_shard_t *rcas) {
+
+	while (1) {
+		rd_cache_node_t *node = rcas->rcas_hand ? :
+			TAILQ_FIRST(&rcas->rcas_ring);
+
+		rcas->rcas_hand = TAILQ_NEXT(node, rcan_link);
+
+		if (!__atomic_load_n(&node->rcan_ref, __ATOMIC_RELAXED))
+			return node;
+
+		__atomic_store_n(&node->rcan_ref, 0, __ATOMIC_RELAXED);
+	}
+}
+
+
+void rd_cache_init (rd_cache_t *rca, int shard_cnt, unsigned int max_cnt,
+		    rd_lru_cache_hash_t *hash, rd_lru_cache_cmp_t *cmp,
+		    rd_lru_cache_evict_cb_t *evict_cb, void *opaque) {
+	unsigned int slot_cnt = 16;
+	int i;
+
+	memset(rca, 0, sizeof(*rca));
+
+	if (shard_cnt <= 0)
+		shard_cnt = RD_CACHE_SHARDS_DEFAULT;
+	while ((1 << rca->rca_shard_bits) < shard_cnt)
+		rca->rca_shard_bits++;
+	shard_cnt = 1 << rca->rca_shard_bits;
+
+	rca->rca_shard_max = RD_MAX(1, (max_cnt + shard_cnt - 1) / shard_cnt);
+	rca->rca_hash      = hash;
+	rca->rca_cmp       = cmp;
+	rca->rca_evict_cb  = evict_cb;
+	rca->rca_opaque    = opaque;
+
+	/* Load factor at or below 1/2 */
+	while (slot_cnt < (rca->rca_shard_max + 1) * 2)
+		slot_cnt <<= 1;
+
+	if (posix_memalign((void **)&rca->rca_shards,
+			   sizeof(*rca->rca_shards),
+			   sizeof(*rca->rca_shards) * shard_cnt))
+		rca->rca_shards = NULL;
+	assert(rca->rca_shards);
+
+	for (i = 0 ; i < shard_cnt ; i++) {
+		rd_cache_shard_t *rcas = &rca->rca_shards[i];
+
+		memset(rcas, 0, sizeof(*rcas));
+		rd_mutex_init(&rcas->rcas_lock);
+		TAILQ_INIT(&rcas->rcas_ring);
+		rcas->rcas_slots = calloc(slot_cnt, sizeof(*rcas->rcas_slots));
+		rcas->rcas_slot_mask = slot_cnt - 1;
+	}
+}
+
+
+/**
+ * Epoch callback: no reader can reference the node anymore.
+ */
+static void rd_cache_node_free (rd_epoch_entry_t *ree) {
+	rd_cache_node_t *node = (rd_cache_node_t *)
+		((char *)ree - offsetof(rd_cache_node_t, rcan_ee));
+
+	if (node->rcan_evict_cb)
+		node->rcan_evict_cb(node->rcan_elm, node->rcan_opaque);
+}
+
+
+/**
+ * Retires a node that has been unlinked, the eviction callback is
+ * called after the epoch grace period.
+ * Must not be called with the shard locked since reclamation may call
+ * the eviction callback.
+ */
+static void rd_cache_node_retire (rd_cache_node_t *node) {
+	rd_epoch_retire_entry(&node->rcan_ee, rd_cache_node_free);
+}
+
+
+void rd_cache_destroy (rd_cache_t *rca) {
+	int i;
+
+	for (i = 0 ; i < (1 << rca->rca_shard_bits) ; i++) {
+		rd_cache_shard_t *rcas = &rca->rca_shards[i];
+		rd_cache_node_t *node;
+
+		rd_cache_shard_wrlock(rcas);
+		while ((node = TAILQ_FIRST(&rcas->rcas_ring))) {
+			rd_cache_unlink(rcas, node);
+			rd_cache_shard_wrunlock(rcas);
+			rd_cache_node_retire(node);
+			rd_cache_shard_wrlock(rcas);
+		}
+		rd_cache_shard_wrunlock(rcas);
+	}
+
+	/* Wait out readers still probing the indexes. */
+	rd_epoch_barrier();
+
+	for (i = 0 ; i < (1 << rca->rca_shard_bits) ; i++) {
+		rd_mutex_destroy(&rca->rca_shards[i].rcas_lock);
+		free(rca->rca_shards[i].rcas_slots);
+	}
+
+	free(rca->rca_shards);
+}
+
+
+void rd_cache_put (rd_cache_t *rca, void *elm, rd_cache_node_t *node,
+		   const void *key) {
+	uint32_t hash = rca->rca_hash(key);
+	rd_cache_shard_t *rcas = rd_cache_shard(rca, hash);
+	rd_cache_node_t *old = NULL, *victim = NULL;
+	unsigned int i;
+	int s;
+
+	node->rcan_key    = key;
+	node->rcan_elm    = elm;
+	node->rcan_hash   = hash;
+	node->rcan_ref    = 0;
+	node->rcan_evict_cb = rca->rca_evict_cb;
+	node->rcan_opaque   = rca->rca_opaque;
+
+	rd_cache_shard_wrlock(rcas);
+
+	if ((s = rd_cache_slot_find(rca, rcas, key, hash)) != -1) {
+		old = rcas->rcas_slots[s].node;
+		rd_cache_unlink(rcas, old);
+	}
+
+	if (rcas->rcas_cnt >= rca->rca_shard_max) {
+		victim = rd_cache_clock_victim(rcas);
+		rd_cache_unlink(rcas, victim);
+	}
+
+	/* Insert at the position just behind the hand so that
+	 * the new node is the last one to be considered. */
+	if (rcas->rcas_hand)
+		TAILQ_INSERT_BEFORE(rcas->rcas_hand, node, rcan_link);
+	else
+		TAILQ_INSERT_TAIL(&rcas->rcas_ring, node, rcan_link);
+	rcas->rcas_cnt++;
+
+	i = hash & rcas->rcas_slot_mask;
+	while (rcas->rcas_slots[i].node)
+		i = (i + 1) & rcas->rcas_slot_mask;
+	__atomic_store_n(&rcas->rcas_slots[i].hash, hash, __ATOMIC_RELAXED);
+	/* Publishes the node's fields to lock-free readers. */
+	__atomic_store_n(&rcas->rcas_slots[i].node, node, __ATOMIC_RELEASE);
+
+	rd_cache_shard_wrunlock(rcas);
+
+	if (old)
+		rd_cache_node_retire(old);
+	if (victim)
+		rd_cache_node_retire(victim);
+}
+
+
+void *rd_cache_get (rd_cache_t *rca, const void *key) {
+	uint32_t hash = rca->rca_hash(key);
+	rd_cache_shard_t *rcas = rd_cache_shard(rca, hash);
+	rd_cache_node_t *node;
+
+	/* Left in rd_cache_release() on hit. */
+	rd_epoch_enter();
+
+	if (!(node = rd_cache_lookup(rca, rcas, key, hash))) {
+		rd_epoch_exit();
+		return NULL;
+	}
+
+	/* Racing readers all store the same value.
+	 * Avoid dirtying the cache line if already referenced. */
+	if (!__atomic_load_n(&node->rcan_ref, __ATOMIC_RELAXED))
+		__atomic_store_n(&node->rcan_ref, 1, __ATOMIC_RELAXED);
+
+	return node->rcan_elm;
+}
+
+
+void rd_cache_release (rd_cache_t *rca, rd_cache_node_t *node) {
+	rd_epoch_exit();
+}
+
+
+int rd_cache_remove (rd_cache_t *rca, const void *key) {
+	uint32_t hash = rca->rca_hash(key);
+	rd_cache_shard_t *rcas = rd_cache_shard(rca, hash);
+	rd_cache_node_t *node = NULL;
+	int s;
+
+	rd_cache_shard_wrlock(rcas);
+	if ((s = rd_cache_slot_find(rca, rcas, key, hash)) != -1) {
+		node = rcas->rcas_slots[s].node;
+		rd_cache_unlink(rcas, node);
+	}
+	rd_cache_shard_wrunlock(rcas);
+
+	if (!node)
+		return 0;
+
+	rd_cache_node_retire(node);
+	return 1;
+}
+
+
+unsigned int rd_cache_cnt (rd_cache_t *rca) {
+	unsigned int cnt = 0;
+	int i;
+
+	for (i = 0 ; i < (1 << rca->rca_shard_bits) ; i++)
+		cnt += *(volatile unsigned int *)&rca->rca_shards[i].rcas_cnt;
+
+	return cnt;
+}
@@ -0,0 +1,167 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "rdthread.h"
+#include "rdsysqueue.h"
+#include "rdlru.h"
+#include "rdepoch.h"
+
+
+/**
+ * Sharded concurrent cache with CLOCK (second-chance) replacement.
+ *
+ * The key space is partitioned over a number of shards, each with its
+ * own writer lock, hash index and CLOCK ring.
+ * Lookups take no lock and write nothing shared but the element's
+ * reference bit (and only if it was clear): the hash index is read
+ * optimistically under a per-shard sequence counter and retried if a
+ * writer modified it meanwhile, while the nodes themselves are protected
+ * by an rd_epoch read-side section (see rdepoch.h).
+ * Inserts take the shard's lock and, when the shard is full,
+ * advance the CLOCK hand clearing reference bits until an unreferenced
+ * victim is found.
+ *
+ * An element returned by rd_cache_get() stays valid until the same
+ * thread calls RD_CACHE_RELEASE(), which leaves the epoch section.
+ * Since a held reference holds back all epoch reclamation it should be
+ * short-lived. Elements removed from the cache (evicted, replaced,
+ * removed or destroyed) are retired to rdepoch and passed to the
+ * eviction callback once no reader can still be referencing them.
+ * The eviction callback runs from epoch reclamation on whichever thread
+ * triggers it, with no cache or rdepoch lock held, and must not call
+ * rd_cache_destroy() or rd_epoch_barrier().
+ *
+ * The hash and comparator callbacks are the same as for
+ * rd_lru_cache_t, see rdlru.h.
+ */
+
+
+/**
+ * Cache node, embed in the cached element.
+ */
+typedef struct rd_cache_node_s {
+	TAILQ_ENTRY(rd_cache_node_s) rcan_link;  /* CLOCK ring */
+	const void   *rcan_key;
+	void         *rcan_elm;      /* Backpointer to containing element */
+	uint32_t      rcan_hash;
+	int           rcan_ref;      /* CLOCK reference bit */
+	rd_epoch_entry_t rcan_ee;    /* Deferred eviction */
+	rd_lru_cache_evict_cb_t *rcan_evict_cb;
+	void         *rcan_opaque;
+} rd_cache_node_t;
+
+
+typedef struct rd_cache_slot_s {
+	uint32_t         hash;
+	rd_cache_node_t *node;
+} rd_cache_slot_t;
+
+
+typedef struct rd_cache_shard_s {
+	rd_mutex_t       rcas_lock;    /* Serializes writers */
+	unsigned int     rcas_seq;     /* Index seqlock, odd while modified */
+	TAILQ_HEAD(, rd_cache_node_s) rcas_ring;  /* CLOCK ring */
+	rd_cache_node_t *rcas_hand;    /* CLOCK hand, NULL = ring head */
+	unsigned int     rcas_cnt;
+	rd_cache_slot_t *rcas_slots;   /* Hash index */
+	unsigned int     rcas_slot_mask;
+} __attribute__((aligned(64))) rd_cache_shard_t;
+
+
+typedef struct rd_cache_s {
+	rd_cache_shard_t *rca_shards;
+	int               rca_shard_bits;
+	unsigned int      rca_shard_max;   /* Max elements per shard */
+
+	rd_lru_cache_hash_t     *rca_hash;
+	rd_lru_cache_cmp_t      *rca_cmp;
+	rd_lru_cache_evict_cb_t *rca_evict_cb;
+	void             *rca_opaque;
+} rd_cache_t;
+
+
+#define RD_CACHE_SHARDS_DEFAULT  16
+
+
+/**
+ * Initializes a cache holding at most (approximately) 'max_cnt'
+ * elements spread over 'shard_cnt' shards (rounded up to a power of 2,
+ * 0 for RD_CACHE_SHARDS_DEFAULT).
+ */
+void rd_cache_init (rd_cache_t *rca, int shard_cnt, unsigned int max_cnt,
+		    rd_lru_cache_hash_t *hash, rd_lru_cache_cmp_t *cmp,
+		    rd_lru_cache_evict_cb_t *evict_cb, void *opaque);
+
+/**
+ * Removes all elements and frees the cache's resources.
+ * Waits for an epoch grace period so that all elements have been
+ * passed to the eviction callback on return (except those retired by
+ * other threads that have not yet handed them over, see rdepoch.h).
+ * Must not be called while holding a reference.
+ */
+void rd_cache_destroy (rd_cache_t *rca);
+
+
+/**
+ * Inserts element 'elm' with key 'key'.
+ * An existing element with the same key is replaced and handled as
+ * evicted.
+ */
+#define RD_CACHE_PUT(rca,elm,field,key)			\
+	rd_cache_put(rca, elm, &(elm)->field, key)
+void rd_cache_put (rd_cache_t *rca, void *elm, rd_cache_node_t *node,
+		   const void *key);
+
+/**
+ * Returns the element matching 'key', or NULL.
+ * A returned element must be released with RD_CACHE_RELEASE() by the
+ * calling thread. References nest and may be held across other cache
+ * calls, except rd_cache_destroy().
+ */
+void *rd_cache_get (rd_cache_t *rca, const void *key);
+
+/**
+ * Releases a reference obtained from rd_cache_get().
+ * After this the element may be evicted and freed at any time.
+ */
+#define RD_CACHE_RELEASE(rca,elm,field)		\
+	rd_cache_release(rca, &(elm)->field)
+void rd_cache_release (rd_cache_t *rca, rd_cache_node_t *node);
+
+/**
+ * Removes the element matching 'key' from the cache.
+ * Returns 1 if an element was removed, else 0.
+ */
+int rd_cache_remove (rd_cache_t *rca, const void *key);
+
+/**
+ * Returns the current number of elements in the cache.
+ */
+unsigned int rd_cache_cnt (rd_cache_t *rca);
@@ -13,10 +13,15 @@
  *    ReflectOut   = True
  *    Algorithm    = table-driven
  *****************************************************************************/
+#include "rd.h"
 #include "rdcrc32.h"     /* include the header file generated with pycrc */
 #include <stdlib.h>
 #include <stdint.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 /**
  * Static table used for the table_driven implementation.
  *****************************************************************************/
@@ -109,14 +114,14 @@ rd_crc32_t rd_crc32_reflect(rd_crc32_t data, size_t data_len)
 
 
 /**
- * Update the crc value with new data.
+ * Update the crc value with new data, one byte at a time.
  *
  * \param crc      The current crc value.
  * \param data     Pointer to a buffer of \a data_len bytes.
  * \param data_len Number of bytes in the \a data buffer.
  * \return         The updated crc value.
  *****************************************************************************/
-rd_crc32_t rd_crc32_update(rd_crc32_t crc, const unsigned char *data, size_t data_len)
+static rd_crc32_t rd_crc32_update_table(rd_crc32_t crc, const unsigned char *data, size_t data_len)
 {
     unsigned int tbl_idx;
 
@@ -131,3 +136,496 @@ rd_crc32_t rd_crc32_update(rd_crc32_t crc, const unsigned char *data, size_t dat
 
 
 
+
+/*
+ * librd additions: slicing-by-8, hardware implementations and combine.
+ *
+ * All implementations operate on the reflected (LSB-first) register,
+ * i.e., the same non-finalized state as rd_crc32_update().
+ */
+
+#define RD_CRC32_POLY_IEEE        0xedb88320  /* Reflected 0x04c11db7 */
+#define RD_CRC32_POLY_CASTAGNOLI  0x82f63b78  /* Reflected 0x1edc6f41 */
+
+/* Lane and shift table sizes for the interleaved CRC32C implementation */
+#define RD_CRC32C_LONG   8192
+#define RD_CRC32C_SHORT  256
+
+typedef struct rd_crc32_poly_s {
+	rd_crc32_t poly;
+	rd_crc32_t table[8][256];  /* Slicing-by-8 tables */
+	rd_crc32_t x2n[32];        /* x^(2^n) mod poly */
+} rd_crc32_poly_t;
+
+static rd_crc32_poly_t rd_crc32_ieee = { .poly = RD_CRC32_POLY_IEEE };
+static rd_crc32_poly_t rd_crc32_castagnoli =
+	{ .poly = RD_CRC32_POLY_CASTAGNOLI };
+
+/* Shift tables for appending RD_CRC32C_LONG/SHORT zero bytes. */
+static rd_crc32_t rd_crc32c_long[4][256];
+static rd_crc32_t rd_crc32c_short[4][256];
+
+static pthread_once_t rd_crc32_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Multiplies polynomials 'a' and 'b' modulo the polynomial (reflected
+ * representation: x^0 is the MSB).
+ */
+static rd_crc32_t rd_crc32_multmodp (rd_crc32_t poly,
+				     rd_crc32_t a, rd_crc32_t b) {
+	rd_crc32_t m = (rd_crc32_t)1 << 31;
+	rd_crc32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+	}
+
+	return p;
+}
+
+/**
+ * Returns x^(n * 2^k) modulo the polynomial.
+ */
+static rd_crc32_t rd_crc32_x2nmodp (const rd_crc32_poly_t *rcp,
+				    uint64_t n, unsigned int k) {
+	rd_crc32_t p = (rd_crc32_t)1 << 31; /* x^0 */
+
+	while (n) {
+		if (n & 1)
+			p = rd_crc32_multmodp(rcp->poly, rcp->x2n[k & 31], p);
+		n >>= 1;
+		k++;
+	}
+
+	return p;
+}
+
+
+static void rd_crc32_poly_init (rd_crc32_poly_t *rcp) {
+	rd_crc32_t p;
+	int n, k;
+
+	for (n = 0 ; n < 256 ; n++) {
+		rd_crc32_t c = (rd_crc32_t)n;
+		for (k = 0 ; k < 8 ; k++)
+			c = c & 1 ? (c >> 1) ^ rcp->poly : c >> 1;
+		rcp->table[0][n] = c;
+	}
+
+	for (n = 0 ; n < 256 ; n++)
+		for (k = 1 ; k < 8 ; k++)
+			rcp->table[k][n] =
+				(rcp->table[k-1][n] >> 8) ^
+				rcp->table[0][rcp->table[k-1][n] & 0xff];
+
+	p = (rd_crc32_t)1 << 30; /* x^1 */
+	rcp->x2n[0] = p;
+	for (n = 1 ; n < 32 ; n++)
+		rcp->x2n[n] = p = rd_crc32_multmodp(rcp->poly, p, p);
+}
+
+/**
+ * Builds the tables for shifting a register over 'len' zero bytes
+ * with four table lookups.
+ */
+static void rd_crc32_shift_init (const rd_crc32_poly_t *rcp,
+				 rd_crc32_t zeros[4][256], size_t len) {
+	rd_crc32_t xn = rd_crc32_x2nmodp(rcp, len, 3);
+	int n, k;
+
+	for (k = 0 ; k < 4 ; k++)
+		for (n = 0 ; n < 256 ; n++)
+			zeros[k][n] = rd_crc32_multmodp(rcp->poly, xn,
+							(rd_crc32_t)n <<
+							(k * 8));
+}
+
+static inline rd_crc32_t rd_crc32_shift (rd_crc32_t zeros[4][256],
+					 rd_crc32_t crc) {
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+		zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void rd_crc32_tables_init (void) {
+	rd_crc32_poly_init(&rd_crc32_ieee);
+	rd_crc32_poly_init(&rd_crc32_castagnoli);
+	rd_crc32_shift_init(&rd_crc32_castagnoli, rd_crc32c_long,
+			    RD_CRC32C_LONG);
+	rd_crc32_shift_init(&rd_crc32_castagnoli, rd_crc32c_short,
+			    RD_CRC32C_SHORT);
+}
+
+
+/**
+ * Slicing-by-8: eight table lookups per 64-bit word.
+ */
+static rd_crc32_t rd_crc32_slice8 (const rd_crc32_poly_t *rcp, rd_crc32_t crc,
+				   const unsigned char *p, size_t len) {
+	const rd_crc32_t (*t)[256] = rcp->table;
+
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t w;
+
+		memcpy(&w, p, 8);
+		w = le64toh(w) ^ crc;
+		crc = t[7][w & 0xff] ^
+			t[6][(w >> 8) & 0xff] ^
+			t[5][(w >> 16) & 0xff] ^
+			t[4][(w >> 24) & 0xff] ^
+			t[3][(w >> 32) & 0xff] ^
+			t[2][(w >> 40) & 0xff] ^
+			t[1][(w >> 48) & 0xff] ^
+			t[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static rd_crc32_t rd_crc32_update_slice8 (rd_crc32_t crc,
+					  const unsigned char *data,
+					  size_t data_len) {
+	return rd_crc32_slice8(&rd_crc32_ieee, crc, data, data_len);
+}
+
+static rd_crc32_t rd_crc32c_update_table (rd_crc32_t crc,
+					  const unsigned char *data,
+					  size_t data_len) {
+	while (data_len-- > 0)
+		crc = rd_crc32_castagnoli.table[0][(crc ^ *data++) & 0xff] ^
+			(crc >> 8);
+	return crc;
+}
+
+static rd_crc32_t rd_crc32c_update_slice8 (rd_crc32_t crc,
+					   const unsigned char *data,
+					   size_t data_len) {
+	return rd_crc32_slice8(&rd_crc32_castagnoli, crc, data, data_len);
+}
+
+
+#if defined(__x86_64__)
+/**
+ * CRC32 (IEEE) by folding with carry-less multiplication, as described
+ * in Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction": four 128-bit lanes are folded 64 bytes at a
+ * time, then folded into one and Barrett-reduced to 32 bits.
+ * Requires 'len' >= 64 and a multiple of 16.
+ */
+static __attribute__((target("pclmul,sse4.1")))
+rd_crc32_t rd_crc32_fold_pclmul (rd_crc32_t crc,
+				 const unsigned char *p, size_t len) {
+	/* Bit-reflected fold constants and the Barrett polynomials */
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+		{ 0x0154442bd4ull, 0x01c6e41596ull };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+		{ 0x01751997d0ull, 0x00ccaa009eull };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+		{ 0x0163cd6124ull, 0 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) =
+		{ 0x01db710641ull, 0x01f7011641ull };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+
+	p += 64;
+	len -= 64;
+
+	/* Fold 64 bytes at a time */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		p += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold the remaining 16 byte blocks */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)p);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		p += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduce to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (rd_crc32_t)_mm_extract_epi32(x1, 1);
+}
+
+static rd_crc32_t rd_crc32_update_pclmul (rd_crc32_t crc,
+					  const unsigned char *data,
+					  size_t data_len) {
+	if (data_len >= 64) {
+		size_t len = data_len & ~(size_t)15;
+		crc = rd_crc32_fold_pclmul(crc, data, len);
+		data += len;
+		data_len -= len;
+	}
+
+	return rd_crc32_slice8(&rd_crc32_ieee, crc, data, data_len);
+}
+
+
+/**
+ * CRC32C with the SSE4.2 crc32 instruction.
+ * The instruction has a latency of three cycles but a throughput of
+ * one per cycle, so large inputs are split into three lanes that are
+ * computed in parallel and then combined with the shift tables.
+ */
+static __attribute__((target("sse4.2")))
+rd_crc32_t rd_crc32c_update_sse42 (rd_crc32_t crc,
+				   const unsigned char *p, size_t len) {
+	uint64_t c0 = crc, c1, c2;
+	const unsigned char *end;
+
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+		len--;
+	}
+
+	while (len >= RD_CRC32C_LONG * 3) {
+		c1 = c2 = 0;
+		end = p + RD_CRC32C_LONG;
+		do {
+			c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+			c1 = _mm_crc32_u64(c1, *(const uint64_t *)
+					   (p + RD_CRC32C_LONG));
+			c2 = _mm_crc32_u64(c2, *(const uint64_t *)
+					   (p + RD_CRC32C_LONG * 2));
+			p += 8;
+		} while (p < end);
+		c0 = rd_crc32_shift(rd_crc32c_long, (rd_crc32_t)c0) ^ c1;
+		c0 = rd_crc32_shift(rd_crc32c_long, (rd_crc32_t)c0) ^ c2;
+		p += RD_CRC32C_LONG * 2;
+		len -= RD_CRC32C_LONG * 3;
+	}
+
+	while (len >= RD_CRC32C_SHORT * 3) {
+		c1 = c2 = 0;
+		end = p + RD_CRC32C_SHORT;
+		do {
+			c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+			c1 = _mm_crc32_u64(c1, *(const uint64_t *)
+					   (p + RD_CRC32C_SHORT));
+			c2 = _mm_crc32_u64(c2, *(const uint64_t *)
+					   (p + RD_CRC32C_SHORT * 2));
+			p += 8;
+		} while (p < end);
+		c0 = rd_crc32_shift(rd_crc32c_short, (rd_crc32_t)c0) ^ c1;
+		c0 = rd_crc32_shift(rd_crc32c_short, (rd_crc32_t)c0) ^ c2;
+		p += RD_CRC32C_SHORT * 2;
+		len -= RD_CRC32C_SHORT * 3;
+	}
+
+	while (len >= 8) {
+		c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+
+	return (rd_crc32_t)c0;
+}
+#endif
+
+
+typedef rd_crc32_t (rd_crc32_update_t) (rd_crc32_t crc,
+					 const unsigned char *data,
+					 size_t data_len);
+
+static rd_crc32_update_t *rd_crc32_update_impl;
+static rd_crc32_update_t *rd_crc32c_update_impl;
+
+
+static int rd_crc32_impl_select (rd_crc32_impl_t impl,
+				 rd_crc32_update_t **crc32p,
+				 rd_crc32_update_t **crc32cp) {
+
+	pthread_once(&rd_crc32_once, rd_crc32_tables_init);
+
+	switch (impl)
+	{
+	case RD_CRC32_IMPL_AUTO:
+	case RD_CRC32_IMPL_HW:
+#if defined(__x86_64__)
+		__builtin_cpu_init();
+		*crc32p = *crc32cp = NULL;
+		if (__builtin_cpu_supports("sse4.2"))
+			*crc32cp = rd_crc32c_update_sse42;
+		if (__builtin_cpu_supports("pclmul") &&
+		    __builtin_cpu_supports("sse4.1"))
+			*crc32p = rd_crc32_update_pclmul;
+		if (impl == RD_CRC32_IMPL_HW) {
+			if (!*crc32p || !*crc32cp)
+				return -1;
+			return 0;
+		}
+		if (!*crc32p)
+			*crc32p = rd_crc32_update_slice8;
+		if (!*crc32cp)
+			*crc32cp = rd_crc32c_update_slice8;
+		return 0;
+#else
+		if (impl == RD_CRC32_IMPL_HW)
+			return -1;
+#endif
+		/* FALLTHRU */
+	case RD_CRC32_IMPL_SLICE8:
+		*crc32p = rd_crc32_update_slice8;
+		*crc32cp = rd_crc32c_update_slice8;
+		return 0;
+
+	case RD_CRC32_IMPL_TABLE:
+		*crc32p = rd_crc32_update_table;
+		*crc32cp = rd_crc32c_update_table;
+		return 0;
+	}
+
+	return -1;
+}
+
+
+int rd_crc32_impl_set (rd_crc32_impl_t impl) {
+	rd_crc32_update_t *crc32, *crc32c;
+
+	if (rd_crc32_impl_select(impl, &crc32, &crc32c) == -1)
+		return -1;
+
+	__atomic_store_n(&rd_crc32_update_impl, crc32, __ATOMIC_RELEASE);
+	__atomic_store_n(&rd_crc32c_update_impl, crc32c, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void rd_crc32_impl_init (void) {
+	rd_crc32_impl_set(RD_CRC32_IMPL_AUTO);
+}
+
+
+/**
+ * Update the crc value with new data, using the best implementation
+ * available (see rd_crc32_impl_set()).
+ */
+rd_crc32_t rd_crc32_update(rd_crc32_t crc, const unsigned char *data, size_t data_len)
+{
+	rd_crc32_update_t *update;
+
+	if (unlikely(!(update = __atomic_load_n(&rd_crc32_update_impl,
+						__ATOMIC_ACQUIRE)))) {
+		rd_crc32_impl_init();
+		update = __atomic_load_n(&rd_crc32_update_impl,
+					 __ATOMIC_ACQUIRE);
+	}
+
+	return update(crc, data, data_len);
+}
+
+rd_crc32_t rd_crc32c_update (rd_crc32_t crc,
+			     const unsigned char *data, size_t data_len) {
+	rd_crc32_update_t *update;
+
+	if (unlikely(!(update = __atomic_load_n(&rd_crc32c_update_impl,
+						__ATOMIC_ACQUIRE)))) {
+		rd_crc32_impl_init();
+		update = __atomic_load_n(&rd_crc32c_update_impl,
+					 __ATOMIC_ACQUIRE);
+	}
+
+	return update(crc, data, data_len);
+}
+
+
+rd_crc32_t rd_crc32_combine (rd_crc32_t crc1, rd_crc32_t crc2, size_t len2) {
+	pthread_once(&rd_crc32_once, rd_crc32_tables_init);
+	return rd_crc32_multmodp(rd_crc32_ieee.poly,
+				 rd_crc32_x2nmodp(&rd_crc32_ieee, len2, 3),
+				 crc1) ^ crc2;
+}
+
+rd_crc32_t rd_crc32c_combine (rd_crc32_t crc1, rd_crc32_t crc2, size_t len2) {
+	pthread_once(&rd_crc32_once, rd_crc32_tables_init);
+	return rd_crc32_multmodp(rd_crc32_castagnoli.poly,
+				 rd_crc32_x2nmodp(&rd_crc32_castagnoli,
+						  len2, 3),
+				 crc1) ^ crc2;
+}
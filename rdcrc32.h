@@ -8,6 +8,8 @@
  * NOTE: Contains librd modifications:
  *       - rd_crc32() helper.
  *       - __RDCRC32___H__ define (was missing the '32' part).
+ *       - Slicing-by-8 and PCLMULQDQ implementations with runtime
+ *         dispatch, CRC32C (Castagnoli) and crc combining.
  *
  * using the configuration:
  *    Width        = 32
@@ -96,6 +98,54 @@ static inline rd_crc32_t rd_crc32 (const char *data, size_t data_len) {
 						 data_len));
 }
 
+
+
+/**
+ * CRC32C (Castagnoli, polynomial 0x1edc6f41) as used by iSCSI, SCTP
+ * and ext4. Same initial and final xor values as CRC32, so it is used
+ * with rd_crc32_init() and rd_crc32_finalize().
+ * Uses the SSE4.2 crc32 instruction when available.
+ */
+rd_crc32_t rd_crc32c_update (rd_crc32_t crc,
+			     const unsigned char *data, size_t data_len);
+
+static inline rd_crc32_t rd_crc32c (const char *data, size_t data_len) {
+	return rd_crc32_finalize(rd_crc32c_update(rd_crc32_init(),
+						  (const unsigned char *)data,
+						  data_len));
+}
+
+
+/**
+ * Combines the finalized CRCs 'crc1' of block A and 'crc2' of block B
+ * (of length 'len2') into the CRC of A followed by B, without access
+ * to the data. This allows blocks to be checksummed in parallel.
+ * Runs in O(log len2).
+ */
+rd_crc32_t rd_crc32_combine (rd_crc32_t crc1, rd_crc32_t crc2, size_t len2);
+rd_crc32_t rd_crc32c_combine (rd_crc32_t crc1, rd_crc32_t crc2, size_t len2);
+
+
+/**
+ * CRC implementations.
+ * The best available one is selected at runtime from the CPU's
+ * capabilities: PCLMULQDQ folding for CRC32, the SSE4.2 crc32
+ * instruction for CRC32C, and slicing-by-8 tables otherwise.
+ */
+typedef enum {
+	RD_CRC32_IMPL_AUTO,    /* Best available */
+	RD_CRC32_IMPL_TABLE,   /* Byte at a time */
+	RD_CRC32_IMPL_SLICE8,  /* Slicing-by-8 */
+	RD_CRC32_IMPL_HW,      /* PCLMULQDQ / SSE4.2 */
+} rd_crc32_impl_t;
+
+/**
+ * Forces a specific implementation, mainly for testing and benchmarking.
+ * Returns 0 on success or -1 if it is not supported by this CPU.
+ */
+int rd_crc32_impl_set (rd_crc32_impl_t impl);
+
+
 #ifdef __cplusplus
 }           /* closing brace for extern "C" */
 #endif
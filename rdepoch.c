@@ -0,0 +1,298 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdthread.h"
+#include "rdepoch.h"
+
+#include <sched.h>
+
+
+/* Objects retired in epoch E are kept on list E % 3 which is freed
+ * when the global epoch advances to E + 3 and the list is reused.
+ * The epoch only advances when all active readers have observed the
+ * current one, so by then every active reader entered its section
+ * after the objects were unlinked. */
+#define RD_EPOCH_LISTS  3
+
+/* Objects a thread retires before handing them over to the limbo
+ * lists and attempting to advance the epoch. */
+#define RD_EPOCH_BATCH  64
+
+
+/* Entry allocated by rd_epoch_retire(). */
+typedef struct rd_epoch_retired_s {
+	rd_epoch_entry_t rer_ee;    /* Must be first */
+	void  *rer_ptr;
+	void (*rer_free_cb) (void *ptr);
+} rd_epoch_retired_t;
+
+
+volatile uint64_t rd_epoch_global = 1;
+__thread rd_epoch_thread_t *rd_epoch_thr;
+
+static rd_mutex_t rd_epoch_lock = RD_MUTEX_INITIALIZER;
+static LIST_HEAD(, rd_epoch_thread_s) rd_epoch_threads;
+static rd_epoch_entry_t *rd_epoch_limbo[RD_EPOCH_LISTS];
+static int rd_epoch_limbo_cnt[RD_EPOCH_LISTS];
+/* Objects detached from the limbo lists whose free callbacks have not
+ * yet returned. Atomic. */
+static int rd_epoch_freeing;
+
+
+rd_epoch_thread_t *rd_epoch_thread_register (void) {
+	rd_epoch_thread_t *ret;
+
+	if (posix_memalign((void **)&ret, 64, sizeof(*ret)))
+		abort();
+	memset(ret, 0, sizeof(*ret));
+
+	rd_mutex_lock(&rd_epoch_lock);
+	LIST_INSERT_HEAD(&rd_epoch_threads, ret, ret_link);
+	rd_mutex_unlock(&rd_epoch_lock);
+
+	rd_epoch_thr = ret;
+
+	return ret;
+}
+
+
+/**
+ * Moves the objects retired by thread 'ret' to the limbo list of the
+ * current epoch, which is no earlier than the epoch they were
+ * retired in.
+ * NOTE: rd_epoch_lock must be held.
+ */
+static void rd_epoch_handover (rd_epoch_thread_t *ret) {
+	int i;
+
+	if (!ret->ret_limbo)
+		return;
+
+	i = rd_epoch_global % RD_EPOCH_LISTS;
+	ret->ret_limbo_tail->ree_next = rd_epoch_limbo[i];
+	rd_epoch_limbo[i] = ret->ret_limbo;
+	rd_epoch_limbo_cnt[i] += ret->ret_limbo_cnt;
+
+	ret->ret_limbo = ret->ret_limbo_tail = NULL;
+	__atomic_store_n(&ret->ret_limbo_cnt, 0, __ATOMIC_RELAXED);
+}
+
+
+void rd_epoch_thread_cleanup (void) {
+	rd_epoch_thread_t *ret = rd_epoch_thr;
+
+	if (!ret)
+		return;
+
+	assert(ret->ret_nest == 0);
+
+	rd_mutex_lock(&rd_epoch_lock);
+	rd_epoch_handover(ret);
+	LIST_REMOVE(ret, ret_link);
+	rd_mutex_unlock(&rd_epoch_lock);
+
+	free(ret);
+	rd_epoch_thr = NULL;
+}
+
+
+/**
+ * Returns the number of objects on the limbo lists.
+ * NOTE: rd_epoch_lock must be held.
+ */
+static int rd_epoch_limbo_total (void) {
+	int i, cnt = 0;
+
+	for (i = 0 ; i < RD_EPOCH_LISTS ; i++)
+		cnt += rd_epoch_limbo_cnt[i];
+
+	return cnt;
+}
+
+
+/**
+ * Calls the free callbacks of the 'cnt' objects on 'ree', a list
+ * detached by rd_epoch_try_advance().
+ * Called without rd_epoch_lock held so that the callbacks may take
+ * application locks and retire objects.
+ */
+static void rd_epoch_free_list (rd_epoch_entry_t *ree, int cnt) {
+	rd_epoch_entry_t *next;
+
+	if (cnt <= 0)
+		return;
+
+	for ( ; ree ; ree = next) {
+		next = ree->ree_next;
+		ree->ree_free_cb(ree);
+	}
+
+	(void)__atomic_sub_fetch(&rd_epoch_freeing, cnt, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Advances the global epoch if all active readers have observed it,
+ * and detaches the list of objects that thereby became unreachable
+ * into '*freelist', to be passed to rd_epoch_free_list() once the
+ * lock is released.
+ * Returns the number of objects detached, or -1 if the epoch was not
+ * advanced.
+ * NOTE: rd_epoch_lock must be held.
+ */
+static int rd_epoch_try_advance (rd_epoch_entry_t **freelist) {
+	rd_epoch_thread_t *ret;
+	uint64_t epoch = rd_epoch_global;
+	int i, cnt;
+
+	/* Pairs with the fence in rd_epoch_enter(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	LIST_FOREACH(ret, &rd_epoch_threads, ret_link) {
+		/* Pairs with the release in rd_epoch_exit(): the reader's
+		 * accesses happen before anything is freed. */
+		uint64_t state = __atomic_load_n(&ret->ret_state,
+						 __ATOMIC_ACQUIRE);
+
+		if ((state & 1) && (state >> 1) != epoch)
+			return -1;
+	}
+
+	__atomic_store_n(&rd_epoch_global, ++epoch, __ATOMIC_RELAXED);
+
+	/* Holds objects retired in epoch - 3. */
+	i = epoch % RD_EPOCH_LISTS;
+	*freelist = rd_epoch_limbo[i];
+	cnt = rd_epoch_limbo_cnt[i];
+	rd_epoch_limbo[i] = NULL;
+	rd_epoch_limbo_cnt[i] = 0;
+	(void)__atomic_add_fetch(&rd_epoch_freeing, cnt, __ATOMIC_RELAXED);
+
+	return cnt;
+}
+
+
+void rd_epoch_retire_entry (rd_epoch_entry_t *ree,
+			    void (*free_cb) (rd_epoch_entry_t *ree)) {
+	rd_epoch_thread_t *ret = rd_epoch_thr;
+
+	if (unlikely(!ret))
+		ret = rd_epoch_thread_register();
+
+	ree->ree_free_cb = free_cb;
+	ree->ree_next = ret->ret_limbo;
+	if (!ret->ret_limbo)
+		ret->ret_limbo_tail = ree;
+	ret->ret_limbo = ree;
+	__atomic_store_n(&ret->ret_limbo_cnt, ret->ret_limbo_cnt + 1,
+			 __ATOMIC_RELAXED);
+
+	if (unlikely(ret->ret_limbo_cnt >= RD_EPOCH_BATCH))
+		rd_epoch_reclaim();
+}
+
+
+static void rd_epoch_retired_free (rd_epoch_entry_t *ree) {
+	rd_epoch_retired_t *rer = (rd_epoch_retired_t *)ree;
+
+	rer->rer_free_cb(rer->rer_ptr);
+	free(rer);
+}
+
+void rd_epoch_retire (void *ptr, void (*free_cb) (void *ptr)) {
+	rd_epoch_retired_t *rer = malloc(sizeof(*rer));
+
+	if (!rer)
+		abort();
+
+	rer->rer_ptr = ptr;
+	rer->rer_free_cb = free_cb;
+
+	rd_epoch_retire_entry(&rer->rer_ee, rd_epoch_retired_free);
+}
+
+
+void rd_epoch_reclaim (void) {
+	rd_epoch_entry_t *freelist = NULL;
+	int cnt;
+
+	rd_mutex_lock(&rd_epoch_lock);
+	if (rd_epoch_thr)
+		rd_epoch_handover(rd_epoch_thr);
+	cnt = rd_epoch_try_advance(&freelist);
+	rd_mutex_unlock(&rd_epoch_lock);
+
+	rd_epoch_free_list(freelist, cnt);
+}
+
+
+void rd_epoch_barrier (void) {
+	int advances = 0;
+
+	assert(!rd_epoch_thr || rd_epoch_thr->ret_nest == 0);
+
+	/* Each list is freed on the third advance after its epoch. */
+	while (1) {
+		rd_epoch_entry_t *freelist = NULL;
+		int cnt, done;
+
+		rd_mutex_lock(&rd_epoch_lock);
+		if (rd_epoch_thr)
+			rd_epoch_handover(rd_epoch_thr);
+		if ((cnt = rd_epoch_try_advance(&freelist)) != -1)
+			advances++;
+		done = advances >= RD_EPOCH_LISTS || !rd_epoch_limbo_total();
+		rd_mutex_unlock(&rd_epoch_lock);
+
+		rd_epoch_free_list(freelist, cnt);
+
+		/* Lists detached by other threads may still be
+		 * being freed. */
+		if (done && !__atomic_load_n(&rd_epoch_freeing,
+					     __ATOMIC_ACQUIRE))
+			break;
+
+		sched_yield();
+	}
+}
+
+
+int rd_epoch_pending (void) {
+	rd_epoch_thread_t *ret;
+	int cnt;
+
+	rd_mutex_lock(&rd_epoch_lock);
+	cnt = rd_epoch_limbo_total() +
+		__atomic_load_n(&rd_epoch_freeing, __ATOMIC_RELAXED);
+	LIST_FOREACH(ret, &rd_epoch_threads, ret_link)
+		cnt += __atomic_load_n(&ret->ret_limbo_cnt, __ATOMIC_RELAXED);
+	rd_mutex_unlock(&rd_epoch_lock);
+
+	return cnt;
+}
@@ -0,0 +1,179 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "rd.h"
+#include "rdsysqueue.h"
+
+
+/**
+ * Epoch-based memory reclamation.
+ *
+ * Lets readers traverse shared data structures without locks or atomic
+ * read-modify-write operations while writers replace parts of the
+ * structure: unlinked objects are handed to rd_epoch_retire() and are
+ * only freed once every thread that could still be referencing them
+ * has left its read-side section.
+ *
+ * Readers bracket their accesses with rd_epoch_enter() and
+ * rd_epoch_exit() which only write to the calling thread's own,
+ * cacheline-aligned, record. Sections may be nested.
+ * Writers must serialize among themselves, publish new objects with
+ * release semantics, and retire the objects they unlinked.
+ *
+ * A thread's record is set up on its first rd_epoch_enter() and released
+ * by rd_thread_cleanup() (or rd_epoch_thread_cleanup()).
+ *
+ * Retired objects are collected on the retiring thread's record and
+ * handed over to the shared limbo lists in batches, so retiring takes
+ * no lock in the common case. Objects that embed an rd_epoch_entry_t
+ * are retired with rd_epoch_retire_entry() which does not allocate.
+ *
+ * Usage:
+ *   Reader:
+ *       rd_epoch_enter();
+ *       obj = __atomic_load_n(&shared, __ATOMIC_ACQUIRE);
+ *       ... use obj ...
+ *       rd_epoch_exit();
+ *
+ *   Writer:
+ *       old = shared;
+ *       __atomic_store_n(&shared, new, __ATOMIC_RELEASE);
+ *       rd_epoch_retire(old, free);
+ */
+
+
+/**
+ * Intrusive retire link, embedded in objects passed to
+ * rd_epoch_retire_entry().
+ */
+typedef struct rd_epoch_entry_s {
+	struct rd_epoch_entry_s *ree_next;
+	void (*ree_free_cb) (struct rd_epoch_entry_s *ree);
+} rd_epoch_entry_t;
+
+
+typedef struct rd_epoch_thread_s {
+	volatile uint64_t ret_state;   /* (epoch << 1) | active */
+	int               ret_nest;    /* Section nesting depth */
+	LIST_ENTRY(rd_epoch_thread_s) ret_link;
+
+	/* Objects retired by this thread, not yet handed over.
+	 * Only ret_limbo_cnt is read by other threads. */
+	rd_epoch_entry_t *ret_limbo;
+	rd_epoch_entry_t *ret_limbo_tail;
+	int               ret_limbo_cnt;
+} __attribute__((aligned(64))) rd_epoch_thread_t;
+
+
+extern volatile uint64_t rd_epoch_global;
+extern __thread rd_epoch_thread_t *rd_epoch_thr;
+
+rd_epoch_thread_t *rd_epoch_thread_register (void);
+
+
+/**
+ * Enters a read-side section.
+ */
+static inline void rd_epoch_enter (void) RD_UNUSED;
+static inline void rd_epoch_enter (void) {
+	rd_epoch_thread_t *ret = rd_epoch_thr;
+
+	if (unlikely(!ret))
+		ret = rd_epoch_thread_register();
+
+	if (ret->ret_nest++ > 0)
+		return;
+
+	__atomic_store_n(&ret->ret_state,
+			 (__atomic_load_n(&rd_epoch_global,
+					  __ATOMIC_RELAXED) << 1) | 1,
+			 __ATOMIC_RELAXED);
+	/* Make the announcement visible before any shared reads. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Leaves a read-side section, references obtained in it may no
+ * longer be used.
+ */
+static inline void rd_epoch_exit (void) RD_UNUSED;
+static inline void rd_epoch_exit (void) {
+	rd_epoch_thread_t *ret = rd_epoch_thr;
+
+	if (--ret->ret_nest > 0)
+		return;
+
+	__atomic_store_n(&ret->ret_state, 0, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Schedules 'free_cb(ree)' to be called once no thread can be
+ * referencing the object embedding 'ree' anymore.
+ * The object must already be unreachable for new readers.
+ * Free callbacks run on whichever thread reclaims the object's batch
+ * (a retiring thread, rd_epoch_reclaim() or rd_epoch_barrier()), with
+ * no rdepoch lock held. They may retire objects but must not call
+ * rd_epoch_barrier().
+ */
+void rd_epoch_retire_entry (rd_epoch_entry_t *ree,
+			    void (*free_cb) (rd_epoch_entry_t *ree));
+
+/**
+ * Same as rd_epoch_retire_entry() for objects without an embedded
+ * rd_epoch_entry_t, at the cost of allocating one.
+ */
+void rd_epoch_retire (void *ptr, void (*free_cb) (void *ptr));
+
+/**
+ * Hands over the calling thread's retired objects and frees what can
+ * be freed without waiting for readers.
+ * rd_epoch_retire*() does this once per batch.
+ */
+void rd_epoch_reclaim (void);
+
+/**
+ * Waits for all current readers to leave their sections and frees
+ * everything retired so far by the calling thread, and by other
+ * threads up to their last handed over batch.
+ * Must not be called from within a read-side section.
+ */
+void rd_epoch_barrier (void);
+
+/**
+ * Returns the number of retired objects not yet freed.
+ */
+int rd_epoch_pending (void);
+
+/**
+ * Hands over the calling thread's retired objects and releases its
+ * record.
+ */
+void rd_epoch_thread_cleanup (void);
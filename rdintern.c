@@ -0,0 +1,266 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdintern.h"
+
+
+#define RD_INTERN_BUCKETS_INIT  64
+
+
+/**
+ * FNV-1a
+ */
+static uint32_t rd_intern_hash0 (const char *str, size_t len) {
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0 ; i < len ; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+static inline rd_intern_shard_t *rd_intern_shard (rd_intern_t *ri,
+						   uint32_t hash) {
+	if (!ri->ri_shard_bits)
+		return &ri->ri_shards[0];
+	return &ri->ri_shards[hash >> (32 - ri->ri_shard_bits)];
+}
+
+
+void rd_intern_init (rd_intern_t *ri, const char *name, int shard_cnt) {
+	int i;
+
+	memset(ri, 0, sizeof(*ri));
+
+	if (shard_cnt <= 0)
+		shard_cnt = RD_INTERN_SHARDS_DEFAULT;
+	while ((1 << ri->ri_shard_bits) < shard_cnt)
+		ri->ri_shard_bits++;
+
+	if (posix_memalign((void **)&ri->ri_shards, 64,
+			   sizeof(*ri->ri_shards) << ri->ri_shard_bits))
+		assert(!*"rd_intern_init: out of memory");
+
+	for (i = 0 ; i < (1 << ri->ri_shard_bits) ; i++) {
+		rd_intern_shard_t *rins = &ri->ri_shards[i];
+
+		memset(rins, 0, sizeof(*rins));
+		rd_mutex_init(&rins->rins_lock);
+		rins->rins_bucket_mask = RD_INTERN_BUCKETS_INIT - 1;
+		rins->rins_buckets = calloc(RD_INTERN_BUCKETS_INIT,
+					    sizeof(*rins->rins_buckets));
+	}
+
+	rd_memctx_init(&ri->ri_memctx, name, RD_MEMCTX_F_LOCK);
+}
+
+
+static inline size_t rd_istr_size (const rd_istr_t *ris) {
+	return sizeof(*ris) + ris->ris_len + 1;
+}
+
+
+void rd_intern_destroy (rd_intern_t *ri) {
+	int i;
+
+	for (i = 0 ; i < (1 << ri->ri_shard_bits) ; i++) {
+		rd_intern_shard_t *rins = &ri->ri_shards[i];
+		unsigned int j;
+
+		for (j = 0 ; j <= rins->rins_bucket_mask ; j++) {
+			rd_istr_t *ris, *next;
+
+			for (ris = rins->rins_buckets[j] ; ris ; ris = next) {
+				next = ris->ris_next;
+				rd_memctx_freesz(&ri->ri_memctx, ris,
+						 rd_istr_size(ris));
+			}
+		}
+
+		free(rins->rins_buckets);
+		rd_mutex_destroy(&rins->rins_lock);
+	}
+
+	free(ri->ri_shards);
+	rd_memctx_destroy(&ri->ri_memctx);
+}
+
+
+/**
+ * Returns the bucket chain link pointing to the string matching
+ * 'str', or to the terminating NULL if not found.
+ * Shard must be locked.
+ */
+static rd_istr_t **rd_intern_lookup (rd_intern_shard_t *rins,
+				     const char *str, size_t len,
+				     uint32_t hash) {
+	rd_istr_t **risp = &rins->rins_buckets[hash & rins->rins_bucket_mask];
+
+	for (; *risp ; risp = &(*risp)->ris_next) {
+		const rd_istr_t *ris = *risp;
+		if (ris->ris_hash == hash && ris->ris_len == len &&
+		    !memcmp(ris->ris_str, str, len))
+			break;
+	}
+
+	return risp;
+}
+
+
+/**
+ * Doubles the number of buckets. Shard must be locked.
+ */
+static void rd_intern_grow (rd_intern_shard_t *rins) {
+	unsigned int mask = (rins->rins_bucket_mask << 1) | 1;
+	rd_istr_t **buckets;
+	unsigned int i;
+
+	if (!(buckets = calloc(mask + 1, sizeof(*buckets))))
+		return; /* Keep the longer chains */
+
+	for (i = 0 ; i <= rins->rins_bucket_mask ; i++) {
+		rd_istr_t *ris, *next;
+
+		for (ris = rins->rins_buckets[i] ; ris ; ris = next) {
+			next = ris->ris_next;
+			ris->ris_next = buckets[ris->ris_hash & mask];
+			buckets[ris->ris_hash & mask] = ris;
+		}
+	}
+
+	free(rins->rins_buckets);
+	rins->rins_buckets = buckets;
+	rins->rins_bucket_mask = mask;
+}
+
+
+const char *rd_intern_n (rd_intern_t *ri, const char *str, size_t len) {
+	uint32_t hash = rd_intern_hash0(str, len);
+	rd_intern_shard_t *rins = rd_intern_shard(ri, hash);
+	rd_istr_t **risp, *ris;
+
+	rd_mutex_lock(&rins->rins_lock);
+
+	risp = rd_intern_lookup(rins, str, len, hash);
+	if ((ris = *risp)) {
+		rd_atomic_add(&ris->ris_refcnt, 1);
+		rd_mutex_unlock(&rins->rins_lock);
+		return ris->ris_str;
+	}
+
+	if (!(ris = rd_memctx_malloc(&ri->ri_memctx,
+				     sizeof(*ris) + len + 1))) {
+		rd_mutex_unlock(&rins->rins_lock);
+		return NULL;
+	}
+
+	ris->ris_next   = NULL;
+	ris->ris_hash   = hash;
+	ris->ris_len    = (uint32_t)len;
+	ris->ris_refcnt = 1;
+	memcpy(ris->ris_str, str, len);
+	ris->ris_str[len] = '\0';
+
+	*risp = ris;
+
+	if (__atomic_add_fetch(&rins->rins_cnt, 1, __ATOMIC_RELAXED) >
+	    rins->rins_bucket_mask)
+		rd_intern_grow(rins);
+
+	rd_mutex_unlock(&rins->rins_lock);
+
+	return ris->ris_str;
+}
+
+
+const char *rd_intern_find_n (rd_intern_t *ri, const char *str, size_t len) {
+	uint32_t hash = rd_intern_hash0(str, len);
+	rd_intern_shard_t *rins = rd_intern_shard(ri, hash);
+	rd_istr_t *ris;
+
+	rd_mutex_lock(&rins->rins_lock);
+	if ((ris = *rd_intern_lookup(rins, str, len, hash)))
+		rd_atomic_add(&ris->ris_refcnt, 1);
+	rd_mutex_unlock(&rins->rins_lock);
+
+	return ris ? ris->ris_str : NULL;
+}
+
+
+void rd_intern_release (rd_intern_t *ri, const char *istr) {
+	rd_istr_t *ris = RD_ISTR(istr);
+	rd_intern_shard_t *rins;
+	rd_istr_t **risp;
+	int refcnt = __atomic_load_n(&ris->ris_refcnt, __ATOMIC_RELAXED);
+
+	/* Any but the last reference is released without locking.
+	 * The last one must be released under the shard lock since
+	 * rd_intern_n() may revive the string concurrently. */
+	while (refcnt > 1) {
+		if (__atomic_compare_exchange_n(&ris->ris_refcnt, &refcnt,
+						refcnt - 1, 0,
+						__ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			return;
+	}
+
+	rins = rd_intern_shard(ri, ris->ris_hash);
+	rd_mutex_lock(&rins->rins_lock);
+
+	if (rd_atomic_sub(&ris->ris_refcnt, 1) > 0) {
+		rd_mutex_unlock(&rins->rins_lock);
+		return;
+	}
+
+	risp = &rins->rins_buckets[ris->ris_hash & rins->rins_bucket_mask];
+	while (*risp != ris)
+		risp = &(*risp)->ris_next;
+	*risp = ris->ris_next;
+	__atomic_sub_fetch(&rins->rins_cnt, 1, __ATOMIC_RELAXED);
+
+	rd_mutex_unlock(&rins->rins_lock);
+
+	rd_memctx_freesz(&ri->ri_memctx, ris, rd_istr_size(ris));
+}
+
+
+unsigned int rd_intern_cnt (rd_intern_t *ri) {
+	unsigned int cnt = 0;
+	int i;
+
+	for (i = 0 ; i < (1 << ri->ri_shard_bits) ; i++)
+		cnt += __atomic_load_n(&ri->ri_shards[i].rins_cnt,
+				       __ATOMIC_RELAXED);
+
+	return cnt;
+}
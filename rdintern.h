@@ -0,0 +1,164 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "rd.h"
+#include "rdthread.h"
+#include "rdmem.h"
+
+
+/**
+ * String interning.
+ *
+ * An rd_intern_t pool keeps a single, immutable, reference counted copy
+ * of each unique string. Interning equal strings returns the same
+ * pointer, so interned strings are compared for equality by pointer
+ * (rd_intern_eq()) and their hash and length are available in O(1).
+ *
+ * Interned strings are stable: the pointer is valid until the last
+ * reference is released with rd_intern_release().
+ *
+ * The pool is sharded by hash with a mutex per shard. Taking an extra
+ * reference (rd_intern_ref()) and releasing any but the last reference
+ * are lock-free.
+ * All string memory is accounted for in the pool's memory context
+ * (named after the pool), see rd_memctx_stats() and rd_memctx_dump().
+ *
+ * Usage:
+ *   rd_intern_t pool;
+ *   rd_intern_init(&pool, "topics", 0);
+ *
+ *   const char *t1 = rd_intern(&pool, "mytopic");
+ *   const char *t2 = rd_intern(&pool, buf);
+ *   if (rd_intern_eq(t1, t2)) ...
+ *
+ *   rd_intern_release(&pool, t1);
+ *   rd_intern_release(&pool, t2);
+ */
+
+
+/**
+ * Interned string header, directly precedes the string.
+ */
+typedef struct rd_istr_s {
+	struct rd_istr_s *ris_next;    /* Hash bucket chain */
+	uint32_t          ris_hash;
+	uint32_t          ris_len;
+	int               ris_refcnt;
+	char              ris_str[];
+} rd_istr_t;
+
+#define RD_ISTR(istr) \
+	((rd_istr_t *)((char *)(istr) - RD_OFFSETOF(rd_istr_t, ris_str)))
+
+
+typedef struct rd_intern_shard_s {
+	rd_mutex_t    rins_lock;
+	rd_istr_t   **rins_buckets;
+	unsigned int  rins_bucket_mask;
+	unsigned int  rins_cnt;
+} __attribute__((aligned(64))) rd_intern_shard_t;
+
+
+typedef struct rd_intern_s {
+	rd_intern_shard_t *ri_shards;
+	int                ri_shard_bits;
+	rd_memctx_t        ri_memctx;
+} rd_intern_t;
+
+
+#define RD_INTERN_SHARDS_DEFAULT  16
+
+
+/**
+ * Initializes an intern pool with 'shard_cnt' shards (rounded up to a
+ * power of 2, 0 for RD_INTERN_SHARDS_DEFAULT).
+ * 'name' is used for the pool's memory context.
+ */
+void rd_intern_init (rd_intern_t *ri, const char *name, int shard_cnt);
+
+/**
+ * Frees the pool and all its strings, whether released or not.
+ */
+void rd_intern_destroy (rd_intern_t *ri);
+
+
+/**
+ * Returns the interned copy of the 'len' bytes at 'str', which need not
+ * be nul-terminated, with a reference held.
+ * The string is added to the pool if not already present.
+ * Returns NULL on memory allocation failure.
+ */
+const char *rd_intern_n (rd_intern_t *ri, const char *str, size_t len);
+
+/**
+ * Same as rd_intern_n() for a nul-terminated string.
+ */
+#define rd_intern(ri,str)  rd_intern_n(ri, str, strlen(str))
+
+/**
+ * Returns the interned copy of 'str' with a reference held, or NULL if
+ * 'str' is not in the pool. The pool is not modified.
+ */
+const char *rd_intern_find_n (rd_intern_t *ri, const char *str, size_t len);
+#define rd_intern_find(ri,str)  rd_intern_find_n(ri, str, strlen(str))
+
+
+/**
+ * Takes an additional reference to an interned string.
+ */
+static inline const char *rd_intern_ref (const char *istr) RD_UNUSED;
+static inline const char *rd_intern_ref (const char *istr) {
+	rd_atomic_add(&RD_ISTR(istr)->ris_refcnt, 1);
+	return istr;
+}
+
+/**
+ * Releases a reference to an interned string, the string is freed
+ * with the last reference.
+ */
+void rd_intern_release (rd_intern_t *ri, const char *istr);
+
+
+/**
+ * Interned strings are equal if and only if their pointers are equal
+ * (for strings from the same pool).
+ */
+#define rd_intern_eq(istr1,istr2)  ((istr1) == (istr2))
+
+/**
+ * Returns the (cached) length and hash of an interned string.
+ */
+#define rd_intern_len(istr)   ((size_t)RD_ISTR(istr)->ris_len)
+#define rd_intern_hash(istr)  (RD_ISTR(istr)->ris_hash)
+
+/**
+ * Returns the number of unique strings in the pool.
+ */
+unsigned int rd_intern_cnt (rd_intern_t *ri);
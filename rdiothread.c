@@ -128,7 +128,9 @@ static rd_thread_t *rd_io_worker_get (void) {
 			if (rd_io_worker_cnt >= RD_IO_THREAD_WORKERS_MAX) {
 				/* Must not create more workers, wait for
 				 * some to become available. */
-				rdbg("Out of IO worker threads, waiting...");
+				rdbg_fac(RD_LOG_FAC_IO,
+					 "Out of IO worker threads, "
+					 "waiting...");
 				usleep(5000);
 				continue;
 			}
@@ -193,7 +195,8 @@ static void *rd_io_thread_main (void *arg) {
 			if (errno == EINTR)
 				continue;
 			/* FIXME: log */
-			rdbg("epoll_wait failed: %s", strerror(errno));
+			rdbg_fac(RD_LOG_FAC_IO, "epoll_wait failed: %s",
+				 strerror(errno));
 			assert(!*"rd:io epoll_wait failed");
 		}
 
@@ -217,14 +220,16 @@ static int rd_io_thread_start (void) {
 
 	if ((rd_io_thread_fd = epoll_create(100)) == -1) {
 		/* FIXME: log */
-		rdbg("Failed to create epoll fd: %s", strerror(errno));
+		rdbg_fac(RD_LOG_FAC_IO, "Failed to create epoll fd: %s",
+			 strerror(errno));
 		return -1;
 	}
 
 	if (rd_thread_create(&rd_io_thread, "rd:io", NULL,
 			     rd_io_thread_main, NULL) == -1) {
 		/* FIXME: log */
-		rdbg("Failed to create rd:io thread: %s", strerror(errno));
+		rdbg_fac(RD_LOG_FAC_IO, "Failed to create rd:io thread: %s",
+			 strerror(errno));
 		close(rd_io_thread_fd);
 		rd_io_thread_fd = -1;
 		return -1;
@@ -314,9 +319,9 @@ int rd_io_add (int fd, int events, int flags, rd_thread_t *target_thread,
 	if (epoll_ctl(rd_io_thread_fd, new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
 		      rioh->rioh_fd, &ev) == -1) {
 		/* FIXME: log */
-		rdbg("epoll_ctl(%i, %s, fd %i) failed: %s",
-		     rd_io_thread_fd, new ? "ADD":"MOD",  rioh->rioh_fd,
-		     strerror(errno));
+		rdbg_fac(RD_LOG_FAC_IO, "epoll_ctl(%i, %s, fd %i) failed: %s",
+			 rd_io_thread_fd, new ? "ADD":"MOD",  rioh->rioh_fd,
+			 strerror(errno));
 		rd_io_hnd_destroy(rioh); /* from .._get() */
 		rd_io_hnd_destroy(rioh); /* pre epoll_ctl */
 	}
@@ -29,104 +29,1111 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <sys/uio.h>
 
 #include "rd.h"
 #include "rdthread.h"
 #include "rdlog.h"
+#include "rdsysqueue.h"
 
 
 
 
-#define RD_DBG_CTXS_MAX 32
-static __thread char *rd_dbg_ctxs[RD_DBG_CTXS_MAX];
+/**
+ * Debug context stack: the contexts are kept preformatted as
+ * "[ctx1]->[ctx2]" in a thread-local buffer, with the buffer offset of
+ * each pushed context saved for pop.
+ */
+#define RD_DBG_CTXS_MAX     32
+#define RD_DBG_CTX_BUF_SIZE 256
+static __thread char rd_dbg_ctx_buf[RD_DBG_CTX_BUF_SIZE];
+static __thread int rd_dbg_ctx_ofs[RD_DBG_CTXS_MAX];
+static __thread int rd_dbg_ctx_len = 0;
 static __thread int rd_dbg_ctx_idx = 0;
 static __thread int rd_dbg_ctx_wanted_idx = 0;
 
-static int rd_current_severity = LOG_INFO;
+int rd_log_severity[RD_LOG_FAC_MAX] = {
+	[0 ... RD_LOG_FAC_MAX-1] = LOG_INFO
+};
 
 void rd_log_set_severity (int severity) {
-	rd_current_severity = severity;
+	int i;
+
+	for (i = 0 ; i < RD_LOG_FAC_MAX ; i++)
+		rd_log_severity[i] = severity;
+}
+
+void rd_log_set_severity_fac (rd_log_fac_t fac, int severity) {
+	assert((unsigned int)fac < RD_LOG_FAC_MAX);
+	rd_log_severity[fac] = severity;
 }
 
 
 void rd_dbg_ctx_push (const char *fmt, ...) {
 	va_list ap;
-	char *buf;
+	int of;
+	int r;
 
-	rd_dbg_ctx_wanted_idx++;
-
-	if (rd_dbg_ctx_idx + 1 == RD_DBG_CTXS_MAX)
+	/* Contexts that don't fit are only counted so that pops
+	 * stay balanced. */
+	if (rd_dbg_ctx_wanted_idx++ != rd_dbg_ctx_idx ||
+	    rd_dbg_ctx_idx == RD_DBG_CTXS_MAX)
 		return;
 
-	buf = malloc(64);
+	of = rd_dbg_ctx_len;
 
-	va_start(ap, fmt);
-	vsnprintf(buf, 64, "%s", ap);
-	va_end(ap);
+	r = snprintf(rd_dbg_ctx_buf+of, sizeof(rd_dbg_ctx_buf)-of, "%s[",
+		     rd_dbg_ctx_idx ? "->" : "");
+	if (r < sizeof(rd_dbg_ctx_buf)-of) {
+		int r2;
+
+		va_start(ap, fmt);
+		r2 = vsnprintf(rd_dbg_ctx_buf+of+r,
+			       sizeof(rd_dbg_ctx_buf)-of-r, fmt, ap);
+		va_end(ap);
+		r += r2;
+
+		if (r + 1 < sizeof(rd_dbg_ctx_buf)-of) {
+			rd_dbg_ctx_buf[of+r++] = ']';
+			rd_dbg_ctx_buf[of+r] = '\0';
+			rd_dbg_ctx_ofs[rd_dbg_ctx_idx++] = of;
+			rd_dbg_ctx_len = of + r;
+			return;
+		}
+	}
 
-	rd_dbg_ctx_idx++;
+	/* Didn't fit: revert. */
+	rd_dbg_ctx_buf[of] = '\0';
 }
 
 void rd_dbg_ctx_pop (void) {
-	assert(rd_dbg_ctx_wanted_idx-- > 0);
-	assert(rd_dbg_ctx_idx-- > 0);
-	free(rd_dbg_ctxs[rd_dbg_ctx_idx]);
+	assert(rd_dbg_ctx_wanted_idx > 0);
+
+	if (rd_dbg_ctx_wanted_idx-- > rd_dbg_ctx_idx)
+		return;
+
+	rd_dbg_ctx_len = rd_dbg_ctx_ofs[--rd_dbg_ctx_idx];
+	rd_dbg_ctx_buf[rd_dbg_ctx_len] = '\0';
 }
 
 void rd_dbg_ctx_clear (void) {
-	while (rd_dbg_ctx_idx > 0)
-		rd_dbg_ctx_pop();
+	rd_dbg_ctx_idx = 0;
+	rd_dbg_ctx_wanted_idx = 0;
+	rd_dbg_ctx_len = 0;
+	rd_dbg_ctx_buf[0] = '\0';
 }
 
 
+int rd_log_rl_check (rd_log_rl_t *rlrl, int rate, int burst) {
+	const int64_t interval = 1000000 / RD_MAX(rate, 1);
+	const int64_t now = (int64_t)rd_clock();
+	int64_t tat = __atomic_load_n(&rlrl->rlrl_tat, __ATOMIC_RELAXED);
+	int64_t ntat;
+
+	do {
+		ntat = RD_MAX(tat, now);
+		if (ntat - now > (int64_t)(RD_MAX(burst, 1) - 1) * interval) {
+			rd_atomic_add(&rlrl->rlrl_suppressed, 1);
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&rlrl->rlrl_tat, &tat,
+					      ntat + interval, 0,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	if (likely(!rlrl->rlrl_suppressed))
+		return 0;
+
+	return __atomic_exchange_n(&rlrl->rlrl_suppressed, 0,
+				   __ATOMIC_RELAXED);
+}
+
+
+#define RD_LOG_LINE_MAX  4096
+
+/**
+ * Returns the calling thread's name for log output.
+ */
+static const char *rd_log_thrname (void) {
+	static __thread char thrname[20];
+
+	if (rd_currthread)
+		return rd_currthread->rdt_name;
+
+	if (unlikely(!*thrname))
+		snprintf(thrname, sizeof(thrname), "thr:%lx",
+			 (unsigned long)pthread_self());
+
+	return thrname;
+}
+
+
+/**
+ * Writes the "|<ts>|<func>:<line>|<thread>| " log line prefix.
+ * Returns the number of bytes written (truncated to 'size').
+ */
+static int rd_log_prefix (char *buf, size_t size, rd_ts_t ts,
+			  const char *func, int line, const char *thrname) {
+	int r = snprintf(buf, size, "|%"PRIu64".%06"PRIu64"|%s:%i|%s| ",
+			 ts / (uint64_t)1000000,
+			 ts % (uint64_t)1000000,
+			 func, line, thrname);
+
+	return RD_MIN(r, (int)size - 1);
+}
 
-void rdputs0 (const char *file, const char *func, int line,
-		int severity, const char *fmt, ...) {
-	va_list ap;
-	char buf[4096];
-	int of = 0;
-	int i;
-	int r RD_UNUSED;
-	rd_ts_t now;
-	static __thread char thrname[16];
-	int printf_rc;
 
-	if (severity > rd_current_severity)
+/**
+ * Asynchronous logging
+ *
+ * Each logging thread owns a byte ring of records. Records are
+ * 8-byte aligned and never wrap: if a record does not fit at the end of
+ * the ring a SKIP record pads out the remainder and the record is
+ * written at the start.
+ * The producer (logging thread) only writes rlrg_head and the consumer
+ * (log thread) only writes rlrg_tail, so no locks are needed on the
+ * fast path.
+ */
+
+typedef struct rd_log_rec_s {
+	uint32_t rlr_len;        /* Payload length */
+	int16_t  rlr_type;
+#define RD_LOG_REC_TEXT  0
+#define RD_LOG_REC_SKIP  1
+#define RD_LOG_REC_BIN   2
+	int16_t  rlr_severity;
+} rd_log_rec_t;
+
+#define RD_LOG_REC_SIZE(len) \
+	((sizeof(rd_log_rec_t) + (len) + 7) & ~(size_t)7)
+
+#define RD_LOG_RING_SIZE_MIN  (16 * 1024)
+#define RD_LOG_RING_SIZE_DEF  (64 * 1024)
+
+typedef struct rd_log_ring_s {
+	TAILQ_ENTRY(rd_log_ring_s) rlrg_link;
+	char      *rlrg_buf;
+	uint64_t   rlrg_size;               /* Power of two */
+	char       rlrg_name[20];           /* Owner thread name */
+	int        rlrg_orphaned;           /* Owner thread has exited */
+
+	/* Producer */
+	uint64_t   rlrg_head __attribute__((aligned(64)));
+	uint64_t   rlrg_drops;
+
+	/* Consumer */
+	uint64_t   rlrg_tail __attribute__((aligned(64)));
+	uint64_t   rlrg_drops_seen;
+} rd_log_ring_t;
+
+
+static struct {
+	rd_mutex_t lock;
+	rd_cond_t  cond;        /* Wakes up an idle log thread */
+	TAILQ_HEAD(, rd_log_ring_s) rings;
+	int        enabled;     /* Producers should use their rings */
+	int        run;         /* Log thread should keep running */
+	int        running;     /* Log thread is running */
+	int        idle;        /* Log thread is (about to be) waiting */
+	pthread_t  thread;
+	int        fd;
+	size_t     ring_size;
+	uint64_t   written;
+	uint64_t   dropped;
+} rd_log_async = {
+	.lock  = RD_MUTEX_INITIALIZER,
+	.cond  = RD_COND_INITIALIZER,
+	.rings = TAILQ_HEAD_INITIALIZER(rd_log_async.rings),
+};
+
+static __thread rd_log_ring_t *rd_log_ring;
+
+
+static rd_log_ring_t *rd_log_ring_new (size_t size) {
+	rd_log_ring_t *rlrg;
+
+	if (posix_memalign((void **)&rlrg, 64, sizeof(*rlrg)))
+		return NULL;
+	memset(rlrg, 0, sizeof(*rlrg));
+
+	if (!(rlrg->rlrg_buf = malloc(size))) {
+		free(rlrg);
+		return NULL;
+	}
+	rlrg->rlrg_size = size;
+
+	snprintf(rlrg->rlrg_name, sizeof(rlrg->rlrg_name), "%s",
+		 rd_log_thrname());
+
+	return rlrg;
+}
+
+static void rd_log_ring_destroy (rd_log_ring_t *rlrg) {
+	free(rlrg->rlrg_buf);
+	free(rlrg);
+}
+
+
+/**
+ * Returns the calling thread's ring, creating and registering it
+ * on first use.
+ */
+static rd_log_ring_t *rd_log_ring_get (void) {
+	rd_log_ring_t *rlrg;
+
+	if (likely(rd_log_ring != NULL))
+		return rd_log_ring;
+
+	if (!(rlrg = rd_log_ring_new(rd_log_async.ring_size)))
+		return NULL;
+
+	rd_mutex_lock(&rd_log_async.lock);
+	TAILQ_INSERT_TAIL(&rd_log_async.rings, rlrg, rlrg_link);
+	rd_mutex_unlock(&rd_log_async.lock);
+
+	return (rd_log_ring = rlrg);
+}
+
+
+/**
+ * Called from rd_thread_cleanup() when a thread exits.
+ * The ring is handed over to the log thread which frees it once drained.
+ */
+void rd_log_thread_cleanup (void) {
+	rd_log_ring_t *rlrg = rd_log_ring;
+
+	if (!rlrg)
 		return;
 
-	now = rd_clock();
+	rd_log_ring = NULL;
+
+	rd_mutex_lock(&rd_log_async.lock);
+	if (rd_log_async.running) {
+		rlrg->rlrg_orphaned = 1;
+		/* Let the log thread drain and free it. */
+		rd_cond_signal(&rd_log_async.cond);
+	} else {
+		TAILQ_REMOVE(&rd_log_async.rings, rlrg, rlrg_link);
+		rd_log_ring_destroy(rlrg);
+	}
+	rd_mutex_unlock(&rd_log_async.lock);
+}
+
 
-	if (unlikely(!rd_currthread && !*thrname)) {
-		const pthread_t tid = pthread_self();
-		char *cursor = thrname;
-		int of = sprintf(cursor, "thr:");
+/**
+ * Producer: appends a record to the ring.
+ * Returns 0 on success or -1 if the ring is full (the record is dropped).
+ */
+static int rd_log_ring_put (rd_log_ring_t *rlrg, int type, int severity,
+			    const void *ptr, size_t len) {
+	const uint64_t mask = rlrg->rlrg_size - 1;
+	uint64_t head = rlrg->rlrg_head;
+	uint64_t tail = __atomic_load_n(&rlrg->rlrg_tail, __ATOMIC_ACQUIRE);
+	size_t need = RD_LOG_REC_SIZE(len);
+	size_t contig = rlrg->rlrg_size - (head & mask);
+	size_t skip = contig < need ? contig : 0;
+	const uint64_t head0 = head;
+	rd_log_rec_t *rlr;
 
-		for (i=0; i<sizeof(tid) && of < sizeof(thrname);
-		    ++i) {
-			cursor += snprintf(cursor, sizeof(thrname), "%02x",
-					   ((uint8_t *)&tid)[i]);
+	if (unlikely(need + skip > rlrg->rlrg_size - (head - tail))) {
+		__atomic_add_fetch(&rlrg->rlrg_drops, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (skip) {
+		rlr = (rd_log_rec_t *)(rlrg->rlrg_buf + (head & mask));
+		rlr->rlr_type = RD_LOG_REC_SKIP;
+		rlr->rlr_len  = skip - sizeof(*rlr);
+		head += skip;
+	}
+
+	rlr = (rd_log_rec_t *)(rlrg->rlrg_buf + (head & mask));
+	rlr->rlr_type     = type;
+	rlr->rlr_severity = severity;
+	rlr->rlr_len      = len;
+	memcpy(rlr+1, ptr, len);
+
+	__atomic_store_n(&rlrg->rlrg_head, head + need, __ATOMIC_RELEASE);
+
+	/* Wake up the log thread if it is idle and the ring went from
+	 * empty to non-empty. Pairs with the fence in rd_log_async_idle():
+	 * either the log thread sees the new head or we see it idle. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (unlikely(__atomic_load_n(&rd_log_async.idle, __ATOMIC_ACQUIRE)) &&
+	    __atomic_load_n(&rlrg->rlrg_tail, __ATOMIC_ACQUIRE) == head0) {
+		rd_mutex_lock(&rd_log_async.lock);
+		rd_cond_signal(&rd_log_async.cond);
+		rd_mutex_unlock(&rd_log_async.lock);
+	}
+
+	return 0;
+}
+
+/**
+ * Binary (deferred) log records
+ *
+ * The payload of a RD_LOG_REC_BIN record is an rd_log_bin_t followed by
+ * the calling thread's debug context (rlb_ctxlen bytes, 8-byte aligned)
+ * and the raw arguments, in format string order, each in an 8-byte
+ * aligned slot. Strings are copied as a uint32_t length followed by the
+ * nul-terminated string, or a length of UINT32_MAX for NULL.
+ * The format string itself is referenced by pointer and must thus
+ * outlive the record, which holds for string literals.
+ */
+
+typedef struct rd_log_bin_s {
+	const char *rlb_fmt;
+	const char *rlb_func;
+	rd_ts_t     rlb_ts;
+	int         rlb_line;
+	int         rlb_argsize;
+	int         rlb_ctxlen;    /* Debug context length, 0 if none */
+} rd_log_bin_t;
+
+#define RD_LOG_BIN_CTX(rlb)   ((const char *)((rlb)+1))
+#define RD_LOG_BIN_ARGS(rlb)						\
+	(RD_LOG_BIN_CTX(rlb) + RD_LOG_ARG_SLOT((rlb)->rlb_ctxlen))
+
+typedef enum {
+	RD_LOG_ARG_NONE,        /* "%%" */
+	RD_LOG_ARG_INT,         /* int, and promoted char and short */
+	RD_LOG_ARG_LONG,
+	RD_LOG_ARG_LLONG,
+	RD_LOG_ARG_SIZE,
+	RD_LOG_ARG_INTMAX,
+	RD_LOG_ARG_PTRDIFF,
+	RD_LOG_ARG_DOUBLE,
+	RD_LOG_ARG_LDOUBLE,
+	RD_LOG_ARG_PTR,
+	RD_LOG_ARG_STR,
+	RD_LOG_ARG_INVALID,     /* Not deferrable: %n, %m, wide chars.. */
+} rd_log_arg_t;
+
+typedef struct rd_log_spec_s {
+	const char  *rls_start;     /* The '%' */
+	int          rls_len;       /* Length including '%' and conversion */
+	int          rls_stars;     /* Number of '*' width/precision args */
+	int          rls_prec;      /* Literal precision, -1 if none */
+	int          rls_prec_star; /* Precision is the last '*' arg */
+	rd_log_arg_t rls_arg;
+} rd_log_spec_t;
+
+#define RD_LOG_SPEC_MAX        32
+#define RD_LOG_ARG_SLOT(size)  (((size) + 7) & ~(size_t)7)
+
+
+/**
+ * Parses the next conversion specification in 'fmt' into 'rls'.
+ * Returns a pointer past the specification, or NULL if there is none.
+ */
+static const char *rd_log_spec_next (const char *fmt, rd_log_spec_t *rls) {
+	const char *s;
+	int lmod = 0;   /* 'h', 'H' (hh), 'l', 'q' (ll), 'L', 'j', 'z', 't' */
+
+	if (!(s = strchr(fmt, '%')))
+		return NULL;
+
+	rls->rls_start = s++;
+	rls->rls_stars = 0;
+	rls->rls_prec = -1;
+	rls->rls_prec_star = 0;
+
+	while (*s && strchr("-+ #0'", *s))
+		s++;
+
+	if (*s == '*') {
+		rls->rls_stars++;
+		s++;
+	} else
+		while (*s >= '0' && *s <= '9')
+			s++;
+
+	if (*s == '.') {
+		s++;
+		if (*s == '*') {
+			rls->rls_stars++;
+			rls->rls_prec_star = 1;
+			s++;
+		} else {
+			/* Capped, long specifications are rejected below. */
+			rls->rls_prec = 0;
+			while (*s >= '0' && *s <= '9')
+				rls->rls_prec = RD_MIN(rls->rls_prec * 10 +
+						       (*s++ - '0'),
+						       100000000);
 		}
 	}
 
-	of += snprintf(buf+of, sizeof(buf)-of,
-		       "|%"PRIu64".%06"PRIu64"|%s:%i|%s| ",
-		       now / (uint64_t)1000000,
-		       now % (uint64_t)1000000,
-		       func, line,
-		       rd_currthread ? rd_currthread->rdt_name : thrname);
+	switch (*s)
+	{
+	case 'h':
+		lmod = *++s == 'h' ? (s++, 'H') : 'h';
+		break;
+	case 'l':
+		lmod = *++s == 'l' ? (s++, 'q') : 'l';
+		break;
+	case 'q':
+	case 'L':
+		lmod = 'q';
+		s++;
+		break;
+	case 'j':
+	case 'z':
+	case 'Z':
+	case 't':
+		lmod = *s++;
+		break;
+	}
+
+	switch (*s)
+	{
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		switch (lmod)
+		{
+		case 'l':
+			rls->rls_arg = RD_LOG_ARG_LONG;
+			break;
+		case 'q':
+			rls->rls_arg = RD_LOG_ARG_LLONG;
+			break;
+		case 'j':
+			rls->rls_arg = RD_LOG_ARG_INTMAX;
+			break;
+		case 'z':
+		case 'Z':
+			rls->rls_arg = RD_LOG_ARG_SIZE;
+			break;
+		case 't':
+			rls->rls_arg = RD_LOG_ARG_PTRDIFF;
+			break;
+		default:
+			rls->rls_arg = RD_LOG_ARG_INT;
+			break;
+		}
+		break;
+
+	case 'c':
+		rls->rls_arg = lmod ? RD_LOG_ARG_INVALID : RD_LOG_ARG_INT;
+		break;
+
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		rls->rls_arg = lmod == 'q' ?
+			RD_LOG_ARG_LDOUBLE : RD_LOG_ARG_DOUBLE;
+		break;
+
+	case 's':
+		rls->rls_arg = lmod ? RD_LOG_ARG_INVALID : RD_LOG_ARG_STR;
+		break;
 
-	if (rd_dbg_ctx_idx > 0) {
-		for (i = 0 ; i < rd_dbg_ctx_idx ; i++)
-			of += snprintf(buf+of, sizeof(buf)-of, "%s[%s]",
-				       i ? "->" : "",
-				       rd_dbg_ctxs[i]);
+	case 'p':
+		rls->rls_arg = RD_LOG_ARG_PTR;
+		break;
 
-		of += snprintf(buf+of, sizeof(buf)-of, " ");
+	case '%':
+		rls->rls_arg = RD_LOG_ARG_NONE;
+		break;
+
+	default:
+		rls->rls_arg = RD_LOG_ARG_INVALID;
+		return NULL;
 	}
 
-	va_start(ap, fmt);
+	s++;
+	rls->rls_len = (int)(s - rls->rls_start);
+	if (rls->rls_len >= RD_LOG_SPEC_MAX)
+		rls->rls_arg = RD_LOG_ARG_INVALID;
+
+	return s;
+}
+
+
+/**
+ * Producer: copies the arguments described by 'fmt' from 'ap' into 'buf'.
+ * Strings are truncated to fit 'size'.
+ * Returns the number of bytes used, or -1 if 'fmt' can't be deferred.
+ */
+static int rd_log_bin_encode (char *buf, size_t size,
+			      const char *fmt, va_list ap) {
+	rd_log_spec_t rls = { .rls_arg = RD_LOG_ARG_NONE };
+	size_t of = 0;
+	int prec;
+	int i;
+
+#define RD_LOG_ARG_PUT(TYPE,PTYPE) do {					\
+		TYPE v = (TYPE)va_arg(ap, PTYPE);			\
+		if (of + RD_LOG_ARG_SLOT(sizeof(v)) > size)		\
+			return -1;					\
+		memcpy(buf+of, &v, sizeof(v));				\
+		of += RD_LOG_ARG_SLOT(sizeof(v));			\
+	} while (0)
+
+	while ((fmt = rd_log_spec_next(fmt, &rls))) {
+
+		for (i = 0 ; i < rls.rls_stars ; i++)
+			RD_LOG_ARG_PUT(int, int);
+
+		/* A '*' precision is the last star argument,
+		 * negative is taken as omitted. */
+		prec = rls.rls_prec;
+		if (rls.rls_prec_star)
+			memcpy(&prec, buf+of-RD_LOG_ARG_SLOT(sizeof(prec)),
+			       sizeof(prec));
+
+		switch (rls.rls_arg)
+		{
+		case RD_LOG_ARG_NONE:
+			break;
+		case RD_LOG_ARG_INT:
+			RD_LOG_ARG_PUT(int, int);
+			break;
+		case RD_LOG_ARG_LONG:
+			RD_LOG_ARG_PUT(long, long);
+			break;
+		case RD_LOG_ARG_LLONG:
+			RD_LOG_ARG_PUT(long long, long long);
+			break;
+		case RD_LOG_ARG_SIZE:
+			RD_LOG_ARG_PUT(size_t, size_t);
+			break;
+		case RD_LOG_ARG_INTMAX:
+			RD_LOG_ARG_PUT(intmax_t, intmax_t);
+			break;
+		case RD_LOG_ARG_PTRDIFF:
+			RD_LOG_ARG_PUT(ptrdiff_t, ptrdiff_t);
+			break;
+		case RD_LOG_ARG_DOUBLE:
+			RD_LOG_ARG_PUT(double, double);
+			break;
+		case RD_LOG_ARG_LDOUBLE:
+			RD_LOG_ARG_PUT(long double, long double);
+			break;
+		case RD_LOG_ARG_PTR:
+			RD_LOG_ARG_PUT(void *, void *);
+			break;
+		case RD_LOG_ARG_STR:
+		{
+			const char *str = va_arg(ap, const char *);
+			uint32_t len = UINT32_MAX;
+
+			if (of + sizeof(len) + 1 > size)
+				return -1;
+
+			if (str) {
+				size_t max = size - of - sizeof(len) - 1;
+
+				/* Like printf, don't read past the
+				 * precision: the string need not be
+				 * nul-terminated. */
+				if (prec >= 0)
+					max = RD_MIN(max, (size_t)prec);
+				len = strnlen(str, max);
+				memcpy(buf+of+sizeof(len), str, len);
+				buf[of+sizeof(len)+len] = '\0';
+			}
+			memcpy(buf+of, &len, sizeof(len));
+
+			of += RD_LOG_ARG_SLOT(sizeof(len) +
+					      (str ? len + 1 : 0));
+			of = RD_MIN(of, size);
+			break;
+		}
+		case RD_LOG_ARG_INVALID:
+			return -1;
+		}
+	}
+
+	/* Trailing unsupported conversion. */
+	if (rls.rls_arg == RD_LOG_ARG_INVALID)
+		return -1;
+
+	return (int)of;
+}
+
+
+/**
+ * Consumer: formats a binary record's message into 'buf'
+ * using the format string's own conversion specifications.
+ * Returns the number of bytes written (truncated to 'size').
+ */
+static int rd_log_bin_format (char *buf, size_t size,
+			      const rd_log_bin_t *rlb) {
+	const char *args = RD_LOG_BIN_ARGS(rlb);
+	const char *fmt = rlb->rlb_fmt;
+	const char *next;
+	rd_log_spec_t rls;
+	size_t aof = 0;
+	size_t of = 0;
+
+#define RD_LOG_ARG_GET(DST,TYPE) do {					\
+		TYPE _v;						\
+		memcpy(&_v, args+aof, sizeof(_v));			\
+		aof += RD_LOG_ARG_SLOT(sizeof(_v));			\
+		DST = _v;						\
+	} while (0)
+
+#define RD_LOG_ARG_PRINTF(TYPE) do {					\
+		TYPE v;							\
+		RD_LOG_ARG_GET(v, TYPE);				\
+		r = rls.rls_stars == 0 ?				\
+			snprintf(buf+of, size-of, spec, v) :		\
+			rls.rls_stars == 1 ?				\
+			snprintf(buf+of, size-of, spec, star[0], v) :	\
+			snprintf(buf+of, size-of, spec, star[0], star[1], v); \
+	} while (0)
+
+	while (of < size - 1 && (next = rd_log_spec_next(fmt, &rls))) {
+		char spec[RD_LOG_SPEC_MAX];
+		int star[2] = { 0, 0 };
+		int r = 0;
+		int i;
+
+		/* Literal text up to the specification. */
+		r = RD_MIN((size_t)(rls.rls_start - fmt), size - 1 - of);
+		memcpy(buf+of, fmt, r);
+		of += r;
+		fmt = next;
+
+		memcpy(spec, rls.rls_start, rls.rls_len);
+		spec[rls.rls_len] = '\0';
+
+		for (i = 0 ; i < rls.rls_stars ; i++)
+			RD_LOG_ARG_GET(star[i], int);
+
+		switch (rls.rls_arg)
+		{
+		case RD_LOG_ARG_NONE:
+			r = snprintf(buf+of, size-of, "%%");
+			break;
+		case RD_LOG_ARG_INT:
+			RD_LOG_ARG_PRINTF(int);
+			break;
+		case RD_LOG_ARG_LONG:
+			RD_LOG_ARG_PRINTF(long);
+			break;
+		case RD_LOG_ARG_LLONG:
+			RD_LOG_ARG_PRINTF(long long);
+			break;
+		case RD_LOG_ARG_SIZE:
+			RD_LOG_ARG_PRINTF(size_t);
+			break;
+		case RD_LOG_ARG_INTMAX:
+			RD_LOG_ARG_PRINTF(intmax_t);
+			break;
+		case RD_LOG_ARG_PTRDIFF:
+			RD_LOG_ARG_PRINTF(ptrdiff_t);
+			break;
+		case RD_LOG_ARG_DOUBLE:
+			RD_LOG_ARG_PRINTF(double);
+			break;
+		case RD_LOG_ARG_LDOUBLE:
+			RD_LOG_ARG_PRINTF(long double);
+			break;
+		case RD_LOG_ARG_PTR:
+			RD_LOG_ARG_PRINTF(void *);
+			break;
+		case RD_LOG_ARG_STR:
+		{
+			const char *v = NULL;
+			uint32_t len;
+
+			memcpy(&len, args+aof, sizeof(len));
+			if (len != UINT32_MAX)
+				v = args+aof+sizeof(len);
+			aof += RD_LOG_ARG_SLOT(sizeof(len) +
+					       (v ? len + 1 : 0));
+
+			r = rls.rls_stars == 0 ?
+				snprintf(buf+of, size-of, spec, v) :
+				rls.rls_stars == 1 ?
+				snprintf(buf+of, size-of, spec, star[0], v) :
+				snprintf(buf+of, size-of, spec,
+					 star[0], star[1], v);
+			break;
+		}
+		case RD_LOG_ARG_INVALID:
+			/* Not reached: rejected by the producer. */
+			r = 0;
+			break;
+		}
+
+		if (r > 0)
+			of = RD_MIN(of + r, size - 1);
+	}
+
+	/* Trailing literal text. */
+	if (of < size - 1) {
+		size_t r = RD_MIN(strlen(fmt), size - 1 - of);
+		memcpy(buf+of, fmt, r);
+		of += r;
+	}
+
+	buf[of] = '\0';
+	return (int)of;
+}
+
+
+/**
+ * Consumer: formats a binary record as a complete log line.
+ * Returns the line length.
+ */
+static int rd_log_bin_line (char *buf, size_t size, const char *thrname,
+			    const rd_log_rec_t *rlr) {
+	const rd_log_bin_t *rlb = (const rd_log_bin_t *)(rlr+1);
+	int of;
+
+	of = rd_log_prefix(buf, size, rlb->rlb_ts,
+			   rlb->rlb_func, rlb->rlb_line, thrname);
+	if (rlb->rlb_ctxlen > 0)
+		of += snprintf(buf+of, size-of, "%.*s ",
+			       rlb->rlb_ctxlen, RD_LOG_BIN_CTX(rlb));
+	of += rd_log_bin_format(buf+of, size-of-1, rlb);
+	buf[of++] = '\n';
+
+	return of;
+}
+
+
+/**
+ * Writes all of 'iov' to 'fd', retrying partial writes.
+ */
+static void rd_log_writev (int fd, struct iovec *iov, int iovcnt) {
+
+	while (iovcnt > 0) {
+		ssize_t r = writev(fd, iov, iovcnt);
+
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		while (iovcnt > 0 && r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+}
+
+
+/**
+ * Consumer: writes out all records currently in the ring.
+ * Text records are written straight from the ring memory.
+ * Returns the number of records written.
+ */
+static int rd_log_ring_drain (rd_log_ring_t *rlrg, int fd) {
+	const uint64_t mask = rlrg->rlrg_size - 1;
+	uint64_t head = __atomic_load_n(&rlrg->rlrg_head, __ATOMIC_ACQUIRE);
+	uint64_t tail = rlrg->rlrg_tail;
+	struct iovec iov[64];
+	int iovcnt = 0;
+	char stage[4 * RD_LOG_LINE_MAX];  /* Formatted binary records */
+	size_t stof = 0;
+	int cnt = 0;
+	uint64_t drops;
+
+	while (tail < head) {
+		const rd_log_rec_t *rlr =
+			(const rd_log_rec_t *)(rlrg->rlrg_buf + (tail & mask));
+		const char *line = NULL;
+		size_t len = 0;
+
+		if (rlr->rlr_type == RD_LOG_REC_TEXT) {
+			line = (const char *)(rlr+1);
+			len  = rlr->rlr_len;
+
+		} else if (rlr->rlr_type == RD_LOG_REC_BIN) {
+			if (stof + RD_LOG_LINE_MAX > sizeof(stage)) {
+				rd_log_writev(fd, iov, iovcnt);
+				iovcnt = 0;
+				stof = 0;
+			}
+			line = stage + stof;
+			len  = rd_log_bin_line(stage+stof, RD_LOG_LINE_MAX,
+					       rlrg->rlrg_name, rlr);
+			stof += len;
+		}
+
+		tail += RD_LOG_REC_SIZE(rlr->rlr_len);
+
+		if (!line)
+			continue;
+
+		if (fd == RD_LOG_SYSLOG)
+			syslog(rlr->rlr_severity, "%.*s", (int)len - 1, line);
+		else {
+			iov[iovcnt].iov_base = (void *)line;
+			iov[iovcnt].iov_len  = len;
+			iovcnt++;
+		}
+		cnt++;
+
+		if (iovcnt == RD_ARRAY_SIZE(iov)) {
+			rd_log_writev(fd, iov, iovcnt);
+			iovcnt = 0;
+			stof = 0;
+			__atomic_store_n(&rlrg->rlrg_tail, tail,
+					 __ATOMIC_RELEASE);
+		}
+	}
+
+	if (iovcnt > 0)
+		rd_log_writev(fd, iov, iovcnt);
+	__atomic_store_n(&rlrg->rlrg_tail, tail, __ATOMIC_RELEASE);
+
+	drops = __atomic_load_n(&rlrg->rlrg_drops, __ATOMIC_RELAXED);
+	if (unlikely(drops != rlrg->rlrg_drops_seen)) {
+		char buf[128];
+		int of;
+
+		of = snprintf(buf, sizeof(buf),
+			      "rd:log: %"PRIu64" log line(s) dropped "
+			      "by thread %s\n",
+			      drops - rlrg->rlrg_drops_seen, rlrg->rlrg_name);
+		if (fd == RD_LOG_SYSLOG)
+			syslog(LOG_WARNING, "%.*s", of - 1, buf);
+		else {
+			iov[0].iov_base = buf;
+			iov[0].iov_len  = of;
+			rd_log_writev(fd, iov, 1);
+		}
+
+		rd_atomic_add(&rd_log_async.dropped,
+			      drops - rlrg->rlrg_drops_seen);
+		rlrg->rlrg_drops_seen = drops;
+	}
+
+	if (cnt > 0)
+		rd_atomic_add(&rd_log_async.written, cnt);
+
+	return cnt;
+}
+
+
+/**
+ * Drains all registered rings once, freeing rings of exited threads.
+ * Returns the number of records written.
+ *
+ * The lock is only held while stepping the list, never during output,
+ * so a stalled output never blocks new threads from registering.
+ * Rings are only removed by the draining thread, which keeps the
+ * current element valid while unlocked.
+ */
+static int rd_log_async_drain_all (int fd) {
+	rd_log_ring_t *rlrg, *next;
+	int cnt = 0;
+
+	rd_mutex_lock(&rd_log_async.lock);
+	rlrg = TAILQ_FIRST(&rd_log_async.rings);
+	rd_mutex_unlock(&rd_log_async.lock);
+
+	while (rlrg) {
+		int orphaned;
+
+		cnt += rd_log_ring_drain(rlrg, fd);
+
+		rd_mutex_lock(&rd_log_async.lock);
+		next = TAILQ_NEXT(rlrg, rlrg_link);
+		orphaned = rlrg->rlrg_orphaned;
+		if (orphaned)
+			TAILQ_REMOVE(&rd_log_async.rings, rlrg, rlrg_link);
+		rd_mutex_unlock(&rd_log_async.lock);
+
+		if (orphaned) {
+			/* The owner cant produce any more: drain the
+			 * remainder before freeing. */
+			cnt += rd_log_ring_drain(rlrg, fd);
+			rd_log_ring_destroy(rlrg);
+		}
+
+		rlrg = next;
+	}
+
+	return cnt;
+}
+
+
+/**
+ * Blocks the log thread until there is something to drain or it is
+ * stopped. Producers only signal when the log thread is idle and their
+ * ring was empty, so a busy log thread costs them nothing.
+ */
+static void rd_log_async_idle (void) {
+	rd_log_ring_t *rlrg;
+	int pending = 0;
+
+	rd_mutex_lock(&rd_log_async.lock);
+	__atomic_store_n(&rd_log_async.idle, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* Re-check after announcing idleness to not miss a put that
+	 * did not see us idle. */
+	TAILQ_FOREACH(rlrg, &rd_log_async.rings, rlrg_link) {
+		if (__atomic_load_n(&rlrg->rlrg_head, __ATOMIC_ACQUIRE) !=
+		    rlrg->rlrg_tail || rlrg->rlrg_orphaned) {
+			pending = 1;
+			break;
+		}
+	}
+
+	if (!pending && __atomic_load_n(&rd_log_async.run, __ATOMIC_ACQUIRE))
+		rd_cond_wait(&rd_log_async.cond, &rd_log_async.lock);
+
+	__atomic_store_n(&rd_log_async.idle, 0, __ATOMIC_RELAXED);
+	rd_mutex_unlock(&rd_log_async.lock);
+}
+
+
+static void *rd_log_async_main (void *arg) {
+	const int fd = rd_log_async.fd;
+
+	while (1) {
+		int run = __atomic_load_n(&rd_log_async.run, __ATOMIC_ACQUIRE);
+		int cnt = rd_log_async_drain_all(fd);
+
+		if (!run)
+			break;
+
+		if (!cnt)
+			rd_log_async_idle();
+	}
+
+	rd_thread_exit();
+	return NULL;
+}
+
+
+int rd_log_async_start (int fd, size_t ring_size) {
+	rd_thread_t *rdt;
+	size_t size = RD_LOG_RING_SIZE_MIN;
+
+	if (!ring_size)
+		ring_size = RD_LOG_RING_SIZE_DEF;
+	while (size < ring_size)
+		size <<= 1;
+
+	rd_mutex_lock(&rd_log_async.lock);
+	if (rd_log_async.running) {
+		rd_mutex_unlock(&rd_log_async.lock);
+		errno = EALREADY;
+		return -1;
+	}
+
+	/* Rings of live threads are reused, new rings get the new size. */
+	rd_log_async.fd        = fd;
+	rd_log_async.ring_size = size;
+	rd_log_async.run       = 1;
+	rd_log_async.running   = 1;
+
+	if (rd_thread_create(&rdt, "rd:log", NULL,
+			     rd_log_async_main, NULL) == -1) {
+		rd_log_async.running = 0;
+		rd_mutex_unlock(&rd_log_async.lock);
+		return -1;
+	}
+	rd_log_async.thread = rdt->rdt_thread;
+
+	__atomic_store_n(&rd_log_async.enabled, 1, __ATOMIC_RELEASE);
+	rd_mutex_unlock(&rd_log_async.lock);
+
+	return 0;
+}
+
+
+void rd_log_async_stop (void) {
+	rd_log_ring_t *rlrg, *tmp;
+
+	rd_mutex_lock(&rd_log_async.lock);
+	if (!rd_log_async.running) {
+		rd_mutex_unlock(&rd_log_async.lock);
+		return;
+	}
+	__atomic_store_n(&rd_log_async.enabled, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&rd_log_async.run, 0, __ATOMIC_RELEASE);
+	rd_cond_signal(&rd_log_async.cond);
+	rd_mutex_unlock(&rd_log_async.lock);
+
+	pthread_join(rd_log_async.thread, NULL);
+
+	/* Pick up lines from producers that raced the stop. */
+	rd_log_async_drain_all(rd_log_async.fd);
+
+	rd_mutex_lock(&rd_log_async.lock);
+	rd_log_async.running = 0;
+	TAILQ_FOREACH_SAFE(rlrg, &rd_log_async.rings, rlrg_link, tmp) {
+		if (!rlrg->rlrg_orphaned)
+			continue;
+		TAILQ_REMOVE(&rd_log_async.rings, rlrg, rlrg_link);
+		rd_log_ring_destroy(rlrg);
+	}
+	rd_mutex_unlock(&rd_log_async.lock);
+}
+
+
+void rd_log_async_stats (uint64_t *written, uint64_t *dropped) {
+	if (written)
+		*written = __atomic_load_n(&rd_log_async.written,
+					   __ATOMIC_RELAXED);
+	if (dropped)
+		*dropped = __atomic_load_n(&rd_log_async.dropped,
+					   __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Outputs a formatted log line, either directly or through the
+ * calling thread's async ring.
+ */
+static void rd_log_output (int severity, const char *buf, size_t len) {
+	int r RD_UNUSED;
+
+	if (__atomic_load_n(&rd_log_async.enabled, __ATOMIC_ACQUIRE)) {
+		rd_log_ring_t *rlrg = rd_log_ring_get();
+		if (likely(rlrg != NULL))
+			rd_log_ring_put(rlrg, RD_LOG_REC_TEXT, severity,
+					buf, len);
+		return;
+	}
+
+	r = write(STDOUT_FILENO, buf, len);
+}
+
+
+
+/**
+ * Formats and outputs a log line on the calling thread.
+ */
+static void rd_vputs0 (const char *func, int line, int severity,
+		       const char *fmt, va_list ap) {
+	char buf[RD_LOG_LINE_MAX];
+	int of = 0;
+	int printf_rc;
+
+	of += rd_log_prefix(buf+of, sizeof(buf)-of, rd_clock(),
+			    func, line, rd_log_thrname());
+
+	if (rd_dbg_ctx_idx > 0)
+		of += snprintf(buf+of, sizeof(buf)-of, "%s ", rd_dbg_ctx_buf);
+
 	printf_rc = vsnprintf(buf+of, sizeof(buf)-of, fmt, ap);
-	va_end(ap);
 
 	if( printf_rc > sizeof(buf) - of ) {
 		// Should we log a log buffer overflow? should we care about 
@@ -140,7 +1147,93 @@ void rdputs0 (const char *file, const char *func, int line,
 	buf[of++] = '\n';
 	buf[of] = '\0';
 
-	r = write(STDOUT_FILENO, buf, of);
+	rd_log_output(severity, buf, of);
+}
+
+
+void rd_log_puts0 (const char *file, const char *func, int line,
+		   int severity, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	rd_vputs0(func, line, severity, fmt, ap);
+	va_end(ap);
+}
+
+void rdputs0 (const char *file, const char *func, int line,
+		int severity, const char *fmt, ...) {
+	va_list ap;
+
+	if (!rd_log_enabled(RD_LOG_FAC_DEFAULT, severity))
+		return;
+
+	va_start(ap, fmt);
+	rd_vputs0(func, line, severity, fmt, ap);
+	va_end(ap);
+}
+
+
+static void rd_vputs_bin0 (const char *func, int line, int severity,
+			   const char *fmt, va_list ap) {
+	va_list ap2;
+	char buf[RD_LOG_LINE_MAX] __attribute__((aligned(8)));
+	rd_log_bin_t *rlb = (rd_log_bin_t *)buf;
+	rd_log_ring_t *rlrg;
+	const int ctxlen = rd_dbg_ctx_idx > 0 ? rd_dbg_ctx_len : 0;
+	const size_t ctxslot = RD_LOG_ARG_SLOT(ctxlen);
+	int r;
+
+	if (!__atomic_load_n(&rd_log_async.enabled, __ATOMIC_ACQUIRE) ||
+	    unlikely(!(rlrg = rd_log_ring_get()))) {
+		rd_vputs0(func, line, severity, fmt, ap);
+		return;
+	}
+
+	/* The debug context is copied since it may change before
+	 * the log thread formats the line. */
+	memcpy((char *)(rlb+1), rd_dbg_ctx_buf, ctxlen);
+
+	va_copy(ap2, ap);
+	r = rd_log_bin_encode((char *)(rlb+1) + ctxslot,
+			      sizeof(buf) - sizeof(*rlb) - ctxslot, fmt, ap2);
+	va_end(ap2);
+
+	if (unlikely(r == -1)) {
+		/* Not deferrable: format it here. */
+		rd_vputs0(func, line, severity, fmt, ap);
+		return;
+	}
+
+	rlb->rlb_fmt     = fmt;
+	rlb->rlb_func    = func;
+	rlb->rlb_ts      = rd_clock();
+	rlb->rlb_line    = line;
+	rlb->rlb_argsize = r;
+	rlb->rlb_ctxlen  = ctxlen;
+
+	rd_log_ring_put(rlrg, RD_LOG_REC_BIN, severity,
+			rlb, sizeof(*rlb) + ctxslot + r);
+}
+
+void rd_log_puts_bin0 (const char *file, const char *func, int line,
+		       int severity, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	rd_vputs_bin0(func, line, severity, fmt, ap);
+	va_end(ap);
+}
+
+void rdputs_bin0 (const char *file, const char *func, int line,
+		  int severity, const char *fmt, ...) {
+	va_list ap;
+
+	if (!rd_log_enabled(RD_LOG_FAC_DEFAULT, severity))
+		return;
+
+	va_start(ap, fmt);
+	rd_vputs_bin0(func, line, severity, fmt, ap);
+	va_end(ap);
 }
 
 
@@ -30,21 +30,201 @@
 
 #include <syslog.h>
 #include <stdio.h>
+#include <stdint.h>
 
+#include "rd.h"
+
+/**
+ * Logs a line if 'severity' is enabled for RD_LOG_FAC_DEFAULT.
+ */
 void rdputs0 (const char *file, const char *func, int line,
 	      int severity,const char *fmt, ...)
 	__attribute__((format (printf, 5, 6)));
 
-#define rdbg(fmt...) \
-	rdputs0(__FILE__,__FUNCTION__,__LINE__,LOG_DEBUG,fmt)
-#define rdlog(severity,fmt...) \
-	rdputs0(__FILE__,__FUNCTION__,__LINE__,severity,fmt)
+/**
+ * Same as rdputs0() but without the severity check, for use by the
+ * log macros which check the facility's level themselves.
+ */
+void rd_log_puts0 (const char *file, const char *func, int line,
+		   int severity,const char *fmt, ...)
+	__attribute__((format (printf, 5, 6)));
+
+
+/**
+ * Log facilities.
+ *
+ * Each facility has its own severity level so that, e.g., rdiothread
+ * debugging can be enabled without enabling all debug output.
+ * Applications may use facilities from RD_LOG_FAC_USER and up.
+ *
+ * The level check is done inline by the log macros, a disabled log
+ * statement costs a single branch and does not evaluate its arguments.
+ */
+typedef enum {
+	RD_LOG_FAC_DEFAULT,     /* rdlog(), rdbg() */
+	RD_LOG_FAC_IO,          /* rdiothread */
+	RD_LOG_FAC_ALERT,       /* rdalert */
+	RD_LOG_FAC_USER,        /* First application facility */
+	RD_LOG_FAC_MAX = 32,
+} rd_log_fac_t;
+
+extern int rd_log_severity[RD_LOG_FAC_MAX];
+
+#define rd_log_enabled(fac,severity) \
+	unlikely((severity) <= rd_log_severity[(fac)])
+
+#define rdlog_fac(fac,severity,fmt...) do {				\
+		if (rd_log_enabled(fac,severity))			\
+			rd_log_puts0(__FILE__,__FUNCTION__,__LINE__,	\
+				severity,fmt);				\
+	} while (0)
+#define rdbg_fac(fac,fmt...)  rdlog_fac(fac,LOG_DEBUG,fmt)
+
+#define rdbg(fmt...)            rdlog_fac(RD_LOG_FAC_DEFAULT,LOG_DEBUG,fmt)
+#define rdlog(severity,fmt...)  rdlog_fac(RD_LOG_FAC_DEFAULT,severity,fmt)
+
+
+/**
+ * Rate-limited logging.
+ *
+ * rdlog_rl() logs at most 'burst' lines back-to-back and 'rate' lines
+ * per second on average from each call site (token bucket).
+ * Suppressed lines are counted and reported with the next line that
+ * gets through.
+ */
+typedef struct rd_log_rl_s {
+	int64_t rlrl_tat;         /* Theoretical arrival time (GCRA) */
+	int     rlrl_suppressed;
+} rd_log_rl_t;
+
+/**
+ * Returns -1 if a line should be suppressed, else the number of lines
+ * suppressed since the last line that got through.
+ */
+int rd_log_rl_check (rd_log_rl_t *rlrl, int rate, int burst);
+
+#define rdlog_rl_fac(fac,rate,burst,severity,fmt...) do {		\
+		static rd_log_rl_t _rlrl;				\
+		int _supp;						\
+		if (rd_log_enabled(fac,severity) &&			\
+		    (_supp = rd_log_rl_check(&_rlrl,rate,burst)) != -1) { \
+			if (unlikely(_supp > 0))			\
+				rd_log_puts0(__FILE__,__FUNCTION__,__LINE__, \
+					severity,			\
+					"%i similar line(s) suppressed", \
+					_supp);				\
+			rd_log_puts0(__FILE__,__FUNCTION__,__LINE__,	\
+				severity,fmt);				\
+		}							\
+	} while (0)
+#define rdlog_rl(rate,burst,severity,fmt...) \
+	rdlog_rl_fac(RD_LOG_FAC_DEFAULT,rate,burst,severity,fmt)
+#define rdbg_rl(rate,burst,fmt...) \
+	rdlog_rl_fac(RD_LOG_FAC_DEFAULT,rate,burst,LOG_DEBUG,fmt)
+
+
+/**
+ * Deferred (binary) logging.
+ *
+ * rdlog_bin() and rdbg_bin() take the same arguments as rdlog() and rdbg()
+ * but, with async logging enabled (see rd_log_async_start()), do not
+ * format the message on the calling thread: the format string pointer,
+ * the raw arguments and an rd_clock() timestamp are copied into the
+ * thread's log ring and the line is formatted by the log thread.
+ *
+ * The format string must outlive the log call (i.e., be a literal).
+ * "%s" arguments are copied at call time.
+ * Formats that can't be deferred (%m, %n, wide characters) and calls made
+ * while async logging is disabled are formatted immediately, as rdputs0().
+ * The debug context (rd_dbg_ctx_push()) is copied into the record.
+ */
+void rdputs_bin0 (const char *file, const char *func, int line,
+		  int severity, const char *fmt, ...)
+	__attribute__((format (printf, 5, 6)));
+
+/**
+ * Same as rdputs_bin0() but without the severity check (see
+ * rd_log_puts0()).
+ */
+void rd_log_puts_bin0 (const char *file, const char *func, int line,
+		       int severity, const char *fmt, ...)
+	__attribute__((format (printf, 5, 6)));
 
-void rd_dbg_ctx_push (const char *fmt, ...);
+#define rdlog_bin_fac(fac,severity,fmt...) do {			\
+		if (rd_log_enabled(fac,severity))			\
+			rd_log_puts_bin0(__FILE__,__FUNCTION__,__LINE__, \
+					 severity,fmt);			\
+	} while (0)
+#define rdbg_bin(fmt...) \
+	rdlog_bin_fac(RD_LOG_FAC_DEFAULT,LOG_DEBUG,fmt)
+#define rdlog_bin(severity,fmt...) \
+	rdlog_bin_fac(RD_LOG_FAC_DEFAULT,severity,fmt)
+
+
+/**
+ * Debug context stack.
+ * Pushed contexts are printed as "[ctx1]->[ctx2] " before the message of
+ * each line logged by the thread. The stack is kept in a fixed size
+ * thread-local buffer: contexts that do not fit are silently left out.
+ */
+void rd_dbg_ctx_push (const char *fmt, ...)
+	__attribute__((format (printf, 1, 2)));
 void rd_dbg_ctx_pop (void);
 void rd_dbg_ctx_clear (void);
+
+/**
+ * Sets the severity level of all facilities.
+ */
 void rd_log_set_severity (int severity);
 
+/**
+ * Sets the severity level of a single facility.
+ */
+void rd_log_set_severity_fac (rd_log_fac_t fac, int severity);
+
 #define rd_dbg_set(onoff) rd_log_set_severity(onoff ? LOG_DEBUG : LOG_INFO)
 
 void rd_hexdump (FILE *fp, const char *name, const void *ptr, size_t len);
+
+
+/**
+ * Asynchronous logging.
+ *
+ * With async logging enabled rdputs0() still formats the line on the
+ * calling thread, but instead of write()ing it the line is copied into
+ * a per-thread single-producer/single-consumer ring.
+ * A dedicated "rd:log" thread drains all rings and hands the lines,
+ * batched, to writev(2) on 'fd', or to syslog(3) if 'fd' is RD_LOG_SYSLOG.
+ *
+ * A logging thread never blocks on output: if its ring is full the line
+ * is dropped and counted. The log thread reports drops in-band
+ * ("N log line(s) dropped") and they are also available through
+ * rd_log_async_stats().
+ *
+ * 'ring_size' is the per-thread ring size in bytes (rounded up to a power
+ * of two, minimum 16 KiB), or 0 for the default of 64 KiB.
+ *
+ * Returns 0 on success or -1 on failure (errno is set).
+ */
+#define RD_LOG_SYSLOG  -1
+
+int  rd_log_async_start (int fd, size_t ring_size);
+
+/**
+ * Stops the log thread after it has drained all rings.
+ * Subsequent log lines are written synchronously again.
+ */
+void rd_log_async_stop (void);
+
+/**
+ * Returns the number of log lines written and dropped by the async
+ * logger since it was first started. Either pointer may be NULL.
+ */
+void rd_log_async_stats (uint64_t *written, uint64_t *dropped);
+
+/**
+ * Releases the calling thread's async log ring.
+ * This is done automatically for librd threads by rd_thread_cleanup(),
+ * other threads that log should call it before exiting.
+ */
+void rd_log_thread_cleanup (void);
@@ -28,6 +28,12 @@
 
 #include "rd.h"
 #include "rdlru.h"
+#include "rdslab.h"
+#include "rdtimer.h"
+
+
+static rd_slab_t rd_lru_elm_slab =
+	RD_SLAB_INITIALIZER("rd_lru_elm", sizeof(rd_lru_elm_t));
 
 
 static void rd_lru_elm_destroy (rd_lru_t *rlru, rd_lru_elm_t *rlrue) {
@@ -35,7 +41,7 @@ static void rd_lru_elm_destroy (rd_lru_t *rlru, rd_lru_elm_t *rlrue) {
 	rlru->rlru_cnt--;
 	if (rlru)
 		TAILQ_REMOVE(&rlru->rlru_elms, rlrue, rlrue_link);
-	free(rlrue);
+	rd_slab_free(&rd_lru_elm_slab, rlrue);
 }
 
 
@@ -63,7 +69,8 @@ rd_lru_t *rd_lru_new (void) {
 void rd_lru_push (rd_lru_t *rlru, void *ptr) {
 	rd_lru_elm_t *rlrue;
 
-	rlrue = calloc(1, sizeof(*rlrue));
+	if (unlikely(!(rlrue = rd_slab_calloc(&rd_lru_elm_slab))))
+		abort();
 	rlrue->rlrue_ptr = ptr;
 
 	TAILQ_INSERT_HEAD(&rlru->rlru_elms, rlrue, rlrue_link);
@@ -97,3 +104,534 @@ void *rd_lru_shift (rd_lru_t *rlru) {
 
 	return ptr;
 }
+
+
+
+
+/**
+ * LRU cache
+ */
+
+#define RD_LRU_CACHE_SLOTS_MIN  16
+
+/* Max elements expired per rd_lru_cache_expire_timer_start() run. */
+#define RD_LRU_CACHE_EXPIRE_BATCH  1000
+
+
+static inline unsigned int rd_lru_cache_slot_mask (const rd_lru_cache_t *rlc) {
+	return rlc->rlc_slot_cnt - 1;
+}
+
+
+/**
+ * Returns the slot index of 'key', or -1 if not found.
+ */
+static int rd_lru_cache_slot_find (const rd_lru_cache_t *rlc,
+				   const void *key, uint32_t hash) {
+	unsigned int mask = rd_lru_cache_slot_mask(rlc);
+	unsigned int i = hash & mask;
+
+	while (rlc->rlc_slots[i].node) {
+		if (rlc->rlc_slots[i].hash == hash &&
+		    !rlc->rlc_cmp(rlc->rlc_slots[i].node->rlrun_key, key))
+			return (int)i;
+		i = (i + 1) & mask;
+	}
+
+	return -1;
+}
+
+/**
+ * Returns the slot index of 'node', which must be in the index.
+ */
+static unsigned int rd_lru_cache_slot_of (const rd_lru_cache_t *rlc,
+					  const rd_lru_node_t *node) {
+	unsigned int mask = rd_lru_cache_slot_mask(rlc);
+	unsigned int i = node->rlrun_hash & mask;
+
+	while (rlc->rlc_slots[i].node != node) {
+		assert(rlc->rlc_slots[i].node);
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+
+static void rd_lru_cache_slot_insert (rd_lru_cache_t *rlc,
+				      rd_lru_node_t *node) {
+	unsigned int mask = rd_lru_cache_slot_mask(rlc);
+	unsigned int i = node->rlrun_hash & mask;
+
+	while (rlc->rlc_slots[i].node)
+		i = (i + 1) & mask;
+
+	rlc->rlc_slots[i].hash = node->rlrun_hash;
+	rlc->rlc_slots[i].node = node;
+}
+
+
+/**
+ * Frees slot 'i' using backward shift deletion, which keeps probe
+ * sequences intact without tombstones.
+ */
+static void rd_lru_cache_slot_delete (rd_lru_cache_t *rlc, unsigned int i) {
+	unsigned int mask = rd_lru_cache_slot_mask(rlc);
+	unsigned int j = i;
+
+	while (1) {
+		unsigned int home;
+
+		j = (j + 1) & mask;
+		if (!rlc->rlc_slots[j].node)
+			break;
+
+		/* Move slot j to i if i lies cyclically in [home, j). */
+		home = rlc->rlc_slots[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			rlc->rlc_slots[i] = rlc->rlc_slots[j];
+			i = j;
+		}
+	}
+
+	rlc->rlc_slots[i].node = NULL;
+}
+
+
+/**
+ * (Re)allocates the hash index with 'slot_cnt' slots.
+ */
+static void rd_lru_cache_slots_resize (rd_lru_cache_t *rlc,
+				       unsigned int slot_cnt) {
+	rd_lru_node_t *node;
+
+	if (rlc->rlc_slots)
+		free(rlc->rlc_slots);
+
+	rlc->rlc_slot_cnt = slot_cnt;
+	rlc->rlc_slots = calloc(slot_cnt, sizeof(*rlc->rlc_slots));
+
+	TAILQ_FOREACH(node, &rlc->rlc_nodes, rlrun_link)
+		rd_lru_cache_slot_insert(rlc, node);
+}
+
+
+void rd_lru_cache_init (rd_lru_cache_t *rlc,
+			rd_lru_cache_hash_t *hash, rd_lru_cache_cmp_t *cmp,
+			unsigned int max_cnt, size_t max_bytes,
+			rd_lru_cache_evict_cb_t *evict_cb, void *opaque) {
+	unsigned int slot_cnt = RD_LRU_CACHE_SLOTS_MIN;
+
+	memset(rlc, 0, sizeof(*rlc));
+
+	rd_mutex_init(&rlc->rlc_lock);
+	TAILQ_INIT(&rlc->rlc_nodes);
+
+	rlc->rlc_hash      = hash;
+	rlc->rlc_cmp       = cmp;
+	rlc->rlc_max_cnt   = max_cnt;
+	rlc->rlc_max_bytes = max_bytes;
+	rlc->rlc_evict_cb  = evict_cb;
+	rlc->rlc_opaque    = opaque;
+	rlc->rlc_ttl_res   = 1000 * 1000;
+
+	/* Keep the load factor at or below 1/2. */
+	while (slot_cnt < (max_cnt + 1) * 2)
+		slot_cnt <<= 1;
+
+	rd_lru_cache_slots_resize(rlc, slot_cnt);
+}
+
+
+void rd_lru_cache_destroy (rd_lru_cache_t *rlc) {
+	void *elm;
+
+	while ((elm = rd_lru_cache_pop(rlc)))
+		if (rlc->rlc_evict_cb)
+			rlc->rlc_evict_cb(elm, rlc->rlc_opaque);
+
+	rd_lru_cache_admission_set(rlc, NULL, NULL, NULL);
+
+	if (rlc->rlc_wheel)
+		free(rlc->rlc_wheel);
+	free(rlc->rlc_slots);
+	rd_mutex_destroy(&rlc->rlc_lock);
+}
+
+
+void rd_lru_cache_admission_set (rd_lru_cache_t *rlc,
+				 rd_lru_cache_record_t *record,
+				 rd_lru_cache_admit_t *admit, void *opaque) {
+
+	if (rlc->rlc_sketch) {
+		rd_cmsketch_destroy(rlc->rlc_sketch);
+		free(rlc->rlc_sketch);
+		rlc->rlc_sketch = NULL;
+	}
+
+	rlc->rlc_record       = record;
+	rlc->rlc_admit        = admit;
+	rlc->rlc_admit_opaque = opaque;
+}
+
+
+static void rd_lru_cache_tinylfu_record (void *opaque, uint32_t hash) {
+	rd_cmsketch_add(opaque, hash);
+}
+
+static int rd_lru_cache_tinylfu_admit (void *opaque, uint32_t cand_hash,
+				       uint32_t victim_hash) {
+	return rd_cmsketch_estimate(opaque, cand_hash) >
+		rd_cmsketch_estimate(opaque, victim_hash);
+}
+
+void rd_lru_cache_tinylfu_set (rd_lru_cache_t *rlc, uint32_t cnt) {
+	rd_cmsketch_t *rcms = malloc(sizeof(*rcms));
+
+	if (!cnt)
+		cnt = rlc->rlc_max_cnt ? : rlc->rlc_slot_cnt;
+
+	rd_cmsketch_init(rcms, cnt);
+
+	rd_lru_cache_admission_set(rlc,
+				   rd_lru_cache_tinylfu_record,
+				   rd_lru_cache_tinylfu_admit, rcms);
+	rlc->rlc_sketch = rcms;
+}
+
+
+double rd_lru_cache_hit_ratio (const rd_lru_cache_t *rlc) {
+	uint64_t total = rlc->rlc_stats.hits + rlc->rlc_stats.misses;
+
+	if (!total)
+		return 0.0;
+
+	return (double)rlc->rlc_stats.hits / (double)total;
+}
+
+
+void rd_lru_cache_ttl_set (rd_lru_cache_t *rlc, unsigned int ttl_ms,
+			   unsigned int resolution_ms) {
+
+	rlc->rlc_ttl = (rd_ts_t)ttl_ms * 1000;
+
+	if (!resolution_ms ||
+	    (rd_ts_t)resolution_ms * 1000 == rlc->rlc_ttl_res)
+		return;
+
+	/* Elements with a TTL are hashed on the wheel by resolution. */
+	assert(!rlc->rlc_ttl_cnt);
+	rlc->rlc_ttl_res = (rd_ts_t)resolution_ms * 1000;
+}
+
+
+/**
+ * Returns the expiry wheel bucket for time 'ts'.
+ */
+static inline struct rd_lru_node_head *
+rd_lru_cache_wheel_bucket (const rd_lru_cache_t *rlc, rd_ts_t ts) {
+	return &rlc->rlc_wheel[(ts / rlc->rlc_ttl_res) %
+			       RD_LRU_CACHE_WHEEL_SLOTS];
+}
+
+
+/**
+ * Unlinks 'node' from the index, the recency list and the expiry wheel.
+ */
+static void rd_lru_cache_unlink (rd_lru_cache_t *rlc, rd_lru_node_t *node) {
+	rd_lru_cache_slot_delete(rlc, rd_lru_cache_slot_of(rlc, node));
+	TAILQ_REMOVE(&rlc->rlc_nodes, node, rlrun_link);
+
+	if (node->rlrun_expire) {
+		TAILQ_REMOVE(rd_lru_cache_wheel_bucket(rlc,
+						       node->rlrun_expire),
+			     node, rlrun_tlink);
+		rlc->rlc_ttl_cnt--;
+	}
+
+	assert(rlc->rlc_cnt > 0);
+	rlc->rlc_cnt--;
+	rlc->rlc_bytes -= node->rlrun_size;
+}
+
+
+/**
+ * Evicts least recently used elements until the capacity is honoured.
+ */
+static void rd_lru_cache_evict (rd_lru_cache_t *rlc) {
+
+	while ((rlc->rlc_max_cnt && rlc->rlc_cnt > rlc->rlc_max_cnt) ||
+	       (rlc->rlc_max_bytes && rlc->rlc_bytes > rlc->rlc_max_bytes)) {
+		void *elm = rd_lru_cache_pop(rlc);
+
+		rlc->rlc_stats.evictions++;
+		if (rlc->rlc_evict_cb)
+			rlc->rlc_evict_cb(elm, rlc->rlc_opaque);
+	}
+}
+
+
+/**
+ * Removes 'node' and passes it to the eviction callback if its TTL
+ * has passed.
+ * Returns 1 if the node expired, else 0.
+ */
+static int rd_lru_cache_expired (rd_lru_cache_t *rlc, rd_lru_node_t *node,
+				 rd_ts_t now) {
+
+	if (likely(!node->rlrun_expire || node->rlrun_expire > now))
+		return 0;
+
+	rd_lru_cache_unlink(rlc, node);
+	rlc->rlc_stats.expired++;
+	if (rlc->rlc_evict_cb)
+		rlc->rlc_evict_cb(node->rlrun_elm, rlc->rlc_opaque);
+
+	return 1;
+}
+
+
+static void *rd_lru_cache_put0 (rd_lru_cache_t *rlc, void *elm,
+				rd_lru_node_t *node,
+				const void *key, size_t size, rd_ts_t ttl) {
+	void *prev = NULL;
+	uint32_t hash = rlc->rlc_hash(key);
+	int i;
+
+	if (rlc->rlc_record)
+		rlc->rlc_record(rlc->rlc_admit_opaque, hash);
+
+	if ((i = rd_lru_cache_slot_find(rlc, key, hash)) != -1) {
+		rd_lru_node_t *old = rlc->rlc_slots[i].node;
+		prev = old->rlrun_elm;
+		rd_lru_cache_unlink(rlc, old);
+
+	} else if (rlc->rlc_admit &&
+		   ((rlc->rlc_max_cnt && rlc->rlc_cnt + 1 > rlc->rlc_max_cnt) ||
+		    (rlc->rlc_max_bytes &&
+		     rlc->rlc_bytes + size > rlc->rlc_max_bytes))) {
+		rd_lru_node_t *victim = TAILQ_LAST(&rlc->rlc_nodes,
+						   rd_lru_node_head);
+
+		/* The new element must prove itself more valuable than
+		 * the element it would evict. */
+		if (victim &&
+		    !rlc->rlc_admit(rlc->rlc_admit_opaque,
+				    hash, victim->rlrun_hash)) {
+			rlc->rlc_stats.rejects++;
+			if (rlc->rlc_evict_cb)
+				rlc->rlc_evict_cb(elm, rlc->rlc_opaque);
+			return NULL;
+		}
+	}
+
+	node->rlrun_key  = key;
+	node->rlrun_elm  = elm;
+	node->rlrun_size = size;
+	node->rlrun_hash = hash;
+
+	/* Grow unbounded index when the load factor exceeds 1/2. */
+	if ((rlc->rlc_cnt + 1) * 2 > rlc->rlc_slot_cnt)
+		rd_lru_cache_slots_resize(rlc, rlc->rlc_slot_cnt * 2);
+
+	rd_lru_cache_slot_insert(rlc, node);
+	TAILQ_INSERT_HEAD(&rlc->rlc_nodes, node, rlrun_link);
+	rlc->rlc_cnt++;
+	rlc->rlc_bytes += size;
+
+	if (ttl) {
+		if (unlikely(!rlc->rlc_wheel)) {
+			int j;
+			rlc->rlc_wheel = malloc(sizeof(*rlc->rlc_wheel) *
+						RD_LRU_CACHE_WHEEL_SLOTS);
+			for (j = 0 ; j < RD_LRU_CACHE_WHEEL_SLOTS ; j++)
+				TAILQ_INIT(&rlc->rlc_wheel[j]);
+		}
+
+		node->rlrun_expire = rd_clock() + ttl;
+		TAILQ_INSERT_TAIL(rd_lru_cache_wheel_bucket(rlc,
+							    node->rlrun_expire),
+				  node, rlrun_tlink);
+		rlc->rlc_ttl_cnt++;
+	} else
+		node->rlrun_expire = 0;
+
+	rd_lru_cache_evict(rlc);
+
+	return prev;
+}
+
+
+void *rd_lru_cache_put (rd_lru_cache_t *rlc, void *elm, rd_lru_node_t *node,
+			const void *key, size_t size) {
+	return rd_lru_cache_put0(rlc, elm, node, key, size, rlc->rlc_ttl);
+}
+
+void *rd_lru_cache_put_ttl (rd_lru_cache_t *rlc, void *elm,
+			    rd_lru_node_t *node,
+			    const void *key, size_t size, unsigned int ttl_ms) {
+	return rd_lru_cache_put0(rlc, elm, node, key, size,
+				 (rd_ts_t)ttl_ms * 1000);
+}
+
+
+void *rd_lru_cache_peek (rd_lru_cache_t *rlc, const void *key) {
+	rd_lru_node_t *node;
+	int i;
+
+	if ((i = rd_lru_cache_slot_find(rlc, key, rlc->rlc_hash(key))) == -1)
+		return NULL;
+
+	node = rlc->rlc_slots[i].node;
+	if (rlc->rlc_ttl_cnt && rd_lru_cache_expired(rlc, node, rd_clock()))
+		return NULL;
+
+	return node->rlrun_elm;
+}
+
+
+void rd_lru_cache_touch (rd_lru_cache_t *rlc, rd_lru_node_t *node) {
+	if (TAILQ_FIRST(&rlc->rlc_nodes) == node)
+		return;
+
+	TAILQ_REMOVE(&rlc->rlc_nodes, node, rlrun_link);
+	TAILQ_INSERT_HEAD(&rlc->rlc_nodes, node, rlrun_link);
+}
+
+
+void *rd_lru_cache_get (rd_lru_cache_t *rlc, const void *key) {
+	rd_lru_node_t *node;
+	uint32_t hash = rlc->rlc_hash(key);
+	int i;
+
+	if (rlc->rlc_record)
+		rlc->rlc_record(rlc->rlc_admit_opaque, hash);
+
+	if ((i = rd_lru_cache_slot_find(rlc, key, hash)) == -1 ||
+	    (rlc->rlc_ttl_cnt &&
+	     rd_lru_cache_expired(rlc, rlc->rlc_slots[i].node, rd_clock()))) {
+		rlc->rlc_stats.misses++;
+		return NULL;
+	}
+
+	rlc->rlc_stats.hits++;
+	node = rlc->rlc_slots[i].node;
+	rd_lru_cache_touch(rlc, node);
+
+	return node->rlrun_elm;
+}
+
+
+void *rd_lru_cache_remove (rd_lru_cache_t *rlc, const void *key) {
+	rd_lru_node_t *node;
+	int i;
+
+	if ((i = rd_lru_cache_slot_find(rlc, key, rlc->rlc_hash(key))) == -1)
+		return NULL;
+
+	node = rlc->rlc_slots[i].node;
+	rd_lru_cache_unlink(rlc, node);
+
+	return node->rlrun_elm;
+}
+
+
+void rd_lru_cache_remove_node (rd_lru_cache_t *rlc, rd_lru_node_t *node) {
+	rd_lru_cache_unlink(rlc, node);
+}
+
+
+void *rd_lru_cache_pop (rd_lru_cache_t *rlc) {
+	rd_lru_node_t *node;
+
+	if (!(node = TAILQ_LAST(&rlc->rlc_nodes, rd_lru_node_head)))
+		return NULL;
+
+	rd_lru_cache_unlink(rlc, node);
+
+	return node->rlrun_elm;
+}
+
+
+int rd_lru_cache_expire (rd_lru_cache_t *rlc, int max_cnt) {
+	rd_ts_t now = rd_clock();
+	uint64_t now_tick = now / rlc->rlc_ttl_res;
+	uint64_t tick;
+	int cnt = 0;
+
+	if (!rlc->rlc_ttl_cnt) {
+		rlc->rlc_wheel_tick = now_tick;
+		return 0;
+	}
+
+	/* Each bucket needs to be visited at most once. */
+	tick = rlc->rlc_wheel_tick;
+	if (now_tick - tick >= RD_LRU_CACHE_WHEEL_SLOTS)
+		tick = now_tick - (RD_LRU_CACHE_WHEEL_SLOTS - 1);
+
+	while (1) {
+		struct rd_lru_node_head *head =
+			&rlc->rlc_wheel[tick % RD_LRU_CACHE_WHEEL_SLOTS];
+		rd_lru_node_t *node, *next;
+
+		/* Buckets also hold elements expiring in later
+		 * revolutions of the wheel, leave those be. */
+		for (node = TAILQ_FIRST(head) ; node ; node = next) {
+			next = TAILQ_NEXT(node, rlrun_tlink);
+
+			if (max_cnt && cnt == max_cnt) {
+				rlc->rlc_wheel_tick = tick;
+				return cnt;
+			}
+
+			cnt += rd_lru_cache_expired(rlc, node, now);
+		}
+
+		/* The current tick is revisited on the next sweep. */
+		if (tick >= now_tick)
+			break;
+		tick++;
+	}
+
+	rlc->rlc_wheel_tick = tick;
+
+	return cnt;
+}
+
+
+static rd_thread_event_f(rd_lru_cache_expire_timer_cb) {
+	rd_lru_cache_t *rlc = ptr;
+
+	rd_lru_cache_lock(rlc);
+	rd_lru_cache_expire(rlc, RD_LRU_CACHE_EXPIRE_BATCH);
+	rd_lru_cache_unlock(rlc);
+}
+
+rd_timer_t *rd_lru_cache_expire_timer_start (rd_lru_cache_t *rlc,
+					     unsigned int interval_ms,
+					     rd_thread_t *rdt) {
+	rd_timer_t *rt;
+
+	rt = rd_timer_new(RD_TIMER_RECURR, rdt,
+			  rd_lru_cache_expire_timer_cb, rlc);
+	rd_timer_start(rt, interval_ms);
+
+	return rt;
+}
+
+
+uint32_t rd_lru_cache_hash_str (const void *key) {
+	const unsigned char *s = key;
+	uint32_t h = 2166136261u;
+
+	while (*s) {
+		h ^= *(s++);
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+int rd_lru_cache_cmp_str (const void *a, const void *b) {
+	return strcmp(a, b);
+}
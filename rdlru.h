@@ -30,6 +30,7 @@
 
 #include "rdthread.h"
 #include "rdsysqueue.h"
+#include "rdbits.h"
 
 
 
@@ -87,3 +88,288 @@ void *rd_lru_shift (rd_lru_t *rlru);
  * Returns the number of entries in the LRU
  */
 #define rd_lru_cnt(rlru) ((rlru)->rlru_cnt)
+
+
+
+
+/**
+ * Bounded, hash-indexed LRU cache.
+ *
+ * Elements embed an rd_lru_node_t and are looked up by key through an
+ * open-addressing hash index, all operations are O(1).
+ * Capacity may be limited by element count, total element size
+ * (as provided to rd_lru_cache_put()), or both. When the capacity is
+ * exceeded the least recently used elements are evicted and passed to
+ * the eviction callback.
+ *
+ * As with rd_lru_t the cache is not locked internally,
+ * use rd_lru_cache_lock() if it is shared between threads.
+ *
+ * Usage:
+ *   struct my_elm {
+ *      char *name;
+ *      rd_lru_node_t link;
+ *   };
+ *
+ *   rd_lru_cache_init(&cache, my_hash, my_cmp, 1000, 0, my_free, NULL);
+ *   RD_LRU_CACHE_PUT(&cache, elm, link, elm->name, sizeof(*elm));
+ *   elm = rd_lru_cache_get(&cache, "somename");
+ */
+
+
+/**
+ * Cache node, embed in the cached element.
+ */
+typedef struct rd_lru_node_s {
+	TAILQ_ENTRY(rd_lru_node_s) rlrun_link;  /* Recency list */
+	const void   *rlrun_key;   /* Key, must remain valid while cached */
+	void         *rlrun_elm;   /* Backpointer to containing element */
+	size_t        rlrun_size;  /* Element size, for byte capacity */
+	uint32_t      rlrun_hash;  /* Key hash */
+	rd_ts_t       rlrun_expire; /* Absolute expiry time, 0 = never */
+	TAILQ_ENTRY(rd_lru_node_s) rlrun_tlink; /* Expiry wheel bucket */
+} rd_lru_node_t;
+
+TAILQ_HEAD(rd_lru_node_head, rd_lru_node_s);
+
+
+/**
+ * Hash index slot.
+ */
+typedef struct rd_lru_slot_s {
+	uint32_t       hash;
+	rd_lru_node_t *node;       /* NULL if slot is free */
+} rd_lru_slot_t;
+
+
+typedef uint32_t (rd_lru_cache_hash_t) (const void *key);
+typedef int      (rd_lru_cache_cmp_t) (const void *a, const void *b);
+typedef void     (rd_lru_cache_evict_cb_t) (void *elm, void *opaque);
+
+/**
+ * Admission policy callbacks, see rd_lru_cache_admission_set().
+ */
+typedef void     (rd_lru_cache_record_t) (void *opaque, uint32_t hash);
+typedef int      (rd_lru_cache_admit_t) (void *opaque, uint32_t cand_hash,
+					 uint32_t victim_hash);
+
+
+typedef struct rd_lru_cache_stats_s {
+	uint64_t hits;       /* rd_lru_cache_get() found the key */
+	uint64_t misses;     /* rd_lru_cache_get() did not find the key */
+	uint64_t evictions;  /* Elements evicted due to capacity */
+	uint64_t rejects;    /* New elements refused by the admission policy */
+	uint64_t expired;    /* Elements removed due to their TTL */
+} rd_lru_cache_stats_t;
+
+
+/**
+ * Expiry timing wheel: RD_LRU_CACHE_WHEEL_SLOTS buckets of
+ * 'resolution' each, an element expiring at time T is kept in bucket
+ * (T / resolution) % RD_LRU_CACHE_WHEEL_SLOTS.
+ */
+#define RD_LRU_CACHE_WHEEL_SLOTS  256
+
+
+typedef struct rd_lru_cache_s {
+	rd_mutex_t    rlc_lock;
+	struct rd_lru_node_head rlc_nodes;  /* Most recently used first */
+	unsigned int  rlc_cnt;              /* Number of elements */
+	size_t        rlc_bytes;            /* Sum of element sizes */
+
+	unsigned int  rlc_max_cnt;          /* Max elements, 0 = unlimited */
+	size_t        rlc_max_bytes;        /* Max bytes, 0 = unlimited */
+
+	rd_lru_slot_t *rlc_slots;           /* Hash index */
+	unsigned int  rlc_slot_cnt;         /* Number of slots (power of 2) */
+
+	rd_lru_cache_hash_t *rlc_hash;
+	rd_lru_cache_cmp_t  *rlc_cmp;
+	rd_lru_cache_evict_cb_t *rlc_evict_cb;
+	void         *rlc_opaque;
+
+	rd_lru_cache_record_t *rlc_record;  /* Admission policy */
+	rd_lru_cache_admit_t  *rlc_admit;
+	void         *rlc_admit_opaque;
+	rd_cmsketch_t *rlc_sketch;          /* Built-in TinyLFU sketch */
+
+	rd_ts_t       rlc_ttl;              /* Default TTL, 0 = none */
+	rd_ts_t       rlc_ttl_res;          /* Wheel resolution */
+	unsigned int  rlc_ttl_cnt;          /* Elements with a TTL */
+	uint64_t      rlc_wheel_tick;       /* Next tick to sweep */
+	struct rd_lru_node_head *rlc_wheel; /* Expiry buckets, lazily alloced*/
+
+	rd_lru_cache_stats_t rlc_stats;
+} rd_lru_cache_t;
+
+
+#define rd_lru_cache_lock(rlc)   rd_mutex_lock(&(rlc)->rlc_lock)
+#define rd_lru_cache_unlock(rlc) rd_mutex_unlock(&(rlc)->rlc_lock)
+
+/**
+ * Returns the number of elements / sum of element sizes in the cache.
+ */
+#define rd_lru_cache_cnt(rlc)    ((rlc)->rlc_cnt)
+#define rd_lru_cache_bytes(rlc)  ((rlc)->rlc_bytes)
+
+
+/**
+ * Initializes a cache.
+ * 'hash' and 'cmp' operate on keys, 'cmp' returns 0 for equal keys.
+ * 'hash' should distribute well in its lower bits.
+ * 'max_cnt' and 'max_bytes' limit the capacity (0 = unlimited).
+ * The optional 'evict_cb' is called for each element evicted due to
+ * capacity limits, and for each remaining element on destroy.
+ */
+void rd_lru_cache_init (rd_lru_cache_t *rlc,
+			rd_lru_cache_hash_t *hash, rd_lru_cache_cmp_t *cmp,
+			unsigned int max_cnt, size_t max_bytes,
+			rd_lru_cache_evict_cb_t *evict_cb, void *opaque);
+
+/**
+ * Installs an admission policy, consulted when inserting a new key
+ * would exceed the capacity.
+ * 'record' is called with the key hash on every rd_lru_cache_get()
+ * and rd_lru_cache_put(), and 'admit' decides whether the new element
+ * ('cand_hash') may evict the least recently used one ('victim_hash').
+ * Rejected elements are not inserted but passed to the eviction
+ * callback.
+ * Pass NULL callbacks to remove the policy.
+ */
+void rd_lru_cache_admission_set (rd_lru_cache_t *rlc,
+				 rd_lru_cache_record_t *record,
+				 rd_lru_cache_admit_t *admit, void *opaque);
+
+/**
+ * Installs the built-in TinyLFU admission policy: key frequencies are
+ * tracked in a count-min sketch (see rdbits.h) sized for 'cnt'
+ * elements (0 = the cache's max element count), and a new
+ * element is only admitted if it is estimated to be used more often
+ * than the eviction victim. This keeps scans of one-off keys from
+ * flushing frequently used elements.
+ */
+void rd_lru_cache_tinylfu_set (rd_lru_cache_t *rlc, uint32_t cnt);
+
+/**
+ * Returns a copy of the cache's counters, and the hit ratio (0.0..1.0)
+ * of rd_lru_cache_get() calls.
+ */
+#define rd_lru_cache_stats(rlc,statsp)  (*(statsp) = (rlc)->rlc_stats)
+double rd_lru_cache_hit_ratio (const rd_lru_cache_t *rlc);
+
+
+/**
+ * Sets the default time-to-live for elements inserted with
+ * rd_lru_cache_put() (0 = no expiry), and the granularity with
+ * which expired elements are swept by rd_lru_cache_expire()
+ * (0 = unchanged, initially 1000 ms).
+ * The resolution may only be changed while no element has a TTL,
+ * the default TTL at any time.
+ */
+void rd_lru_cache_ttl_set (rd_lru_cache_t *rlc, unsigned int ttl_ms,
+			   unsigned int resolution_ms);
+
+
+/**
+ * Removes all elements, passing them to the eviction callback,
+ * and frees the cache's resources.
+ */
+void rd_lru_cache_destroy (rd_lru_cache_t *rlc);
+
+
+/**
+ * Inserts element 'elm' with key 'key' and size 'size' into the cache
+ * as the most recently used element.
+ * If an element with the same key exists it is replaced and returned
+ * (without calling the eviction callback), else NULL is returned.
+ * Elements are then evicted as necessary to honour the capacity,
+ * unless an admission policy rejects 'elm' which is then passed to the
+ * eviction callback instead.
+ */
+#define RD_LRU_CACHE_PUT(rlc,elm,field,key,size)				\
+	rd_lru_cache_put(rlc, elm, &(elm)->field, key, size)
+
+void *rd_lru_cache_put (rd_lru_cache_t *rlc, void *elm, rd_lru_node_t *node,
+			const void *key, size_t size);
+
+/**
+ * Same as rd_lru_cache_put() but the element expires after 'ttl_ms'
+ * milliseconds (0 = never) regardless of the default TTL.
+ * Expired elements are no longer returned by lookups and are passed to
+ * the eviction callback either when looked up or when swept by
+ * rd_lru_cache_expire().
+ */
+#define RD_LRU_CACHE_PUT_TTL(rlc,elm,field,key,size,ttl_ms)		\
+	rd_lru_cache_put_ttl(rlc, elm, &(elm)->field, key, size, ttl_ms)
+
+void *rd_lru_cache_put_ttl (rd_lru_cache_t *rlc, void *elm,
+			    rd_lru_node_t *node,
+			    const void *key, size_t size, unsigned int ttl_ms);
+
+/**
+ * Returns the element matching 'key' and marks it as most recently used,
+ * or NULL if not found.
+ */
+void *rd_lru_cache_get (rd_lru_cache_t *rlc, const void *key);
+
+/**
+ * Same as rd_lru_cache_get() but does not update the element's recency,
+ * the hit/miss counters or the admission policy.
+ */
+void *rd_lru_cache_peek (rd_lru_cache_t *rlc, const void *key);
+
+/**
+ * Marks the element as most recently used.
+ */
+#define RD_LRU_CACHE_TOUCH(rlc,elm,field)			\
+	rd_lru_cache_touch(rlc, &(elm)->field)
+void rd_lru_cache_touch (rd_lru_cache_t *rlc, rd_lru_node_t *node);
+
+/**
+ * Removes and returns the element matching 'key', or NULL if not found.
+ * The eviction callback is not called.
+ */
+void *rd_lru_cache_remove (rd_lru_cache_t *rlc, const void *key);
+
+/**
+ * Removes element from the cache.
+ * The eviction callback is not called.
+ */
+#define RD_LRU_CACHE_REMOVE_ELM(rlc,elm,field)			\
+	rd_lru_cache_remove_node(rlc, &(elm)->field)
+void rd_lru_cache_remove_node (rd_lru_cache_t *rlc, rd_lru_node_t *node);
+
+/**
+ * Removes and returns the least recently used element, or NULL if the
+ * cache is empty.
+ * The eviction callback is not called.
+ */
+void *rd_lru_cache_pop (rd_lru_cache_t *rlc);
+
+
+/**
+ * Incrementally sweeps the expiry wheel up to the current time,
+ * removing at most 'max_cnt' (0 = unlimited) expired elements and
+ * passing them to the eviction callback.
+ * A sweep that hits 'max_cnt' resumes where it left off on the next call.
+ * Returns the number of elements removed.
+ */
+int rd_lru_cache_expire (rd_lru_cache_t *rlc, int max_cnt);
+
+/**
+ * Starts a recurring timer calling rd_lru_cache_expire() with the
+ * cache locked every 'interval_ms' milliseconds on thread 'rdt'
+ * (or the current thread if NULL).
+ * Returns the timer, stop it with rd_timer_destroy() before the
+ * cache is destroyed.
+ */
+struct rd_timer_s *rd_lru_cache_expire_timer_start (rd_lru_cache_t *rlc,
+						    unsigned int interval_ms,
+						    rd_thread_t *rdt);
+
+
+/**
+ * FNV-1a hash for nul-terminated string keys, and a matching comparator.
+ */
+uint32_t rd_lru_cache_hash_str (const void *key);
+int      rd_lru_cache_cmp_str (const void *a, const void *b);
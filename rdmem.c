@@ -30,6 +30,7 @@
 #include "rdmem.h"
 #include "rdthread.h"
 #include "rdbits.h"
+#include "rdtimer.h"
 
 #include <stdarg.h>
 
@@ -37,6 +38,14 @@ static rd_mutex_t rd_memctxs_lock = RD_MUTEX_INITIALIZER;
 static TAILQ_HEAD(, rd_memctx_s) rd_memctxs =
 	TAILQ_HEAD_INITIALIZER(rd_memctxs);
 
+/* The calling thread's most recently used shards, see rd_memctx_shard() */
+static __thread struct {
+	uint64_t           id;    /* rmc_id, 0 if unused */
+	rd_memctx_shard_t *rmcs;
+} rd_memctx_shard_cache[RD_MEMCTX_SHARD_CACHE];
+
+static uint64_t rd_memctx_next_id = 0;
+
 
 
 void rd_memctx_init (rd_memctx_t *rmc, const char *name, int flags) {
@@ -53,6 +62,26 @@ void rd_memctx_init (rd_memctx_t *rmc, const char *name, int flags) {
 	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_TRACK))
 		TAILQ_INIT(&rmc->rmc_ptrs);
 
+	assert(!BIT_MATCH(rmc->rmc_flags,
+			  RD_MEMCTX_F_TRACK|RD_MEMCTX_F_ARENA));
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_ARENA))
+		rmc->rmc_chunk_size = RD_MEMCTX_CHUNK_SIZE;
+
+	/* Plain shared memctxs only need the lock for the counters,
+	 * use per-thread counter shards instead. */
+	assert(!BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_PROFILE) ||
+	       !BIT_TEST(rmc->rmc_flags,
+			 RD_MEMCTX_F_TRACK|RD_MEMCTX_F_ARENA));
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_PROFILE))
+		rmc->rmc_prof = calloc(1, sizeof(*rmc->rmc_prof));
+
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_LOCK) &&
+	    !BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_TRACK|RD_MEMCTX_F_ARENA|
+		      RD_MEMCTX_F_PROFILE)) {
+		rmc->rmc_id = rd_atomic_add(&rd_memctx_next_id, 1);
+		BIT_SET(rmc->rmc_flags, RD_MEMCTX_F_SHARDED);
+	}
+
 	rd_mutex_lock(&rd_memctxs_lock);
 	TAILQ_INSERT_TAIL(&rd_memctxs, rmc, rmc_link);
 	rd_mutex_unlock(&rd_memctxs_lock);
@@ -60,6 +89,21 @@ void rd_memctx_init (rd_memctx_t *rmc, const char *name, int flags) {
 	BIT_SET(rmc->rmc_flags, RD_MEMCTX_F_INITED);
 }
 
+
+void rd_memctx_arena_init (rd_memctx_t *rmc, const char *name, int flags,
+			   size_t chunk_size) {
+
+	rd_memctx_init(rmc, name, flags | RD_MEMCTX_F_ARENA);
+
+	if (chunk_size)
+		rmc->rmc_chunk_size = chunk_size;
+}
+
+
+static uint64_t rd_memctx_chunks_free0 (rd_memctx_t *rmc,
+					rd_memctx_chunk_t *until,
+					unsigned int *outp);
+
 void rd_memctx_destroy (rd_memctx_t *rmc) {
 
 	rd_mutex_lock(&rd_memctxs_lock);
@@ -68,6 +112,17 @@ void rd_memctx_destroy (rd_memctx_t *rmc) {
 
 	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_TRACK))
 		rd_memctx_freeall(rmc);
+	else if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_ARENA))
+		rd_memctx_chunks_free0(rmc, NULL, NULL);
+
+	while (rmc->rmc_shards) {
+		rd_memctx_shard_t *rmcs = rmc->rmc_shards;
+		rmc->rmc_shards = rmcs->rmcs_next;
+		free(rmcs);
+	}
+
+	if (rmc->rmc_prof)
+		free(rmc->rmc_prof);
 
 	if (rmc->rmc_name)
 		free(rmc->rmc_name);
@@ -115,8 +170,11 @@ static rd_memctx_ptr_t *rd_memctx_ptr_new (rd_memctx_t *rmc,
 					   rd_memctx_alloc_type_t type) {
 	rd_memctx_ptr_t *rmcp;
 
-	rmcp = rd_memctx_alloc0(sizeof(*rmcp) + size, type);
-	
+	if (!(rmcp = rd_memctx_alloc0(sizeof(*rmcp) + size, type))) {
+		*ptr = NULL;
+		return NULL;
+	}
+
 	rmcp->rmcp_size = size;
 	*ptr = rmcp+1;
 
@@ -127,13 +185,264 @@ static rd_memctx_ptr_t *rd_memctx_ptr_new (rd_memctx_t *rmc,
 
 
 
+#define RD_MEMCTX_ALIGNED(sz) \
+	(((sz) + RD_MEMCTX_ALIGN - 1) & ~((size_t)RD_MEMCTX_ALIGN - 1))
+
+#define RD_MEMCTX_CHUNK_HDRSIZE RD_MEMCTX_ALIGNED(sizeof(rd_memctx_chunk_t))
+
+#define RD_MEMCTX_CHUNK_DATA(rmcc) \
+	((char *)(rmcc) + RD_MEMCTX_CHUNK_HDRSIZE)
+
+
+/**
+ * Frees all arena chunks newer than 'until' (exclusive).
+ * If 'until' is NULL all chunks are freed.
+ * Returns the sum in bytes of their current allocations, and the
+ * number of them in '*outp' if not NULL.
+ * memctx must be locked.
+ */
+static uint64_t rd_memctx_chunks_free0 (rd_memctx_t *rmc,
+					rd_memctx_chunk_t *until,
+					unsigned int *outp) {
+	rd_memctx_chunk_t *rmcc;
+	unsigned int out = 0;
+	uint64_t sum = 0;
+
+	while ((rmcc = rmc->rmc_chunks) && rmcc != until) {
+		rmc->rmc_chunks = rmcc->rmcc_next;
+		out += rmcc->rmcc_out;
+		sum += rmcc->rmcc_bytes_out;
+		/* Embedded chunks are newer than the chunk holding them
+		 * and thus released first. */
+		if (!rmcc->rmcc_embedded)
+			free(rmcc);
+	}
+
+	if (outp)
+		*outp = out;
+
+	return sum;
+}
+
+
+/**
+ * Returns the arena chunk holding allocation 'ptr', or NULL.
+ * memctx must be locked.
+ */
+static rd_memctx_chunk_t *rd_memctx_chunk_find (rd_memctx_t *rmc,
+						const void *ptr) {
+	rd_memctx_chunk_t *rmcc;
+
+	/* Newest first: an embedded chunk is found before the chunk
+	 * holding it. */
+	for (rmcc = rmc->rmc_chunks ; rmcc ; rmcc = rmcc->rmcc_next)
+		if ((const char *)ptr >= RD_MEMCTX_CHUNK_DATA(rmcc) &&
+		    (const char *)ptr < RD_MEMCTX_CHUNK_DATA(rmcc) +
+		    rmcc->rmcc_of)
+			return rmcc;
+
+	return NULL;
+}
+
+
+/**
+ * Bump-allocates 'size' bytes from the current arena chunk,
+ * adding a new chunk if the current one is exhausted.
+ * memctx must be locked.
+ */
+static void *rd_memctx_arena_alloc (rd_memctx_t *rmc, size_t size,
+				    rd_memctx_alloc_type_t type) {
+	rd_memctx_chunk_t *rmcc = rmc->rmc_chunks;
+	/* Zero-sized allocations also get their own address, see
+	 * rd_memctx_chunk_find(). */
+	size_t asize = RD_MEMCTX_ALIGNED(RD_MAX(size, 1));
+	void *ptr;
+
+	if (unlikely(!rmcc || rmcc->rmcc_size - rmcc->rmcc_of < asize)) {
+		size_t csize = RD_MAX(rmc->rmc_chunk_size, asize);
+
+		if (!(rmcc = malloc(RD_MEMCTX_CHUNK_HDRSIZE + csize)))
+			return NULL;
+
+		rmcc->rmcc_size = csize;
+		rmcc->rmcc_of   = 0;
+		rmcc->rmcc_out  = 0;
+		rmcc->rmcc_bytes_out = 0;
+		rmcc->rmcc_embedded  = 0;
+		rmcc->rmcc_next = rmc->rmc_chunks;
+		rmc->rmc_chunks = rmcc;
+	}
+
+	ptr = RD_MEMCTX_CHUNK_DATA(rmcc) + rmcc->rmcc_of;
+	rmcc->rmcc_of += asize;
+	rmcc->rmcc_out++;
+	rmcc->rmcc_bytes_out += size;
+
+	if (type == RD_MEMCTX_CALLOC)
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+
+/**
+ * Returns the histogram bucket for value 'v', see rd_memctx_prof_t.
+ */
+static inline int rd_memctx_prof_bucket (uint64_t v) {
+	if (!v)
+		return 0;
+	return RD_MIN(64 - __builtin_clzll(v), RD_MEMCTX_PROF_BUCKETS - 1);
+}
+
+
+/**
+ * Returns the site table index for call site 'site', inserting it
+ * if not already seen, or -1 if the table is full.
+ * RD_MEMCTX_LOCK must be held.
+ */
+static int rd_memctx_prof_site (rd_memctx_prof_t *rmcpf, void *site) {
+	unsigned int i = (unsigned int)(((uintptr_t)site >> 2) * 2654435761u);
+	int n;
+
+	for (n = 0 ; n < RD_MEMCTX_PROF_SITES ; n++) {
+		rd_memctx_prof_site_t *rmps;
+
+		i %= RD_MEMCTX_PROF_SITES;
+		rmps = &rmcpf->sites[i];
+
+		if (likely(rmps->site == site))
+			return i;
+		else if (!rmps->site) {
+			rmps->site = site;
+			rmcpf->site_cnt++;
+			return i;
+		}
+		i++;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Records a new allocation of 'size' bytes from 'site'.
+ * RD_MEMCTX_LOCK must be held.
+ */
+static void rd_memctx_prof_alloc (rd_memctx_t *rmc,
+				  rd_memctx_prof_hdr_t *rmph,
+				  size_t size, void *site) {
+	rd_memctx_prof_t *rmcpf = rmc->rmc_prof;
+
+	rmph->rmph_size = size;
+	rmph->rmph_ts   = rd_clock();
+	rmph->rmph_site = rd_memctx_prof_site(rmcpf, site);
+
+	rmcpf->size_hist[rd_memctx_prof_bucket(size)]++;
+
+	if (likely(rmph->rmph_site != -1)) {
+		rd_memctx_prof_site_t *rmps = &rmcpf->sites[rmph->rmph_site];
+		rmps->allocs++;
+		rmps->bytes += size;
+		rmps->out++;
+	} else
+		rmcpf->site_misses++;
+}
+
+
+/**
+ * Records the release of a profiled allocation.
+ * RD_MEMCTX_LOCK must be held.
+ */
+static void rd_memctx_prof_free (rd_memctx_t *rmc,
+				 const rd_memctx_prof_hdr_t *rmph) {
+	rd_memctx_prof_t *rmcpf = rmc->rmc_prof;
+
+	rmcpf->lifetime_hist[rd_memctx_prof_bucket(rd_clock() -
+						   rmph->rmph_ts)]++;
+
+	if (likely(rmph->rmph_site != -1))
+		rmcpf->sites[rmph->rmph_site].out--;
+}
+
+
+/**
+ * Looks up or creates the calling thread's shard for 'rmc'.
+ * Shards are only freed by rd_memctx_destroy(), a shard left by an
+ * exited thread is taken over by a new thread with the same id.
+ */
+static rd_memctx_shard_t *rd_memctx_shard_get (rd_memctx_t *rmc) {
+	pthread_t thr = pthread_self();
+	rd_memctx_shard_t *rmcs;
+
+	rd_mutex_lock(&rmc->rmc_lock);
+	for (rmcs = rmc->rmc_shards ; rmcs ; rmcs = rmcs->rmcs_next)
+		if (pthread_equal(rmcs->rmcs_thread, thr))
+			break;
+
+	if (!rmcs) {
+		if (posix_memalign((void **)&rmcs, 64, sizeof(*rmcs)))
+			abort();
+		memset(rmcs, 0, sizeof(*rmcs));
+		rmcs->rmcs_thread = thr;
+		rmcs->rmcs_next = rmc->rmc_shards;
+		/* Publish to lock-less readers in rd_memctx_stats() */
+		__atomic_store_n(&rmc->rmc_shards, rmcs, __ATOMIC_RELEASE);
+	}
+	rd_mutex_unlock(&rmc->rmc_lock);
+
+	return rmcs;
+}
+
+/**
+ * Returns the calling thread's statistics shard for an
+ * RD_MEMCTX_F_SHARDED memctx.
+ */
+static inline rd_memctx_shard_t *rd_memctx_shard (rd_memctx_t *rmc) {
+	int i = rmc->rmc_id & (RD_MEMCTX_SHARD_CACHE - 1);
+
+	if (unlikely(rd_memctx_shard_cache[i].id != rmc->rmc_id)) {
+		rd_memctx_shard_cache[i].rmcs = rd_memctx_shard_get(rmc);
+		rd_memctx_shard_cache[i].id   = rmc->rmc_id;
+	}
+
+	return rd_memctx_shard_cache[i].rmcs;
+}
+
+/* Counter update by the shard's owner thread: plain load and store,
+ * atomic only to not tear for concurrent rd_memctx_stats() readers. */
+#define RD_MEMCTX_SHARD_ADD(field,val)						__atomic_store_n(&(field), (field) + (val), __ATOMIC_RELAXED)
+
+
 void *rd_memctx_alloc (rd_memctx_t *rmc, size_t size,
 		       rd_memctx_alloc_type_t type) {
-	void *ptr;
+	void *ptr = NULL;
+
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_SHARDED)) {
+		rd_memctx_shard_t *rmcs = rd_memctx_shard(rmc);
+
+		if (!(ptr = rd_memctx_alloc0(size, type)))
+			return NULL;
+
+		RD_MEMCTX_SHARD_ADD(rmcs->rmcs_out, 1);
+		RD_MEMCTX_SHARD_ADD(rmcs->rmcs_bytes_out, (int64_t)size);
+		RD_MEMCTX_SHARD_ADD(rmcs->rmcs_allocs, 1);
+		return ptr;
+	}
 
 	RD_MEMCTX_LOCK(rmc);
 
-	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_TRACK))
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_ARENA))
+		ptr = rd_memctx_arena_alloc(rmc, size, type);
+	else if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_PROFILE)) {
+		rd_memctx_prof_hdr_t *rmph;
+
+		if ((rmph = rd_memctx_alloc0(sizeof(*rmph) + size, type))) {
+			rd_memctx_prof_alloc(rmc, rmph, size,
+					     __builtin_return_address(0));
+			ptr = rmph + 1;
+		} else
+			ptr = NULL;
+	} else if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_TRACK))
 		rd_memctx_ptr_new(rmc, size, &ptr, type);
 	else {
 		switch (type)
@@ -150,8 +459,16 @@ void *rd_memctx_alloc (rd_memctx_t *rmc, size_t size,
 		}
 	}
 
+	if (unlikely(!ptr)) {
+		RD_MEMCTX_UNLOCK(rmc);
+		return NULL;
+	}
+
 	rmc->rmc_out++;
+	rmc->rmc_allocs++;
 	rmc->rmc_bytes_out += size;
+	if (rmc->rmc_bytes_out > rmc->rmc_bytes_hwm)
+		rmc->rmc_bytes_hwm = rmc->rmc_bytes_out;
 
 	RD_MEMCTX_UNLOCK(rmc);
 	return ptr;
@@ -160,8 +477,30 @@ void *rd_memctx_alloc (rd_memctx_t *rmc, size_t size,
 
 void rd_memctx_free0 (rd_memctx_t *rmc, void *ptr, size_t size) {
 
+	if (unlikely(!ptr))
+		return;
+
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_SHARDED)) {
+		rd_memctx_shard_t *rmcs = rd_memctx_shard(rmc);
+
+		free(ptr);
+
+		RD_MEMCTX_SHARD_ADD(rmcs->rmcs_out, -1);
+		if (size)
+			RD_MEMCTX_SHARD_ADD(rmcs->rmcs_bytes_out,
+					    -(int64_t)size);
+		return;
+	}
+
 	RD_MEMCTX_LOCK(rmc);
 
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_PROFILE)) {
+		rd_memctx_prof_hdr_t *rmph = (rd_memctx_prof_hdr_t *)ptr - 1;
+		rd_memctx_prof_free(rmc, rmph);
+		size = rmph->rmph_size;
+		ptr = rmph;
+	}
+
 	if (size) {
 		assert(rmc->rmc_bytes_out - size >= 0);
 		rmc->rmc_bytes_out -= size;
@@ -169,7 +508,17 @@ void rd_memctx_free0 (rd_memctx_t *rmc, void *ptr, size_t size) {
 
 	assert(rmc->rmc_out > 0);
 	rmc->rmc_out--;
-	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_TRACK)) {
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_ARENA)) {
+		rd_memctx_chunk_t *rmcc = rd_memctx_chunk_find(rmc, ptr);
+
+		/* Arena memory is reclaimed by freeall() or rollback(),
+		 * which must not count this allocation again. */
+		assert(rmcc && rmcc->rmcc_out > 0);
+		rmcc->rmcc_out--;
+		rmcc->rmcc_bytes_out -= size;
+		RD_MEMCTX_UNLOCK(rmc);
+		return;
+	} else if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_TRACK)) {
 		rd_memctx_ptr_t *rmcp = (rd_memctx_ptr_t *)ptr - 1;
 		TAILQ_REMOVE(&rmc->rmc_ptrs, rmcp, rmcp_link);
 		ptr = rmcp;
@@ -186,16 +535,58 @@ void rd_memctx_free0 (rd_memctx_t *rmc, void *ptr, size_t size) {
 /**
  * Frees all memory allocated with the memctx and returns the
  * number of bytes freed.
- * Requires RD_MEMCTX_F_TRACK to be set.
+ * Requires RD_MEMCTX_F_TRACK or RD_MEMCTX_F_ARENA to be set.
+ *
+ * For arenas the oldest standard-sized chunk is kept and reset
+ * for reuse, all other chunks are freed.
  */
+/**
+ * Arena part of rd_memctx_freeall().
+ * memctx must be locked.
+ */
+static size_t rd_memctx_arena_freeall0 (rd_memctx_t *rmc) {
+	rd_memctx_chunk_t *last = rmc->rmc_chunks;
+	size_t sum;
+
+	while (last && last->rmcc_next)
+		last = last->rmcc_next;
+
+	if (last && last->rmcc_size != rmc->rmc_chunk_size)
+		last = NULL;
+
+	sum = rmc->rmc_bytes_out;
+	rd_memctx_chunks_free0(rmc, last, NULL);
+	if (last) {
+		last->rmcc_of = 0;
+		last->rmcc_out = 0;
+		last->rmcc_bytes_out = 0;
+	}
+
+	rmc->rmc_out = 0;
+	rmc->rmc_bytes_out = 0;
+
+	/* Existing marks may reference freed chunks or offsets
+	 * past the reset one. */
+	rmc->rmc_arena_gen++;
+
+	return sum;
+}
+
 size_t rd_memctx_freeall (rd_memctx_t *rmc) {
 	rd_memctx_ptr_t *rmcp;
 	size_t sum = 0;
 
-	assert(BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_TRACK));
+	assert(BIT_TEST(rmc->rmc_flags,
+			RD_MEMCTX_F_TRACK|RD_MEMCTX_F_ARENA));
 
 	RD_MEMCTX_LOCK(rmc);
 
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_ARENA)) {
+		sum = rd_memctx_arena_freeall0(rmc);
+		RD_MEMCTX_UNLOCK(rmc);
+		return sum;
+	}
+
 	while ((rmcp = TAILQ_FIRST(&rmc->rmc_ptrs))) {
 		sum += rmcp->rmcp_size;
 		rd_memctx_ptr_free(rmc, rmcp);
@@ -208,6 +599,78 @@ size_t rd_memctx_freeall (rd_memctx_t *rmc) {
 
 
 
+void rd_memctx_mark (rd_memctx_t *rmc, rd_memctx_mark_t *mark) {
+	rd_memctx_chunk_t *rmcc;
+
+	assert(BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_ARENA));
+
+	RD_MEMCTX_LOCK(rmc);
+
+	rmcc = rmc->rmc_chunks;
+	mark->chunk = rmcc;
+	mark->of    = rmcc ? rmcc->rmcc_of : 0;
+	mark->gen   = rmc->rmc_arena_gen;
+
+	/* Close the current chunk so that all allocations after the mark
+	 * are in newer chunks: continue in its tail as an embedded chunk,
+	 * or in a new chunk if the tail is too small. */
+	if (rmcc) {
+		size_t avail = rmcc->rmcc_size - rmcc->rmcc_of;
+
+		if (avail >= RD_MEMCTX_CHUNK_HDRSIZE + RD_MEMCTX_ALIGN) {
+			rd_memctx_chunk_t *sub = (rd_memctx_chunk_t *)
+				(RD_MEMCTX_CHUNK_DATA(rmcc) + rmcc->rmcc_of);
+
+			sub->rmcc_size      = avail - RD_MEMCTX_CHUNK_HDRSIZE;
+			sub->rmcc_of        = 0;
+			sub->rmcc_out       = 0;
+			sub->rmcc_bytes_out = 0;
+			sub->rmcc_embedded  = 1;
+			sub->rmcc_next      = rmcc;
+			rmc->rmc_chunks     = sub;
+		}
+
+		rmcc->rmcc_of = rmcc->rmcc_size;
+	}
+
+	RD_MEMCTX_UNLOCK(rmc);
+}
+
+
+size_t rd_memctx_rollback (rd_memctx_t *rmc, const rd_memctx_mark_t *mark) {
+	unsigned int out;
+	uint64_t sum;
+
+	assert(BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_ARENA));
+
+	RD_MEMCTX_LOCK(rmc);
+
+	/* freeall() was called after the mark: whatever is allocated
+	 * now was allocated after the mark. */
+	if (unlikely(mark->gen != rmc->rmc_arena_gen)) {
+		sum = rd_memctx_arena_freeall0(rmc);
+		RD_MEMCTX_UNLOCK(rmc);
+		return sum;
+	}
+
+	/* The marked chunk was closed by rd_memctx_mark(): all later
+	 * allocations are in newer chunks, which know how many of
+	 * theirs are still outstanding. */
+	sum = rd_memctx_chunks_free0(rmc, mark->chunk, &out);
+	if (mark->chunk)
+		mark->chunk->rmcc_of = mark->of;
+
+	assert(rmc->rmc_out >= out && rmc->rmc_bytes_out >= sum);
+	rmc->rmc_out       -= out;
+	rmc->rmc_bytes_out -= sum;
+
+	RD_MEMCTX_UNLOCK(rmc);
+
+	return (size_t)sum;
+}
+
+
+
 void *rd_calloc_struct0 (rd_memctx_t *rmc, size_t base_size, ...) {
 	va_list ap;
 	size_t tot_size = base_size;
@@ -270,29 +733,245 @@ void *rd_calloc_struct0 (rd_memctx_t *rmc, size_t base_size, ...) {
 
 
 
-#if 0
-/**
- * Returns memory information about the designated process.
- */
-size_t rd_mem_proc (pid_t pid) {
+rd_memctx_snapshot_t *rd_memctx_snapshot (int *cntp) {
+	rd_memctx_snapshot_t *snaps;
+	rd_memctx_t *rmc;
+	int cnt = 0;
+	int i = 0;
+
+	rd_mutex_lock(&rd_memctxs_lock);
+
+	TAILQ_FOREACH(rmc, &rd_memctxs, rmc_link)
+		cnt++;
+
+	snaps = calloc(cnt ? cnt : 1, sizeof(*snaps));
+
+	TAILQ_FOREACH(rmc, &rd_memctxs, rmc_link) {
+		rd_memctx_snapshot_t *snap = &snaps[i++];
+		rd_ts_t now;
+
+		snprintf(snap->name, sizeof(snap->name), "%s",
+			 rmc->rmc_name ? : "");
+		rd_memctx_stats(rmc, &snap->stats);
+
+		/* The rate fields are protected by rd_memctxs_lock. */
+		now = rd_clock();
+		if (rmc->rmc_rate_ts && now > rmc->rmc_rate_ts)
+			snap->alloc_rate =
+				(double)(snap->stats.allocs -
+					 rmc->rmc_rate_allocs) * 1000000.0 /
+				(double)(now - rmc->rmc_rate_ts);
+		rmc->rmc_rate_allocs = snap->stats.allocs;
+		rmc->rmc_rate_ts = now;
+	}
+
+	rd_mutex_unlock(&rd_memctxs_lock);
+
+	*cntp = cnt;
+	return snaps;
+}
+
+
+int rd_mem_proc (pid_t pid, rd_mem_proc_t *rmp) {
 	char path[64];
-	char buf[128];
-	int fd;
+	FILE *fp;
+	unsigned long size, resident, shared, text, lib, data;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int r;
+
+	if (pid)
+		snprintf(path, sizeof(path), "/proc/%i/statm", (int)pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/statm");
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+
+	r = fscanf(fp, "%lu %lu %lu %lu %lu %lu",
+		   &size, &resident, &shared, &text, &lib, &data);
+	fclose(fp);
+
+	if (r != 6) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	sprintf(path, "/proc/%i/statm", pid);
-	if ((fd = open(path, O_RDONLY) == -1))
-		return 0;
+	rmp->size     = (size_t)size * pagesize;
+	rmp->resident = (size_t)resident * pagesize;
+	rmp->shared   = (size_t)shared * pagesize;
+	rmp->text     = (size_t)text * pagesize;
+	rmp->data     = (size_t)data * pagesize;
+
+	return 0;
+}
+
+
+size_t rd_mem_rss (void) {
+	rd_mem_proc_t rmp;
 
-	if (read(fd, buf, sizeof(buf)) < 1) {
-		close(fd);
+	if (rd_mem_proc(0, &rmp) == -1)
 		return 0;
+
+	return rmp.resident;
+}
+
+
+void rd_memctx_dump (FILE *fp) {
+	rd_memctx_snapshot_t *snaps;
+	rd_mem_proc_t rmp;
+	int cnt, i;
+
+	snaps = rd_memctx_snapshot(&cnt);
+
+	fprintf(fp, "%-32s %10s %14s %14s %12s\n",
+		"# memctx", "out", "bytes_out", "bytes_hwm", "allocs/s");
+	for (i = 0 ; i < cnt ; i++)
+		fprintf(fp, "%-32s %10u %14zu %14zu %12.1f\n",
+			snaps[i].name,
+			snaps[i].stats.out,
+			snaps[i].stats.bytes_out,
+			snaps[i].stats.bytes_hwm,
+			snaps[i].alloc_rate);
+
+	if (rd_mem_proc(0, &rmp) != -1)
+		fprintf(fp, "# process: rss %zu, vsz %zu, data %zu bytes\n",
+			rmp.resident, rmp.size, rmp.data);
+
+	fflush(fp);
+
+	free(snaps);
+}
+
+
+static rd_thread_event_f(rd_memctx_dump_timer_cb) {
+	rd_memctx_dump((FILE *)ptr);
+}
+
+
+rd_timer_t *rd_memctx_dump_timer_start (FILE *fp, unsigned int interval_ms,
+					rd_thread_t *rdt) {
+	rd_timer_t *rt;
+
+	rt = rd_timer_new(RD_TIMER_RECURR, rdt, rd_memctx_dump_timer_cb, fp);
+	rd_timer_start(rt, interval_ms);
+
+	return rt;
+}
+
+
+
+static int rd_memctx_prof_cmp_allocs (const void *_a, const void *_b) {
+	const rd_memctx_prof_site_t *a = _a, *b = _b;
+	return (a->allocs < b->allocs) - (a->allocs > b->allocs);
+}
+
+static int rd_memctx_prof_cmp_bytes (const void *_a, const void *_b) {
+	const rd_memctx_prof_site_t *a = _a, *b = _b;
+	return (a->bytes < b->bytes) - (a->bytes > b->bytes);
+}
+
+static int rd_memctx_prof_cmp_out (const void *_a, const void *_b) {
+	const rd_memctx_prof_site_t *a = _a, *b = _b;
+	return (a->out < b->out) - (a->out > b->out);
+}
+
+
+int rd_memctx_prof_top (rd_memctx_t *rmc, rd_memctx_prof_site_t *sites,
+			int cnt, rd_memctx_prof_order_t order) {
+	rd_memctx_prof_site_t *all;
+	int i, n = 0;
+	int (*cmp) (const void *, const void *);
+
+	assert(BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_PROFILE));
+
+	switch (order)
+	{
+	case RD_MEMCTX_PROF_BY_BYTES:
+		cmp = rd_memctx_prof_cmp_bytes;
+		break;
+	case RD_MEMCTX_PROF_BY_OUT:
+		cmp = rd_memctx_prof_cmp_out;
+		break;
+	default:
+		cmp = rd_memctx_prof_cmp_allocs;
+		break;
 	}
 
-	/* FIXME: scanf and so on...
-	 *        produce a struct that includes the relevant fields.
-	 * http://elinux.org/Runtime_Memory_Measurement
-	 *
-	 * Then make rd_mem_rss() that returns just the rss field.
-	 */
+	if (!(all = malloc(sizeof(*all) * RD_MEMCTX_PROF_SITES)))
+		return -1;
+
+	RD_MEMCTX_LOCK(rmc);
+	for (i = 0 ; i < RD_MEMCTX_PROF_SITES ; i++)
+		if (rmc->rmc_prof->sites[i].site)
+			all[n++] = rmc->rmc_prof->sites[i];
+	RD_MEMCTX_UNLOCK(rmc);
+
+	qsort(all, n, sizeof(*all), cmp);
+
+	n = RD_MIN(n, cnt);
+	memcpy(sites, all, sizeof(*all) * n);
+	free(all);
+
+	return n;
+}
+
+
+void rd_memctx_prof_hist (rd_memctx_t *rmc, uint64_t *size_hist,
+			  uint64_t *lifetime_hist) {
+
+	assert(BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_PROFILE));
+
+	RD_MEMCTX_LOCK(rmc);
+	if (size_hist)
+		memcpy(size_hist, rmc->rmc_prof->size_hist,
+		       sizeof(rmc->rmc_prof->size_hist));
+	if (lifetime_hist)
+		memcpy(lifetime_hist, rmc->rmc_prof->lifetime_hist,
+		       sizeof(rmc->rmc_prof->lifetime_hist));
+	RD_MEMCTX_UNLOCK(rmc);
+}
+
+
+void rd_memctx_prof_dump (rd_memctx_t *rmc, FILE *fp, int cnt) {
+	uint64_t size_hist[RD_MEMCTX_PROF_BUCKETS];
+	uint64_t lifetime_hist[RD_MEMCTX_PROF_BUCKETS];
+	rd_memctx_prof_site_t *sites;
+	int i, n;
+
+	/* No more sites than that are tracked, bounds the alloca(). */
+	cnt = RD_MAX(0, RD_MIN(cnt, RD_MEMCTX_PROF_SITES));
+	sites = alloca(sizeof(*sites) * cnt);
+
+	rd_memctx_prof_hist(rmc, size_hist, lifetime_hist);
+
+	fprintf(fp, "# memctx %s profile\n", rmc->rmc_name ? : "");
+
+	fprintf(fp, "# %-20s %14s %14s\n", "bucket <", "size", "lifetime_us");
+	for (i = 0 ; i < RD_MEMCTX_PROF_BUCKETS ; i++) {
+		if (!size_hist[i] && !lifetime_hist[i])
+			continue;
+		fprintf(fp, "  %-20"PRIu64" %14"PRIu64" %14"PRIu64"\n",
+			(uint64_t)1 << i,
+			size_hist[i], lifetime_hist[i]);
+	}
+
+	n = RD_MAX(0, rd_memctx_prof_top(rmc, sites, cnt,
+					 RD_MEMCTX_PROF_BY_ALLOCS));
+	fprintf(fp, "# top %i sites by allocations: "
+		"site allocs bytes out\n", n);
+	for (i = 0 ; i < n ; i++)
+		fprintf(fp, "  %p %"PRIu64" %"PRIu64" %"PRId64"\n",
+			sites[i].site, sites[i].allocs, sites[i].bytes,
+			sites[i].out);
+
+	n = RD_MAX(0, rd_memctx_prof_top(rmc, sites, cnt,
+					 RD_MEMCTX_PROF_BY_OUT));
+	fprintf(fp, "# top %i sites by live allocations: "
+		"site allocs bytes out\n", n);
+	for (i = 0 ; i < n && sites[i].out > 0 ; i++)
+		fprintf(fp, "  %p %"PRIu64" %"PRIu64" %"PRId64"\n",
+			sites[i].site, sites[i].allocs, sites[i].bytes,
+			sites[i].out);
+
+	fflush(fp);
 }
-#endif
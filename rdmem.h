@@ -41,6 +41,87 @@ typedef struct rd_memctx_ptr_s {
 } rd_memctx_ptr_t;
 
 
+/**
+ * Arena chunk, when RD_MEMCTX_F_ARENA is used.
+ * Allocations are carved out of the chunk's tail space by bumping
+ * 'rmcc_of', the chunk memory follows directly after this header.
+ * rd_memctx_mark() turns the rest of the current chunk into a chunk of
+ * its own so that a rollback releases whole chunks, and knows how many
+ * of their allocations are still outstanding.
+ */
+typedef struct rd_memctx_chunk_s {
+	struct rd_memctx_chunk_s *rmcc_next;  /* Previous (older) chunk */
+	size_t        rmcc_size;              /* Usable size */
+	size_t        rmcc_of;                /* Next free offset */
+	unsigned int  rmcc_out;               /* Current allocations */
+	int           rmcc_embedded;          /* In rmcc_next's tail,
+					       * not malloc()ed */
+	uint64_t      rmcc_bytes_out;         /* Their sum in bytes */
+} rd_memctx_chunk_t;
+
+/**
+ * Per-thread statistics shard, used for RD_MEMCTX_F_LOCK memctxs that
+ * do not need the lock for anything but the counters.
+ * Each thread using the memctx gets its own shard, on its own cache
+ * line, which only it writes to (plain stores, no atomic
+ * read-modify-write), rd_memctx_stats() sums all shards.
+ * Counters are signed since memory may be freed by another thread
+ * (shard) than it was allocated by.
+ */
+typedef struct rd_memctx_shard_s {
+	int64_t       rmcs_out;
+	int64_t       rmcs_bytes_out;
+	uint64_t      rmcs_allocs;
+	pthread_t     rmcs_thread;              /* Owner */
+	struct rd_memctx_shard_s *rmcs_next;    /* Next shard of memctx */
+} __attribute__((aligned(64))) rd_memctx_shard_t;
+
+/* Per-thread cache of shards, by memctx id (power of 2) */
+#define RD_MEMCTX_SHARD_CACHE  8
+
+
+/**
+ * Allocation header, when RD_MEMCTX_F_PROFILE is used.
+ * Aligned to keep the returned memory suitably aligned for any type.
+ */
+typedef struct rd_memctx_prof_hdr_s {
+	size_t        rmph_size;   /* Allocation size */
+	rd_ts_t       rmph_ts;     /* Time of allocation */
+	int32_t       rmph_site;   /* Call site index, or -1 */
+} __attribute__((aligned(16))) rd_memctx_prof_hdr_t;
+
+#define RD_MEMCTX_PROF_BUCKETS  64   /* log2 histogram buckets */
+#define RD_MEMCTX_PROF_SITES    256  /* Max tracked call sites */
+
+/**
+ * Per call site allocation statistics.
+ */
+typedef struct rd_memctx_prof_site_s {
+	void         *site;        /* Call site (return address) */
+	uint64_t      allocs;      /* Total allocations */
+	uint64_t      bytes;       /* Total bytes allocated */
+	int64_t       out;         /* Current (live) allocations */
+} rd_memctx_prof_site_t;
+
+/**
+ * Allocation profile, when RD_MEMCTX_F_PROFILE is used.
+ * Histogram bucket 'i' counts values 'v' where 2^(i-1) <= v < 2^i,
+ * bucket 0 counts zero values.
+ */
+typedef struct rd_memctx_prof_s {
+	uint64_t      size_hist[RD_MEMCTX_PROF_BUCKETS];     /* Bytes */
+	uint64_t      lifetime_hist[RD_MEMCTX_PROF_BUCKETS]; /* Microseconds */
+	rd_memctx_prof_site_t sites[RD_MEMCTX_PROF_SITES];   /* Hash table */
+	int           site_cnt;
+	uint64_t      site_misses; /* Allocations from untracked sites
+				    * due to a full site table. */
+} rd_memctx_prof_t;
+
+
+#define RD_MEMCTX_CHUNK_SIZE  (64 * 1024)  /* Default arena chunk size */
+#define RD_MEMCTX_ALIGN       16           /* Arena allocation alignment */
+
+
 /**
  * Memory context.
  */
@@ -55,6 +136,13 @@ typedef struct rd_memctx_s {
 	uint64_t     rmc_bytes_out; /* Sum of current allocations in bytes.
 				     * Requires the use of rd_memctx_freesz()
 				     * or RD_MEMCTX_F_TRACK. */
+	uint64_t     rmc_bytes_hwm; /* High-water mark of rmc_bytes_out.
+				     * Only sampled by rd_memctx_stats()
+				     * for _F_SHARDED memctxs. */
+	uint64_t     rmc_allocs;    /* Total number of allocations */
+
+	uint64_t     rmc_rate_allocs; /* rmc_allocs and time of the last */
+	rd_ts_t      rmc_rate_ts;     /* rd_memctx_snapshot() */
 
 	int          rmc_flags;
 #define RD_MEMCTX_F_TRACK   0x1    /* Track all allocations by maintaining
@@ -68,10 +156,46 @@ typedef struct rd_memctx_s {
 #define RD_MEMCTX_F_LOCK    0x2    /* This flag is required for memctx's
 				    * shared by multiple threads to enable 
 				    * mutex locking. */
+#define RD_MEMCTX_F_ARENA   0x4    /* Bump-allocate from large chunks
+				    * rather than calling malloc() for
+				    * each allocation.
+				    * rd_memctx_free() only updates the
+				    * counters, memory is reclaimed by
+				    * rd_memctx_freeall() or
+				    * rd_memctx_rollback().
+				    * Mutually exclusive with _F_TRACK. */
+#define RD_MEMCTX_F_PROFILE 0x8    /* Record allocation size and lifetime
+				    * histograms and per call site
+				    * statistics, see rd_memctx_prof_*().
+				    * Adds a small header to each
+				    * allocation and one rd_clock() call
+				    * to alloc and free.
+				    * Mutually exclusive with _F_TRACK
+				    * and _F_ARENA. */
 #define RD_MEMCTX_F_INITED  0x100  /* Initialized */
+#define RD_MEMCTX_F_SHARDED 0x200  /* Internal: _F_LOCK without _F_TRACK,
+				    * _F_ARENA or _F_PROFILE: the lock
+				    * only serializes shard creation,
+				    * counters are kept in rmc_shards. */
 
 	TAILQ_HEAD(, rd_memctx_ptr_s) rmc_ptrs;  /* If _F_TRACK is set:
 						  * Current allocations. */
+
+	rd_memctx_chunk_t *rmc_chunks;     /* If _F_ARENA is set:
+					    * Chunk list, newest first. */
+	size_t       rmc_chunk_size;       /* If _F_ARENA is set:
+					    * Standard chunk size. */
+	unsigned int rmc_arena_gen;        /* If _F_ARENA is set:
+					    * bumped by rd_memctx_freeall(),
+					    * invalidates older marks. */
+
+	rd_memctx_shard_t *rmc_shards;     /* If _F_SHARDED is set:
+					    * per-thread counter shards. */
+	uint64_t           rmc_id;         /* If _F_SHARDED is set:
+					    * unique id, keys the
+					    * per-thread shard cache. */
+
+	rd_memctx_prof_t  *rmc_prof;       /* If _F_PROFILE is set */
 } rd_memctx_t;
 
 
@@ -88,19 +212,59 @@ typedef struct rd_memctx_s {
 void rd_memctx_init (rd_memctx_t *rmc, const char *name, int flags);
 void rd_memctx_destroy (rd_memctx_t *rmc);
 
+/**
+ * Same as rd_memctx_init() but sets up an RD_MEMCTX_F_ARENA context
+ * with standard chunks of 'chunk_size' bytes.
+ * If 'chunk_size' is 0 the default RD_MEMCTX_CHUNK_SIZE is used.
+ * Allocations larger than the chunk size get a dedicated chunk.
+ */
+void rd_memctx_arena_init (rd_memctx_t *rmc, const char *name, int flags,
+			   size_t chunk_size);
+
 #define RD_MEMCTX_INITED(rmc) ((rmc)->rmc_flags & RD_MEMCTX_F_INITED)
 
 typedef struct rd_memctx_stats_s {
 	unsigned int out;
 	size_t       bytes_out;
+	size_t       bytes_hwm;   /* High-water mark of bytes_out */
+	uint64_t     allocs;      /* Total number of allocations */
 } rd_memctx_stats_t;
 
 static void rd_memctx_stats (rd_memctx_t *rmc, rd_memctx_stats_t *stats)
 	RD_UNUSED;
 static void rd_memctx_stats (rd_memctx_t *rmc, rd_memctx_stats_t *stats) {
+	if (BIT_TEST(rmc->rmc_flags, RD_MEMCTX_F_SHARDED)) {
+		int64_t out = 0, bytes_out = 0;
+		uint64_t allocs = 0;
+		rd_memctx_shard_t *rmcs;
+
+		for (rmcs = __atomic_load_n(&rmc->rmc_shards,
+					    __ATOMIC_ACQUIRE) ;
+		     rmcs ; rmcs = rmcs->rmcs_next) {
+			out += __atomic_load_n(&rmcs->rmcs_out,
+					       __ATOMIC_RELAXED);
+			bytes_out += __atomic_load_n(&rmcs->rmcs_bytes_out,
+						     __ATOMIC_RELAXED);
+			allocs += __atomic_load_n(&rmcs->rmcs_allocs,
+						  __ATOMIC_RELAXED);
+		}
+
+		/* Benign race: the hwm is only an approximation here. */
+		if (bytes_out > (int64_t)rmc->rmc_bytes_hwm)
+			rmc->rmc_bytes_hwm = bytes_out;
+
+		stats->out = (unsigned int)out;
+		stats->bytes_out = (size_t)bytes_out;
+		stats->bytes_hwm = rmc->rmc_bytes_hwm;
+		stats->allocs = allocs;
+		return;
+	}
+
 	RD_MEMCTX_LOCK(rmc);
 	stats->out = rmc->rmc_out;
 	stats->bytes_out = rmc->rmc_bytes_out;
+	stats->bytes_hwm = rmc->rmc_bytes_hwm;
+	stats->allocs = rmc->rmc_allocs;
 	RD_MEMCTX_UNLOCK(rmc);
 }
 
@@ -117,16 +281,150 @@ void *rd_memctx_alloc (rd_memctx_t *rmc, size_t size,
 #define rd_memctx_calloc(rmc,nmemb,size)  \
 	rd_memctx_alloc(rmc,(nmemb)*(size),RD_MEMCTX_CALLOC)
 
+/**
+ * Frees memory allocated from 'rmc'. Like free(), 'ptr' may be NULL.
+ */
 void  rd_memctx_free0 (rd_memctx_t *rmc, void *ptr, size_t size);
 #define rd_memctx_free(rmc,ptr)       rd_memctx_free0(rmc,ptr,0);
 #define rd_memctx_freesz(rmc,ptr,sz)  rd_memctx_free0(rmc,ptr,sz)
 
 size_t rd_memctx_freeall (rd_memctx_t *rmc);
 
+
+/**
+ * Arena checkpoint, see rd_memctx_mark().
+ */
+typedef struct rd_memctx_mark_s {
+	rd_memctx_chunk_t *chunk;
+	size_t             of;
+	unsigned int       gen;         /* rmc_arena_gen */
+} rd_memctx_mark_t;
+
+/**
+ * Records the current arena position of an RD_MEMCTX_F_ARENA memctx
+ * in 'mark'.
+ * Subsequent allocations are made from the rest of the current chunk,
+ * behind a chunk header, or from a new chunk if less than that is left.
+ */
+void rd_memctx_mark (rd_memctx_t *rmc, rd_memctx_mark_t *mark);
+
+/**
+ * Releases all arena allocations made after 'mark' was recorded
+ * and subtracts those not already freed from the counters.
+ * Marks must be rolled back in reverse order (LIFO), a rollback
+ * invalidates all marks recorded after 'mark'.
+ * Rolling back to a mark recorded before the last rd_memctx_freeall()
+ * releases everything, like rd_memctx_freeall().
+ * Returns the number of bytes subtracted.
+ */
+size_t rd_memctx_rollback (rd_memctx_t *rmc, const rd_memctx_mark_t *mark);
+
 #define rd_memctx_name(rmc) ((rmc)->rmc_name)
 
 
 
+
+/**
+ * Memory accounting overview.
+ *
+ * All initialized memctxs are registered in a global list which may be
+ * inspected with rd_memctx_snapshot(), or dumped in human readable form
+ * with rd_memctx_dump(), optionally periodically by
+ * rd_memctx_dump_timer_start().
+ */
+
+typedef struct rd_memctx_snapshot_s {
+	char         name[64];    /* Truncated memctx name */
+	rd_memctx_stats_t stats;
+	double       alloc_rate;  /* Allocations per second since the
+				   * previous snapshot, 0 on the first. */
+} rd_memctx_snapshot_t;
+
+/**
+ * Returns an array of snapshots of all registered memctxs and sets
+ * '*cntp' to the number of elements.
+ * The returned array must be freed with free().
+ */
+rd_memctx_snapshot_t *rd_memctx_snapshot (int *cntp);
+
+
+/**
+ * Process memory usage as reported by /proc/<pid>/statm, in bytes.
+ */
+typedef struct rd_mem_proc_s {
+	size_t size;       /* Total program size (VSZ) */
+	size_t resident;   /* Resident set size (RSS) */
+	size_t shared;     /* Resident shared pages (file backed) */
+	size_t text;       /* Text (code) */
+	size_t data;       /* Data + stack */
+} rd_mem_proc_t;
+
+/**
+ * Reads the memory usage of process 'pid' (0 for the current process)
+ * into 'rmp'.
+ * Returns 0 on success or -1 on error (see errno).
+ */
+int rd_mem_proc (pid_t pid, rd_mem_proc_t *rmp);
+
+/**
+ * Returns the resident set size of the current process in bytes,
+ * or 0 if it could not be read.
+ */
+size_t rd_mem_rss (void);
+
+
+/**
+ * Writes a snapshot of all memctxs and the process memory usage to 'fp'.
+ */
+void rd_memctx_dump (FILE *fp);
+
+/**
+ * Starts a recurring timer calling rd_memctx_dump('fp') every
+ * 'interval_ms' milliseconds on thread 'rdt' (or the current thread
+ * if NULL).
+ * Returns the timer, stop it with rd_timer_destroy().
+ */
+struct rd_timer_s *rd_memctx_dump_timer_start (FILE *fp,
+					       unsigned int interval_ms,
+					       rd_thread_t *rdt);
+
+
+
+/**
+ * Allocation profiling (RD_MEMCTX_F_PROFILE).
+ */
+
+typedef enum {
+	RD_MEMCTX_PROF_BY_ALLOCS,  /* Most allocations (churn) */
+	RD_MEMCTX_PROF_BY_BYTES,   /* Most bytes allocated */
+	RD_MEMCTX_PROF_BY_OUT,     /* Most live allocations (leaks) */
+} rd_memctx_prof_order_t;
+
+/**
+ * Copies the top (at most) 'cnt' call sites of the profiling memctx
+ * 'rmc' ordered by 'order' to 'sites'.
+ * Returns the number of sites copied, or -1 on memory allocation failure.
+ */
+int rd_memctx_prof_top (rd_memctx_t *rmc, rd_memctx_prof_site_t *sites,
+			int cnt, rd_memctx_prof_order_t order);
+
+/**
+ * Copies the size and lifetime histograms of the profiling memctx 'rmc'.
+ * Either of 'size_hist' and 'lifetime_hist' may be NULL, otherwise
+ * they must have room for RD_MEMCTX_PROF_BUCKETS elements.
+ */
+void rd_memctx_prof_hist (rd_memctx_t *rmc, uint64_t *size_hist,
+			  uint64_t *lifetime_hist);
+
+/**
+ * Writes the histograms and the top 'cnt' call sites by allocations
+ * and by live allocations of the profiling memctx 'rmc' to 'fp'.
+ * 'cnt' is capped at RD_MEMCTX_PROF_SITES.
+ */
+void rd_memctx_prof_dump (rd_memctx_t *rmc, FILE *fp, int cnt);
+
+
+
 #define RD_MEM_END_TOKEN -2
 
 /**
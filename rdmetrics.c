@@ -0,0 +1,442 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdmetrics.h"
+#include "rdtimer.h"
+
+#include <ctype.h>
+#include <sys/stat.h>
+
+
+/* Quantiles exported for RD_AVG_HDR metrics */
+static const struct {
+	double      pct;
+	const char *name;   /* Prometheus quantile label */
+	const char *key;    /* JSON key */
+} rd_metrics_quantiles[] = {
+	{ 50.0, "0.5",   "p50" },
+	{ 90.0, "0.9",   "p90" },
+	{ 99.0, "0.99",  "p99" },
+	{ 99.9, "0.999", "p999" },
+};
+
+static uint64_t rd_metrics_next_id;
+
+
+/**
+ * Checks that 'name' is a valid Prometheus metric name.
+ */
+static int rd_metrics_name_valid (const char *name) {
+	const char *s;
+
+	if (!*name || isdigit((unsigned char)*name))
+		return 0;
+
+	for (s = name ; *s ; s++)
+		if (!isalnum((unsigned char)*s) && *s != '_' && *s != ':')
+			return 0;
+
+	return 1;
+}
+
+
+rd_metrics_t *rd_metrics_new (const char *prefix) {
+	rd_metrics_t *rms;
+
+	/* Exported as the start of every name. */
+	if (prefix && !rd_metrics_name_valid(prefix)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rms = calloc(1, sizeof(*rms));
+	rms->rms_id = rd_atomic_add(&rd_metrics_next_id, 1);
+	TAILQ_INIT(&rms->rms_metrics);
+	rd_mutex_init(&rms->rms_lock);
+	if (prefix)
+		rms->rms_prefix = strdup(prefix);
+
+	return rms;
+}
+
+
+void rd_metrics_destroy (rd_metrics_t *rms) {
+	rd_metric_t *rm;
+
+	if (rms->rms_timer)
+		rd_timer_destroy(rms->rms_timer);
+
+	while ((rm = TAILQ_FIRST(&rms->rms_metrics))) {
+		TAILQ_REMOVE(&rms->rms_metrics, rm, rm_link);
+		free(rm->rm_name);
+		if (rm->rm_help)
+			free(rm->rm_help);
+		free(rm);
+	}
+
+	if (rms->rms_prefix)
+		free(rms->rms_prefix);
+	if (rms->rms_export_path)
+		free(rms->rms_export_path);
+
+	rd_mutex_destroy(&rms->rms_lock);
+	free(rms);
+}
+
+
+/**
+ * Looks up or creates metric 'name' of type 'type'.
+ */
+static rd_metric_t *rd_metrics_get (rd_metrics_t *rms, const char *name,
+				    const char *help, rd_metric_type_t type,
+				    rd_avg_t *ra) {
+	rd_metric_t *rm;
+
+	if (!rd_metrics_name_valid(name)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rd_mutex_lock(&rms->rms_lock);
+
+	TAILQ_FOREACH(rm, &rms->rms_metrics, rm_link)
+		if (!strcmp(rm->rm_name, name))
+			break;
+
+	if (rm) {
+		if (rm->rm_type != type ||
+		    (type == RD_METRIC_AVG && rm->rm_u.avg != ra)) {
+			errno = EEXIST;
+			rm = NULL;
+		}
+		rd_mutex_unlock(&rms->rms_lock);
+		return rm;
+	}
+
+	rm = calloc(1, sizeof(*rm));
+	rm->rm_name = strdup(name);
+	if (help)
+		rm->rm_help = strdup(help);
+	rm->rm_type = type;
+	if (type == RD_METRIC_AVG)
+		rm->rm_u.avg = ra;
+
+	TAILQ_INSERT_TAIL(&rms->rms_metrics, rm, rm_link);
+	rms->rms_cnt++;
+
+	rd_mutex_unlock(&rms->rms_lock);
+
+	return rm;
+}
+
+
+rd_metric_t *rd_metrics_counter (rd_metrics_t *rms, const char *name,
+				 const char *help) {
+	return rd_metrics_get(rms, name, help, RD_METRIC_COUNTER, NULL);
+}
+
+rd_metric_t *rd_metrics_gauge (rd_metrics_t *rms, const char *name,
+			       const char *help) {
+	return rd_metrics_get(rms, name, help, RD_METRIC_GAUGE, NULL);
+}
+
+rd_metric_t *rd_metrics_avg (rd_metrics_t *rms, const char *name,
+			     const char *help, rd_avg_t *ra) {
+	if (ra->ra_type != RD_AVG_RATE && ra->ra_type != RD_AVG_HDR) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return rd_metrics_get(rms, name, help, RD_METRIC_AVG, ra);
+}
+
+
+
+/**
+ * Writes the Prometheus HELP text with backslashes and newlines escaped.
+ */
+static void rd_metrics_help_write (FILE *fp, const char *help) {
+	for ( ; *help ; help++) {
+		if (*help == '\\')
+			fputs("\\\\", fp);
+		else if (*help == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*help, fp);
+	}
+}
+
+
+static void rd_metrics_dump_prometheus (rd_metrics_t *rms,
+					const rd_metric_t *rm, FILE *fp) {
+	static const char *types[] = {
+		[RD_METRIC_COUNTER] = "counter",
+		[RD_METRIC_GAUGE] = "gauge",
+	};
+	const char *pfx = rms->rms_prefix ? : "";
+	const char *sep = rms->rms_prefix ? "_" : "";
+	const char *type;
+	rd_avg_t *ra = NULL;
+
+	if (rm->rm_type == RD_METRIC_AVG) {
+		ra = rm->rm_u.avg;
+		type = ra->ra_type == RD_AVG_HDR ? "summary" : "gauge";
+	} else
+		type = types[rm->rm_type];
+
+	if (rm->rm_help) {
+		fprintf(fp, "# HELP %s%s%s ", pfx, sep, rm->rm_name);
+		rd_metrics_help_write(fp, rm->rm_help);
+		fputc('\n', fp);
+	}
+	fprintf(fp, "# TYPE %s%s%s %s\n", pfx, sep, rm->rm_name, type);
+
+	switch (rm->rm_type)
+	{
+	case RD_METRIC_COUNTER:
+		fprintf(fp, "%s%s%s %"PRIu64"\n", pfx, sep, rm->rm_name,
+			__atomic_load_n(&rm->rm_u.counter, __ATOMIC_RELAXED));
+		break;
+
+	case RD_METRIC_GAUGE:
+		fprintf(fp, "%s%s%s %"PRId64"\n", pfx, sep, rm->rm_name,
+			__atomic_load_n(&rm->rm_u.gauge, __ATOMIC_RELAXED));
+		break;
+
+	case RD_METRIC_AVG:
+	{
+		rd_hdr_t hdr;
+		int i;
+
+		if (ra->ra_type == RD_AVG_RATE) {
+			fprintf(fp, "%s%s%s %f\n", pfx, sep, rm->rm_name,
+				rd_avg(ra, RD_AVG_PREV).dbl);
+			break;
+		}
+
+		/* All statistics from one consistent snapshot. */
+		if (rd_avg_hdr_copy(ra, RD_AVG_PREV, &hdr) == -1)
+			break;
+
+		for (i = 0 ; i < RD_ARRAYSIZE(rd_metrics_quantiles) ; i++)
+			fprintf(fp, "%s%s%s{quantile=\"%s\"} %"PRIu64"\n",
+				pfx, sep, rm->rm_name,
+				rd_metrics_quantiles[i].name,
+				rd_hdr_percentile(&hdr,
+						  rd_metrics_quantiles[i].pct));
+		fprintf(fp, "%s%s%s_sum %"PRIu64"\n", pfx, sep, rm->rm_name,
+			hdr.rh_sum);
+		fprintf(fp, "%s%s%s_count %"PRIu64"\n", pfx, sep, rm->rm_name,
+			hdr.rh_total);
+		rd_hdr_destroy(&hdr);
+		break;
+	}
+	}
+}
+
+
+static void rd_metrics_dump_json (rd_metrics_t *rms,
+				  const rd_metric_t *rm, FILE *fp) {
+	const char *pfx = rms->rms_prefix ? : "";
+	const char *sep = rms->rms_prefix ? "_" : "";
+
+	fprintf(fp, "\"%s%s%s\":", pfx, sep, rm->rm_name);
+
+	switch (rm->rm_type)
+	{
+	case RD_METRIC_COUNTER:
+		fprintf(fp, "%"PRIu64,
+			__atomic_load_n(&rm->rm_u.counter, __ATOMIC_RELAXED));
+		break;
+
+	case RD_METRIC_GAUGE:
+		fprintf(fp, "%"PRId64,
+			__atomic_load_n(&rm->rm_u.gauge, __ATOMIC_RELAXED));
+		break;
+
+	case RD_METRIC_AVG:
+	{
+		rd_avg_t *ra = rm->rm_u.avg;
+		rd_hdr_t hdr;
+		int i;
+
+		if (ra->ra_type == RD_AVG_RATE) {
+			fprintf(fp, "%f", rd_avg(ra, RD_AVG_PREV).dbl);
+			break;
+		}
+
+		/* All statistics from one consistent snapshot. */
+		if (rd_avg_hdr_copy(ra, RD_AVG_PREV, &hdr) == -1) {
+			fputs("null", fp);
+			break;
+		}
+
+		fprintf(fp, "{\"count\":%"PRIu64",\"sum\":%"PRIu64
+			",\"mean\":%f,\"min\":%"PRIu64",\"max\":%"PRIu64,
+			hdr.rh_total, hdr.rh_sum, rd_hdr_mean(&hdr),
+			hdr.rh_total ? hdr.rh_min : 0, hdr.rh_max);
+		for (i = 0 ; i < RD_ARRAYSIZE(rd_metrics_quantiles) ; i++)
+			fprintf(fp, ",\"%s\":%"PRIu64,
+				rd_metrics_quantiles[i].key,
+				rd_hdr_percentile(&hdr,
+						  rd_metrics_quantiles[i].pct));
+		fputc('}', fp);
+		rd_hdr_destroy(&hdr);
+		break;
+	}
+	}
+}
+
+
+void rd_metrics_dump (rd_metrics_t *rms, rd_metrics_fmt_t fmt, FILE *fp) {
+	rd_metric_t *rm;
+	int first = 1;
+
+	rd_mutex_lock(&rms->rms_lock);
+
+	if (fmt == RD_METRICS_FMT_JSON)
+		fputc('{', fp);
+
+	TAILQ_FOREACH(rm, &rms->rms_metrics, rm_link) {
+		if (fmt == RD_METRICS_FMT_JSON) {
+			if (!first)
+				fputc(',', fp);
+			rd_metrics_dump_json(rms, rm, fp);
+		} else
+			rd_metrics_dump_prometheus(rms, rm, fp);
+		first = 0;
+	}
+
+	if (fmt == RD_METRICS_FMT_JSON)
+		fputs("}\n", fp);
+
+	rd_mutex_unlock(&rms->rms_lock);
+}
+
+
+char *rd_metrics_export (rd_metrics_t *rms, rd_metrics_fmt_t fmt,
+			 size_t *lenp) {
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if (!(fp = open_memstream(&buf, &len)))
+		return NULL;
+
+	rd_metrics_dump(rms, fmt, fp);
+	fclose(fp);
+
+	if (lenp)
+		*lenp = len;
+
+	return buf;
+}
+
+
+int rd_metrics_write (rd_metrics_t *rms, rd_metrics_fmt_t fmt,
+		      const char *path) {
+	char *tmppath = alloca(strlen(path) + 8);
+	FILE *fp;
+	int fd;
+
+	/* Unique temporary file: concurrent writers of the same path
+	 * (e.g., the export timer and an application call) each rename
+	 * their own complete snapshot. */
+	sprintf(tmppath, "%s.XXXXXX", path);
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		return -1;
+
+	/* mkstemp() creates the file private to the user. */
+	if (fchmod(fd, 0644) == -1 || !(fp = fdopen(fd, "w"))) {
+		int errno_save = errno;
+		close(fd);
+		unlink(tmppath);
+		errno = errno_save;
+		return -1;
+	}
+
+	rd_metrics_dump(rms, fmt, fp);
+
+	if (fclose(fp) == EOF || rename(tmppath, path) == -1) {
+		int errno_save = errno;
+		unlink(tmppath);
+		errno = errno_save;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static rd_thread_event_f(rd_metrics_export_timer_cb) {
+	rd_metrics_t *rms = ptr;
+
+	if (rms->rms_export_path)
+		rd_metrics_write(rms, rms->rms_export_fmt,
+				 rms->rms_export_path);
+
+	if (rms->rms_export_cb) {
+		size_t len;
+		char *buf = rd_metrics_export(rms, rms->rms_export_fmt, &len);
+		if (buf) {
+			rms->rms_export_cb(rms, buf, len,
+					   rms->rms_export_opaque);
+			free(buf);
+		}
+	}
+}
+
+
+rd_timer_t *
+rd_metrics_export_timer_start (rd_metrics_t *rms, rd_metrics_fmt_t fmt,
+			       const char *path,
+			       void (*cb) (rd_metrics_t *rms,
+					   const char *buf, size_t len,
+					   void *opaque),
+			       void *opaque,
+			       unsigned int interval_ms, rd_thread_t *rdt) {
+
+	if (rms->rms_timer)
+		rd_timer_destroy(rms->rms_timer);
+
+	if (rms->rms_export_path)
+		free(rms->rms_export_path);
+
+	rms->rms_export_fmt = fmt;
+	rms->rms_export_path = path ? strdup(path) : NULL;
+	rms->rms_export_cb = cb;
+	rms->rms_export_opaque = opaque;
+
+	rms->rms_timer = rd_timer_new(RD_TIMER_RECURR, rdt,
+				      rd_metrics_export_timer_cb, rms);
+	rd_timer_start(rms->rms_timer, interval_ms);
+
+	return rms->rms_timer;
+}
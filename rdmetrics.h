@@ -0,0 +1,232 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "rd.h"
+#include "rdsysqueue.h"
+#include "rdthread.h"
+#include "rdavg.h"
+
+
+/**
+ * Metrics registry.
+ *
+ * Named counters, gauges and rd_avg_t rates and HDR histograms that
+ * can be exported as a snapshot in Prometheus text exposition format
+ * or JSON, either on demand or periodically from an rd_timer_t.
+ *
+ * Updating a metric is a single relaxed atomic operation (or an
+ * rd_avg_put()), the registry lock is only taken when registering
+ * and exporting.
+ *
+ * Usage:
+ *   rms = rd_metrics_new("myapp");
+ *   ...
+ *   RD_METRIC_INC(rms, "requests_total");
+ *   RD_METRIC_ADD(rms, "bytes_total", len);
+ *
+ *   rd_metrics_avg(rms, "latency_us", "Request latency",
+ *                  rd_avg_new_hdr(2, 10000000, 60000000, 3));
+ *
+ *   rd_metrics_export_timer_start(rms, RD_METRICS_FMT_PROMETHEUS,
+ *                                 "/var/run/myapp.prom", NULL, NULL,
+ *                                 10000, rd_mainthread);
+ */
+
+
+typedef enum {
+	RD_METRIC_COUNTER,  /* Monotonically increasing */
+	RD_METRIC_GAUGE,    /* Arbitrary value that can go up and down */
+	RD_METRIC_AVG,      /* rd_avg_t: RD_AVG_RATE or RD_AVG_HDR */
+} rd_metric_type_t;
+
+typedef enum {
+	RD_METRICS_FMT_PROMETHEUS,  /* Prometheus text exposition format */
+	RD_METRICS_FMT_JSON,        /* A single JSON object */
+} rd_metrics_fmt_t;
+
+
+typedef struct rd_metric_s {
+	TAILQ_ENTRY(rd_metric_s) rm_link;
+	char             *rm_name;
+	char             *rm_help;
+	rd_metric_type_t  rm_type;
+	union {
+		uint64_t  counter;
+		int64_t   gauge;
+		rd_avg_t *avg;
+	} rm_u;
+} rd_metric_t;
+
+
+typedef struct rd_metrics_s {
+	TAILQ_HEAD(, rd_metric_s) rms_metrics;
+	uint64_t          rms_id;       /* Unique, never reused */
+	rd_mutex_t        rms_lock;
+	char             *rms_prefix;   /* Name prefix, may be NULL */
+	int               rms_cnt;
+
+	/* rd_metrics_export_timer_start() configuration */
+	struct rd_timer_s *rms_timer;
+	rd_metrics_fmt_t  rms_export_fmt;
+	char             *rms_export_path;
+	void (*rms_export_cb) (struct rd_metrics_s *rms,
+			       const char *buf, size_t len, void *opaque);
+	void             *rms_export_opaque;
+} rd_metrics_t;
+
+
+/**
+ * Creates a new registry. Exported names are prefixed with
+ * "'prefix'_" unless 'prefix' is NULL.
+ * Returns NULL and sets errno to EINVAL if 'prefix' is not a valid
+ * metric name, see rd_metrics_counter().
+ */
+rd_metrics_t *rd_metrics_new (const char *prefix);
+
+/**
+ * Destroys the registry and its metrics, stops the export timer.
+ * rd_avg_t objects are not destroyed.
+ */
+void rd_metrics_destroy (rd_metrics_t *rms);
+
+
+/**
+ * Returns the counter or gauge 'name', creating it if it does not
+ * exist. 'help' is optional.
+ * Returns NULL and sets errno to EINVAL for invalid names (not matching
+ * [a-zA-Z_:][a-zA-Z0-9_:]*) or EEXIST if 'name' exists with another type.
+ */
+rd_metric_t *rd_metrics_counter (rd_metrics_t *rms, const char *name,
+				 const char *help);
+rd_metric_t *rd_metrics_gauge (rd_metrics_t *rms, const char *name,
+			       const char *help);
+
+/**
+ * Registers the RD_AVG_RATE or RD_AVG_HDR average 'ra' as 'name'.
+ * The last completed period is exported: the rate for RD_AVG_RATE,
+ * and a summary (quantiles 0.5, 0.9, 0.99 and 0.999, sum and count)
+ * for RD_AVG_HDR.
+ * The application remains the owner of 'ra' and must not destroy it
+ * while it is registered.
+ * Returns NULL and sets errno on failure (see above, or EINVAL for
+ * unsupported types).
+ */
+rd_metric_t *rd_metrics_avg (rd_metrics_t *rms, const char *name,
+			     const char *help, rd_avg_t *ra);
+
+
+/**
+ * Metric updates.
+ */
+static inline void rd_metric_add (rd_metric_t *rm, int64_t val) RD_UNUSED;
+static inline void rd_metric_add (rd_metric_t *rm, int64_t val) {
+	if (rm->rm_type == RD_METRIC_COUNTER)
+		__atomic_add_fetch(&rm->rm_u.counter, (uint64_t)val,
+				   __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&rm->rm_u.gauge, val, __ATOMIC_RELAXED);
+}
+
+#define rd_metric_inc(rm)  rd_metric_add(rm, 1)
+
+static inline void rd_metric_set (rd_metric_t *rm, int64_t val) RD_UNUSED;
+static inline void rd_metric_set (rd_metric_t *rm, int64_t val) {
+	assert(rm->rm_type == RD_METRIC_GAUGE);
+	__atomic_store_n(&rm->rm_u.gauge, val, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * One-liner instrumentation: the metric is looked up (or created) once
+ * per call site, registry and thread, and cached in a thread-local
+ * variable keyed by the registry's id (ids are never reused, so a
+ * destroyed registry's cached metric is never used again).
+ * Updates are silently skipped if the metric can't be created
+ * (invalid name or type mismatch).
+ * 'name' must be constant for the call site.
+ */
+#define RD_METRIC_ADD0(rms,ctor,name,val) do {			\
+		static __thread struct {				\
+			uint64_t     id;				\
+			rd_metric_t *rm;				\
+		} _rmc;							\
+		if (unlikely(_rmc.id != (rms)->rms_id)) {		\
+			_rmc.rm = ctor(rms, name, NULL);		\
+			_rmc.id = (rms)->rms_id;			\
+		}							\
+		if (likely(_rmc.rm != NULL))				\
+			rd_metric_add(_rmc.rm, val);			\
+	} while (0)
+
+#define RD_METRIC_ADD(rms,name,val) \
+	RD_METRIC_ADD0(rms, rd_metrics_counter, name, val)
+#define RD_METRIC_INC(rms,name)  RD_METRIC_ADD(rms, name, 1)
+#define RD_GAUGE_ADD(rms,name,val) \
+	RD_METRIC_ADD0(rms, rd_metrics_gauge, name, val)
+
+
+
+/**
+ * Writes a snapshot of all metrics in format 'fmt' to 'fp'.
+ */
+void rd_metrics_dump (rd_metrics_t *rms, rd_metrics_fmt_t fmt, FILE *fp);
+
+/**
+ * Returns a snapshot of all metrics in format 'fmt' as a
+ * nul-terminated string that the caller must free(),
+ * its length is returned in '*lenp' if non-NULL.
+ */
+char *rd_metrics_export (rd_metrics_t *rms, rd_metrics_fmt_t fmt,
+			 size_t *lenp);
+
+/**
+ * Atomically replaces the file 'path' (mode 0644) with a snapshot of
+ * all metrics (written to a unique temporary file "'path'.XXXXXX" in
+ * the same directory, that is renamed).
+ * Returns 0 on success or -1 on error (errno set).
+ */
+int rd_metrics_write (rd_metrics_t *rms, rd_metrics_fmt_t fmt,
+		      const char *path);
+
+/**
+ * Starts a recurring timer exporting the metrics every 'interval_ms'
+ * in thread 'rdt', to the file 'path' (if not NULL, see
+ * rd_metrics_write()) and to 'cb' (if not NULL).
+ * Only one export timer per registry is supported, a previous one is
+ * stopped.
+ */
+struct rd_timer_s *
+rd_metrics_export_timer_start (rd_metrics_t *rms, rd_metrics_fmt_t fmt,
+			       const char *path,
+			       void (*cb) (rd_metrics_t *rms,
+					   const char *buf, size_t len,
+					   void *opaque),
+			       void *opaque,
+			       unsigned int interval_ms, rd_thread_t *rdt);
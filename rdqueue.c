@@ -29,8 +29,17 @@
 #include "rd.h"
 #include "rdthread.h"
 #include "rdqueue.h"
+#include "rdslab.h"
 
 
+static rd_slab_t rd_fifoq_elm_slab =
+	RD_SLAB_INITIALIZER("rd_fifoq_elm", sizeof(rd_fifoq_elm_t));
+
+
+void rd_fifoq_elm_free (rd_fifoq_elm_t *rfqe) {
+	rd_slab_free(&rd_fifoq_elm_slab, rfqe);
+}
+
 
 void rd_fifoq_destroy (rd_fifoq_t *rfq) {
 	rd_fifoq_elm_t *rfqe;
@@ -38,7 +47,7 @@ void rd_fifoq_destroy (rd_fifoq_t *rfq) {
 	rd_mutex_lock(&rfq->rfq_lock);
 	while ((rfqe = TAILQ_FIRST(&rfq->rfq_q))) {
 		TAILQ_REMOVE(&rfq->rfq_q, rfqe, rfqe_link);
-		free(rfqe);
+		rd_fifoq_elm_free(rfqe);
 	}
 
 	rd_mutex_unlock(&rfq->rfq_lock);
@@ -83,7 +92,8 @@ void rd_fifoq_add0 (rd_fifoq_t *rfq, void *ptr, void **ptr_purged) {
 
 	assert(rfq->rfq_inited);
 
-	rfqe = malloc(sizeof(*rfqe));
+	if (unlikely(!(rfqe = rd_slab_alloc(&rd_fifoq_elm_slab))))
+		abort();
 
 	rfqe->rfqe_refcnt = 2; /* one for rfq, one for caller */
 	rfqe->rfqe_ptr = ptr;
@@ -102,13 +102,18 @@ rd_fifoq_elm_t *rd_fifoq_pop0 (rd_fifoq_t *rfq, int no_wait, int timeout_ms);
 #define rd_fifoq_pop_timedwait(rfq,tmo) rd_fifoq_pop0(rfq, 0, tmo)
 #define rd_fifoq_pop(rfq) rd_fifoq_pop0(rfq, 1, 0)
 
+/**
+ * Returns an element's memory to the fifoq element allocator.
+ */
+void rd_fifoq_elm_free (rd_fifoq_elm_t *rfqe);
+
 static inline void rd_fifoq_elm_release0 (rd_fifoq_t *rfq,
 					  rd_fifoq_elm_t *rfqe) {
 	(void)rfq;
 	if (rd_atomic_sub(&rfqe->rfqe_refcnt, 1) > 0)
 		return;
 
-	free(rfqe);
+	rd_fifoq_elm_free(rfqe);
 }
 
 #define rd_fifoq_elm_release(RFQ,RFQE) do {   \
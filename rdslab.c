@@ -0,0 +1,382 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdslab.h"
+#include "rdbits.h"
+
+
+/**
+ * Per-thread, per-slab cache of free objects.
+ */
+typedef struct rd_slab_tcache_s {
+	void         *rst_free;   /* Free list */
+	unsigned int  rst_cnt;    /* Objects on free list */
+	unsigned int  rst_gen;    /* Slab generation the cache belongs to */
+} rd_slab_tcache_t;
+
+static __thread rd_slab_tcache_t rd_slab_tcaches[RD_SLAB_MAX];
+
+/* Flushes the thread caches of threads that exit without calling
+ * rd_slab_thread_cleanup(). */
+static pthread_key_t rd_slab_tkey;
+static pthread_once_t rd_slab_tkey_once = PTHREAD_ONCE_INIT;
+static __thread int rd_slab_tkey_set;
+
+/* Slabs by thread cache index, used by rd_slab_thread_cleanup(). */
+static rd_mutex_t rd_slabs_lock = RD_MUTEX_INITIALIZER;
+static rd_slab_t *rd_slabs[RD_SLAB_MAX];
+static unsigned int rd_slabs_gen = 0;
+
+
+#define RD_SLAB_ALIGNED(sz) \
+	(((sz) + RD_SLAB_ALIGN - 1) & ~((size_t)RD_SLAB_ALIGN - 1))
+
+#define RD_SLAB_PAGE_HDRSIZE  RD_SLAB_ALIGNED(sizeof(rd_slab_page_t))
+
+/* Free list link, stored in the first word of each free object. */
+#define RD_SLAB_NEXT(obj)  (*(void **)(obj))
+
+
+
+/**
+ * Sets up the slab's geometry and assigns it a thread cache index.
+ * rd_slabs_lock must be held.
+ */
+static void rd_slab_init0 (rd_slab_t *rs) {
+	int i;
+
+	rs->rs_objsize = RD_SLAB_ALIGNED(RD_MAX(rs->rs_size, sizeof(void *)));
+	rs->rs_pagesize = RD_MAX(RD_SLAB_PAGE_SIZE,
+				 RD_SLAB_PAGE_HDRSIZE + rs->rs_objsize * 8);
+	rs->rs_id = -1;
+
+	for (i = 0 ; i < RD_SLAB_MAX ; i++) {
+		if (!rd_slabs[i]) {
+			rd_slabs[i] = rs;
+			rs->rs_id = i;
+			break;
+		}
+	}
+	rs->rs_gen = ++rd_slabs_gen;
+
+	__sync_synchronize();
+	BIT_SET(rs->rs_flags, RD_SLAB_F_INITED);
+}
+
+
+void rd_slab_init (rd_slab_t *rs, const char *name, size_t size,
+		   rd_memctx_t *rmc) {
+
+	memset(rs, 0, sizeof(*rs));
+
+	rd_mutex_init(&rs->rs_lock);
+	rs->rs_name   = name;
+	rs->rs_size   = size;
+	rs->rs_memctx = rmc;
+
+	rd_mutex_lock(&rd_slabs_lock);
+	rd_slab_init0(rs);
+	rd_mutex_unlock(&rd_slabs_lock);
+}
+
+
+/**
+ * Lazy initialization of statically initialized slabs.
+ */
+static void rd_slab_lazy_init (rd_slab_t *rs) {
+	rd_mutex_lock(&rd_slabs_lock);
+	if (!BIT_TEST(rs->rs_flags, RD_SLAB_F_INITED))
+		rd_slab_init0(rs);
+	rd_mutex_unlock(&rd_slabs_lock);
+}
+
+
+void rd_slab_destroy (rd_slab_t *rs) {
+	rd_slab_page_t *rsp;
+
+	if (!BIT_TEST(rs->rs_flags, RD_SLAB_F_INITED))
+		return;
+
+	rd_mutex_lock(&rd_slabs_lock);
+	if (rs->rs_id != -1)
+		rd_slabs[rs->rs_id] = NULL;
+	rd_mutex_unlock(&rd_slabs_lock);
+
+	while ((rsp = rs->rs_pages)) {
+		rs->rs_pages = rsp->rsp_next;
+		if (rs->rs_memctx)
+			rd_memctx_freesz(rs->rs_memctx, rsp, rs->rs_pagesize);
+		else
+			free(rsp);
+	}
+
+	rs->rs_depot = NULL;
+	rs->rs_depot_cnt = 0;
+	rs->rs_page_cnt = 0;
+	rs->rs_out = 0;
+	BIT_RESET(rs->rs_flags, RD_SLAB_F_INITED);
+
+	rd_mutex_destroy(&rs->rs_lock);
+}
+
+
+
+static void rd_slab_tkey_dtor (void *arg) {
+	rd_slab_tkey_set = 0;
+	rd_slab_thread_cleanup();
+}
+
+static void rd_slab_tkey_init (void) {
+	if (pthread_key_create(&rd_slab_tkey, rd_slab_tkey_dtor))
+		abort();
+}
+
+/**
+ * Arms the calling thread's exit destructor, called on first use of
+ * a thread cache.
+ */
+static void rd_slab_tkey_arm (void) {
+	pthread_once(&rd_slab_tkey_once, rd_slab_tkey_init);
+	pthread_setspecific(rd_slab_tkey, (void *)1);
+	rd_slab_tkey_set = 1;
+}
+
+
+/**
+ * Returns the calling thread's cache for slab 'rs', or NULL if the
+ * slab has no thread cache index.
+ * A cache left over from a destroyed slab with the same index is reset.
+ */
+static inline rd_slab_tcache_t *rd_slab_tcache (rd_slab_t *rs) {
+	rd_slab_tcache_t *rst;
+
+	if (unlikely(rs->rs_id == -1))
+		return NULL;
+
+	rst = &rd_slab_tcaches[rs->rs_id];
+	if (unlikely(rst->rst_gen != rs->rs_gen)) {
+		if (unlikely(!rd_slab_tkey_set))
+			rd_slab_tkey_arm();
+		rst->rst_free = NULL;
+		rst->rst_cnt  = 0;
+		rst->rst_gen  = rs->rs_gen;
+	}
+
+	return rst;
+}
+
+
+/**
+ * Allocates a new page and adds its objects to the depot.
+ * Slab must be locked.
+ */
+static int rd_slab_page_add (rd_slab_t *rs) {
+	rd_slab_page_t *rsp;
+	char *base;
+	int cnt, i;
+
+	if (rs->rs_memctx)
+		rsp = rd_memctx_malloc(rs->rs_memctx, rs->rs_pagesize);
+	else
+		rsp = malloc(rs->rs_pagesize);
+
+	if (!rsp)
+		return -1;
+
+	rsp->rsp_next = rs->rs_pages;
+	rs->rs_pages = rsp;
+	rs->rs_page_cnt++;
+
+	base = (char *)rsp + RD_SLAB_PAGE_HDRSIZE;
+	cnt = (rs->rs_pagesize - RD_SLAB_PAGE_HDRSIZE) / rs->rs_objsize;
+
+	/* Link objects in address order. */
+	for (i = cnt - 1 ; i >= 0 ; i--) {
+		void *obj = base + (i * rs->rs_objsize);
+		RD_SLAB_NEXT(obj) = rs->rs_depot;
+		rs->rs_depot = obj;
+	}
+
+	rs->rs_depot_cnt += cnt;
+
+	return 0;
+}
+
+
+/**
+ * Takes one object from the depot, adding a page if needed.
+ * Slab must be locked.
+ */
+static inline void *rd_slab_depot_get (rd_slab_t *rs) {
+	void *obj;
+
+	if (unlikely(!rs->rs_depot) && rd_slab_page_add(rs) == -1)
+		return NULL;
+
+	obj = rs->rs_depot;
+	rs->rs_depot = RD_SLAB_NEXT(obj);
+	rs->rs_depot_cnt--;
+
+	return obj;
+}
+
+
+/**
+ * Moves up to RD_SLAB_BATCH objects from the depot to the thread cache.
+ */
+static void rd_slab_refill (rd_slab_t *rs, rd_slab_tcache_t *rst) {
+	int n;
+
+	rd_mutex_lock(&rs->rs_lock);
+	for (n = 0 ; n < RD_SLAB_BATCH ; n++) {
+		void *obj;
+
+		if (!(obj = rd_slab_depot_get(rs)))
+			break;
+
+		RD_SLAB_NEXT(obj) = rst->rst_free;
+		rst->rst_free = obj;
+	}
+	rs->rs_out += n;
+	rd_mutex_unlock(&rs->rs_lock);
+
+	rst->rst_cnt += n;
+}
+
+
+/**
+ * Moves 'cnt' objects from the thread cache to the depot.
+ * Slab must be locked.
+ */
+static void rd_slab_flush0 (rd_slab_t *rs, rd_slab_tcache_t *rst,
+			    unsigned int cnt) {
+	unsigned int n;
+
+	for (n = 0 ; n < cnt && rst->rst_free ; n++) {
+		void *obj = rst->rst_free;
+		rst->rst_free = RD_SLAB_NEXT(obj);
+		RD_SLAB_NEXT(obj) = rs->rs_depot;
+		rs->rs_depot = obj;
+	}
+
+	rst->rst_cnt -= n;
+	rs->rs_depot_cnt += n;
+	rs->rs_out -= n;
+}
+
+
+
+void *rd_slab_alloc (rd_slab_t *rs) {
+	rd_slab_tcache_t *rst;
+	void *obj;
+
+	if (unlikely(!BIT_TEST(rs->rs_flags, RD_SLAB_F_INITED)))
+		rd_slab_lazy_init(rs);
+
+	if (likely((rst = rd_slab_tcache(rs)) != NULL)) {
+		if (unlikely(!rst->rst_free)) {
+			rd_slab_refill(rs, rst);
+			if (!rst->rst_free)
+				return NULL;
+		}
+
+		obj = rst->rst_free;
+		rst->rst_free = RD_SLAB_NEXT(obj);
+		rst->rst_cnt--;
+		return obj;
+	}
+
+	/* No thread cache: use the depot directly. */
+	rd_mutex_lock(&rs->rs_lock);
+	if ((obj = rd_slab_depot_get(rs)))
+		rs->rs_out++;
+	rd_mutex_unlock(&rs->rs_lock);
+
+	return obj;
+}
+
+
+void rd_slab_free (rd_slab_t *rs, void *ptr) {
+	rd_slab_tcache_t *rst;
+
+	if (likely((rst = rd_slab_tcache(rs)) != NULL)) {
+		RD_SLAB_NEXT(ptr) = rst->rst_free;
+		rst->rst_free = ptr;
+
+		if (unlikely(++rst->rst_cnt >= RD_SLAB_BATCH * 2)) {
+			rd_mutex_lock(&rs->rs_lock);
+			rd_slab_flush0(rs, rst, RD_SLAB_BATCH);
+			rd_mutex_unlock(&rs->rs_lock);
+		}
+		return;
+	}
+
+	rd_mutex_lock(&rs->rs_lock);
+	RD_SLAB_NEXT(ptr) = rs->rs_depot;
+	rs->rs_depot = ptr;
+	rs->rs_depot_cnt++;
+	rs->rs_out--;
+	rd_mutex_unlock(&rs->rs_lock);
+}
+
+
+void rd_slab_thread_cleanup (void) {
+	int i;
+
+	rd_mutex_lock(&rd_slabs_lock);
+	for (i = 0 ; i < RD_SLAB_MAX ; i++) {
+		rd_slab_tcache_t *rst = &rd_slab_tcaches[i];
+		rd_slab_t *rs = rd_slabs[i];
+
+		if (!rst->rst_cnt)
+			continue;
+
+		/* Only return objects to the slab they came from,
+		 * caches of destroyed slabs are simply dropped. */
+		if (rs && rs->rs_gen == rst->rst_gen) {
+			rd_mutex_lock(&rs->rs_lock);
+			rd_slab_flush0(rs, rst, rst->rst_cnt);
+			rd_mutex_unlock(&rs->rs_lock);
+		}
+
+		rst->rst_free = NULL;
+		rst->rst_cnt  = 0;
+	}
+	rd_mutex_unlock(&rd_slabs_lock);
+}
+
+
+void rd_slab_stats (rd_slab_t *rs, rd_slab_stats_t *stats) {
+	rd_mutex_lock(&rs->rs_lock);
+	stats->out   = rs->rs_out;
+	stats->depot = rs->rs_depot_cnt;
+	stats->pages = rs->rs_page_cnt;
+	stats->bytes = (size_t)rs->rs_page_cnt * rs->rs_pagesize;
+	rd_mutex_unlock(&rs->rs_lock);
+}
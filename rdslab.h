@@ -0,0 +1,161 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "rd.h"
+#include "rdthread.h"
+#include "rdmem.h"
+
+
+/**
+ * Fixed-size object (slab) allocator.
+ *
+ * Each rd_slab_t hands out objects of a single size class, carved out of
+ * larger pages. Every thread keeps a small private free list per slab
+ * (thread cache) that is refilled from, and flushed to, the slab's shared
+ * free list (depot) in batches of RD_SLAB_BATCH objects, so the common
+ * alloc/free path takes no locks.
+ *
+ * Pages are allocated from the optional memctx passed to rd_slab_init()
+ * which allows the slab's memory usage to be accounted for there.
+ *
+ * Objects are released back to the depot when the owning thread calls
+ * rd_thread_cleanup() (or rd_slab_thread_cleanup()), or at the latest
+ * when it exits, and all memory is freed by rd_slab_destroy().
+ *
+ * Usage:
+ *   static rd_slab_t my_slab = RD_SLAB_INITIALIZER("my_obj",
+ *                                                  sizeof(struct my_obj));
+ *   obj = rd_slab_alloc(&my_slab);
+ *   ...
+ *   rd_slab_free(&my_slab, obj);
+ */
+
+
+#define RD_SLAB_MAX        64    /* Maximum number of slabs with
+				  * thread caches, additional slabs
+				  * fall back on the locked depot. */
+#define RD_SLAB_BATCH      32    /* Thread cache refill/flush batch size */
+#define RD_SLAB_PAGE_SIZE  (16 * 1024)  /* Minimum page size */
+#define RD_SLAB_ALIGN      16    /* Object alignment */
+
+
+typedef struct rd_slab_page_s {
+	struct rd_slab_page_s *rsp_next;
+} rd_slab_page_t;
+
+
+typedef struct rd_slab_s {
+	rd_mutex_t      rs_lock;       /* Protects the depot and pages */
+	const char     *rs_name;       /* Name, must remain valid for the
+					* lifetime of the slab. */
+	size_t          rs_size;       /* Requested object size */
+	size_t          rs_objsize;    /* Aligned object size */
+	size_t          rs_pagesize;   /* Allocated page size */
+	int             rs_id;         /* Thread cache index, or -1. */
+	unsigned int    rs_gen;        /* Thread cache generation */
+	int             rs_flags;
+#define RD_SLAB_F_INITED  0x1      /* Initialized */
+
+	rd_memctx_t    *rs_memctx;     /* Optional memctx for pages */
+
+	void           *rs_depot;      /* Shared free list */
+	unsigned int    rs_depot_cnt;  /* Objects in depot */
+	unsigned int    rs_out;        /* Objects handed out to threads,
+					* in use or in thread caches. */
+	rd_slab_page_t *rs_pages;      /* Allocated pages */
+	unsigned int    rs_page_cnt;
+} rd_slab_t;
+
+
+/**
+ * Static initializer for slabs without memctx accounting.
+ * The slab is lazily set up on first use and may be used without
+ * calling rd_slab_init().
+ */
+#define RD_SLAB_INITIALIZER(name,size)			\
+	{ .rs_lock = RD_MUTEX_INITIALIZER,			\
+	  .rs_name = (name),					\
+	  .rs_size = (size),					\
+	  .rs_id = -1 }
+
+
+/**
+ * Initializes slab 'rs' for objects of 'size' bytes.
+ * If 'rmc' is non-NULL all pages are allocated from it.
+ */
+void rd_slab_init (rd_slab_t *rs, const char *name, size_t size,
+		   rd_memctx_t *rmc);
+
+/**
+ * Frees all the slab's pages.
+ * Any outstanding objects are invalid after this call.
+ */
+void rd_slab_destroy (rd_slab_t *rs);
+
+
+/**
+ * Allocates an (uninitialized) object from the slab.
+ * Returns NULL on memory allocation failure.
+ */
+void *rd_slab_alloc (rd_slab_t *rs);
+
+/**
+ * Allocates a zeroed object from the slab.
+ */
+static inline void *rd_slab_calloc (rd_slab_t *rs) RD_UNUSED;
+static inline void *rd_slab_calloc (rd_slab_t *rs) {
+	void *ptr = rd_slab_alloc(rs);
+	if (likely(ptr != NULL))
+		memset(ptr, 0, rs->rs_size);
+	return ptr;
+}
+
+/**
+ * Returns object 'ptr' to the slab.
+ * The object may be freed by any thread, not just the allocating one.
+ */
+void rd_slab_free (rd_slab_t *rs, void *ptr);
+
+
+/**
+ * Returns the calling thread's cached objects for all slabs to their
+ * depots. Called automatically by rd_thread_cleanup().
+ */
+void rd_slab_thread_cleanup (void);
+
+
+typedef struct rd_slab_stats_s {
+	unsigned int out;        /* Objects handed out to threads */
+	unsigned int depot;      /* Objects in the shared free list */
+	unsigned int pages;      /* Number of pages */
+	size_t       bytes;      /* Total page memory */
+} rd_slab_stats_t;
+
+void rd_slab_stats (rd_slab_t *rs, rd_slab_stats_t *stats);
@@ -30,6 +30,8 @@
 #include "rdstring.h"
 #include "rdmem.h"
 
+#include <math.h>
+
 /*
  * Thread-local states
  */
@@ -76,8 +78,11 @@ char *rd_tsprintf (const char *format, ...) {
 
 	cyc = rdstr_cyclic_get(&rdstr_states.tsp, RD_TSPRINTF_BUFCNT);
 
+	/* Format straight into the current buffer (if any) and only
+	 * reallocate and format again if it was too small. */
 	va_start(ap, format);
-	len = vsnprintf(NULL, 0, format, ap);
+	len = vsnprintf(cyc->buf[cyc->i],
+			cyc->buf[cyc->i] ? cyc->len[cyc->i] : 0, format, ap);
 	va_end(ap);
 
 	if (len < 0) /* Error */
@@ -85,21 +90,25 @@ char *rd_tsprintf (const char *format, ...) {
 
 	len++; /* Include nul-byte */
 
-	if (cyc->buf[cyc->i] == NULL ||
-	    cyc->len[cyc->i] < len ||
-	    (cyc->len[cyc->i] > (len * 4) &&
-	     cyc->len[cyc->i] > 64)) {
+	if (cyc->buf[cyc->i] == NULL || cyc->len[cyc->i] < len) {
 		if (cyc->buf[cyc->i])
 			free(cyc->buf[cyc->i]);
 
 		cyc->len[cyc->i] = len;
 		cyc->buf[cyc->i] = malloc(len);
-	}
-
 
-	va_start(ap, format);
-	vsnprintf(cyc->buf[cyc->i], cyc->len[cyc->i], format, ap);
-	va_end(ap);
+		va_start(ap, format);
+		vsnprintf(cyc->buf[cyc->i], cyc->len[cyc->i], format, ap);
+		va_end(ap);
+
+	} else if (cyc->len[cyc->i] > (len * 4) && cyc->len[cyc->i] > 64) {
+		/* Don't hold on to oversized buffers. */
+		char *buf = realloc(cyc->buf[cyc->i], len);
+		if (buf) {
+			cyc->buf[cyc->i] = buf;
+			cyc->len[cyc->i] = len;
+		}
+	}
 
 	return cyc->buf[cyc->i];
 }
@@ -143,30 +152,263 @@ void rd_string_thread_cleanup (void) {
 
 
 
-char *rd_strnchrs (const char *s, ssize_t size, const char *delimiters,
-		   int match_eol) {
-	const char *end = s + size;
-	char map[256] = {};
+/**
+ * Character sets
+ */
+
+void rd_charset_add (rd_charset_t *rcs, unsigned char c) {
+	if (c < 0x80)
+		rcs->rcs_lo[c & 0xf] |= 1 << (c >> 4);
+	else
+		rcs->rcs_hi[c & 0xf] |= 1 << ((c >> 4) - 8);
+	rcs->rcs_map[c] = 1;
+}
+
+void rd_charset_init (rd_charset_t *rcs, const char *chars) {
+	memset(rcs, 0, sizeof(*rcs));
+	while (*chars)
+		rd_charset_add(rcs, (unsigned char)*(chars++));
+}
+
+void rd_charset_init_map (rd_charset_t *rcs, const char map[256]) {
+	int i;
+
+	memset(rcs, 0, sizeof(*rcs));
+	for (i = 0 ; i < 256 ; i++)
+		if (map[i])
+			rd_charset_add(rcs, i);
+}
+
 
-	while (*delimiters) {
-		map[(int)*delimiters] = 1;
-		delimiters++;
+/**
+ * Returns the offset of the first byte in 's' (of 'size' bytes) that is
+ * either a nul-byte or, depending on 'stop_member', is (1) or is not (0)
+ * a member of 'rcs'. Returns 'size' if there is no such byte.
+ */
+typedef size_t (rd_charset_scan_t) (const char *s, size_t size,
+				    const rd_charset_t *rcs, int stop_member);
+
+static size_t rd_charset_scan_scalar (const char *s, size_t size,
+				      const rd_charset_t *rcs,
+				      int stop_member) {
+	size_t i;
+
+	for (i = 0 ; i < size ; i++) {
+		const unsigned char c = s[i];
+		if (rcs->rcs_map[c] == stop_member || !c)
+			break;
 	}
 
-	while ((size == -1 || s < end) && *s) {
-		if (map[(unsigned char)*s])
-			return (char *)s;
+	return i;
+}
 
-		s++;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/**
+ * Classifies the 16 bytes in 'v': returns a byte mask of set members.
+ * The low nibble of each byte selects a row from the lo/hi tables,
+ * the high nibble selects the bit within the row.
+ */
+static inline __attribute__((target("ssse3")))
+__m128i rd_charset_classify_ssse3 (__m128i v, __m128i tlo, __m128i thi) {
+	const __m128i nib = _mm_set1_epi8(0x0f);
+	const __m128i bitpos = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+					     1, 2, 4, 8, 16, 32, 64, -128);
+	__m128i lo = _mm_and_si128(v, nib);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+	__m128i is_hi = _mm_cmpgt_epi8(hi, _mm_set1_epi8(7));
+	__m128i row = _mm_or_si128(
+		_mm_and_si128(is_hi, _mm_shuffle_epi8(thi, lo)),
+		_mm_andnot_si128(is_hi, _mm_shuffle_epi8(tlo, lo)));
+	__m128i bit = _mm_shuffle_epi8(bitpos, hi);
+
+	return _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit);
+}
+
+/**
+ * The vector scanners only use aligned loads, which never cross a page
+ * boundary, and stop at the first nul-byte: they may read bytes before
+ * 's' and after the terminator (or 'size') within the same aligned block,
+ * but never touch a page the string does not reside in.
+ * Such reads are outside the object as far as ASan is concerned.
+ */
+#define RD_CHARSET_SCAN_ATTR  __attribute__((no_sanitize_address))
+
+static __attribute__((target("ssse3"))) RD_CHARSET_SCAN_ATTR
+size_t rd_charset_scan_ssse3 (const char *s, size_t size,
+			      const rd_charset_t *rcs, int stop_member) {
+	const __m128i tlo = _mm_load_si128((const __m128i *)rcs->rcs_lo);
+	const __m128i thi = _mm_load_si128((const __m128i *)rcs->rcs_hi);
+	const __m128i zero = _mm_setzero_si128();
+	const unsigned int flip = stop_member ? 0 : 0xffff;
+	const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+	unsigned int m;
+	__m128i v;
+
+	if (size == 0)
+		return 0;
+
+	/* The first block may start before 's': ignore those bytes. */
+	v = _mm_load_si128((const __m128i *)p);
+	m = _mm_movemask_epi8(rd_charset_classify_ssse3(v, tlo, thi));
+	m = ((m ^ flip) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) &
+		(0xffffu << (s - p));
+
+	while (!m) {
+		p += 16;
+		if ((size_t)(p - s) >= size)
+			return size;
+
+		v = _mm_load_si128((const __m128i *)p);
+		m = _mm_movemask_epi8(rd_charset_classify_ssse3(v, tlo, thi));
+		m = (m ^ flip) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
 	}
 
+	return RD_MIN((size_t)(p + __builtin_ctz(m) - s), size);
+}
+
+
+static inline __attribute__((target("avx2")))
+__m256i rd_charset_classify_avx2 (__m256i v, __m256i tlo, __m256i thi) {
+	const __m256i nib = _mm256_set1_epi8(0x0f);
+	const __m256i bitpos = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+						1, 2, 4, 8, 16, 32, 64, -128,
+						1, 2, 4, 8, 16, 32, 64, -128,
+						1, 2, 4, 8, 16, 32, 64, -128);
+	__m256i lo = _mm256_and_si256(v, nib);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+	__m256i is_hi = _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(7));
+	__m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(tlo, lo),
+					 _mm256_shuffle_epi8(thi, lo), is_hi);
+	__m256i bit = _mm256_shuffle_epi8(bitpos, hi);
+
+	return _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit);
+}
+
+static __attribute__((target("avx2"))) RD_CHARSET_SCAN_ATTR
+size_t rd_charset_scan_avx2 (const char *s, size_t size,
+			     const rd_charset_t *rcs, int stop_member) {
+	const __m256i tlo = _mm256_broadcastsi128_si256(
+		_mm_load_si128((const __m128i *)rcs->rcs_lo));
+	const __m256i thi = _mm256_broadcastsi128_si256(
+		_mm_load_si128((const __m128i *)rcs->rcs_hi));
+	const __m256i zero = _mm256_setzero_si256();
+	const uint32_t flip = stop_member ? 0 : 0xffffffffu;
+	const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)31);
+	uint32_t m;
+	__m256i v;
+
+	if (size == 0)
+		return 0;
+
+	/* The first block may start before 's': ignore those bytes. */
+	v = _mm256_load_si256((const __m256i *)p);
+	m = (uint32_t)_mm256_movemask_epi8(
+		rd_charset_classify_avx2(v, tlo, thi));
+	m = ((m ^ flip) |
+	     (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))) &
+		(0xffffffffu << (s - p));
+
+	while (!m) {
+		p += 32;
+		if ((size_t)(p - s) >= size)
+			return size;
+
+		v = _mm256_load_si256((const __m256i *)p);
+		m = (uint32_t)_mm256_movemask_epi8(
+			rd_charset_classify_avx2(v, tlo, thi));
+		m = (m ^ flip) |
+			(uint32_t)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(v, zero));
+	}
+
+	return RD_MIN((size_t)(p + __builtin_ctz(m) - s), size);
+}
+#endif
+
+
+static rd_charset_scan_t *rd_charset_scan_select (rd_charset_impl_t impl) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if ((impl == RD_CHARSET_IMPL_AUTO || impl == RD_CHARSET_IMPL_AVX2) &&
+	    __builtin_cpu_supports("avx2"))
+		return rd_charset_scan_avx2;
+
+	if ((impl == RD_CHARSET_IMPL_AUTO || impl == RD_CHARSET_IMPL_SSSE3) &&
+	    __builtin_cpu_supports("ssse3"))
+		return rd_charset_scan_ssse3;
+#endif
+
+	if (impl == RD_CHARSET_IMPL_AUTO || impl == RD_CHARSET_IMPL_SCALAR)
+		return rd_charset_scan_scalar;
+
+	return NULL;
+}
+
+static rd_charset_scan_t *rd_charset_scan_impl;
+
+static size_t rd_charset_scan (const char *s, size_t size,
+			       const rd_charset_t *rcs, int stop_member) {
+	rd_charset_scan_t *scan;
+
+	if (unlikely(!(scan = __atomic_load_n(&rd_charset_scan_impl,
+					      __ATOMIC_RELAXED)))) {
+		scan = rd_charset_scan_select(RD_CHARSET_IMPL_AUTO);
+		__atomic_store_n(&rd_charset_scan_impl, scan,
+				 __ATOMIC_RELAXED);
+	}
+
+	return scan(s, size, rcs, stop_member);
+}
+
+int rd_charset_impl_set (rd_charset_impl_t impl) {
+	rd_charset_scan_t *scan;
+
+	if (!(scan = rd_charset_scan_select(impl)))
+		return -1;
+
+	__atomic_store_n(&rd_charset_scan_impl, scan, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+char *rd_strnchrs_charset (const char *s, ssize_t size,
+			   const rd_charset_t *rcs, int match_eol) {
+	size_t of;
+
+	/* size -1 (unbounded) is SIZE_MAX: the scan stops at the nul. */
+	of = rd_charset_scan(s, (size_t)size, rcs, 1);
+
+	if (of < (size_t)size && s[of])
+		return (char *)s + of;
+
 	if (match_eol)
-		return (char *)s;
+		return (char *)s + of;
 
 	return NULL;
 }
 
 
+size_t rd_strnspn_charset (const char *s, size_t size,
+			   int accept, const rd_charset_t *rcs) {
+	return rd_charset_scan(s, size, rcs, !accept);
+}
+
+
+
+char *rd_strnchrs (const char *s, ssize_t size, const char *delimiters,
+		   int match_eol) {
+	rd_charset_t rcs;
+
+	rd_charset_init(&rcs, delimiters);
+
+	return rd_strnchrs_charset(s, size, &rcs, match_eol);
+}
+
+
 
 
 size_t rd_strnspn_map (const char *s, size_t size,
@@ -175,7 +417,7 @@ size_t rd_strnspn_map (const char *s, size_t size,
 	int cnt = 0;
 
 	while ((size == -1 || s < end) && *s) {
-		if (map[(int)*s] != accept)
+		if (map[(unsigned char)*s] != accept)
 			return cnt;
 		s++;
 		cnt++;
@@ -185,27 +427,21 @@ size_t rd_strnspn_map (const char *s, size_t size,
 }
 
 size_t rd_strnspn (const char *s, size_t size, const char *accept) {
-	char map[256] = {};
+	rd_charset_t rcs;
 
-	while (*accept) {
-		map[(int)*accept] = 1;
-		accept++;
-	}
+	rd_charset_init(&rcs, accept);
 
-	return rd_strnspn_map(s, size, 1, map);
+	return rd_strnspn_charset(s, size, 1, &rcs);
 }
 
 
 
 size_t rd_strncspn (const char *s, size_t size, const char *reject) {
-	char map[256] = {};
+	rd_charset_t rcs;
 
-	while (*reject) {
-		map[(int)*reject] = 1;
-		reject++;
-	}
+	rd_charset_init(&rcs, reject);
 
-	return rd_strnspn_map(s, size, 0, map);
+	return rd_strnspn_charset(s, size, 0, &rcs);
 }
 
 
@@ -238,3 +474,246 @@ ssize_t rd_strdiffpos (const char *s1, const char *s2) {
 
 	return (ssize_t)(s1 - begin);
 }
+
+
+
+/**
+ * String builder
+ */
+
+int rd_strbuf_init (rd_strbuf_t *rsb, size_t size) {
+	/* Fallback buffer: keeps the builder valid (but empty) if the
+	 * allocation fails, appends will then try to grow it. */
+	static char empty[1];
+
+	rsb->rsb_size  = RD_MAX(size, RD_STRBUF_SIZE_MIN);
+	rsb->rsb_len   = 0;
+	rsb->rsb_flags = 0;
+
+	if (unlikely(!(rsb->rsb_buf = malloc(rsb->rsb_size)))) {
+		rsb->rsb_buf   = empty;
+		rsb->rsb_size  = sizeof(empty);
+		rsb->rsb_flags = RD_STRBUF_F_STATIC;
+		return -1;
+	}
+
+	rsb->rsb_buf[0] = '\0';
+	return 0;
+}
+
+void rd_strbuf_init_static (rd_strbuf_t *rsb, char *buf, size_t size) {
+	assert(size > 0);
+	rsb->rsb_buf   = buf;
+	rsb->rsb_size  = size;
+	rsb->rsb_len   = 0;
+	rsb->rsb_flags = RD_STRBUF_F_STATIC;
+	rsb->rsb_buf[0] = '\0';
+}
+
+void rd_strbuf_destroy (rd_strbuf_t *rsb) {
+	if (!(rsb->rsb_flags & RD_STRBUF_F_STATIC))
+		free(rsb->rsb_buf);
+	rsb->rsb_buf = NULL;
+	rsb->rsb_size = rsb->rsb_len = 0;
+}
+
+int rd_strbuf_grow (rd_strbuf_t *rsb, size_t len) {
+	size_t size = rsb->rsb_size * 2;
+	char *buf;
+
+	while (size - rsb->rsb_len <= len)
+		size *= 2;
+
+	if (rsb->rsb_flags & RD_STRBUF_F_STATIC) {
+		if (!(buf = malloc(size)))
+			return -1;
+		memcpy(buf, rsb->rsb_buf, rsb->rsb_len + 1);
+		rsb->rsb_flags &= ~RD_STRBUF_F_STATIC;
+	} else if (!(buf = realloc(rsb->rsb_buf, size)))
+		return -1;
+
+	rsb->rsb_buf  = buf;
+	rsb->rsb_size = size;
+	return 0;
+}
+
+char *rd_strbuf_detach (rd_strbuf_t *rsb, size_t *lenp) {
+	char *str;
+
+	if (lenp)
+		*lenp = rsb->rsb_len;
+
+	if (rsb->rsb_flags & RD_STRBUF_F_STATIC) {
+		if (!(str = malloc(rsb->rsb_len + 1)))
+			return NULL;
+		memcpy(str, rsb->rsb_buf, rsb->rsb_len + 1);
+		rd_strbuf_reset(rsb);
+	} else {
+		str = rsb->rsb_buf;
+		rd_strbuf_init(rsb, 0);
+	}
+
+	return str;
+}
+
+
+int rd_strbuf_vprintf (rd_strbuf_t *rsb, const char *format, va_list ap) {
+	size_t avail = rsb->rsb_size - rsb->rsb_len;
+	va_list ap2;
+	int r;
+
+	/* Try formatting straight into the free space first. */
+	va_copy(ap2, ap);
+	r = vsnprintf(rsb->rsb_buf + rsb->rsb_len, avail, format, ap2);
+	va_end(ap2);
+
+	if (unlikely(r < 0)) {
+		rsb->rsb_buf[rsb->rsb_len] = '\0';
+		return -1;
+	}
+
+	if (unlikely((size_t)r >= avail)) {
+		if (rd_strbuf_grow(rsb, r) == -1) {
+			rsb->rsb_buf[rsb->rsb_len] = '\0';
+			return -1;
+		}
+		vsnprintf(rsb->rsb_buf + rsb->rsb_len,
+			  rsb->rsb_size - rsb->rsb_len, format, ap);
+	}
+
+	rsb->rsb_len += r;
+	return r;
+}
+
+int rd_strbuf_printf (rd_strbuf_t *rsb, const char *format, ...) {
+	va_list ap;
+	int r;
+
+	va_start(ap, format);
+	r = rd_strbuf_vprintf(rsb, format, ap);
+	va_end(ap);
+
+	return r;
+}
+
+
+static const char rd_digits2[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/**
+ * Writes the decimal digits of 'v' backwards ending at 'end',
+ * two digits at a time. Returns a pointer to the first digit.
+ */
+static inline char *rd_u64toa_rev (char *end, uint64_t v) {
+	char *p = end;
+
+	while (v >= 100) {
+		const char *d = &rd_digits2[(v % 100) * 2];
+		v /= 100;
+		*--p = d[1];
+		*--p = d[0];
+	}
+
+	if (v >= 10) {
+		const char *d = &rd_digits2[v * 2];
+		*--p = d[1];
+		*--p = d[0];
+	} else
+		*--p = '0' + (char)v;
+
+	return p;
+}
+
+size_t rd_u64toa (char *dst, uint64_t v) {
+	char tmp[20];
+	char *p = rd_u64toa_rev(tmp + sizeof(tmp), v);
+	size_t len = (size_t)(tmp + sizeof(tmp) - p);
+
+	memcpy(dst, p, len);
+	return len;
+}
+
+void rd_strbuf_append_uint (rd_strbuf_t *rsb, uint64_t v) {
+	if (unlikely(rd_strbuf_reserve(rsb, 20) == -1))
+		return;
+	rsb->rsb_len += rd_u64toa(rsb->rsb_buf + rsb->rsb_len, v);
+	rsb->rsb_buf[rsb->rsb_len] = '\0';
+}
+
+void rd_strbuf_append_int (rd_strbuf_t *rsb, int64_t v) {
+	if (unlikely(rd_strbuf_reserve(rsb, 21) == -1))
+		return;
+
+	if (v < 0) {
+		rsb->rsb_buf[rsb->rsb_len++] = '-';
+		/* Negate in unsigned to handle INT64_MIN */
+		rsb->rsb_len += rd_u64toa(rsb->rsb_buf + rsb->rsb_len,
+					  -(uint64_t)v);
+	} else
+		rsb->rsb_len += rd_u64toa(rsb->rsb_buf + rsb->rsb_len,
+					  (uint64_t)v);
+
+	rsb->rsb_buf[rsb->rsb_len] = '\0';
+}
+
+void rd_strbuf_append_double (rd_strbuf_t *rsb, double v, int prec) {
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+	};
+	static const uint64_t upow10[] = {
+		1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull,
+		1000000ull, 10000000ull, 100000000ull, 1000000000ull
+	};
+	double x, scaled;
+	uint64_t u, ipart, fpart;
+	char tmp[32];
+	char *p, *end = tmp + sizeof(tmp);
+	int neg;
+	int i;
+
+	/* Precisions beyond the tables are left to printf. */
+	if (unlikely(prec < 0 || prec > 9)) {
+		rd_strbuf_printf(rsb, "%.*f", prec, v);
+		return;
+	}
+
+	neg = signbit(v);
+	x = fabs(v) * pow10[prec];
+	scaled = nearbyint(x);
+
+	/* NaN, Inf and large values, as well as values that are too close
+	 * to a rounding halfway point for the scaled product to tell
+	 * which way printf would round: fall back to printf. */
+	if (unlikely(!(scaled < 9007199254740992.0 /* 2^53 */) ||
+		     fabs(x - floor(x) - 0.5) <= x * 1e-15)) {
+		rd_strbuf_printf(rsb, "%.*f", prec, v);
+		return;
+	}
+
+	u = (uint64_t)scaled;
+	ipart = u / upow10[prec];
+	fpart = u % upow10[prec];
+
+	p = end;
+	if (prec > 0) {
+		for (i = 0 ; i < prec ; i++) {
+			*--p = '0' + (char)(fpart % 10);
+			fpart /= 10;
+		}
+		*--p = '.';
+	}
+	p = rd_u64toa_rev(p, ipart);
+	if (neg)
+		*--p = '-';
+
+	rd_strbuf_append(rsb, p, (size_t)(end - p));
+}
@@ -66,6 +66,7 @@ int rd_snprintf_cat (char *str, size_t size, const char *format, ...)
  * conveniant scan-to-token(s)-or-end-of-buffer operations.
  * The other difference is that supports multiple tokens to look for.
  * 'size' is either the length of 's' or '-1' if it is to scan to '\0'.
+ * Scanning always stops at the first '\0', even before 'size'.
  */
 char *rd_strnchrs (const char *s, ssize_t size, const char *delimiters,
 		   int match_eol);
@@ -93,6 +94,68 @@ size_t rd_strncspn (const char *s, size_t size, const char *reject);
 
 
 
+/**
+ * Precompiled character set for repeated scanning with
+ * rd_strnchrs_charset() and rd_strnspn_charset().
+ *
+ * The set is kept both as a 1:1 map (scalar path) and as two nibble
+ * lookup tables which allow SSSE3/AVX2 implementations to classify
+ * 16/32 input bytes at a time with a pair of byte shuffles.
+ * The implementation is selected at runtime from the CPU's capabilities.
+ */
+typedef struct rd_charset_s {
+	uint8_t rcs_lo[16];   /* Bit 'h' set for chars (h<<4 | idx), h 0..7 */
+	uint8_t rcs_hi[16];   /* Same for h 8..15 (bit h-8) */
+	uint8_t rcs_map[256];
+} __attribute__((aligned(16))) rd_charset_t;
+
+/**
+ * Initializes 'rcs' with the characters in the nul-terminated 'chars'.
+ */
+void rd_charset_init (rd_charset_t *rcs, const char *chars);
+
+/**
+ * Initializes 'rcs' from a 1:1 map (as used by rd_strnspn_map()).
+ */
+void rd_charset_init_map (rd_charset_t *rcs, const char map[256]);
+
+/**
+ * Adds character 'c' to the set.
+ */
+void rd_charset_add (rd_charset_t *rcs, unsigned char c);
+
+
+/**
+ * Like rd_strnchrs() but with a precompiled set of delimiters.
+ */
+char *rd_strnchrs_charset (const char *s, ssize_t size,
+			   const rd_charset_t *rcs, int match_eol);
+
+/**
+ * Like rd_strnspn_map() but with a precompiled character set.
+ */
+size_t rd_strnspn_charset (const char *s, size_t size,
+			   int accept, const rd_charset_t *rcs);
+
+
+/**
+ * Character set scanning implementations.
+ */
+typedef enum {
+	RD_CHARSET_IMPL_AUTO,    /* Best available */
+	RD_CHARSET_IMPL_SCALAR,
+	RD_CHARSET_IMPL_SSSE3,
+	RD_CHARSET_IMPL_AVX2,
+} rd_charset_impl_t;
+
+/**
+ * Forces a specific implementation, mainly for testing and benchmarking.
+ * Returns 0 on success or -1 if it is not supported by this CPU.
+ */
+int rd_charset_impl_set (rd_charset_impl_t impl);
+
+
+
 /**
  * strncmp() wrapper which takes two input lengths.
  */
@@ -121,6 +184,142 @@ ssize_t rd_strndiffpos (const char *s1, size_t size1,
 
 
 
+/**
+ * Growable string builder.
+ *
+ * The builder caches its length and grows its buffer geometrically,
+ * so appends are amortized O(1) with no strlen() of the destination.
+ * rd_strbuf_printf() formats directly into the free space and only
+ * formats a second time if that space was too small.
+ * Integers and fixed-point doubles can be appended without printf.
+ *
+ * The buffer is always nul-terminated.
+ *
+ * A builder may start out on a caller-provided (e.g., stack) buffer,
+ * see rd_strbuf_init_static(), and is moved to the heap if it outgrows it.
+ *
+ * The built string can be handed off without copying with
+ * rd_strbuf_detach() or rd_bufh_append_strbuf() (see rdbuf.h).
+ */
+typedef struct rd_strbuf_s {
+	char   *rsb_buf;
+	size_t  rsb_len;     /* String length, excluding the nul */
+	size_t  rsb_size;    /* Allocated size */
+	int     rsb_flags;
+#define RD_STRBUF_F_STATIC 0x1  /* rsb_buf is provided by the caller */
+} rd_strbuf_t;
+
+#define RD_STRBUF_SIZE_MIN  64
+
+/**
+ * Initializes an empty builder with room for 'size' bytes
+ * (0 for the default RD_STRBUF_SIZE_MIN).
+ * Returns 0 on success or -1 on memory allocation failure, in which
+ * case the builder is still valid but appends may fail.
+ */
+int rd_strbuf_init (rd_strbuf_t *rsb, size_t size);
+
+/**
+ * Initializes an empty builder on the 'size' bytes at 'buf'.
+ * 'buf' is not freed by rd_strbuf_destroy().
+ */
+void rd_strbuf_init_static (rd_strbuf_t *rsb, char *buf, size_t size);
+
+/**
+ * Frees the builder's buffer (unless static).
+ */
+void rd_strbuf_destroy (rd_strbuf_t *rsb);
+
+/**
+ * Returns the built string and resets the builder to empty.
+ * The string is owned by the caller and must be freed with free().
+ * If 'lenp' is non-NULL the string length is returned in '*lenp'.
+ */
+char *rd_strbuf_detach (rd_strbuf_t *rsb, size_t *lenp);
+
+/**
+ * Makes room for at least 'len' more bytes (plus the nul).
+ * Returns 0 on success or -1 on memory allocation failure.
+ */
+int rd_strbuf_grow (rd_strbuf_t *rsb, size_t len);
+
+static inline int rd_strbuf_reserve (rd_strbuf_t *rsb, size_t len) RD_UNUSED;
+static inline int rd_strbuf_reserve (rd_strbuf_t *rsb, size_t len) {
+	if (likely(rsb->rsb_size - rsb->rsb_len > len))
+		return 0;
+	return rd_strbuf_grow(rsb, len);
+}
+
+#define rd_strbuf_str(rsb)    ((const char *)(rsb)->rsb_buf)
+#define rd_strbuf_len(rsb)    ((rsb)->rsb_len)
+#define rd_strbuf_reset(rsb)  ((rsb)->rsb_buf[((rsb)->rsb_len = 0)] = '\0')
+
+/**
+ * Truncates the string to 'len' bytes (if longer).
+ */
+#define rd_strbuf_truncate(rsb,len) do {				\
+		if ((len) < (rsb)->rsb_len)				\
+			(rsb)->rsb_buf[((rsb)->rsb_len = (len))] = '\0'; \
+	} while (0)
+
+
+/**
+ * Appends 'len' bytes from 'data'.
+ */
+static inline void rd_strbuf_append (rd_strbuf_t *rsb,
+				     const void *data, size_t len) RD_UNUSED;
+static inline void rd_strbuf_append (rd_strbuf_t *rsb,
+				     const void *data, size_t len) {
+	if (unlikely(rd_strbuf_reserve(rsb, len) == -1))
+		return;
+	memcpy(rsb->rsb_buf + rsb->rsb_len, data, len);
+	rsb->rsb_len += len;
+	rsb->rsb_buf[rsb->rsb_len] = '\0';
+}
+
+#define rd_strbuf_puts(rsb,str)  rd_strbuf_append(rsb, str, strlen(str))
+
+static inline void rd_strbuf_putc (rd_strbuf_t *rsb, char c) RD_UNUSED;
+static inline void rd_strbuf_putc (rd_strbuf_t *rsb, char c) {
+	if (unlikely(rd_strbuf_reserve(rsb, 1) == -1))
+		return;
+	rsb->rsb_buf[rsb->rsb_len++] = c;
+	rsb->rsb_buf[rsb->rsb_len] = '\0';
+}
+
+/**
+ * Appends a printf-formatted string.
+ * Returns the number of bytes appended or -1 on failure.
+ */
+int rd_strbuf_printf (rd_strbuf_t *rsb, const char *format, ...)
+	__attribute__((format (printf, 2, 3)));
+int rd_strbuf_vprintf (rd_strbuf_t *rsb, const char *format, va_list ap);
+
+/**
+ * Appends the decimal representation of 'v' without using printf.
+ */
+void rd_strbuf_append_int (rd_strbuf_t *rsb, int64_t v);
+void rd_strbuf_append_uint (rd_strbuf_t *rsb, uint64_t v);
+
+/**
+ * Appends 'v' with 'prec' decimals, like printf("%.*f").
+ * With 'prec' 0..9, values whose scaled magnitude fits in 53 bits are
+ * formatted without printf. Such values are rounded from v*10^prec,
+ * which in rare halfway cases may differ from printf in the last
+ * decimal.
+ * Other precisions and values (and NaN/Inf) fall back to printf.
+ */
+void rd_strbuf_append_double (rd_strbuf_t *rsb, double v, int prec);
+
+/**
+ * Writes the decimal representation of 'v' to 'dst', which must have
+ * room for 20 bytes, without a terminating nul.
+ * Returns the number of bytes written.
+ */
+size_t rd_u64toa (char *dst, uint64_t v);
+
+
+
 /**
  * Frees thread-local resources on thread exit.
  */
@@ -78,7 +78,13 @@ static void rd_thread_destroy (rd_thread_t *rdt) {
 
 void rd_thread_cleanup (void) {
 	extern void rd_string_thread_cleanup ();
+	extern void rd_slab_thread_cleanup (void);
+	extern void rd_epoch_thread_cleanup (void);
+	extern void rd_log_thread_cleanup (void);
 	rd_string_thread_cleanup();
+	rd_slab_thread_cleanup();
+	rd_epoch_thread_cleanup();
+	rd_log_thread_cleanup();
 }
 
 
@@ -73,6 +73,22 @@ static inline rd_ts_t rd_clock (void) {
 }
 
 
+/**
+ * Coarse version of rd_clock() on the same time base:
+ * resolution is a scheduler tick (typically 1-4ms) but it is
+ * considerably cheaper to read.
+ */
+static inline rd_ts_t rd_clock_coarse (void) RD_UNUSED;
+static inline rd_ts_t rd_clock_coarse (void) {
+#ifdef CLOCK_MONOTONIC_COARSE
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return TIMESPEC_TO_TS(&ts);
+#else
+	return rd_clock();
+#endif
+}
+
 
 /**
  * Thread-safe version of ctime() that strips the trailing newline.
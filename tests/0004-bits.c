@@ -159,10 +159,50 @@ static int bitvec_tests (void) {
 }
 
 
+static int cmsketch_tests (void) {
+	int fails = 0;
+	rd_cmsketch_t rcms;
+	uint32_t h = 0;
+	int i, est;
+
+	rd_cmsketch_init(&rcms, 64);
+
+	for (i = 0 ; i < 10 ; i++)
+		rd_cmsketch_add(&rcms, 0x1234);
+	rd_cmsketch_add(&rcms, 0x5678);
+
+	if ((est = rd_cmsketch_estimate(&rcms, 0x1234)) != 10) {
+		printf("%s:%i: cmsketch estimate %i, should've been 10\n",
+		       __FUNCTION__,__LINE__, est);
+		fails++;
+	}
+
+	/* Counters saturate at 15 and are halved once the sample size
+	 * is reached. */
+	for (i = 0 ; i < 20 ; i++)
+		rd_cmsketch_add(&rcms, 0x1234);
+	while (rcms.rcms_additions < rcms.rcms_sample - 1)
+		rd_cmsketch_add(&rcms, 0x10000 + h++);
+	rd_cmsketch_add(&rcms, 0x10000 + h);
+
+	if ((est = rd_cmsketch_estimate(&rcms, 0x1234)) < 7 || est > 8) {
+		printf("%s:%i: cmsketch estimate %i after aging, "
+		       "should've been 7..8\n",
+		       __FUNCTION__,__LINE__, est);
+		fails++;
+	}
+
+	rd_cmsketch_destroy(&rcms);
+
+	return fails;
+}
+
+
 int main (int argc, char **argv) {
 	int fails = 0;
 
 	fails += bitvec_tests();
+	fails += cmsketch_tests();
 
 	return fails ? 1 : 0;
 }
@@ -29,6 +29,9 @@
 #include "rd.h"
 #include "rdmem.h"
 #include "rdunits.h"
+#include "rdtimer.h"
+
+#include <limits.h>
 
 static int test_memctxs (void) {
 	int fails = 0;
@@ -222,6 +225,392 @@ static int test_memctxs (void) {
 }
 
 
+static int test_memctx_arena (void) {
+	int fails = 0;
+	rd_memctx_t rmc;
+	rd_memctx_stats_t stats;
+	rd_memctx_mark_t mark, mark2;
+	const int num = 200;
+	char *ptr[num];
+	char *big;
+	int i;
+	size_t sum = 0;
+
+	rd_memctx_arena_init(&rmc, "test4:arena", 0, 1024);
+
+	for (i = 0 ; i < num ; i++) {
+		int sz = 1 + (i % 50);
+		ptr[i] = rd_memctx_calloc(&rmc, 1, sz);
+		if (((uintptr_t)ptr[i] & (RD_MEMCTX_ALIGN-1)) || ptr[i][0]) {
+			printf("%s:%i: failed: ptr %p misaligned or not "
+			       "zeroed\n", __FUNCTION__,__LINE__, ptr[i]);
+			fails++;
+		}
+		memset(ptr[i], i, sz);
+		sum += sz;
+	}
+
+	/* Verify nothing overlapped */
+	for (i = 0 ; i < num ; i++) {
+		if (ptr[i][0] != (char)i) {
+			printf("%s:%i: failed: ptr[%i] overwritten\n",
+			       __FUNCTION__,__LINE__, i);
+			fails++;
+		}
+	}
+
+	rd_memctx_stats(&rmc, &stats);
+	if (stats.out != num || stats.bytes_out != sum) {
+		printf("%s:%i: failed: stats %i/%zd != %i/%zd\n",
+		       __FUNCTION__,__LINE__,
+		       stats.out, stats.bytes_out, num, sum);
+		fails++;
+	}
+
+	/* Checkpoint, allocate past the chunk size, and roll back. */
+	rd_memctx_mark(&rmc, &mark);
+	big = rd_memctx_malloc(&rmc, 4000);
+	memset(big, 0xff, 4000);
+	for (i = 0 ; i < 100 ; i++)
+		rd_memctx_malloc(&rmc, 100);
+
+	rd_memctx_rollback(&rmc, &mark);
+	rd_memctx_stats(&rmc, &stats);
+	if (stats.out != num || stats.bytes_out != sum) {
+		printf("%s:%i: failed: stats after rollback %i/%zd != "
+		       "%i/%zd\n",
+		       __FUNCTION__,__LINE__,
+		       stats.out, stats.bytes_out, num, sum);
+		fails++;
+	}
+
+	if (ptr[num-1][0] != (char)(num-1)) {
+		printf("%s:%i: failed: rollback clobbered live memory\n",
+		       __FUNCTION__,__LINE__);
+		fails++;
+	}
+
+	/* Frees after a mark stay accounted for by the rollback, whether
+	 * the allocation was made before or after the mark, also with
+	 * nested marks. */
+	rd_memctx_mark(&rmc, &mark);
+	rd_memctx_freesz(&rmc, ptr[0], 1);
+	big = rd_memctx_malloc(&rmc, 100);
+	rd_memctx_mark(&rmc, &mark2);
+	rd_memctx_malloc(&rmc, 50);
+	rd_memctx_freesz(&rmc, big, 100);
+	rd_memctx_rollback(&rmc, &mark2);
+	rd_memctx_malloc(&rmc, 30);
+	rd_memctx_rollback(&rmc, &mark);
+	sum -= 1;
+	rd_memctx_stats(&rmc, &stats);
+	if (stats.out != num - 1 || stats.bytes_out != sum) {
+		printf("%s:%i: failed: stats after frees and rollback "
+		       "%i/%zd != %i/%zd\n",
+		       __FUNCTION__,__LINE__,
+		       stats.out, stats.bytes_out, num - 1, sum);
+		fails++;
+	}
+
+	/* Reset */
+	if (rd_memctx_freeall(&rmc) != sum) {
+		printf("%s:%i: failed: freeall did not return %zd\n",
+		       __FUNCTION__,__LINE__, sum);
+		fails++;
+	}
+
+	rd_memctx_stats(&rmc, &stats);
+	if (stats.out != 0 || stats.bytes_out != 0) {
+		printf("%s:%i: failed: stats after freeall %i/%zd != 0/0\n",
+		       __FUNCTION__,__LINE__, stats.out, stats.bytes_out);
+		fails++;
+	}
+
+	/* Arena is reusable after freeall */
+	ptr[0] = rd_memctx_malloc(&rmc, 10);
+	if (!ptr[0]) {
+		printf("%s:%i: failed: no allocation after freeall\n",
+		       __FUNCTION__,__LINE__);
+		fails++;
+	}
+
+	/* A mark from before freeall rolls back to empty. */
+	rd_memctx_mark(&rmc, &mark);
+	for (i = 0 ; i < 50 ; i++)
+		rd_memctx_malloc(&rmc, 100);
+	rd_memctx_freeall(&rmc);
+	for (i = 0 ; i < 50 ; i++)
+		rd_memctx_malloc(&rmc, 100);
+	rd_memctx_rollback(&rmc, &mark);
+
+	rd_memctx_stats(&rmc, &stats);
+	if (stats.out != 0 || stats.bytes_out != 0) {
+		printf("%s:%i: failed: stats after stale rollback "
+		       "%i/%zd != 0/0\n",
+		       __FUNCTION__,__LINE__, stats.out, stats.bytes_out);
+		fails++;
+	}
+
+	rd_memctx_destroy(&rmc);
+
+	return fails;
+}
+
+
+struct test_memctx_shared_arg {
+	rd_memctx_t *rmc;
+	void        *keep[10];
+};
+
+static void *test_memctx_shared_thread (void *arg) {
+	struct test_memctx_shared_arg *tmsa = arg;
+	void *ptr[100];
+	int i, j;
+
+	for (j = 0 ; j < 100 ; j++) {
+		for (i = 0 ; i < 100 ; i++)
+			ptr[i] = rd_memctx_malloc(tmsa->rmc, 10 + i);
+		for (i = 0 ; i < 100 ; i++) {
+			/* Keep the last 10 allocations of the last round
+			 * for the main thread to free. */
+			if (j == 99 && i >= 90)
+				tmsa->keep[i - 90] = ptr[i];
+			else
+				rd_memctx_freesz(tmsa->rmc, ptr[i], 10 + i);
+		}
+	}
+
+	return NULL;
+}
+
+static int test_memctx_shared (void) {
+	int fails = 0;
+	rd_memctx_t rmc;
+	rd_memctx_stats_t stats;
+	const int thrcnt = 8;
+	pthread_t thrs[thrcnt];
+	struct test_memctx_shared_arg args[thrcnt];
+	int i, j;
+	size_t sum = 0;
+
+	rd_memctx_init(&rmc, "test5:shared", RD_MEMCTX_F_LOCK);
+
+	for (i = 0 ; i < thrcnt ; i++) {
+		args[i].rmc = &rmc;
+		pthread_create(&thrs[i], NULL, test_memctx_shared_thread,
+			       &args[i]);
+	}
+	for (i = 0 ; i < thrcnt ; i++)
+		pthread_join(thrs[i], NULL);
+
+	/* Each thread keeps sizes 100..109 */
+	for (i = 90 ; i < 100 ; i++)
+		sum += 10 + i;
+	sum *= thrcnt;
+
+	rd_memctx_stats(&rmc, &stats);
+	if (stats.out != thrcnt * 10 || stats.bytes_out != sum) {
+		printf("%s:%i: failed: stats %i/%zd != %i/%zd\n",
+		       __FUNCTION__,__LINE__,
+		       stats.out, stats.bytes_out, thrcnt * 10, sum);
+		fails++;
+	}
+
+	/* Free from another thread than the allocating one */
+	for (i = 0 ; i < thrcnt ; i++)
+		for (j = 0 ; j < 10 ; j++)
+			rd_memctx_freesz(&rmc, args[i].keep[j], 100 + j);
+
+	rd_memctx_stats(&rmc, &stats);
+	if (stats.out != 0 || stats.bytes_out != 0) {
+		printf("%s:%i: failed: stats %i/%zd != 0/0\n",
+		       __FUNCTION__,__LINE__, stats.out, stats.bytes_out);
+		fails++;
+	}
+
+	rd_memctx_destroy(&rmc);
+
+	return fails;
+}
+
+
+static int test_memctx_snapshot (void) {
+	int fails = 0;
+	rd_memctx_t rmc;
+	rd_memctx_snapshot_t *snaps;
+	rd_timer_t *rt;
+	FILE *fp;
+	char buf[256];
+	int cnt, i, found = 0;
+	void *ptr;
+	rd_ts_t ts_end;
+
+	rd_memctx_init(&rmc, "test6:snapshot", 0);
+
+	ptr = rd_memctx_malloc(&rmc, 1000);
+	rd_memctx_freesz(&rmc, ptr, 1000);
+	ptr = rd_memctx_malloc(&rmc, 100);
+
+	snaps = rd_memctx_snapshot(&cnt);
+	for (i = 0 ; i < cnt ; i++) {
+		if (strcmp(snaps[i].name, "test6:snapshot"))
+			continue;
+		found++;
+		if (snaps[i].stats.out != 1 ||
+		    snaps[i].stats.bytes_out != 100 ||
+		    snaps[i].stats.bytes_hwm != 1000 ||
+		    snaps[i].stats.allocs != 2) {
+			printf("%s:%i: failed: snapshot %u/%zd/%zd/%"PRIu64
+			       " != 1/100/1000/2\n",
+			       __FUNCTION__,__LINE__,
+			       snaps[i].stats.out, snaps[i].stats.bytes_out,
+			       snaps[i].stats.bytes_hwm, snaps[i].stats.allocs);
+			fails++;
+		}
+	}
+	free(snaps);
+
+	if (found != 1) {
+		printf("%s:%i: failed: memctx found %i times in snapshot\n",
+		       __FUNCTION__,__LINE__, found);
+		fails++;
+	}
+
+	if (rd_mem_rss() == 0) {
+		printf("%s:%i: failed: rd_mem_rss() returned 0\n",
+		       __FUNCTION__,__LINE__);
+		fails++;
+	}
+
+	/* Periodic dump */
+	fp = tmpfile();
+	rt = rd_memctx_dump_timer_start(fp, 100, NULL);
+	ts_end = rd_clock() + 500000;
+	while (rd_clock() < ts_end)
+		rd_thread_poll(10);
+	rd_timer_destroy(rt);
+
+	rewind(fp);
+	found = 0;
+	while (fgets(buf, sizeof(buf), fp))
+		if (!strncmp(buf, "test6:snapshot ", 15))
+			found++;
+	fclose(fp);
+
+	if (found < 2) {
+		printf("%s:%i: failed: memctx dumped %i times, expected >= 2\n",
+		       __FUNCTION__,__LINE__, found);
+		fails++;
+	}
+
+	rd_memctx_freesz(&rmc, ptr, 100);
+	rd_memctx_destroy(&rmc);
+
+	return fails;
+}
+
+
+static __attribute__((noinline)) void *prof_site_a (rd_memctx_t *rmc) {
+	return rd_memctx_malloc(rmc, 100);
+}
+
+static __attribute__((noinline)) void *prof_site_b (rd_memctx_t *rmc) {
+	return rd_memctx_calloc(rmc, 1, 5000);
+}
+
+static int test_memctx_profile (void) {
+	int fails = 0;
+	rd_memctx_t rmc;
+	rd_memctx_stats_t stats;
+	rd_memctx_prof_site_t sites[4];
+	uint64_t size_hist[RD_MEMCTX_PROF_BUCKETS];
+	uint64_t lifetime_hist[RD_MEMCTX_PROF_BUCKETS];
+	uint64_t lifetimes = 0;
+	FILE *fp;
+	void *a[30], *b[10];
+	int i, n;
+
+	rd_memctx_init(&rmc, "test7:profile", RD_MEMCTX_F_PROFILE);
+
+	for (i = 0 ; i < 30 ; i++)
+		a[i] = prof_site_a(&rmc);
+	for (i = 0 ; i < 10 ; i++)
+		b[i] = prof_site_b(&rmc);
+
+	/* Free all of site a, leaving site b's allocations live.
+	 * Sizes are known from the profile header. */
+	for (i = 0 ; i < 30 ; i++)
+		rd_memctx_free(&rmc, a[i]);
+
+	/* Freeing NULL is a no-op. */
+	rd_memctx_free(&rmc, NULL);
+
+	for (i = 0 ; i < 10 ; i++) {
+		if ((uintptr_t)b[i] % 16) {
+			printf("%s:%i: failed: %p is not 16-byte aligned\n",
+			       __FUNCTION__,__LINE__, b[i]);
+			fails++;
+		}
+	}
+
+	rd_memctx_stats(&rmc, &stats);
+	if (stats.out != 10 || stats.bytes_out != 10 * 5000) {
+		printf("%s:%i: failed: stats %u/%zd != 10/50000\n",
+		       __FUNCTION__,__LINE__, stats.out, stats.bytes_out);
+		fails++;
+	}
+
+	n = rd_memctx_prof_top(&rmc, sites, 4, RD_MEMCTX_PROF_BY_ALLOCS);
+	if (n != 2 || sites[0].allocs != 30 || sites[0].out != 0 ||
+	    sites[1].allocs != 10 || sites[1].bytes != 50000) {
+		printf("%s:%i: failed: top sites by allocs (%i) wrong\n",
+		       __FUNCTION__,__LINE__, n);
+		fails++;
+	}
+
+	n = rd_memctx_prof_top(&rmc, sites, 1, RD_MEMCTX_PROF_BY_OUT);
+	if (n != 1 || sites[0].out != 10) {
+		printf("%s:%i: failed: top leaking site has %"PRId64
+		       " live allocations, not 10\n",
+		       __FUNCTION__,__LINE__, n ? sites[0].out : -1);
+		fails++;
+	}
+
+	rd_memctx_prof_hist(&rmc, size_hist, lifetime_hist);
+	/* 100 is in [64,128), 5000 in [4096,8192) */
+	if (size_hist[7] != 30 || size_hist[13] != 10) {
+		printf("%s:%i: failed: size histogram %"PRIu64"/%"PRIu64
+		       " != 30/10\n",
+		       __FUNCTION__,__LINE__, size_hist[7], size_hist[13]);
+		fails++;
+	}
+
+	for (i = 0 ; i < RD_MEMCTX_PROF_BUCKETS ; i++)
+		lifetimes += lifetime_hist[i];
+	if (lifetimes != 30) {
+		printf("%s:%i: failed: %"PRIu64" lifetimes recorded, not 30\n",
+		       __FUNCTION__,__LINE__, lifetimes);
+		fails++;
+	}
+
+	if (getenv("LIBRD_TEST_DBG"))
+		rd_memctx_prof_dump(&rmc, stdout, 4);
+
+	/* The site count is capped to the tracked sites. */
+	if ((fp = tmpfile())) {
+		rd_memctx_prof_dump(&rmc, fp, INT_MAX);
+		fclose(fp);
+	}
+
+	for (i = 0 ; i < 10 ; i++)
+		rd_memctx_free(&rmc, b[i]);
+
+	rd_memctx_destroy(&rmc);
+
+	return fails;
+}
+
+
 static int test_alloc_struct (void) {
 	struct test {
 		int a;
@@ -278,8 +667,18 @@ static int test_alloc_struct (void) {
 int main (int argc, char **argv) {
 	int fails = 0;
 
+	rd_init();
+
 	fails += test_memctxs();
 
+	fails += test_memctx_arena();
+
+	fails += test_memctx_shared();
+
+	fails += test_memctx_snapshot();
+
+	fails += test_memctx_profile();
+
 	fails += test_alloc_struct();
 	return fails ? 1 : 0;
 }
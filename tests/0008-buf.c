@@ -46,6 +46,7 @@ static int test_bufs (void) {
 	int fails = 0;
 	char buf2[256];
 	char *out;
+	rd_strbuf_t rsb;
 	
 	rbh = rd_bufh_new(NULL, 0);
 
@@ -111,18 +112,120 @@ static int test_bufs (void) {
 	
 	rd_bufh_destroy(rbh);
 
+
+	/*
+	 * Formatted appends and string builder hand-off.
+	 */
+	rbh = rd_bufh_new(NULL, 0);
+	rd_bufh_sprintf(rbh, "%s=%i;", "a", 1);
+	rd_bufh_sprintf(rbh, "%s=%i;", "b", 2);
+	rd_strbuf_init(&rsb, 0);
+	rd_strbuf_puts(&rsb, "c=");
+	rd_strbuf_append_int(&rsb, -3);
+	rd_bufh_append_strbuf(rbh, &rsb);
+	rd_strbuf_destroy(&rsb);
+
+	out = alloca(rd_bufh_len(rbh)+1);
+	out[rd_bufh_len(rbh)] = '\0';
+	rd_bufh_copyout(rbh, out);
+
+	if (strcmp(out, "a=1;b=2;c=-3")) {
+		printf("%s:%i: unexpected sprintf/strbuf result: \"%s\"\n",
+		       __FUNCTION__,__LINE__, out);
+		fails++;
+	}
+
+	rd_bufh_destroy(rbh);
+
 	return fails;
 }
 
 
 
 
+static void *crc_worker (void *arg) {
+	rd_thread_dispatch();
+	return NULL;
+}
+
+static int test_crc (void) {
+	rd_bufh_t *rbh;
+	rd_thread_t *workers[3];
+	size_t size = 3 * 1024 * 1024 + 12345;
+	size_t of;
+	char *data = malloc(size);
+	rd_crc32_t exp32, exp32c, crc, crc2;
+	int i;
+	int fails = 0;
+
+	for (of = 0 ; of < size ; of++)
+		data[of] = (char)random();
+
+	exp32 = rd_crc32(data, size);
+	exp32c = rd_crc32c(data, size);
+
+	/* Segments of random sizes, some of them empty. */
+	rbh = rd_bufh_new(NULL, 0);
+	for (of = 0 ; of < size ; ) {
+		size_t len = RD_MIN((size_t)(random() % 100000), size - of);
+		rd_bufh_append(rbh, data+of, len, 0);
+		of += len;
+	}
+
+	for (i = 0 ; i < RD_ARRAY_SIZE(workers) ; i++)
+		rd_thread_create(&workers[i], "crc", NULL, crc_worker, NULL);
+
+	for (i = 0 ; i <= RD_ARRAY_SIZE(workers) ; i++) {
+		if ((crc = rd_bufh_crc32(rbh, i ? workers : NULL, i)) != exp32) {
+			printf("%s:%i: rd_bufh_crc32 with %i workers: "
+			       "0x%08x != 0x%08x\n",
+			       __FUNCTION__,__LINE__, i, crc, exp32);
+			fails++;
+		}
+		if ((crc = rd_bufh_crc32c(rbh, i ? workers : NULL, i)) !=
+		    exp32c) {
+			printf("%s:%i: rd_bufh_crc32c with %i workers: "
+			       "0x%08x != 0x%08x\n",
+			       __FUNCTION__,__LINE__, i, crc, exp32c);
+			fails++;
+		}
+	}
+
+	for (i = 0 ; i < RD_ARRAY_SIZE(workers) ; i++)
+		rd_thread_kill_join(workers[i], NULL);
+
+	/* Streaming: checksum the data through the serializer and the
+	 * serialized output through the writer. */
+	crc = rd_crc32_init();
+	crc2 = rd_crc32_init();
+	if (rd_bufh_serialize(rbh, rd_bufh_serialize_binary_crc32,
+			      rd_bufh_write_crc32c, &crc, &crc2) != size) {
+		printf("%s:%i: rd_bufh_serialize length mismatch\n",
+		       __FUNCTION__,__LINE__);
+		fails++;
+	}
+	if (rd_crc32_finalize(crc) != exp32 ||
+	    rd_crc32_finalize(crc2) != exp32c) {
+		printf("%s:%i: streaming crc mismatch: 0x%08x, 0x%08x\n",
+		       __FUNCTION__,__LINE__, rd_crc32_finalize(crc),
+		       rd_crc32_finalize(crc2));
+		fails++;
+	}
+
+	rd_bufh_destroy(rbh);
+	free(data);
+
+	return fails;
+}
+
+
 int main (int argc, char **argv) {
 	int fails = 0;
 
 	rd_dbg_set(1);
 
 	fails += test_bufs();
+	fails += test_crc();
 
 	return fails ? 1 : 0;
 }
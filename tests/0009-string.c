@@ -29,6 +29,10 @@
 #include "rd.h"
 #include "rdstring.h"
 
+#include <inttypes.h>
+#include <math.h>
+#include <sys/mman.h>
+
 static int test_string (void) {
 	char *str1 = "1234\n5678";
 	char *str2;
@@ -158,11 +162,297 @@ static int test_string (void) {
 
 
 
+/**
+ * Reference implementation for rd_strnspn_charset().
+ */
+static size_t ref_strnspn (const char *s, size_t size, int accept,
+			   const char *map) {
+	size_t i;
+
+	for (i = 0 ; i < size && s[i] ; i++)
+		if (!!map[(unsigned char)s[i]] != accept)
+			break;
+
+	return i;
+}
+
+/**
+ * Compares all charset scan implementations against the reference
+ * for random sets and inputs of various lengths and alignments.
+ */
+static int test_charset (void) {
+	static const rd_charset_impl_t impls[] = {
+		RD_CHARSET_IMPL_SCALAR,
+		RD_CHARSET_IMPL_SSSE3,
+		RD_CHARSET_IMPL_AVX2,
+	};
+	char buf[300];
+	char map[256];
+	rd_charset_t rcs;
+	int fails = 0;
+	int impl;
+	int i;
+
+	srand(1234);
+
+	for (impl = 0 ; impl < RD_ARRAY_SIZE(impls) ; impl++) {
+		if (rd_charset_impl_set(impls[impl]) == -1) {
+			printf("%s: charset implementation %i not "
+			       "supported: skipping\n",
+			       __FUNCTION__, impls[impl]);
+			continue;
+		}
+
+		for (i = 0 ; i < 2000 ; i++) {
+			int of = rand() % 32;
+			int len = rand() % (sizeof(buf) - of);
+			int setsize = 1 + rand() % 40;
+			int accept = rand() & 1;
+			size_t r, exp;
+			char *m;
+			int j;
+
+			/* Mostly printable input with the occasional
+			 * high-bit or nul byte. */
+			for (j = 0 ; j < len ; j++) {
+				buf[of+j] = 32 + rand() % 95;
+				if (!(rand() % 50))
+					buf[of+j] = (char)(128 + rand() % 128);
+				if (!(rand() % 500))
+					buf[of+j] = 0;
+			}
+
+			memset(map, 0, sizeof(map));
+			for (j = 0 ; j < setsize ; j++)
+				map[1 + rand() % 255] = 1;
+			rd_charset_init_map(&rcs, map);
+
+			exp = ref_strnspn(buf+of, len, accept, map);
+			r = rd_strnspn_charset(buf+of, len, accept, &rcs);
+			if (r != exp) {
+				printf("%s:%i: impl %i: rd_strnspn_charset("
+				       "len %i, accept %i) failed: "
+				       "expected %zu, got %zu\n",
+				       __FUNCTION__, __LINE__, impls[impl],
+				       len, accept, exp, r);
+				fails++;
+			}
+
+			exp = ref_strnspn(buf+of, len, 0, map);
+			m = rd_strnchrs_charset(buf+of, len, &rcs, 0);
+			if (m != (exp < len && buf[of+exp] ?
+				  buf+of+exp : NULL)) {
+				printf("%s:%i: impl %i: rd_strnchrs_charset("
+				       "len %i) failed: expected offset %zu, "
+				       "got %p\n",
+				       __FUNCTION__, __LINE__, impls[impl],
+				       len, exp, m);
+				fails++;
+			}
+		}
+	}
+
+	rd_charset_impl_set(RD_CHARSET_IMPL_AUTO);
+
+	return fails;
+}
+
+
+
+/**
+ * Strings ending right before an inaccessible page must not be read past
+ * their terminator or 'size', whatever the implementation.
+ */
+static int test_charset_guard (void) {
+	static const rd_charset_impl_t impls[] = {
+		RD_CHARSET_IMPL_SCALAR,
+		RD_CHARSET_IMPL_SSSE3,
+		RD_CHARSET_IMPL_AVX2,
+	};
+	long pagesize = sysconf(_SC_PAGESIZE);
+	char *pages, *end, *s;
+	int fails = 0;
+	int impl;
+	int of;
+
+	pages = mmap(NULL, pagesize * 2, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED) {
+		printf("%s:%i: mmap failed: %s\n",
+		       __FUNCTION__, __LINE__, strerror(errno));
+		return 1;
+	}
+	end = pages + pagesize;
+	mprotect(end, pagesize, PROT_NONE);
+	memset(pages, 'a', pagesize);
+
+	for (impl = 0 ; impl < RD_ARRAY_SIZE(impls) ; impl++) {
+		if (rd_charset_impl_set(impls[impl]) == -1)
+			continue;
+
+		for (of = 1 ; of <= 40 ; of++) {
+			/* Nul-terminated: "ab..\0" */
+			s = end - of;
+			end[-1] = '\0';
+			if (of > 1)
+				s[0] = 'b';
+
+			if (rd_strnspn(s, 100, "ab") != of - 1 ||
+			    rd_strnspn(s, -1, "ab") != of - 1 ||
+			    rd_strncspn(s, 100, "x") != of - 1 ||
+			    rd_strnchrs(s, 100, "x", 0) != NULL ||
+			    rd_strnchrs(s, -1, "x", 1) != end - 1) {
+				printf("%s:%i: impl %i: nul-terminated scan "
+				       "of %i bytes failed\n",
+				       __FUNCTION__, __LINE__,
+				       impls[impl], of - 1);
+				fails++;
+			}
+
+			/* Unterminated, bounded by 'size'. */
+			end[-1] = 'a';
+			if (rd_strnspn(s, of, "ab") != of ||
+			    rd_strnchrs(s, of, "x", 0) != NULL) {
+				printf("%s:%i: impl %i: bounded scan "
+				       "of %i bytes failed\n",
+				       __FUNCTION__, __LINE__,
+				       impls[impl], of);
+				fails++;
+			}
+			s[0] = 'a';
+		}
+	}
+
+	rd_charset_impl_set(RD_CHARSET_IMPL_AUTO);
+	munmap(pages, pagesize * 2);
+
+	return fails;
+}
+
+
+static int test_strbuf (void) {
+	static const int64_t ints[] = { 0, 1, -1, 9, 10, 99, 100, -12345,
+					INT64_MAX, INT64_MIN, 1000000007 };
+	static const double dbls[] = { 0.0, -0.0, 1.5, -2.25, 3.14159265,
+				       0.005, 123456.789, -0.04, 1e15, 1e300,
+				       1.0/0.0, -1.0/0.0 };
+	rd_strbuf_t rsb;
+	char tmp[16];
+	char exp[512];
+	char *str;
+	size_t len;
+	int i, prec;
+	int fails = 0;
+
+	/* Static buffer spilling over to the heap */
+	rd_strbuf_init_static(&rsb, tmp, sizeof(tmp));
+	for (i = 0 ; i < 100 ; i++)
+		rd_strbuf_putc(&rsb, 'a' + (i % 26));
+	if (rd_strbuf_len(&rsb) != 100 ||
+	    strlen(rd_strbuf_str(&rsb)) != 100 ||
+	    rd_strbuf_str(&rsb)[26] != 'a') {
+		printf("%s:%i: strbuf spill failed: len %zu: \"%s\"\n",
+		       __FUNCTION__, __LINE__, rd_strbuf_len(&rsb),
+		       rd_strbuf_str(&rsb));
+		fails++;
+	}
+	rd_strbuf_destroy(&rsb);
+
+	/* Integers */
+	rd_strbuf_init(&rsb, 0);
+	for (i = 0 ; i < RD_ARRAY_SIZE(ints) ; i++) {
+		rd_strbuf_reset(&rsb);
+		rd_strbuf_append_int(&rsb, ints[i]);
+		snprintf(exp, sizeof(exp), "%"PRId64, ints[i]);
+		if (strcmp(rd_strbuf_str(&rsb), exp) ||
+		    rd_strbuf_len(&rsb) != strlen(exp)) {
+			printf("%s:%i: append_int: expected \"%s\", "
+			       "got \"%s\"\n",
+			       __FUNCTION__, __LINE__, exp,
+			       rd_strbuf_str(&rsb));
+			fails++;
+		}
+	}
+
+	rd_strbuf_reset(&rsb);
+	rd_strbuf_append_uint(&rsb, UINT64_MAX);
+	if (strcmp(rd_strbuf_str(&rsb), "18446744073709551615")) {
+		printf("%s:%i: append_uint: got \"%s\"\n",
+		       __FUNCTION__, __LINE__, rd_strbuf_str(&rsb));
+		fails++;
+	}
+
+	/* Doubles */
+	for (prec = -1 ; prec < 14 ; prec++) {
+		/* Precisions outside 0..9 are formatted by printf. */
+		for (i = 0 ; i < RD_ARRAY_SIZE(dbls) ; i++) {
+			rd_strbuf_reset(&rsb);
+			rd_strbuf_append_double(&rsb, dbls[i], prec);
+			snprintf(exp, sizeof(exp), "%.*f", prec, dbls[i]);
+			if (strcmp(rd_strbuf_str(&rsb), exp)) {
+				printf("%s:%i: append_double(%g, %i): "
+				       "expected \"%s\", got \"%s\"\n",
+				       __FUNCTION__, __LINE__, dbls[i], prec,
+				       exp, rd_strbuf_str(&rsb));
+				fails++;
+			}
+		}
+	}
+
+	for (i = 0 ; i < 100000 ; i++) {
+		double v = ((double)random() / RAND_MAX - 0.5) *
+			pow(10, (random() % 12) - 3);
+		prec = i % 10;
+		rd_strbuf_reset(&rsb);
+		rd_strbuf_append_double(&rsb, v, prec);
+		snprintf(exp, sizeof(exp), "%.*f", prec, v);
+		if (strcmp(rd_strbuf_str(&rsb), exp)) {
+			printf("%s:%i: append_double(%.17g, %i): "
+			       "expected \"%s\", got \"%s\"\n",
+			       __FUNCTION__, __LINE__, v, prec,
+			       exp, rd_strbuf_str(&rsb));
+			fails++;
+			break;
+		}
+	}
+
+	/* printf, with and without growing */
+	rd_strbuf_reset(&rsb);
+	rd_strbuf_printf(&rsb, "%s=%i", "a", 1);
+	rd_strbuf_puts(&rsb, ", ");
+	memset(exp, 'x', 300);
+	exp[300] = '\0';
+	rd_strbuf_printf(&rsb, "%s!", exp);
+	if (rd_strbuf_len(&rsb) != 3 + 2 + 301 ||
+	    strncmp(rd_strbuf_str(&rsb), "a=1, xxx", 8) ||
+	    rd_strbuf_str(&rsb)[rd_strbuf_len(&rsb)-1] != '!') {
+		printf("%s:%i: strbuf printf failed: len %zu\n",
+		       __FUNCTION__, __LINE__, rd_strbuf_len(&rsb));
+		fails++;
+	}
+
+	/* Detach */
+	str = rd_strbuf_detach(&rsb, &len);
+	if (len != 306 || strlen(str) != 306 || rd_strbuf_len(&rsb) != 0) {
+		printf("%s:%i: strbuf detach failed: len %zu\n",
+		       __FUNCTION__, __LINE__, len);
+		fails++;
+	}
+	free(str);
+	rd_strbuf_destroy(&rsb);
+
+	return fails;
+}
+
+
 
 int main (int argc, char **argv) {
 	int fails = 0;
 
 	fails += test_string();
+	fails += test_charset();
+	fails += test_charset_guard();
+	fails += test_strbuf();
 
 	return fails ? 1 : 0;
 }
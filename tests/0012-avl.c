@@ -202,10 +202,385 @@ static int test_avl (void) {
 	return fails;
 }
 
+
+struct ielm {
+	int           i_val;
+	rd_avl_node_t i_link;
+};
+
+static int ielm_cmp (const void *_a, const void *_b) {
+	const struct ielm *a = _a, *b = _b;
+	return a->i_val - b->i_val;
+}
+
+/**
+ * Verifies ordering, heights and balance of the subtree,
+ * returns its height or -1 on error.
+ */
+static int avl_verify (rd_avl_t *ravl, const rd_avl_node_t *ran) {
+	int hl, hr;
+
+	if (!ran)
+		return 0;
+
+	if ((hl = avl_verify(ravl, ran->ran_p[RD_AVL_LEFT])) == -1 ||
+	    (hr = avl_verify(ravl, ran->ran_p[RD_AVL_RIGHT])) == -1)
+		return -1;
+
+	if ((ran->ran_p[RD_AVL_LEFT] &&
+	     ravl->ravl_cmp(ran->ran_p[RD_AVL_LEFT]->ran_elm,
+			    ran->ran_elm) >= 0) ||
+	    (ran->ran_p[RD_AVL_RIGHT] &&
+	     ravl->ravl_cmp(ran->ran_p[RD_AVL_RIGHT]->ran_elm,
+			    ran->ran_elm) <= 0) ||
+	    hl - hr > 1 || hr - hl > 1 ||
+	    ran->ran_height != RD_MAX(hl, hr) + 1)
+		return -1;
+
+	return ran->ran_height;
+}
+
+static void range_sum (void *velm, void *opaque) {
+	*(int *)opaque += ((struct ielm *)velm)->i_val;
+}
+
+static int test_avl_ordered (void) {
+	int fails = 0;
+	static struct ielm ielms[1000];
+	struct ielm skel, *e;
+	rd_avl_t ravl;
+	rd_avl_iter_t it;
+	int i, prev, cnt, sum;
+
+#define FAIL(fmt...) do {					\
+		printf("%s:%i: ", __FUNCTION__, __LINE__);	\
+		printf(fmt);					\
+		printf("\n");					\
+		fails++;					\
+	} while (0)
+
+	rd_avl_init(&ravl, ielm_cmp, RD_AVL_F_LOCKS);
+
+	if (RD_AVL_FIRST(&ravl) || RD_AVL_LAST(&ravl))
+		FAIL("empty tree has first/last element");
+
+	/* Insert even values 0..1998 in scrambled order. */
+	for (i = 0 ; i < 1000 ; i++) {
+		ielms[i].i_val = ((i * 7919) % 1000) * 2;
+		RD_AVL_INSERT(&ravl, &ielms[i], i_link);
+	}
+
+	if (avl_verify(&ravl, ravl.ravl_root) == -1)
+		FAIL("tree invalid after inserts");
+
+	e = RD_AVL_FIRST(&ravl);
+	if (!e || e->i_val != 0)
+		FAIL("first is %i, not 0", e ? e->i_val : -1);
+	e = RD_AVL_LAST(&ravl);
+	if (!e || e->i_val != 1998)
+		FAIL("last is %i, not 1998", e ? e->i_val : -1);
+
+	/* Ascending and descending iteration */
+	rd_avl_rdlock(&ravl);
+	rd_avl_iter_init(&it, &ravl, RD_AVL_LEFT);
+	for (prev = -2, cnt = 0 ; (e = rd_avl_iter_next(&it)) ; cnt++) {
+		if (e->i_val != prev + 2)
+			FAIL("ascending: %i follows %i", e->i_val, prev);
+		prev = e->i_val;
+	}
+	if (cnt != 1000)
+		FAIL("ascending iteration returned %i elements", cnt);
+
+	rd_avl_iter_init(&it, &ravl, RD_AVL_RIGHT);
+	for (prev = 2000, cnt = 0 ; (e = rd_avl_iter_next(&it)) ; cnt++) {
+		if (e->i_val != prev - 2)
+			FAIL("descending: %i follows %i", e->i_val, prev);
+		prev = e->i_val;
+	}
+	if (cnt != 1000)
+		FAIL("descending iteration returned %i elements", cnt);
+
+	skel.i_val = 501;
+	rd_avl_iter_seek(&it, &ravl, &skel, 0);
+	for (cnt = 0 ; (e = rd_avl_iter_next(&it)) ; cnt++)
+		if (cnt == 0 && e->i_val != 502)
+			FAIL("seek(501) starts at %i", e->i_val);
+	if (cnt != 749)
+		FAIL("seek(501) iterated %i elements", cnt);
+	rd_avl_unlock(&ravl);
+
+	/* Bounds */
+	skel.i_val = 500;
+	e = RD_AVL_LOWER_BOUND(&ravl, &skel);
+	if (!e || e->i_val != 500)
+		FAIL("lower_bound(500) is %i", e ? e->i_val : -1);
+	e = RD_AVL_UPPER_BOUND(&ravl, &skel);
+	if (!e || e->i_val != 502)
+		FAIL("upper_bound(500) is %i", e ? e->i_val : -1);
+	skel.i_val = 1998;
+	if (RD_AVL_UPPER_BOUND(&ravl, &skel))
+		FAIL("upper_bound(1998) is not NULL");
+
+	/* Range [10,20] */
+	{
+		struct ielm lo = { .i_val = 9 }, hi = { .i_val = 20 };
+		sum = 0;
+		cnt = RD_AVL_RANGE(&ravl, &lo, &hi, range_sum, &sum);
+		if (cnt != 6 || sum != 10+12+14+16+18+20)
+			FAIL("range [9,20]: %i elements, sum %i", cnt, sum);
+		sum = 0;
+		cnt = RD_AVL_RANGE(&ravl, NULL, &lo, range_sum, &sum);
+		if (cnt != 5)
+			FAIL("range [,9]: %i elements", cnt);
+	}
+
+	/* Remove every other element */
+	for (i = 0 ; i < 1000 ; i += 2) {
+		skel.i_val = ((i * 7919) % 1000) * 2;
+		RD_AVL_REMOVE_ELM(&ravl, &skel);
+	}
+
+	if (avl_verify(&ravl, ravl.ravl_root) == -1)
+		FAIL("tree invalid after removes");
+
+	cnt = 0;
+	rd_avl_rdlock(&ravl);
+	rd_avl_iter_init(&it, &ravl, RD_AVL_LEFT);
+	while ((e = rd_avl_iter_next(&it)))
+		cnt++;
+	rd_avl_unlock(&ravl);
+	if (cnt != 500)
+		FAIL("%i elements remain after removes, not 500", cnt);
+
+	for (i = 0 ; i < 1000 ; i++) {
+		e = RD_AVL_FIND(&ravl, &ielms[i]);
+		if (!!e != (i & 1))
+			FAIL("element %i (%i) %sfound", i, ielms[i].i_val,
+			     e ? "" : "not ");
+	}
+
+	rd_avl_destroy(&ravl);
+
+#undef FAIL
+	return fails;
+}
+
+
+
+static rd_avl_t rcu_avl;
+static struct ielm rcu_elms[2000];
+static volatile int rcu_run = 1;
+
+static void *rcu_reader (void *arg) {
+	unsigned int seed = (unsigned int)(intptr_t)arg;
+	intptr_t fails = 0;
+
+	while (rcu_run) {
+		struct ielm skel, *e;
+		rd_avl_iter_t it;
+		int prev = -1, cnt = 0;
+
+		/* Even values are never removed. */
+		skel.i_val = (rand_r(&seed) % 1000) * 2;
+		e = RD_AVL_FIND(&rcu_avl, &skel);
+		if (!e || e->i_val != skel.i_val)
+			fails++;
+
+		/* Every snapshot is ordered. */
+		rd_avl_rdlock(&rcu_avl);
+		rd_avl_iter_init(&it, &rcu_avl, RD_AVL_LEFT);
+		while ((e = rd_avl_iter_next(&it))) {
+			if (e->i_val <= prev)
+				fails++;
+			prev = e->i_val;
+			cnt++;
+		}
+		rd_avl_rdunlock(&rcu_avl);
+
+		if (cnt < 1000 || cnt > 2000)
+			fails++;
+
+		/* Advance the epoch concurrently with the writer, which
+		 * must not let nodes go before they are unreachable. */
+		rd_epoch_reclaim();
+	}
+
+	rd_epoch_thread_cleanup();
+
+	return (void *)fails;
+}
+
+static int test_avl_rcu (void) {
+	int fails = 0;
+	pthread_t thrs[4];
+	int i, round;
+
+	rd_avl_init(&rcu_avl, ielm_cmp, RD_AVL_F_RCU);
+
+	for (i = 0 ; i < 2000 ; i++)
+		rcu_elms[i].i_val = i;
+	for (i = 0 ; i < 2000 ; i += 2)
+		RD_AVL_INSERT(&rcu_avl, &rcu_elms[i], i_link);
+
+	for (i = 0 ; i < RD_ARRAYSIZE(thrs) ; i++)
+		pthread_create(&thrs[i], NULL, rcu_reader, (void *)(intptr_t)i);
+
+	/* Writer: add and remove the odd values. */
+	for (round = 0 ; round < 20 ; round++) {
+		for (i = 1 ; i < 2000 ; i += 2)
+			RD_AVL_INSERT(&rcu_avl, &rcu_elms[i], i_link);
+		for (i = 1 ; i < 2000 ; i += 2)
+			RD_AVL_REMOVE_ELM(&rcu_avl, &rcu_elms[i]);
+	}
+
+	rcu_run = 0;
+	for (i = 0 ; i < RD_ARRAYSIZE(thrs) ; i++) {
+		void *ret;
+		pthread_join(thrs[i], &ret);
+		if (ret) {
+			printf("%s:%i: reader %i saw %i inconsistencies\n",
+			       __FUNCTION__, __LINE__, i, (int)(intptr_t)ret);
+			fails++;
+		}
+	}
+
+	if (avl_verify(&rcu_avl, rcu_avl.ravl_root) == -1) {
+		printf("%s:%i: RCU tree invalid\n", __FUNCTION__, __LINE__);
+		fails++;
+	}
+
+	rd_avl_destroy(&rcu_avl);
+
+	rd_epoch_barrier();
+	if (rd_epoch_pending() != 0) {
+		printf("%s:%i: %i retired nodes not freed\n",
+		       __FUNCTION__, __LINE__, rd_epoch_pending());
+		fails++;
+	}
+
+	return fails;
+}
+
+
+static void count_cb (void *velm, void *opaque) {
+	(*(int *)opaque)++;
+}
+
+static void free_cb (void *velm, void *opaque) {
+	(*(int *)opaque)++;
+	free(velm);
+}
+
+static int test_avl_bulk (void) {
+	int fails = 0;
+	const int cnt = 100000;
+	struct ielm **elms = malloc(sizeof(*elms) * cnt);
+	struct ielm skel, *e;
+	rd_avl_t ravl;
+	int i, freed;
+	int flags[] = { RD_AVL_F_LOCKS, RD_AVL_F_RCU };
+	int f;
+
+	for (f = 0 ; f < RD_ARRAYSIZE(flags) ; f++) {
+		rd_avl_init(&ravl, ielm_cmp, flags[f]);
+
+		for (i = 0 ; i < cnt ; i++) {
+			elms[i] = malloc(sizeof(*elms[i]));
+			elms[i]->i_val = i * 3;
+		}
+
+		if (RD_AVL_BUILD(&ravl, elms, cnt, struct ielm, i_link) == -1) {
+			printf("%s:%i: build failed: %s\n",
+			       __FUNCTION__, __LINE__, strerror(errno));
+			fails++;
+		}
+
+		if (avl_verify(&ravl, ravl.ravl_root) == -1) {
+			printf("%s:%i: built tree invalid\n",
+			       __FUNCTION__, __LINE__);
+			fails++;
+		}
+
+		for (i = 0 ; i < cnt * 3 ; i += 7) {
+			skel.i_val = i;
+			e = RD_AVL_FIND(&ravl, &skel);
+			if ((e != NULL) != (i % 3 == 0)) {
+				printf("%s:%i: %i %sfound\n",
+				       __FUNCTION__, __LINE__, i,
+				       e ? "" : "not ");
+				fails++;
+				break;
+			}
+		}
+
+		/* Built tree accepts regular inserts and removes. */
+		skel.i_val = 3;
+		RD_AVL_REMOVE_ELM(&ravl, &skel);
+		free(elms[1]);
+		elms[1] = malloc(sizeof(*elms[1]));
+		elms[1]->i_val = 1;
+		RD_AVL_INSERT(&ravl, elms[1], i_link);
+		if (avl_verify(&ravl, ravl.ravl_root) == -1) {
+			printf("%s:%i: tree invalid after insert\n",
+			       __FUNCTION__, __LINE__);
+			fails++;
+		}
+
+		/* Build into non-empty tree must fail. */
+		if (RD_AVL_BUILD(&ravl, elms, 1, struct ielm, i_link) != -1 ||
+		    errno != EEXIST) {
+			printf("%s:%i: build into non-empty tree succeeded\n",
+			       __FUNCTION__, __LINE__);
+			fails++;
+		}
+
+		freed = 0;
+		rd_avl_destroy_cb(&ravl, free_cb, &freed);
+		if (freed != cnt) {
+			printf("%s:%i: freed %i elements, not %i\n",
+			       __FUNCTION__, __LINE__, freed, cnt);
+			fails++;
+		}
+	}
+
+	/* Unsorted input is rejected. */
+	rd_avl_init(&ravl, ielm_cmp, 0);
+	{
+		struct ielm a = { 2 }, b = { 1 };
+		struct ielm *unsorted[] = { &a, &b };
+		if (RD_AVL_BUILD(&ravl, unsorted, 2,
+				 struct ielm, i_link) != -1 ||
+		    errno != EINVAL || ravl.ravl_root) {
+			printf("%s:%i: unsorted build succeeded\n",
+			       __FUNCTION__, __LINE__);
+			fails++;
+		}
+
+		/* Clear leaves a reusable empty tree. */
+		RD_AVL_BUILD(&ravl, unsorted + 1, 1, struct ielm, i_link);
+		freed = 0;
+		RD_AVL_CLEAR(&ravl, count_cb, &freed);
+		if (freed != 1 || ravl.ravl_root) {
+			printf("%s:%i: clear visited %i elements\n",
+			       __FUNCTION__, __LINE__, freed);
+			fails++;
+		}
+	}
+	rd_avl_destroy(&ravl);
+
+	free(elms);
+
+	return fails;
+}
+
+
 int main (int argc, char **argv) {
 	int fails = 0;
 
 	fails += test_avl();
+	fails += test_avl_ordered();
+	fails += test_avl_rcu();
+	fails += test_avl_bulk();
 
 	return fails ? 1 : 0;
 }
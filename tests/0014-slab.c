@@ -0,0 +1,230 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdslab.h"
+#include "rdmem.h"
+
+#include "rdtests.h"
+
+
+struct obj {
+	int  o_id;
+	char o_pad[40];
+};
+
+
+static int test_slab_basic (void) {
+	TEST_VARS;
+	rd_slab_t rs;
+	rd_memctx_t rmc;
+	rd_memctx_stats_t mstats;
+	rd_slab_stats_t stats;
+	const int num = 1000;
+	struct obj *objs[num];
+	int i;
+
+	rd_memctx_init(&rmc, "slab", 0);
+	rd_slab_init(&rs, "obj", sizeof(struct obj), &rmc);
+
+	for (i = 0 ; i < num ; i++) {
+		objs[i] = rd_slab_calloc(&rs);
+		if (!objs[i] || objs[i]->o_id != 0)
+			TEST_FAIL("object #%i not allocated or not zeroed", i);
+		else if ((uintptr_t)objs[i] & (RD_SLAB_ALIGN-1))
+			TEST_FAIL("object #%i %p misaligned", i, objs[i]);
+		objs[i]->o_id = i;
+	}
+
+	for (i = 0 ; i < num ; i++)
+		if (objs[i]->o_id != i)
+			TEST_FAIL("object #%i overwritten: %i",
+				  i, objs[i]->o_id);
+
+	rd_slab_stats(&rs, &stats);
+	if (stats.out < num)
+		TEST_FAIL("stats.out %u < %i", stats.out, num);
+
+	/* Pages are accounted in the memctx */
+	rd_memctx_stats(&rmc, &mstats);
+	if (mstats.out != stats.pages || mstats.bytes_out != stats.bytes)
+		TEST_FAIL("memctx %u/%zd != slab pages %u/%zd",
+			  mstats.out, mstats.bytes_out,
+			  stats.pages, stats.bytes);
+
+	for (i = 0 ; i < num ; i++)
+		rd_slab_free(&rs, objs[i]);
+
+	/* Freed objects are reused without growing the slab. */
+	for (i = 0 ; i < num ; i++)
+		objs[i] = rd_slab_alloc(&rs);
+	for (i = 0 ; i < num ; i++)
+		rd_slab_free(&rs, objs[i]);
+
+	rd_memctx_stats(&rmc, &mstats);
+	if (mstats.out != stats.pages)
+		TEST_FAIL("slab grew from %u to %u pages on reuse",
+			  stats.pages, mstats.out);
+
+	rd_slab_thread_cleanup();
+	rd_slab_stats(&rs, &stats);
+	if (stats.out != 0)
+		TEST_FAIL("stats.out %u != 0 after thread cleanup", stats.out);
+
+	rd_slab_destroy(&rs);
+
+	rd_memctx_stats(&rmc, &mstats);
+	if (mstats.out != 0 || mstats.bytes_out != 0)
+		TEST_FAIL("memctx %u/%zd != 0/0 after destroy",
+			  mstats.out, mstats.bytes_out);
+
+	rd_memctx_destroy(&rmc);
+
+	TEST_RETURN;
+}
+
+
+
+static rd_slab_t test_static_slab =
+	RD_SLAB_INITIALIZER("static_obj", sizeof(struct obj));
+
+#define TEST_THREAD_CNT  8
+#define TEST_THREAD_OBJS 10000
+
+static void *test_slab_thread (void *arg) {
+	struct obj **objs = arg;
+	int i, j;
+
+	/* Allocate in one thread, free in another (see main). */
+	for (j = 0 ; j < 10 ; j++) {
+		struct obj *tmp[100];
+		for (i = 0 ; i < 100 ; i++) {
+			tmp[i] = rd_slab_alloc(&test_static_slab);
+			tmp[i]->o_id = i;
+		}
+		for (i = 0 ; i < 100 ; i++) {
+			if (tmp[i]->o_id != i)
+				return (void *)1;
+			rd_slab_free(&test_static_slab, tmp[i]);
+		}
+	}
+
+	for (i = 0 ; i < TEST_THREAD_OBJS ; i++)
+		objs[i] = rd_slab_alloc(&test_static_slab);
+
+	rd_slab_thread_cleanup();
+
+	return NULL;
+}
+
+static int test_slab_threads (void) {
+	TEST_VARS;
+	pthread_t thrs[TEST_THREAD_CNT];
+	static struct obj *objs[TEST_THREAD_CNT][TEST_THREAD_OBJS];
+	rd_slab_stats_t stats;
+	int i, j;
+
+	for (i = 0 ; i < TEST_THREAD_CNT ; i++)
+		pthread_create(&thrs[i], NULL, test_slab_thread, objs[i]);
+
+	for (i = 0 ; i < TEST_THREAD_CNT ; i++) {
+		void *ret;
+		pthread_join(thrs[i], &ret);
+		if (ret)
+			TEST_FAIL("thread #%i saw corrupt objects", i);
+	}
+
+	rd_slab_stats(&test_static_slab, &stats);
+	if (stats.out != TEST_THREAD_CNT * TEST_THREAD_OBJS)
+		TEST_FAIL("stats.out %u != %i",
+			  stats.out, TEST_THREAD_CNT * TEST_THREAD_OBJS);
+
+	for (i = 0 ; i < TEST_THREAD_CNT ; i++)
+		for (j = 0 ; j < TEST_THREAD_OBJS ; j++)
+			rd_slab_free(&test_static_slab, objs[i][j]);
+
+	rd_slab_thread_cleanup();
+
+	rd_slab_stats(&test_static_slab, &stats);
+	if (stats.out != 0)
+		TEST_FAIL("stats.out %u != 0", stats.out);
+	if (stats.depot < TEST_THREAD_CNT * TEST_THREAD_OBJS)
+		TEST_FAIL("stats.depot %u < %i",
+			  stats.depot, TEST_THREAD_CNT * TEST_THREAD_OBJS);
+
+	rd_slab_destroy(&test_static_slab);
+
+	TEST_RETURN;
+}
+
+
+static rd_slab_t test_exit_slab =
+	RD_SLAB_INITIALIZER("exit_obj", sizeof(struct obj));
+
+static void *test_slab_exit_thread (void *arg) {
+	struct obj *tmp[100];
+	int i;
+
+	for (i = 0 ; i < 100 ; i++)
+		tmp[i] = rd_slab_alloc(&test_exit_slab);
+	for (i = 0 ; i < 100 ; i++)
+		rd_slab_free(&test_exit_slab, tmp[i]);
+
+	/* No rd_slab_thread_cleanup(): thread exit must flush the cache. */
+	return NULL;
+}
+
+static int test_slab_thread_exit (void) {
+	TEST_VARS;
+	pthread_t thr;
+	rd_slab_stats_t stats;
+
+	pthread_create(&thr, NULL, test_slab_exit_thread, NULL);
+	pthread_join(thr, NULL);
+
+	rd_slab_stats(&test_exit_slab, &stats);
+	if (stats.out != 0)
+		TEST_FAIL("stats.out %u != 0 after thread exit", stats.out);
+
+	rd_slab_destroy(&test_exit_slab);
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	fails += test_slab_basic();
+	fails += test_slab_threads();
+	fails += test_slab_thread_exit();
+
+	TEST_EXIT;
+}
@@ -0,0 +1,308 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdlru.h"
+#include "rdtimer.h"
+
+#include "rdtests.h"
+
+
+struct elm {
+	char          e_key[16];
+	rd_lru_node_t e_link;
+	int           e_evicted;
+};
+
+static int evict_cnt = 0;
+
+static void elm_evict (void *_elm, void *opaque) {
+	struct elm *elm = _elm;
+	elm->e_evicted++;
+	evict_cnt++;
+}
+
+
+static int test_lru_cache_count (void) {
+	TEST_VARS;
+	rd_lru_cache_t rlc;
+	const int num = 1000;
+	const int cap = 100;
+	static struct elm elms[1000];
+	struct elm *elm, dup;
+	int i;
+
+	evict_cnt = 0;
+	rd_lru_cache_init(&rlc, rd_lru_cache_hash_str, rd_lru_cache_cmp_str,
+			  cap, 0, elm_evict, NULL);
+
+	for (i = 0 ; i < num ; i++) {
+		snprintf(elms[i].e_key, sizeof(elms[i].e_key), "key%i", i);
+		if (RD_LRU_CACHE_PUT(&rlc, &elms[i], e_link, elms[i].e_key, 1))
+			TEST_FAIL("put of new key %s returned previous",
+				  elms[i].e_key);
+
+		/* Keep key0 hot */
+		if (!rd_lru_cache_get(&rlc, "key0"))
+			TEST_FAIL("key0 evicted after %i puts", i);
+	}
+
+	TEST_INT_EQ(rd_lru_cache_cnt(&rlc), cap);
+	TEST_INT_EQ(evict_cnt, num - cap);
+
+	/* The most recent cap-1 elements and key0 remain. */
+	for (i = 1 ; i < num ; i++) {
+		int expect = i >= num - (cap - 1);
+		elm = rd_lru_cache_peek(&rlc, elms[i].e_key);
+		if (!!elm != expect || elms[i].e_evicted != !expect)
+			TEST_FAIL("%s: cached %i, evicted %i, expected %i",
+				  elms[i].e_key, !!elm, elms[i].e_evicted,
+				  expect);
+	}
+
+	/* Replace */
+	strcpy(dup.e_key, "key999");
+	elm = RD_LRU_CACHE_PUT(&rlc, &dup, e_link, dup.e_key, 1);
+	TEST_ASSERT(elm == &elms[999]);
+	TEST_ASSERT(rd_lru_cache_get(&rlc, "key999") == &dup);
+	TEST_INT_EQ(rd_lru_cache_cnt(&rlc), cap);
+
+	/* Remove */
+	TEST_ASSERT(rd_lru_cache_remove(&rlc, "key999") == &dup);
+	TEST_ASSERT(rd_lru_cache_get(&rlc, "key999") == NULL);
+	RD_LRU_CACHE_REMOVE_ELM(&rlc, &elms[998], e_link);
+	TEST_ASSERT(rd_lru_cache_peek(&rlc, "key998") == NULL);
+	TEST_INT_EQ(rd_lru_cache_cnt(&rlc), cap - 2);
+
+	/* Pop returns the least recently used: key901 */
+	elm = rd_lru_cache_pop(&rlc);
+	TEST_ASSERT(elm == &elms[num - (cap - 1)]);
+
+	/* All remaining elements are found after the deletions above. */
+	for (i = num - (cap - 2) ; i < num - 2 ; i++)
+		if (!rd_lru_cache_peek(&rlc, elms[i].e_key))
+			TEST_FAIL("%s not found", elms[i].e_key);
+
+	evict_cnt = 0;
+	rd_lru_cache_destroy(&rlc);
+	TEST_INT_EQ(evict_cnt, cap - 3);
+
+	TEST_RETURN;
+}
+
+
+static int test_lru_cache_bytes (void) {
+	TEST_VARS;
+	rd_lru_cache_t rlc;
+	static struct elm elms[100];
+	int i;
+
+	evict_cnt = 0;
+	rd_lru_cache_init(&rlc, rd_lru_cache_hash_str, rd_lru_cache_cmp_str,
+			  0, 1000, elm_evict, NULL);
+
+	for (i = 0 ; i < 100 ; i++) {
+		snprintf(elms[i].e_key, sizeof(elms[i].e_key), "key%i", i);
+		RD_LRU_CACHE_PUT(&rlc, &elms[i], e_link, elms[i].e_key, 100);
+	}
+
+	TEST_INT_EQ(rd_lru_cache_cnt(&rlc), 10);
+	TEST_ASSERT(rd_lru_cache_bytes(&rlc) == 1000);
+	TEST_INT_EQ(evict_cnt, 90);
+
+	rd_lru_cache_destroy(&rlc);
+
+	/* Unbounded cache: index grows */
+	rd_lru_cache_init(&rlc, rd_lru_cache_hash_str, rd_lru_cache_cmp_str,
+			  0, 0, NULL, NULL);
+	for (i = 0 ; i < 100 ; i++)
+		RD_LRU_CACHE_PUT(&rlc, &elms[i], e_link, elms[i].e_key, 100);
+	for (i = 0 ; i < 100 ; i++)
+		if (rd_lru_cache_get(&rlc, elms[i].e_key) != &elms[i])
+			TEST_FAIL("%s not found", elms[i].e_key);
+	TEST_INT_EQ(rd_lru_cache_cnt(&rlc), 100);
+	rd_lru_cache_destroy(&rlc);
+
+	TEST_RETURN;
+}
+
+
+/**
+ * Accesses a hot set of keys between scans of one-off keys,
+ * returns the number of hot set hits.
+ */
+static int test_lru_cache_scan (rd_lru_cache_t *rlc) {
+	static struct elm hot[50];
+	static struct elm scan[1000];
+	int round, i, s = 0;
+	int hits = 0;
+
+	for (i = 0 ; i < 50 ; i++)
+		snprintf(hot[i].e_key, sizeof(hot[i].e_key), "hot%i", i);
+	for (i = 0 ; i < 1000 ; i++)
+		snprintf(scan[i].e_key, sizeof(scan[i].e_key), "scan%i", i);
+
+	for (round = 0 ; round < 10 ; round++) {
+		/* Scan twice the cache capacity after the warm-up rounds */
+		if (round >= 5) {
+			for (i = 0 ; i < 200 ; i++, s++)
+				RD_LRU_CACHE_PUT(rlc, &scan[s], e_link,
+						 scan[s].e_key, 1);
+		}
+
+		for (i = 0 ; i < 50 ; i++) {
+			if (rd_lru_cache_get(rlc, hot[i].e_key)) {
+				if (round >= 5)
+					hits++;
+			} else
+				RD_LRU_CACHE_PUT(rlc, &hot[i], e_link,
+						 hot[i].e_key, 1);
+		}
+	}
+
+	return hits;
+}
+
+static int test_lru_cache_tinylfu (void) {
+	TEST_VARS;
+	rd_lru_cache_t rlc;
+	rd_lru_cache_stats_t stats;
+	int lru_hits, lfu_hits;
+
+	/* Plain LRU: the scans flush the hot set. */
+	rd_lru_cache_init(&rlc, rd_lru_cache_hash_str, rd_lru_cache_cmp_str,
+			  100, 0, NULL, NULL);
+	lru_hits = test_lru_cache_scan(&rlc);
+	rd_lru_cache_destroy(&rlc);
+
+	/* TinyLFU: one-off keys are not admitted over the hot set. */
+	evict_cnt = 0;
+	rd_lru_cache_init(&rlc, rd_lru_cache_hash_str, rd_lru_cache_cmp_str,
+			  100, 0, elm_evict, NULL);
+	rd_lru_cache_tinylfu_set(&rlc, 0);
+	lfu_hits = test_lru_cache_scan(&rlc);
+
+	rd_lru_cache_stats(&rlc, &stats);
+	TEST_ASSERT(stats.rejects > 0);
+	TEST_INT_EQ((int)(stats.rejects + stats.evictions), evict_cnt);
+	TEST_ASSERT(rd_lru_cache_hit_ratio(&rlc) > 0.5);
+	TEST_INT_EQ(rd_lru_cache_cnt(&rlc), 100);
+	rd_lru_cache_destroy(&rlc);
+
+	if (lfu_hits < 225 || lfu_hits <= lru_hits)
+		TEST_FAIL("TinyLFU hot set hits %i/250, LRU %i/250",
+			  lfu_hits, lru_hits);
+
+	TEST_RETURN;
+}
+
+
+static int test_lru_cache_ttl (void) {
+	TEST_VARS;
+	rd_lru_cache_t rlc;
+	rd_lru_cache_stats_t stats;
+	static struct elm elms[30];
+	rd_timer_t *rt;
+	rd_ts_t ts_end;
+	int i;
+
+	memset(elms, 0, sizeof(elms));
+	evict_cnt = 0;
+	rd_lru_cache_init(&rlc, rd_lru_cache_hash_str, rd_lru_cache_cmp_str,
+			  100, 0, elm_evict, NULL);
+	rd_lru_cache_ttl_set(&rlc, 0, 10);
+
+	/* 10 elements expire, 10 don't. */
+	for (i = 0 ; i < 20 ; i++) {
+		snprintf(elms[i].e_key, sizeof(elms[i].e_key), "key%i", i);
+		RD_LRU_CACHE_PUT_TTL(&rlc, &elms[i], e_link, elms[i].e_key, 1,
+				     i < 10 ? 50 : 0);
+	}
+
+	for (i = 0 ; i < 20 ; i++)
+		if (!rd_lru_cache_peek(&rlc, elms[i].e_key))
+			TEST_FAIL("%s expired too early", elms[i].e_key);
+
+	usleep(80 * 1000);
+
+	/* Lazy expiry on lookup */
+	TEST_ASSERT(rd_lru_cache_get(&rlc, "key0") == NULL);
+	TEST_INT_EQ(elms[0].e_evicted, 1);
+
+	/* Incremental sweep */
+	TEST_INT_EQ(rd_lru_cache_expire(&rlc, 4), 4);
+	TEST_INT_EQ(rd_lru_cache_expire(&rlc, 0), 5);
+	TEST_INT_EQ(rd_lru_cache_expire(&rlc, 0), 0);
+
+	TEST_INT_EQ(rd_lru_cache_cnt(&rlc), 10);
+	TEST_INT_EQ(evict_cnt, 10);
+	for (i = 10 ; i < 20 ; i++)
+		if (!rd_lru_cache_peek(&rlc, elms[i].e_key))
+			TEST_FAIL("%s without TTL expired", elms[i].e_key);
+
+	/* Default TTL and background sweep */
+	rd_lru_cache_ttl_set(&rlc, 30, 10);
+	for (i = 20 ; i < 30 ; i++) {
+		snprintf(elms[i].e_key, sizeof(elms[i].e_key), "key%i", i);
+		RD_LRU_CACHE_PUT(&rlc, &elms[i], e_link, elms[i].e_key, 1);
+	}
+
+	/* The default TTL may change while elements have a TTL. */
+	rd_lru_cache_ttl_set(&rlc, 40, 10);
+	rd_lru_cache_ttl_set(&rlc, 30, 0);
+
+	rt = rd_lru_cache_expire_timer_start(&rlc, 20, NULL);
+	ts_end = rd_clock() + 200 * 1000;
+	while (rd_clock() < ts_end)
+		rd_thread_poll(10);
+	rd_timer_destroy(rt);
+
+	TEST_INT_EQ(rd_lru_cache_cnt(&rlc), 10);
+	rd_lru_cache_stats(&rlc, &stats);
+	TEST_INT_EQ((int)stats.expired, 20);
+
+	rd_lru_cache_destroy(&rlc);
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	rd_init();
+
+	fails += test_lru_cache_count();
+	fails += test_lru_cache_bytes();
+	fails += test_lru_cache_tinylfu();
+	fails += test_lru_cache_ttl();
+
+	TEST_EXIT;
+}
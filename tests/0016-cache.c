@@ -0,0 +1,197 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdcache.h"
+
+#include "rdtests.h"
+
+
+struct elm {
+	char            e_key[16];
+	rd_cache_node_t e_link;
+	int             e_value;
+};
+
+static int elms_alloced = 0;
+static int elms_freed = 0;
+
+static struct elm *elm_new (const char *key, int value) {
+	struct elm *elm = calloc(1, sizeof(*elm));
+	snprintf(elm->e_key, sizeof(elm->e_key), "%s", key);
+	elm->e_value = value;
+	(void)rd_atomic_add(&elms_alloced, 1);
+	return elm;
+}
+
+static void elm_evict (void *elm, void *opaque) {
+	free(elm);
+	(void)rd_atomic_add(&elms_freed, 1);
+}
+
+
+static int test_cache_clock (void) {
+	TEST_VARS;
+	rd_cache_t rca;
+	struct elm *elm;
+	const char *keys[] = { "a", "b", "c", "d" };
+	int i;
+
+	rd_cache_init(&rca, 1, 4, rd_lru_cache_hash_str, rd_lru_cache_cmp_str,
+		      elm_evict, NULL);
+
+	for (i = 0 ; i < 4 ; i++) {
+		elm = elm_new(keys[i], i);
+		RD_CACHE_PUT(&rca, elm, e_link, elm->e_key);
+	}
+
+	/* Reference "a" and "c": "b" is the first unreferenced victim. */
+	for (i = 0 ; i < 4 ; i += 2) {
+		if (!(elm = rd_cache_get(&rca, keys[i])))
+			TEST_FAIL_RETURN("%s not found", keys[i]);
+		TEST_INT_EQ(elm->e_value, i);
+		RD_CACHE_RELEASE(&rca, elm, e_link);
+	}
+
+	elm = elm_new("e", 4);
+	RD_CACHE_PUT(&rca, elm, e_link, elm->e_key);
+
+	TEST_INT_EQ(rd_cache_cnt(&rca), 4);
+	/* Eviction is deferred to the end of the epoch grace period. */
+	rd_epoch_barrier();
+	TEST_INT_EQ(elms_freed, 1);
+	TEST_ASSERT(rd_cache_get(&rca, "b") == NULL);
+
+	/* A held reference keeps an evicted element alive. */
+	elm = rd_cache_get(&rca, "a");
+	TEST_ASSERT(rd_cache_remove(&rca, "a") == 1);
+	TEST_ASSERT(rd_cache_get(&rca, "a") == NULL);
+	for (i = 0 ; i < 4 ; i++)
+		rd_epoch_reclaim();
+	TEST_INT_EQ(elms_freed, 1);
+	TEST_INT_EQ(elm->e_value, 0);
+	RD_CACHE_RELEASE(&rca, elm, e_link);
+	rd_epoch_barrier();
+	TEST_INT_EQ(elms_freed, 2);
+
+	/* Replace */
+	elm = elm_new("c", 100);
+	RD_CACHE_PUT(&rca, elm, e_link, elm->e_key);
+	rd_epoch_barrier();
+	TEST_INT_EQ(elms_freed, 3);
+	elm = rd_cache_get(&rca, "c");
+	TEST_INT_EQ(elm ? elm->e_value : -1, 100);
+	RD_CACHE_RELEASE(&rca, elm, e_link);
+
+	rd_cache_destroy(&rca);
+	TEST_INT_EQ(elms_freed, elms_alloced);
+
+	TEST_RETURN;
+}
+
+
+
+#define TEST_THREADS 8
+#define TEST_KEYS    2000
+
+static rd_cache_t test_rca;
+
+static void *test_cache_thread (void *arg) {
+	intptr_t id = (intptr_t)arg;
+	unsigned int seed = (unsigned int)id;
+	int i;
+
+	for (i = 0 ; i < 100000 ; i++) {
+		char key[16];
+		int k = rand_r(&seed) % TEST_KEYS;
+		struct elm *elm;
+
+		snprintf(key, sizeof(key), "k%i", k);
+
+		if ((elm = rd_cache_get(&test_rca, key))) {
+			if (strcmp(elm->e_key, key) || elm->e_value != k)
+				return (void *)1;
+			RD_CACHE_RELEASE(&test_rca, elm, e_link);
+		} else {
+			elm = elm_new(key, k);
+			RD_CACHE_PUT(&test_rca, elm, e_link, elm->e_key);
+		}
+	}
+
+	/* Hand over this thread's retired elements. */
+	rd_epoch_thread_cleanup();
+
+	return NULL;
+}
+
+static int test_cache_threads (void) {
+	TEST_VARS;
+	pthread_t thrs[TEST_THREADS];
+	intptr_t i;
+
+	elms_alloced = elms_freed = 0;
+
+	rd_cache_init(&test_rca, 0, TEST_KEYS / 2,
+		      rd_lru_cache_hash_str, rd_lru_cache_cmp_str,
+		      elm_evict, NULL);
+
+	for (i = 0 ; i < TEST_THREADS ; i++)
+		pthread_create(&thrs[i], NULL, test_cache_thread, (void *)i);
+
+	for (i = 0 ; i < TEST_THREADS ; i++) {
+		void *ret;
+		pthread_join(thrs[i], &ret);
+		if (ret)
+			TEST_FAIL("thread #%i got a mismatching element",
+				  (int)i);
+	}
+
+	/* Capacity is enforced per shard. */
+	if (rd_cache_cnt(&test_rca) >
+	    test_rca.rca_shard_max << test_rca.rca_shard_bits)
+		TEST_FAIL("cache holds %u elements, capacity is %u",
+			  rd_cache_cnt(&test_rca),
+			  test_rca.rca_shard_max << test_rca.rca_shard_bits);
+
+	rd_cache_destroy(&test_rca);
+	TEST_INT_EQ(elms_freed, elms_alloced);
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	fails += test_cache_clock();
+	fails += test_cache_threads();
+
+	TEST_EXIT;
+}
@@ -0,0 +1,207 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+#include "rd.h"
+#include "rdepoch.h"
+
+#include "rdtests.h"
+
+
+static int freed;
+
+static void test_free (void *ptr) {
+	freed++;
+	free(ptr);
+}
+
+
+static volatile int reader_state;
+
+static void *reader_main (void *arg) {
+	rd_epoch_enter();
+	reader_state = 1;
+
+	while (reader_state == 1)
+		usleep(1000);
+
+	rd_epoch_exit();
+	rd_epoch_thread_cleanup();
+
+	return NULL;
+}
+
+
+static int test_epoch (void) {
+	TEST_VARS;
+	pthread_t thr;
+	int i;
+
+	/* No readers: barrier frees everything. */
+	for (i = 0 ; i < 10 ; i++)
+		rd_epoch_retire(malloc(16), test_free);
+	rd_epoch_barrier();
+	TEST_INT_EQ(freed, 10);
+	TEST_INT_EQ(rd_epoch_pending(), 0);
+
+	/* Nested sections on this thread. */
+	rd_epoch_enter();
+	rd_epoch_enter();
+	rd_epoch_exit();
+	rd_epoch_exit();
+
+	/* An active reader holds back reclamation. */
+	freed = 0;
+	pthread_create(&thr, NULL, reader_main, NULL);
+	while (reader_state == 0)
+		usleep(1000);
+
+	for (i = 0 ; i < 200 ; i++)
+		rd_epoch_retire(malloc(16), test_free);
+	for (i = 0 ; i < 5 ; i++)
+		rd_epoch_reclaim();
+
+	TEST_INT_EQ(freed, 0);
+	TEST_INT_EQ(rd_epoch_pending(), 200);
+
+	reader_state = 2;
+	pthread_join(thr, NULL);
+
+	rd_epoch_barrier();
+	TEST_INT_EQ(freed, 200);
+
+	rd_epoch_thread_cleanup();
+
+	TEST_RETURN;
+}
+
+
+struct obj {
+	int              o_freed;
+	rd_epoch_entry_t o_ee;
+};
+
+static struct obj objs[4][100];
+static struct obj mine;
+
+static void obj_free (rd_epoch_entry_t *ree) {
+	struct obj *o = (struct obj *)((char *)ree -
+				       offsetof(struct obj, o_ee));
+	o->o_freed++;
+}
+
+static void *retirer_main (void *arg) {
+	struct obj *o = arg;
+	int i;
+
+	for (i = 0 ; i < 100 ; i++)
+		rd_epoch_retire_entry(&o[i].o_ee, obj_free);
+
+	/* Hands over the last partial batch. */
+	rd_epoch_thread_cleanup();
+
+	return NULL;
+}
+
+
+/**
+ * Intrusive entries retired by several threads.
+ */
+static int test_epoch_entry (void) {
+	TEST_VARS;
+	pthread_t thrs[4];
+	int i, j;
+
+	for (i = 0 ; i < 4 ; i++)
+		pthread_create(&thrs[i], NULL, retirer_main, objs[i]);
+	for (i = 0 ; i < 4 ; i++)
+		pthread_join(thrs[i], NULL);
+
+	TEST_INT_EQ(rd_epoch_pending() <= 4 * 100, 1);
+
+	/* Objects retired by this thread are pending until handed over. */
+	rd_epoch_retire_entry(&mine.o_ee, obj_free);
+	TEST_INT_EQ(rd_epoch_pending() >= 1, 1);
+
+	rd_epoch_barrier();
+	TEST_INT_EQ(rd_epoch_pending(), 0);
+
+	for (i = 0 ; i < 4 ; i++)
+		for (j = 0 ; j < 100 ; j++)
+			if (objs[i][j].o_freed != 1)
+				TEST_FAIL("obj %i/%i freed %i times",
+					  i, j, objs[i][j].o_freed);
+	TEST_INT_EQ(mine.o_freed, 1);
+
+	rd_epoch_thread_cleanup();
+
+	TEST_RETURN;
+}
+
+
+static struct obj first, chained;
+
+/* Uses rdepoch itself: rd_epoch_pending() takes rd_epoch_lock. */
+static void obj_free_chain (rd_epoch_entry_t *ree) {
+	obj_free(ree);
+	(void)rd_epoch_pending();
+	rd_epoch_retire_entry(&chained.o_ee, obj_free);
+}
+
+/**
+ * Free callbacks run without rdepoch's lock held.
+ */
+static int test_epoch_cb (void) {
+	TEST_VARS;
+
+	rd_epoch_retire_entry(&first.o_ee, obj_free_chain);
+	rd_epoch_barrier();
+	TEST_INT_EQ(first.o_freed, 1);
+
+	rd_epoch_barrier();
+	TEST_INT_EQ(chained.o_freed, 1);
+	TEST_INT_EQ(rd_epoch_pending(), 0);
+
+	rd_epoch_thread_cleanup();
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	fails += test_epoch();
+	fails += test_epoch_entry();
+	fails += test_epoch_cb();
+
+	TEST_EXIT;
+}
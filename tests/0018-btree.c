@@ -0,0 +1,269 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdbtree.h"
+
+#include "rdtests.h"
+
+
+struct ielm {
+	int  key;
+};
+
+static int ielm_cmp (const void *a, const void *b) {
+	const struct ielm *x = a, *y = b;
+	return x->key - y->key;
+}
+
+
+/**
+ * Verifies B-tree invariants: element count limits, uniform leaf
+ * depth and ordering. Returns the number of elements or -1 on error.
+ */
+static int btree_verify0 (const rd_btree_node_t *node, int depth,
+			  int *leaf_depth, int is_root) {
+	int i, cnt = node->rbtn_cnt;
+
+	if (node->rbtn_cnt > RD_BTREE_KEYS_MAX ||
+	    (!is_root && node->rbtn_cnt < RD_BTREE_T - 1))
+		return -1;
+
+	for (i = 1 ; i < node->rbtn_cnt ; i++)
+		if (RD_BTREE_IKEYS(node)[i-1] >= RD_BTREE_IKEYS(node)[i])
+			return -1;
+
+	if (node->rbtn_leaf) {
+		if (*leaf_depth == -1)
+			*leaf_depth = depth;
+		return *leaf_depth == depth ? cnt : -1;
+	}
+
+	for (i = 0 ; i <= node->rbtn_cnt ; i++) {
+		int r = btree_verify0(RD_BTREE_CHILD(node)[i], depth + 1,
+				      leaf_depth, 0);
+		if (r == -1)
+			return -1;
+		cnt += r;
+	}
+
+	return cnt;
+}
+
+static int btree_verify (const rd_btree_t *rbt) {
+	int leaf_depth = -1;
+	if (!rbt->rbt_root)
+		return 0;
+	return btree_verify0(rbt->rbt_root, 0, &leaf_depth, 1);
+}
+
+
+static int test_btree_int (void) {
+	TEST_VARS;
+	rd_btree_t *rbt;
+	rd_btree_iter_t rbti;
+	const int max = 20000;
+	char *present = calloc(max, 1);
+	int64_t key, prev;
+	int i, cnt = 0;
+	void *elm;
+
+	rbt = rd_btree_init(NULL, NULL, RD_BTREE_F_INTKEY|RD_BTREE_F_LOCKS);
+
+	/* Random inserts and removes, checked against 'present'. */
+	for (i = 0 ; i < max * 10 ; i++) {
+		int k = rand() % max;
+		if (rand() % 4 > 0) {
+			elm = rd_btree_insert_int(rbt, k, present + k);
+			if ((elm != NULL) != present[k])
+				TEST_FAIL_RETURN("insert %i returned %p", k,
+						 elm);
+			if (!present[k])
+				cnt++;
+			present[k] = 1;
+		} else {
+			elm = rd_btree_remove_int(rbt, k);
+			if ((elm != NULL) != present[k])
+				TEST_FAIL_RETURN("remove %i returned %p", k,
+						 elm);
+			if (present[k])
+				cnt--;
+			present[k] = 0;
+		}
+	}
+
+	TEST_INT_EQ((int)rd_btree_cnt(rbt), cnt);
+	TEST_INT_EQ(btree_verify(rbt), cnt);
+
+	for (i = 0 ; i < max ; i++) {
+		elm = rd_btree_find_int(rbt, i);
+		if ((elm != NULL) != present[i] ||
+		    (elm && elm != present + i))
+			TEST_FAIL_RETURN("find %i returned %p", i, elm);
+	}
+
+	/* In-order iteration. */
+	rd_btree_rdlock(rbt);
+	rd_btree_iter_init(&rbti, rbt);
+	prev = -1;
+	i = 0;
+	while ((elm = rd_btree_iter_next(&rbti, &key))) {
+		if (key <= prev || !present[key] || elm != present + key)
+			TEST_FAIL_RETURN("iter: key %"PRId64" after %"PRId64,
+					 key, prev);
+		prev = key;
+		i++;
+	}
+	TEST_INT_EQ(i, cnt);
+
+	/* Bounds. */
+	for (i = 0 ; i < 1000 ; i++) {
+		int k = (rand() % (max + 3)) - 1;
+		int lo, hi;
+
+		for (lo = RD_MAX(k, 0) ; lo < max && !present[lo] ; lo++)
+			;
+		for (hi = RD_MAX(k + 1, 0) ; hi < max && !present[hi] ; hi++)
+			;
+
+		rd_btree_iter_seek_int(&rbti, rbt, k, 0);
+		if (!(elm = rd_btree_iter_next(&rbti, &key)))
+			key = max;
+		if (key != lo)
+			TEST_FAIL_RETURN("lower bound of %i: %"PRId64
+					 " != %i", k, key, lo);
+
+		rd_btree_iter_seek_int(&rbti, rbt, k, 1);
+		if (!(elm = rd_btree_iter_next(&rbti, &key)))
+			key = max;
+		if (key != hi)
+			TEST_FAIL_RETURN("upper bound of %i: %"PRId64
+					 " != %i", k, key, hi);
+	}
+	rd_btree_unlock(rbt);
+
+	/* Remove all. */
+	for (i = 0 ; i < max ; i++) {
+		if (present[i] && !rd_btree_remove_int(rbt, i))
+			TEST_FAIL_RETURN("remove %i failed", i);
+		if (i % 1000 == 0 && btree_verify(rbt) == -1)
+			TEST_FAIL_RETURN("invalid tree after removing %i", i);
+	}
+
+	TEST_INT_EQ((int)rd_btree_cnt(rbt), 0);
+	if (rbt->rbt_root)
+		TEST_FAIL_RETURN("root not freed");
+
+	rd_btree_destroy(rbt);
+	free(present);
+
+	TEST_RETURN;
+}
+
+
+static void sum_cb (void *elm, void *opaque) {
+	int *sum = opaque;
+	*sum += ((struct ielm *)elm)->key;
+}
+
+static int test_btree_cmp (void) {
+	TEST_VARS;
+	rd_btree_t rbt;
+	rd_btree_iter_t rbti;
+	const int max = 5000;
+	struct ielm *elms = malloc(sizeof(*elms) * max);
+	struct ielm skel, *e;
+	int i, sum = 0, exp_sum = 0;
+
+	rd_btree_init(&rbt, ielm_cmp, 0);
+
+	/* Insert even keys in descending order. */
+	for (i = max - 1 ; i >= 0 ; i--) {
+		elms[i].key = i * 2;
+		if (rd_btree_insert(&rbt, &elms[i]))
+			TEST_FAIL_RETURN("insert %i replaced", i);
+		exp_sum += i * 2;
+	}
+
+	TEST_INT_EQ((int)rd_btree_cnt(&rbt), max);
+
+	rd_btree_foreach(&rbt, sum_cb, &sum);
+	TEST_INT_EQ(sum, exp_sum);
+
+	for (i = 0 ; i < max * 2 ; i++) {
+		skel.key = i;
+		e = rd_btree_find(&rbt, &skel);
+		if ((e != NULL) != !(i & 1))
+			TEST_FAIL_RETURN("find %i returned %p", i, e);
+	}
+
+	/* Odd key seeks to the next even. */
+	skel.key = 101;
+	rd_btree_iter_seek(&rbti, &rbt, &skel, 0);
+	TEST_INT_EQ(((struct ielm *)rd_btree_iter_next(&rbti, NULL))->key,
+		    102);
+	skel.key = 102;
+	rd_btree_iter_seek(&rbti, &rbt, &skel, 1);
+	TEST_INT_EQ(((struct ielm *)rd_btree_iter_next(&rbti, NULL))->key,
+		    104);
+
+	/* Remove every other element. */
+	for (i = 0 ; i < max ; i += 2) {
+		skel.key = i * 2;
+		if (rd_btree_remove(&rbt, &skel) != &elms[i])
+			TEST_FAIL_RETURN("remove %i failed", i * 2);
+	}
+
+	TEST_INT_EQ((int)rd_btree_cnt(&rbt), max / 2);
+
+	rd_btree_iter_init(&rbti, &rbt);
+	i = 1;
+	while ((e = rd_btree_iter_next(&rbti, NULL))) {
+		if (e != &elms[i])
+			TEST_FAIL_RETURN("iter: expected %i, got %i",
+					 elms[i].key, e->key);
+		i += 2;
+	}
+
+	rd_btree_destroy(&rbt);
+	free(elms);
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	fails += test_btree_int();
+	fails += test_btree_cmp();
+
+	TEST_EXIT;
+}
@@ -0,0 +1,310 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdavg.h"
+
+#include "rdtests.h"
+
+
+/* Checks that 'v' is within the relative precision of 'exp'. */
+#define TEST_NEAR(v, exp, prec) do {					\
+		uint64_t _v = (v), _e = (exp);				\
+		if (_v + _e / (prec) + 1 < _e || _v > _e + _e / (prec) + 1) \
+			TEST_FAIL("%"PRIu64" not within 1/%i of %"PRIu64, \
+				  _v, (prec), _e);			\
+	} while (0)
+
+
+static int test_hdr (void) {
+	TEST_VARS;
+	rd_hdr_t hdr, hdr2, hdr3;
+	uint64_t v;
+
+	if (rd_hdr_init(&hdr, 3600llu * 1000000, 0) != -1)
+		TEST_FAIL_RETURN("sigfigs 0 accepted");
+
+	if (rd_hdr_init(&hdr, 3600llu * 1000000, 3) == -1)
+		TEST_FAIL_RETURN("init failed");
+
+	TEST_INT_EQ((int)rd_hdr_percentile(&hdr, 50.0), 0);
+
+	for (v = 1 ; v <= 100000 ; v++)
+		rd_hdr_record(&hdr, v);
+
+	TEST_INT_EQ((int)hdr.rh_total, 100000);
+	TEST_INT_EQ((int)hdr.rh_min, 1);
+	TEST_INT_EQ((int)hdr.rh_max, 100000);
+	TEST_NEAR(rd_hdr_percentile(&hdr, 50.0), 50000, 1000);
+	TEST_NEAR(rd_hdr_percentile(&hdr, 99.0), 99000, 1000);
+	TEST_NEAR(rd_hdr_percentile(&hdr, 99.9), 99900, 1000);
+	TEST_INT_EQ((int)rd_hdr_percentile(&hdr, 100.0), 100000);
+	TEST_INT_EQ((int)rd_hdr_mean(&hdr), 50000);
+
+	/* Small values are exact. */
+	rd_hdr_init(&hdr2, 3600llu * 1000000, 3);
+	for (v = 0 ; v < 1000 ; v++)
+		rd_hdr_record(&hdr2, v);
+	TEST_INT_EQ((int)rd_hdr_percentile(&hdr2, 50.0), 499);
+	TEST_INT_EQ((int)rd_hdr_percentile(&hdr2, 0.0), 0);
+
+	/* Huge values are capped. */
+	rd_hdr_record(&hdr2, 1llu << 62);
+	TEST_INT_EQ((int)hdr2.rh_overflow, 1);
+	if (hdr2.rh_max != 3600llu * 1000000)
+		TEST_FAIL("max %"PRIu64" not capped", hdr2.rh_max);
+
+	/* Merge */
+	if (rd_hdr_merge(&hdr, &hdr2) == -1)
+		TEST_FAIL_RETURN("merge failed");
+	TEST_INT_EQ((int)hdr.rh_total, 100000 + 1001);
+	TEST_INT_EQ((int)hdr.rh_min, 0);
+	TEST_NEAR(rd_hdr_percentile(&hdr, 50.0), 49500, 1000);
+
+	rd_hdr_init(&hdr3, 1000, 2);
+	if (rd_hdr_merge(&hdr, &hdr3) != -1)
+		TEST_FAIL("merge of mismatching histograms succeeded");
+
+	rd_hdr_reset(&hdr);
+	TEST_INT_EQ((int)hdr.rh_total, 0);
+	TEST_INT_EQ((int)rd_hdr_percentile(&hdr, 99.0), 0);
+
+	rd_hdr_destroy(&hdr);
+	rd_hdr_destroy(&hdr2);
+	rd_hdr_destroy(&hdr3);
+
+	TEST_RETURN;
+}
+
+
+static int test_avg_hdr (void) {
+	TEST_VARS;
+	rd_avg_t *ra;
+	rd_avg_res_t res;
+	rd_hdr_t hdr;
+	uint64_t v;
+
+	/* 3 periods of 200ms */
+	ra = rd_avg_new_hdr(3, 200000, 1000000, 3);
+	rd_avg_start(ra);
+
+	for (v = 1 ; v <= 1000 ; v++)
+		rd_avg_put(ra, v);
+
+	res = rd_avg(ra, RD_AVG_CURR);
+	TEST_INT_EQ((int)res.sum, 1000);
+	TEST_INT_EQ((int)res.dbl, 500);
+	TEST_INT_EQ((int)rd_avg_percentile(ra, RD_AVG_CURR, 99.0), 990);
+
+	/* Roll over to the next period. */
+	usleep(250000);
+	rd_avg_put(ra, 5);
+
+	TEST_INT_EQ((int)rd_avg_percentile(ra, RD_AVG_PREV, 50.0), 500);
+	TEST_INT_EQ(rd_avg_hdr_copy(ra, RD_AVG_PREV, &hdr), 0);
+	TEST_INT_EQ((int)hdr.rh_total, 1000);
+	TEST_INT_EQ((int)rd_hdr_percentile(&hdr, 50.0), 500);
+	rd_hdr_destroy(&hdr);
+	TEST_INT_EQ(rd_avg_hdr_copy(ra, RD_AVG_CURR, &hdr), 0);
+	TEST_INT_EQ((int)hdr.rh_total, 1);
+	rd_hdr_destroy(&hdr);
+	TEST_INT_EQ((int)rd_avg_percentile(ra, RD_AVG_CURR, 99.9), 5);
+
+	rd_avg_destroy(ra);
+
+	TEST_RETURN;
+}
+
+
+#define CONC_THREADS  4
+#define CONC_PUTS     50000
+
+static void *conc_main (void *arg) {
+	rd_avg_t **ras = arg;
+	int i;
+
+	for (i = 0 ; i < CONC_PUTS ; i++) {
+		rd_avg_put(ras[0], 1);
+		rd_avg_put(ras[1], (i % 1000) + 1);
+	}
+
+	return NULL;
+}
+
+static int test_avg_concurrent (void) {
+	TEST_VARS;
+	rd_avg_t *ras[2];
+	pthread_t thrs[CONC_THREADS];
+	rd_avg_res_t res;
+	uint64_t sum = 0;
+	int i;
+
+	/* Short periods: puts are spread over a number of periods. */
+	ras[0] = rd_avg_new_rate(1000, 20000, 0);
+	ras[1] = rd_avg_new_hdr(2, 600 * 1000000, 1000000, 3);
+	for (i = 0 ; i < 2 ; i++) {
+		rd_avg_concurrent(ras[i]);
+		rd_avg_start(ras[i]);
+	}
+
+	for (i = 0 ; i < CONC_THREADS ; i++)
+		pthread_create(&thrs[i], NULL, conc_main, ras);
+	for (i = 0 ; i < CONC_THREADS ; i++)
+		pthread_join(thrs[i], NULL);
+
+	/* Nothing is lost over all periods */
+	for (i = 0 ; i < 1000 ; i++)
+		sum += rd_avg(ras[0], i).sum;
+	TEST_INT_EQ((int)sum, CONC_THREADS * CONC_PUTS);
+
+	res = rd_avg(ras[1], RD_AVG_CURR);
+	TEST_INT_EQ((int)res.sum, CONC_THREADS * CONC_PUTS);
+	TEST_INT_EQ((int)res.high, 1000);
+	TEST_INT_EQ((int)res.low, 1);
+	TEST_NEAR(rd_avg_percentile(ras[1], RD_AVG_CURR, 50.0), 500, 1000);
+
+	rd_avg_destroy(ras[0]);
+	rd_avg_destroy(ras[1]);
+
+	TEST_RETURN;
+}
+
+
+static int test_ewma (void) {
+	TEST_VARS;
+	rd_ewma_t re;
+	const int windows[] = { 1, 10 };
+	rd_ts_t base;
+	double r;
+	int t;
+
+	rd_ewma_init(&re, 1000, windows, 2);
+	base = re.re_last;
+
+	/* Steady 100/s */
+	for (t = 0 ; t < 60 ; t++)
+		rd_ewma_update0(&re, 100, base + t * 1000000 + 500000);
+
+	TEST_INT_EQ((int)(rd_ewma_rate0(&re, 0, base + 60500000) + 0.5), 100);
+	TEST_INT_EQ((int)(rd_ewma_rate0(&re, 1, base + 60500000) + 0.5), 100);
+
+	/* 10 idle seconds: the 1s window is gone, 10s has decayed to 1/e */
+	r = rd_ewma_rate0(&re, 0, base + 70500000);
+	if (r > 0.01)
+		TEST_FAIL("1s window rate %f after 10s idle", r);
+	r = rd_ewma_rate0(&re, 1, base + 70500000);
+	if (r < 36.0 || r > 38.0)
+		TEST_FAIL("10s window rate %f after 10s idle, not ~36.8", r);
+
+	TEST_RETURN;
+}
+
+
+static int test_swrate (void) {
+	TEST_VARS;
+	rd_swrate_t rsw;
+	const rd_ts_t base = 10 * 1000000;
+	int k;
+
+	if (rd_swrate_init(&rsw, 1000, 10) == -1)
+		TEST_FAIL_RETURN("init failed");
+
+	/* 100 values evenly over one second */
+	for (k = 0 ; k < 100 ; k++)
+		rd_swrate_put0(&rsw, 1, base + k * 10000);
+
+	TEST_INT_EQ((int)rd_swrate_sum0(&rsw, base + 999000), 100);
+	TEST_INT_EQ((int)(rd_swrate_rate0(&rsw, base + 999000) + 0.5), 100);
+
+	/* Half a second later the first 60 are out of the window */
+	TEST_INT_EQ((int)rd_swrate_sum0(&rsw, base + 1500000), 40);
+
+	/* Recycled sub-buckets start from zero */
+	rd_swrate_put0(&rsw, 5, base + 2050000);
+	TEST_INT_EQ((int)rd_swrate_sum0(&rsw, base + 2050000), 5);
+
+	rd_swrate_destroy(&rsw);
+
+	TEST_RETURN;
+}
+
+
+static int test_avg_parent (void) {
+	TEST_VARS;
+	rd_avg_t *parent, *children[2], *rate;
+	int i;
+
+	parent = rd_avg_new_hdr(2, 600 * 1000000, 1000000, 3);
+	rd_avg_start(parent);
+
+	for (i = 0 ; i < 2 ; i++) {
+		children[i] = rd_avg_new_hdr(2, 50000, 1000000, 3);
+		if (rd_avg_parent_set(children[i], parent) == -1)
+			TEST_FAIL_RETURN("parent_set failed");
+		rd_avg_start(children[i]);
+	}
+
+	rate = rd_avg_new_rate(1, 1, 0);
+	if (rd_avg_parent_set(children[0], rate) != -1)
+		TEST_FAIL("mismatching parent accepted");
+	rd_avg_destroy(rate);
+
+	for (i = 1 ; i <= 100 ; i++)
+		rd_avg_put(children[i & 1], i);
+
+	/* Roll the children into the parent */
+	usleep(60000);
+	rd_avg_put(children[0], 1);
+	rd_avg_put(children[1], 1);
+
+	TEST_INT_EQ((int)rd_avg(parent, RD_AVG_CURR).sum, 100);
+	TEST_INT_EQ((int)rd_avg(parent, RD_AVG_CURR).high, 100);
+	TEST_INT_EQ((int)rd_avg_percentile(parent, RD_AVG_CURR, 50.0), 50);
+
+	for (i = 0 ; i < 2 ; i++)
+		rd_avg_destroy(children[i]);
+	rd_avg_destroy(parent);
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	fails += test_hdr();
+	fails += test_avg_hdr();
+	fails += test_avg_concurrent();
+	fails += test_ewma();
+	fails += test_swrate();
+	fails += test_avg_parent();
+
+	TEST_EXIT;
+}
@@ -0,0 +1,238 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdmetrics.h"
+#include "rdtimer.h"
+
+#include "rdtests.h"
+
+
+static rd_metrics_t *write_rms;
+static const char *write_path;
+
+static void *writer_main (void *arg) {
+	intptr_t fails = 0;
+	int i;
+
+	for (i = 0 ; i < 200 ; i++)
+		if (rd_metrics_write(write_rms, RD_METRICS_FMT_PROMETHEUS,
+				     write_path) == -1)
+			fails++;
+
+	return (void *)fails;
+}
+
+
+static void count_requests (rd_metrics_t *rms, int cnt) {
+	int i;
+	for (i = 0 ; i < cnt ; i++)
+		RD_METRIC_INC(rms, "requests_total");
+}
+
+
+static int export_calls;
+
+static void export_cb (rd_metrics_t *rms, const char *buf, size_t len,
+		       void *opaque) {
+	if (strlen(buf) == len && strstr(buf, "\"app_requests_total\":10"))
+		export_calls++;
+}
+
+
+static int test_metrics (void) {
+	TEST_VARS;
+	rd_metrics_t *rms;
+	rd_metric_t *rm;
+	rd_avg_t *lat;
+	char *buf;
+	size_t len;
+	char path[64];
+	FILE *fp;
+	rd_ts_t ts_end;
+	pthread_t thr;
+	intptr_t failed;
+	void *ret;
+	int i;
+	const char *json_start =
+		"{\"app_requests_total\":10,"
+		"\"app_queue_depth\":-2,"
+		"\"app_latency_us\":{\"count\":1000,\"sum\":500500,";
+
+	rms = rd_metrics_new("app");
+
+	count_requests(rms, 10);
+
+	rm = rd_metrics_gauge(rms, "queue_depth", "Queued items\nnow");
+	rd_metric_set(rm, 5);
+	rd_metric_add(rm, -7);
+
+	if (rd_metrics_gauge(rms, "requests_total", NULL) || errno != EEXIST)
+		TEST_FAIL("type mismatch not detected");
+	if (rd_metrics_counter(rms, "9bad-name", NULL) || errno != EINVAL)
+		TEST_FAIL("invalid name accepted");
+	if (rd_metrics_new("bad-prefix") || errno != EINVAL)
+		TEST_FAIL("invalid prefix accepted");
+	if (rd_metrics_counter(rms, "requests_total", NULL) !=
+	    rd_metrics_counter(rms, "requests_total", "ignored"))
+		TEST_FAIL("counter lookup returned different metrics");
+
+	/* HDR latency, rolled once so the previous period has data. */
+	lat = rd_avg_new_hdr(2, 20000, 1000000, 3);
+	rd_avg_start(lat);
+	for (i = 1 ; i <= 1000 ; i++)
+		rd_avg_put(lat, i);
+	usleep(30000);
+	rd_avg_put(lat, 1);
+
+	if (!rd_metrics_avg(rms, "latency_us", "Latency", lat))
+		TEST_FAIL_RETURN("avg registration failed");
+
+	buf = rd_metrics_export(rms, RD_METRICS_FMT_PROMETHEUS, &len);
+	TEST_INT_EQ((int)strlen(buf), (int)len);
+	if (!strstr(buf, "# TYPE app_requests_total counter\n"
+		    "app_requests_total 10\n") ||
+	    !strstr(buf, "# HELP app_queue_depth Queued items\\nnow\n"
+		    "# TYPE app_queue_depth gauge\n"
+		    "app_queue_depth -2\n") ||
+	    !strstr(buf, "# TYPE app_latency_us summary\n") ||
+	    !strstr(buf, "app_latency_us{quantile=\"0.5\"} 500\n") ||
+	    !strstr(buf, "app_latency_us{quantile=\"0.99\"} 990\n") ||
+	    !strstr(buf, "app_latency_us_sum 500500\n") ||
+	    !strstr(buf, "app_latency_us_count 1000\n"))
+		TEST_FAIL("unexpected prometheus output:\n%s", buf);
+	free(buf);
+
+	buf = rd_metrics_export(rms, RD_METRICS_FMT_JSON, NULL);
+	if (strncmp(buf, json_start, strlen(json_start)) ||
+	    !strstr(buf, ",\"p50\":500,\"p90\":900,"
+		    "\"p99\":990,\"p999\":999}}\n"))
+		TEST_FAIL("unexpected JSON output:\n%s", buf);
+	free(buf);
+
+	/* File export */
+	snprintf(path, sizeof(path), "/tmp/librd-metrics-%i.prom",
+		 (int)getpid());
+	if (rd_metrics_write(rms, RD_METRICS_FMT_PROMETHEUS, path) == -1)
+		TEST_FAIL("write failed: %s", strerror(errno));
+	else if (!(fp = fopen(path, "r")))
+		TEST_FAIL("%s not written", path);
+	else {
+		char line[128];
+		int found = 0;
+		while (fgets(line, sizeof(line), fp))
+			if (!strcmp(line, "app_requests_total 10\n"))
+				found++;
+		fclose(fp);
+		TEST_INT_EQ(found, 1);
+	}
+
+	/* Concurrent writers of the same path. */
+	write_rms = rms;
+	write_path = path;
+	pthread_create(&thr, NULL, writer_main, NULL);
+	failed = (intptr_t)writer_main(NULL);
+	pthread_join(thr, &ret);
+	failed += (intptr_t)ret;
+	TEST_INT_EQ((int)failed, 0);
+	unlink(path);
+
+	/* Periodic export */
+	rd_metrics_export_timer_start(rms, RD_METRICS_FMT_JSON, NULL,
+				      export_cb, NULL, 20, NULL);
+	ts_end = rd_clock() + 200 * 1000;
+	while (rd_clock() < ts_end && export_calls < 2)
+		rd_thread_poll(10);
+	if (export_calls < 2)
+		TEST_FAIL("export callback called %i times", export_calls);
+
+	rd_metrics_destroy(rms);
+	rd_avg_destroy(lat);
+
+	TEST_RETURN;
+}
+
+
+/**
+ * The one-liner call site cache must follow the registry it is
+ * called with, including registries created after others were destroyed.
+ */
+static int test_metrics_callsite (void) {
+	TEST_VARS;
+	rd_metrics_t *a, *b;
+	char *buf;
+	int i;
+
+	a = rd_metrics_new("a");
+	b = rd_metrics_new("b");
+
+	count_requests(a, 3);
+	count_requests(b, 2);
+
+	buf = rd_metrics_export(a, RD_METRICS_FMT_JSON, NULL);
+	if (strcmp(buf, "{\"a_requests_total\":3}\n"))
+		TEST_FAIL("unexpected JSON output for a: %s", buf);
+	free(buf);
+	buf = rd_metrics_export(b, RD_METRICS_FMT_JSON, NULL);
+	if (strcmp(buf, "{\"b_requests_total\":2}\n"))
+		TEST_FAIL("unexpected JSON output for b: %s", buf);
+	free(buf);
+
+	for (i = 0 ; i < 3 ; i++) {
+		rd_metrics_destroy(a);
+		a = rd_metrics_new("a");
+		count_requests(a, 1);
+		buf = rd_metrics_export(a, RD_METRICS_FMT_JSON, NULL);
+		if (strcmp(buf, "{\"a_requests_total\":1}\n"))
+			TEST_FAIL("unexpected JSON output after "
+				  "re-creation: %s", buf);
+		free(buf);
+	}
+
+	/* Invalid names are skipped. */
+	RD_METRIC_INC(a, "9invalid");
+
+	rd_metrics_destroy(a);
+	rd_metrics_destroy(b);
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	rd_init();
+
+	fails += test_metrics();
+	fails += test_metrics_callsite();
+
+	TEST_EXIT;
+}
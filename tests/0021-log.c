@@ -0,0 +1,518 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "rd.h"
+#include "rdlog.h"
+#include "rdtime.h"
+
+#include "rdtests.h"
+
+
+#define LOG_THREADS  4
+#define LOG_LINES    1000
+
+static void *log_main (void *arg) {
+	int i;
+
+	for (i = 0 ; i < LOG_LINES ; i++)
+		rdlog(LOG_INFO, "async-test thread %li line %i",
+		      (long)(intptr_t)arg, i);
+
+	rd_log_thread_cleanup();
+	return NULL;
+}
+
+
+static int test_log_async (void) {
+	TEST_VARS;
+	char path[] = "/tmp/rdlog-testXXXXXX";
+	pthread_t thr[LOG_THREADS];
+	uint64_t written, dropped;
+	char line[512];
+	FILE *fp;
+	int lines = 0;
+	int fd;
+	int i;
+
+	if ((fd = mkstemp(path)) == -1)
+		TEST_FAIL_RETURN("mkstemp failed: %s", strerror(errno));
+
+	if (rd_log_async_start(fd, 1024*1024) == -1)
+		TEST_FAIL_RETURN("rd_log_async_start failed: %s",
+				 strerror(errno));
+
+	if (rd_log_async_start(fd, 0) != -1 || errno != EALREADY)
+		TEST_FAIL("second rd_log_async_start should fail");
+
+	for (i = 0 ; i < LOG_THREADS ; i++)
+		pthread_create(&thr[i], NULL, log_main, (void *)(intptr_t)i);
+	for (i = 0 ; i < LOG_THREADS ; i++)
+		pthread_join(thr[i], NULL);
+
+	rd_log_async_stop();
+	rd_log_async_stats(&written, &dropped);
+	TEST_INT_EQ((int)written, LOG_THREADS * LOG_LINES);
+	TEST_INT_EQ((int)dropped, 0);
+
+	fp = fdopen(fd, "r");
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp))
+		if (strstr(line, "async-test thread "))
+			lines++;
+	fclose(fp);
+	unlink(path);
+
+	TEST_INT_EQ(lines, LOG_THREADS * LOG_LINES);
+
+	TEST_RETURN;
+}
+
+
+/**
+ * An idle log thread must be woken up by the first line logged to
+ * an empty ring (it blocks rather than polls when idle).
+ */
+static int test_log_wakeup (void) {
+	TEST_VARS;
+	char path[] = "/tmp/rdlog-testXXXXXX";
+	uint64_t written, written0, dropped;
+	int fd;
+	int i;
+
+	if ((fd = mkstemp(path)) == -1)
+		TEST_FAIL_RETURN("mkstemp failed: %s", strerror(errno));
+
+	if (rd_log_async_start(fd, 64*1024) == -1)
+		TEST_FAIL_RETURN("rd_log_async_start failed: %s",
+				 strerror(errno));
+
+	/* Stats are cumulative over async sessions. */
+	rd_log_async_stats(&written0, NULL);
+
+	for (i = 0 ; i < 3 ; i++) {
+		rd_ts_t deadline;
+
+		/* Let the log thread go idle. */
+		usleep(20*1000);
+
+		rdlog(LOG_INFO, "wakeup-test line %i", i);
+
+		deadline = rd_clock() + 2000000;
+		do {
+			rd_log_async_stats(&written, &dropped);
+			if ((int)(written - written0) == i + 1)
+				break;
+			usleep(100);
+		} while (rd_clock() < deadline);
+
+		TEST_INT_EQ((int)(written - written0), i + 1);
+	}
+
+	rd_log_thread_cleanup();
+	rd_log_async_stop();
+	close(fd);
+	unlink(path);
+
+	TEST_RETURN;
+}
+
+
+static int reader_dropped;
+
+static void *reader_main (void *arg) {
+	FILE *fp = fdopen((int)(intptr_t)arg, "r");
+	char line[512];
+
+	while (fgets(line, sizeof(line), fp))
+		if (strstr(line, "log line(s) dropped"))
+			reader_dropped = 1;
+
+	fclose(fp);
+	return NULL;
+}
+
+
+/**
+ * Logging must not block when the output is stalled:
+ * lines that do not fit in the ring are dropped and accounted for.
+ */
+static int test_log_drops (void) {
+	TEST_VARS;
+	uint64_t written0, dropped0, written, dropped;
+	char fill[4096];
+	pthread_t thr;
+	rd_ts_t t;
+	int fds[2];
+	int i;
+
+	if (pipe(fds) == -1)
+		TEST_FAIL_RETURN("pipe failed: %s", strerror(errno));
+
+	/* Fill the pipe so the log thread blocks in writev(). */
+	memset(fill, 'x', sizeof(fill));
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	while (write(fds[1], fill, sizeof(fill)) > 0)
+		;
+	fcntl(fds[1], F_SETFL, 0);
+
+	rd_log_async_stats(&written0, &dropped0);
+
+	if (rd_log_async_start(fds[1], 16*1024) == -1)
+		TEST_FAIL_RETURN("rd_log_async_start failed: %s",
+				 strerror(errno));
+
+	t = rd_clock();
+	for (i = 0 ; i < LOG_LINES ; i++)
+		rdlog(LOG_INFO, "stalled line %i: %.*s", i, 200, fill);
+	t = rd_clock() - t;
+
+	if (t > 1000000)
+		TEST_FAIL("logging to a stalled output took %"PRIu64"us", t);
+
+	pthread_create(&thr, NULL, reader_main, (void *)(intptr_t)fds[0]);
+
+	rd_log_async_stop();
+	close(fds[1]);
+	pthread_join(thr, NULL);
+
+	rd_log_async_stats(&written, &dropped);
+	written -= written0;
+	dropped -= dropped0;
+
+	if (dropped == 0)
+		TEST_FAIL("expected dropped log lines");
+	TEST_INT_EQ((int)(written + dropped), LOG_LINES);
+	TEST_INT_EQ(reader_dropped, 1);
+
+	TEST_RETURN;
+}
+
+
+/**
+ * Deferred binary records must render exactly as the printf equivalent.
+ */
+static int test_log_bin (void) {
+	TEST_VARS;
+	char path[] = "/tmp/rdlog-testXXXXXX";
+	char exp[16][256];
+	char str[32] = "transient";
+	long pgsz = sysconf(_SC_PAGESIZE);
+	char *guard, *unterm;
+	const char *volatile null = NULL;
+	char line[512];
+	FILE *fp;
+	int cnt = 0;
+	int fd;
+	int i = 0;
+
+	if ((fd = mkstemp(path)) == -1)
+		TEST_FAIL_RETURN("mkstemp failed: %s", strerror(errno));
+
+	if (rd_log_async_start(fd, 0) == -1)
+		TEST_FAIL_RETURN("rd_log_async_start failed: %s",
+				 strerror(errno));
+
+#define LOG_BIN(fmt...) do {						\
+		snprintf(exp[i++], sizeof(exp[0]), fmt);		\
+		rdlog_bin(LOG_INFO, fmt);				\
+	} while (0)
+
+	LOG_BIN("bin %d %u %ld %lld %zu %x %hhd %c %%",
+		-1, 2u, -3L, 4LL, (size_t)5, 0xab, (char)-6, 'z');
+	LOG_BIN("bin %5.2f %-8s|%*d|%.*s|%e %Lg",
+		3.14159, "ab", 6, 42, 3, "abcdef", 1e10, (long double)2.5);
+	LOG_BIN("bin %jd %td %#o %+i %s", (intmax_t)-7, (ptrdiff_t)8, 9, 10,
+		null);
+	LOG_BIN("bin %p", (void *)&str);
+	LOG_BIN("bin no args");
+
+	/* Strings are copied at call time. */
+	LOG_BIN("bin str=%s", str);
+	strcpy(str, "changed");
+
+	/* The precision bounds the string read: an unterminated
+	 * string right before an inaccessible page. */
+	guard = mmap(NULL, pgsz * 2, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (guard == MAP_FAILED)
+		TEST_FAIL_RETURN("mmap failed: %s", strerror(errno));
+	mprotect(guard + pgsz, pgsz, PROT_NONE);
+	unterm = guard + pgsz - 3;
+	memcpy(unterm, "abc", 3);
+	LOG_BIN("bin prec=%.*s|%5.*s", 3, unterm, 2, unterm);
+	LOG_BIN("bin prec=%.3s|%-4.1s|", unterm, unterm);
+
+		/* Not deferrable: formatted immediately. */
+	errno = ENOENT;
+	LOG_BIN("bin errno %m");
+
+	rd_log_async_stop();
+	munmap(guard, pgsz * 2);
+
+	fp = fdopen(fd, "r");
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)) {
+		char *t = strstr(line, "| bin ");
+
+		if (!t)
+			continue;
+		t += 2;
+		t[strlen(t)-1] = '\0';
+
+		if (cnt >= i)
+			TEST_FAIL("unexpected line: %s", t);
+		else if (strcmp(t, exp[cnt]))
+			TEST_FAIL("line %i: expected \"%s\", got \"%s\"",
+				  cnt, exp[cnt], t);
+		cnt++;
+	}
+	fclose(fp);
+	unlink(path);
+
+	TEST_INT_EQ(cnt, i);
+
+	TEST_RETURN;
+}
+
+/**
+ * Log capture helpers: route log output to a temporary file through
+ * the async logger.
+ */
+static char capture_path[64];
+
+static int capture_start (void) {
+	int fd;
+
+	strcpy(capture_path, "/tmp/rdlog-testXXXXXX");
+	if ((fd = mkstemp(capture_path)) == -1)
+		return -1;
+
+	if (rd_log_async_start(fd, 0) == -1) {
+		close(fd);
+		unlink(capture_path);
+		return -1;
+	}
+
+	return fd;
+}
+
+static FILE *capture_stop (int fd) {
+	FILE *fp;
+
+	rd_log_async_stop();
+	unlink(capture_path);
+
+	fp = fdopen(fd, "r");
+	return fp;
+}
+
+/**
+ * Returns the number of captured lines containing 'needle' and
+ * copies the last one to 'match'.
+ */
+static int capture_grep (FILE *fp, const char *needle,
+			 char *match, size_t size) {
+	char line[512];
+	int cnt = 0;
+
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strstr(line, needle))
+			continue;
+		if (match)
+			snprintf(match, size, "%s", line);
+		cnt++;
+	}
+
+	return cnt;
+}
+
+
+static int evaluated;
+
+static int side_effect (void) {
+	return ++evaluated;
+}
+
+static int test_log_fac (void) {
+	TEST_VARS;
+	FILE *fp;
+	int fd;
+
+	rd_log_set_severity(LOG_INFO);
+	rd_log_set_severity_fac(RD_LOG_FAC_IO, LOG_DEBUG);
+
+	if (!rd_log_enabled(RD_LOG_FAC_IO, LOG_DEBUG))
+		TEST_FAIL("IO facility debug should be enabled");
+	if (rd_log_enabled(RD_LOG_FAC_DEFAULT, LOG_DEBUG))
+		TEST_FAIL("default facility debug should be disabled");
+
+	if ((fd = capture_start()) == -1)
+		TEST_FAIL_RETURN("capture failed: %s", strerror(errno));
+
+	rdbg("fac-test default %i", side_effect());
+	rdbg_fac(RD_LOG_FAC_IO, "fac-test io %i", side_effect());
+	rdlog_fac(RD_LOG_FAC_USER, LOG_INFO, "fac-test user");
+
+	/* Direct calls are filtered by the default facility's level. */
+	rdputs0(__FILE__, __FUNCTION__, __LINE__, LOG_DEBUG,
+		"fac-test direct debug");
+	rdputs_bin0(__FILE__, __FUNCTION__, __LINE__, LOG_DEBUG,
+		    "fac-test direct bin debug");
+	rdputs0(__FILE__, __FUNCTION__, __LINE__, LOG_INFO,
+		"fac-test direct info");
+
+	fp = capture_stop(fd);
+
+	TEST_INT_EQ(evaluated, 1);
+	TEST_INT_EQ(capture_grep(fp, "fac-test default", NULL, 0), 0);
+	TEST_INT_EQ(capture_grep(fp, "fac-test io 1", NULL, 0), 1);
+	TEST_INT_EQ(capture_grep(fp, "fac-test user", NULL, 0), 1);
+	TEST_INT_EQ(capture_grep(fp, "fac-test direct", NULL, 0), 1);
+	fclose(fp);
+
+	rd_log_set_severity(LOG_INFO);
+
+	TEST_RETURN;
+}
+
+
+static int test_log_rl (void) {
+	TEST_VARS;
+	rd_log_rl_t rlrl = {};
+	char line[512];
+	FILE *fp;
+	int fd;
+	int cnt;
+	int i;
+
+	/* Burst of 5, then nothing until a token is refilled. */
+	for (i = 0 ; i < 5 ; i++)
+		TEST_INT_EQ(rd_log_rl_check(&rlrl, 10, 5), 0);
+	TEST_INT_EQ(rd_log_rl_check(&rlrl, 10, 5), -1);
+	TEST_INT_EQ(rd_log_rl_check(&rlrl, 10, 5), -1);
+	usleep(150000);
+	TEST_INT_EQ(rd_log_rl_check(&rlrl, 10, 5), 2);
+
+	if ((fd = capture_start()) == -1)
+		TEST_FAIL_RETURN("capture failed: %s", strerror(errno));
+
+	for (i = 0 ; i < 2 ; i++) {
+		int j;
+
+		for (j = 0 ; j < 100 ; j++)
+			rdlog_rl(10, 5, LOG_INFO, "rl-test %i", j);
+		usleep(150000);
+	}
+
+	fp = capture_stop(fd);
+
+	/* 5 lines of burst, 1 refilled token, and some slack for
+	 * slow machines. */
+	cnt = capture_grep(fp, "rl-test ", NULL, 0);
+	if (cnt < 6 || cnt > 10)
+		TEST_FAIL("expected 6 rate limited lines, got %i", cnt);
+
+	TEST_INT_EQ(capture_grep(fp, "similar line(s) suppressed",
+				 line, sizeof(line)), 1);
+	if (!strstr(line, "| 95 similar") && cnt == 6)
+		TEST_FAIL("unexpected suppression line: %s", line);
+	fclose(fp);
+
+	TEST_RETURN;
+}
+
+
+static int test_dbg_ctx (void) {
+	TEST_VARS;
+	FILE *fp;
+	int fd;
+	int i;
+
+	if ((fd = capture_start()) == -1)
+		TEST_FAIL_RETURN("capture failed: %s", strerror(errno));
+
+	rd_dbg_ctx_push("a%i", 1);
+	rd_dbg_ctx_push("b");
+	rdlog(LOG_INFO, "ctx-test two");
+	rd_dbg_ctx_pop();
+	rdlog(LOG_INFO, "ctx-test one");
+
+	/* Overflowing pushes must keep pops balanced. */
+	for (i = 0 ; i < 100 ; i++)
+		rd_dbg_ctx_push("overflow-%i", i);
+	for (i = 0 ; i < 100 ; i++)
+		rd_dbg_ctx_pop();
+	rdlog(LOG_INFO, "ctx-test after");
+
+	/* Deferred lines carry the context at call time. */
+	rd_dbg_ctx_push("bin%i", 2);
+	rdlog_bin(LOG_INFO, "ctx-test deferred %i", 3);
+	rd_dbg_ctx_pop();
+	rdlog_bin(LOG_INFO, "ctx-test deferred %i", 4);
+
+	rd_dbg_ctx_clear();
+	rdlog(LOG_INFO, "ctx-test none");
+
+	fp = capture_stop(fd);
+
+	TEST_INT_EQ(capture_grep(fp, "[a1]->[b] ctx-test two",
+				 NULL, 0), 1);
+	TEST_INT_EQ(capture_grep(fp, "| [a1] ctx-test one", NULL, 0), 1);
+	TEST_INT_EQ(capture_grep(fp, "| [a1] ctx-test after", NULL, 0), 1);
+	TEST_INT_EQ(capture_grep(fp, "| [a1]->[bin2] ctx-test deferred 3",
+				 NULL, 0), 1);
+	TEST_INT_EQ(capture_grep(fp, "| [a1] ctx-test deferred 4",
+				 NULL, 0), 1);
+	TEST_INT_EQ(capture_grep(fp, "| ctx-test none", NULL, 0), 1);
+	fclose(fp);
+
+	TEST_RETURN;
+}
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	rd_init();
+
+	fails += test_log_async();
+	fails += test_log_wakeup();
+	fails += test_log_drops();
+	fails += test_log_bin();
+	fails += test_log_fac();
+	fails += test_log_rl();
+	fails += test_dbg_ctx();
+
+	TEST_EXIT;
+}
@@ -0,0 +1,187 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdintern.h"
+
+#include "rdtests.h"
+
+
+static int test_intern (void) {
+	TEST_VARS;
+	rd_intern_t ri;
+	rd_memctx_stats_t stats;
+	char buf[64];
+	const char *s1, *s2, *s3, *s4;
+
+	rd_intern_init(&ri, "test-intern", 4);
+
+	s1 = rd_intern(&ri, "hostname.example.com");
+	snprintf(buf, sizeof(buf), "%s.%s", "hostname", "example.com");
+	s2 = rd_intern(&ri, buf);
+	s3 = rd_intern(&ri, "other");
+
+	if (!rd_intern_eq(s1, s2))
+		TEST_FAIL("equal strings should intern to the same pointer");
+	if (rd_intern_eq(s1, s3))
+		TEST_FAIL("different strings should not be equal");
+	if (s2 == buf || strcmp(s2, buf))
+		TEST_FAIL("interned copy mismatch: %s", s2);
+	TEST_INT_EQ((int)rd_intern_len(s1), (int)strlen(buf));
+	TEST_INT_EQ(rd_intern_cnt(&ri), 2);
+
+	/* Sized input need not be nul-terminated. */
+	s4 = rd_intern_n(&ri, "otherwise", 5);
+	if (!rd_intern_eq(s3, s4))
+		TEST_FAIL("rd_intern_n() should match \"other\"");
+	TEST_INT_EQ(s4[5], '\0');
+
+	if (rd_intern_find(&ri, "not-there"))
+		TEST_FAIL("rd_intern_find() found a missing string");
+	TEST_INT_EQ(rd_intern_cnt(&ri), 2);
+
+	/* Memory accounting. */
+	rd_memctx_stats(&ri.ri_memctx, &stats);
+	TEST_INT_EQ(stats.out, 2);
+	if (stats.bytes_out < strlen(s1) + strlen(s3) + 2)
+		TEST_FAIL("bytes_out %zu too small", stats.bytes_out);
+
+	/* Refcounting: s1 has two references (s1, s2) + one from ref */
+	rd_intern_ref(s1);
+	rd_intern_release(&ri, s1);
+	rd_intern_release(&ri, s2);
+	TEST_INT_EQ(rd_intern_cnt(&ri), 2);
+	if (rd_intern_find(&ri, "hostname.example.com") != s1)
+		TEST_FAIL("string released too early");
+	rd_intern_release(&ri, s1);   /* find() reference */
+	rd_intern_release(&ri, s1);
+	TEST_INT_EQ(rd_intern_cnt(&ri), 1);
+	if (rd_intern_find(&ri, "hostname.example.com"))
+		TEST_FAIL("released string still in pool");
+
+	rd_intern_release(&ri, s3);
+	rd_intern_release(&ri, s4);
+	TEST_INT_EQ(rd_intern_cnt(&ri), 0);
+
+	rd_memctx_stats(&ri.ri_memctx, &stats);
+	TEST_INT_EQ(stats.out, 0);
+	TEST_INT_EQ((int)stats.bytes_out, 0);
+
+	/* Grow beyond the initial bucket count, then destroy with
+	 * strings still referenced. */
+	{
+		int i;
+		for (i = 0 ; i < 5000 ; i++) {
+			snprintf(buf, sizeof(buf), "str-%i", i);
+			rd_intern(&ri, buf);
+		}
+		TEST_INT_EQ(rd_intern_cnt(&ri), 5000);
+		s1 = rd_intern(&ri, "str-1234");
+		if (strcmp(s1, "str-1234"))
+			TEST_FAIL("lookup after grow failed: %s", s1);
+	}
+
+	rd_intern_destroy(&ri);
+
+	TEST_RETURN;
+}
+
+
+#define THREAD_CNT  4
+#define STR_CNT     64
+
+static rd_intern_t thr_ri;
+static const char *thr_first[STR_CNT];
+static int thr_mismatches;
+
+static void *intern_main (void *arg) {
+	int i;
+
+	for (i = 0 ; i < 20000 ; i++) {
+		char buf[32];
+		const char *s;
+		int n = (i * 7 + (int)(intptr_t)arg) % STR_CNT;
+
+		snprintf(buf, sizeof(buf), "key-%i", n);
+		s = rd_intern(&thr_ri, buf);
+		if (strcmp(s, buf))
+			rd_atomic_add(&thr_mismatches, 1);
+
+		/* Pinned strings must always intern to the same pointer. */
+		if (thr_first[n] && s != thr_first[n])
+			rd_atomic_add(&thr_mismatches, 1);
+
+		rd_intern_release(&thr_ri, s);
+	}
+
+	return NULL;
+}
+
+static int test_intern_concurrent (void) {
+	TEST_VARS;
+	pthread_t thr[THREAD_CNT];
+	int i;
+
+	rd_intern_init(&thr_ri, "test-intern-mt", 0);
+
+	/* Pin half of the strings. */
+	for (i = 0 ; i < STR_CNT ; i += 2) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "key-%i", i);
+		thr_first[i] = rd_intern(&thr_ri, buf);
+	}
+
+	for (i = 0 ; i < THREAD_CNT ; i++)
+		pthread_create(&thr[i], NULL, intern_main,
+			       (void *)(intptr_t)i);
+	for (i = 0 ; i < THREAD_CNT ; i++)
+		pthread_join(thr[i], NULL);
+
+	TEST_INT_EQ(thr_mismatches, 0);
+	TEST_INT_EQ(rd_intern_cnt(&thr_ri), STR_CNT / 2);
+
+	for (i = 0 ; i < STR_CNT ; i += 2)
+		rd_intern_release(&thr_ri, thr_first[i]);
+	TEST_INT_EQ(rd_intern_cnt(&thr_ri), 0);
+
+	rd_intern_destroy(&thr_ri);
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	fails += test_intern();
+	fails += test_intern_concurrent();
+
+	TEST_EXIT;
+}
@@ -0,0 +1,182 @@
+/*
+ * librd - Rapid Development C library
+ *
+ * Copyright (c) 2012-2013, Magnus Edenhill
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdcrc32.h"
+
+#include "rdtests.h"
+
+
+static const char *impl_names[] = { "auto", "table", "slice8", "hw" };
+
+
+static int test_vectors (void) {
+	TEST_VARS;
+	rd_crc32_impl_t impl;
+
+	for (impl = RD_CRC32_IMPL_AUTO ; impl <= RD_CRC32_IMPL_HW ; impl++) {
+		if (rd_crc32_impl_set(impl) == -1) {
+			TEST_DBG("%s implementation not supported",
+				 impl_names[impl]);
+			continue;
+		}
+
+		if (rd_crc32("123456789", 9) != 0xcbf43926)
+			TEST_FAIL("%s: crc32 check value mismatch: 0x%08x",
+				  impl_names[impl], rd_crc32("123456789", 9));
+		if (rd_crc32c("123456789", 9) != 0xe3069283)
+			TEST_FAIL("%s: crc32c check value mismatch: 0x%08x",
+				  impl_names[impl], rd_crc32c("123456789", 9));
+		if (rd_crc32("", 0) != 0)
+			TEST_FAIL("%s: crc32 of empty input should be 0",
+				  impl_names[impl]);
+	}
+
+	rd_crc32_impl_set(RD_CRC32_IMPL_AUTO);
+
+	TEST_RETURN;
+}
+
+
+/**
+ * All implementations must agree with the byte-at-a-time tables for
+ * all lengths and alignments, including incremental updates.
+ */
+static int test_impls (void) {
+	TEST_VARS;
+	const size_t size = 3 * 8192 * 2 + 1000;
+	unsigned char *buf = malloc(size + 8);
+	size_t lens[] = { 0, 1, 7, 15, 16, 63, 64, 65, 127, 200, 767, 768,
+			  1000, 4097, 3 * 8192, 3 * 8192 + 13, size };
+	rd_crc32_t exp32[RD_ARRAY_SIZE(lens)][8];
+	rd_crc32_t exp32c[RD_ARRAY_SIZE(lens)][8];
+	rd_crc32_impl_t impl;
+	size_t i;
+	int of;
+
+	for (i = 0 ; i < size + 8 ; i++)
+		buf[i] = (unsigned char)random();
+
+	rd_crc32_impl_set(RD_CRC32_IMPL_TABLE);
+	for (i = 0 ; i < RD_ARRAY_SIZE(lens) ; i++) {
+		for (of = 0 ; of < 8 ; of++) {
+			exp32[i][of] = rd_crc32((char *)buf+of, lens[i]);
+			exp32c[i][of] = rd_crc32c((char *)buf+of, lens[i]);
+		}
+	}
+
+	for (impl = RD_CRC32_IMPL_SLICE8 ; impl <= RD_CRC32_IMPL_HW ; impl++) {
+		if (rd_crc32_impl_set(impl) == -1)
+			continue;
+
+		for (i = 0 ; i < RD_ARRAY_SIZE(lens) ; i++) {
+			for (of = 0 ; of < 8 ; of++) {
+				rd_crc32_t c, c2;
+				size_t half = lens[i] / 3;
+
+				c = rd_crc32((char *)buf+of, lens[i]);
+				if (c != exp32[i][of])
+					TEST_FAIL("%s: crc32(len %zu, of %i): "
+						  "0x%08x != 0x%08x",
+						  impl_names[impl], lens[i], of,
+						  c, exp32[i][of]);
+
+				c = rd_crc32c((char *)buf+of, lens[i]);
+				if (c != exp32c[i][of])
+					TEST_FAIL("%s: crc32c(len %zu, of %i): "
+						  "0x%08x != 0x%08x",
+						  impl_names[impl], lens[i], of,
+						  c, exp32c[i][of]);
+
+				/* Incremental */
+				c2 = rd_crc32c_update(rd_crc32_init(),
+						      buf+of, half);
+				c2 = rd_crc32c_update(c2, buf+of+half,
+						      lens[i] - half);
+				if (rd_crc32_finalize(c2) != exp32c[i][of])
+					TEST_FAIL("%s: incremental crc32c("
+						  "len %zu) mismatch",
+						  impl_names[impl], lens[i]);
+			}
+		}
+
+		if (fails)
+			break;
+	}
+
+	rd_crc32_impl_set(RD_CRC32_IMPL_AUTO);
+	free(buf);
+
+	TEST_RETURN;
+}
+
+
+static int test_combine (void) {
+	TEST_VARS;
+	char buf[5000];
+	size_t splits[] = { 0, 1, 9, 1000, 2500, 4999, 5000 };
+	rd_crc32_t exp32, exp32c;
+	size_t i;
+
+	for (i = 0 ; i < sizeof(buf) ; i++)
+		buf[i] = (char)random();
+
+	exp32 = rd_crc32(buf, sizeof(buf));
+	exp32c = rd_crc32c(buf, sizeof(buf));
+
+	for (i = 0 ; i < RD_ARRAY_SIZE(splits) ; i++) {
+		size_t a = splits[i], b = sizeof(buf) - splits[i];
+		rd_crc32_t c;
+
+		c = rd_crc32_combine(rd_crc32(buf, a), rd_crc32(buf+a, b), b);
+		if (c != exp32)
+			TEST_FAIL("crc32_combine(split %zu): 0x%08x != 0x%08x",
+				  a, c, exp32);
+
+		c = rd_crc32c_combine(rd_crc32c(buf, a),
+				      rd_crc32c(buf+a, b), b);
+		if (c != exp32c)
+			TEST_FAIL("crc32c_combine(split %zu): "
+				  "0x%08x != 0x%08x", a, c, exp32c);
+	}
+
+	TEST_RETURN;
+}
+
+
+int main (int argc, char **argv) {
+	TEST_VARS;
+
+	TEST_INIT;
+
+	fails += test_vectors();
+	fails += test_impls();
+	fails += test_combine();
+
+	TEST_EXIT;
+}